@@ -111,14 +111,21 @@ private:
 	int32_t refId;
 	int32_t mateId;
 	int32_t matePos;
-	vector<CigarOp> cigar;
 	Strandedness strandedness;
 	Orientation orientation;
-	Strand strand;
+
+	// The cigar and strand are only decoded from the raw record when first
+	// requested, as many alignments (e.g. unspliced reads) never need them
+	mutable vector<CigarOp> cigar;
+	mutable bool cigarDecoded;
+	mutable Strand strand;
+	mutable bool strandDecoded;
 
 	void init();
 
-	Strand calcStrand();
+	void decodeCigar() const;
+
+	Strand calcStrand() const;
 
 public:
 
@@ -160,21 +167,22 @@ public:
 
 	void setCigar(vector<CigarOp>& cig) {
 		cigar = cig;
+		cigarDecoded = true;
 	}
 
 	const vector<CigarOp>& getCigar() const {
+		if (!cigarDecoded) {
+			decodeCigar();
+		}
 		return cigar;
 	}
 
 	const string getCigarAsString() const {
-		stringstream ss;
-		for (const auto & c : cigar) {
-			ss << c.toString();
-		}
-		return ss.str();
+		return cigarToString(getCigar());
 	}
 
 	void setCigarOpAt(uint32_t index, CigarOp cigarOp) {
+		getCigar();
 		cigar[index] = cigarOp;
 	}
 
@@ -199,11 +207,11 @@ public:
 	}
 
 	const CigarOp& getCigarOpAt(uint32_t index) const {
-		return cigar[index];
+		return getCigar()[index];
 	}
 
 	size_t getNbCigarOps() const {
-		return cigar.size();
+		return cigarDecoded ? cigar.size() : b->core.n_cigar;
 	}
 
 	int32_t getPosition() const {
@@ -239,6 +247,14 @@ public:
 	}
 
 	Strand getStrand() const {
+		if (!strandDecoded) {
+			// Try deriving from XS tag first if it's present.  If not then try to
+			// work it all out from the protocol suggested and the reverse strand
+			// flag.
+			Strand s = getXSStrand();
+			strand = s != Strand::UNKNOWN ? s : calcStrand();
+			strandDecoded = true;
+		}
 		return strand;
 	}
 
@@ -311,6 +327,22 @@ public:
 
 	uint32_t getNbJunctionsInRead() const;
 
+	/**
+	 * Checks the raw cigar of a samtools bam alignment for any reference skips.
+	 * This doesn't require the alignment to be decoded in any way.
+	 * @param b The samtools bam alignment
+	 * @return True if the alignment contains at least one junction
+	 */
+	static bool isSplicedRead(const bam1_t* b) {
+		const uint32_t* c = bam_get_cigar(b);
+		for (uint32_t i = 0; i < b->core.n_cigar; i++) {
+			if (bam_cigar_op(c[i]) == BAM_CREF_SKIP) {
+				return true;
+			}
+		}
+		return false;
+	}
+
 	bool isMultiplySplicedRead() const {
 		return getNbJunctionsInRead() > 1;
 	}
@@ -321,6 +353,26 @@ public:
 	string getPaddedQuerySeq(const string& querySeq, int32_t start, int32_t end, int32_t& actual_start, int32_t& actual_end, const bool include_soft_clips) const;
 	string getPaddedGenomeSeq(const string& fullGenomeSeq, int32_t start, int32_t end, int32_t q_start, int32_t q_end, const bool include_soft_clips) const;
 
+	// Versions of the above that work from the alignment's start position, aligned
+	// length and cigar alone, so they can be used without holding onto the full
+	// BAM record.
+
+	static string getQuerySeqAfterClipping(const string& query_seq, const vector<CigarOp>& cigar, int32_t position, int32_t alignedLength);
+
+	static string getPaddedQuerySeq(const vector<CigarOp>& cigar, int32_t position, int32_t alignedLength,
+			const string& querySeq, int32_t start, int32_t end, int32_t& actual_start, int32_t& actual_end, const bool include_soft_clips);
+
+	static string getPaddedGenomeSeq(const vector<CigarOp>& cigar, int32_t position, int32_t alignedLength,
+			const string& fullGenomeSeq, int32_t start, int32_t end, int32_t q_start, int32_t q_end, const bool include_soft_clips);
+
+	static string cigarToString(const vector<CigarOp>& cigar) {
+		stringstream ss;
+		for (const auto & c : cigar) {
+			ss << c.toString();
+		}
+		return ss.str();
+	}
+
 	string toString() const;
 	string toString(bool afterClipping) const;
 
@@ -267,6 +267,14 @@ public:
 	 */
 	static string createIndexBamCmd(const path& sortedBam, bool useCsi);
 
+	/**
+	 * Indexes a sorted bam file in process, writing the index alongside it, as
+	 * "samtools index" would.  Throws a BamException if indexing fails.
+	 * @param sortedBam Path to a sorted bam file to index
+	 * @param useCsi Whether to create a CSI index rather than a BAI index
+	 */
+	static void indexBam(const path& sortedBam, bool useCsi);
+
 };
 }
 }
@@ -0,0 +1,111 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <htslib/sam.h>
+
+namespace portcullis {
+namespace bam {
+
+/**
+ * Merges coordinate sorted BAM files into a single sorted BAM file, in one pass
+ * over the inputs.  Alignments that sort equally come out in the order of the
+ * inputs, as with "samtools merge".  The inputs may have different target
+ * sequences, as long as the ones they share are in the same order.  The output
+ * can be indexed as it is written.
+ */
+class BamMerger {
+private:
+	vector<path> inputs;
+	path outputBam;
+	uint16_t threads;
+	uint16_t ioThreads;
+	int compressionLevel;
+	bool index;
+	bool useCsi;
+
+	uint64_t nbAlignments;
+
+public:
+
+	/**
+	 * Creates a merger for the given inputs
+	 * @param _inputs The sorted BAM files to merge
+	 * @param _outputBam The merged BAM file to create
+	 * @param _threads Number of threads to use for compressing the output
+	 */
+	BamMerger(const vector<path>& _inputs, const path& _outputBam, const uint16_t _threads);
+
+	/**
+	 * Additional threads to use for compressing the output.  Any value above 0
+	 * also reads each input ahead on one helper thread.
+	 */
+	void setIoThreads(const uint16_t ioThreads) {
+		this->ioThreads = ioThreads;
+	}
+
+	/**
+	 * Compression level for the output, from 0 to 9, or -1 for the htslib default
+	 */
+	void setCompressionLevel(const int compressionLevel) {
+		this->compressionLevel = compressionLevel;
+	}
+
+	/**
+	 * Indexes the merged BAM as it is written
+	 * @param useCsi Whether to create a CSI index rather than a BAI index
+	 */
+	void setIndex(const bool useCsi) {
+		this->index = true;
+		this->useCsi = useCsi;
+	}
+
+	uint64_t getNbAlignments() const {
+		return nbAlignments;
+	}
+
+	/**
+	 * Merges the inputs.  Throws a BamException if the inputs can't be merged,
+	 * for example if they are not sorted, or if anything else goes wrong.
+	 */
+	void merge();
+
+	/**
+	 * Creates a header for the merged output, marked as coordinate sorted.  The
+	 * target sequences are those of the first header, followed by any others in
+	 * the order they first appear.  Header lines other than @HD and @SQ come from
+	 * the first header, followed by any lines from the other headers not already
+	 * present.  Throws a BamException if the headers disagree about the length or
+	 * order of the target sequences.
+	 * @param headers The headers of the inputs
+	 * @param tidMaps Filled with a map from each input's target sequence indices to
+	 * the merged target sequence indices
+	 * @return The merged header, to be freed with bam_hdr_destroy
+	 */
+	static bam_hdr_t* mergeHeaders(const vector<bam_hdr_t*>& headers, vector<vector<int32_t>>& tidMaps);
+};
+
+}
+}
@@ -17,11 +17,17 @@
 
 #pragma once
 
+#include <condition_variable>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
+using std::condition_variable;
+using std::mutex;
+using std::thread;
 using std::unique_ptr;
 using std::string;
 using std::unordered_map;
@@ -52,12 +58,23 @@ namespace portcullis {
 namespace bam {
 
 
+const size_t DEFAULT_READ_AHEAD_BATCH_SIZE = 4096;
+
+/**
+ * A batch of alignments decoded ahead of time by the read ahead thread
+ */
+struct ReadAheadBatch {
+	vector<bam1_t*> records;
+	size_t size = 0;
+	bool eof = false;
+};
+
 class BamReader {
 
 private:
 
 	path bamFile;
-	uint16_t threads;
+	uint16_t ioThreads;
 
 	BGZF *fp;
 	bam_hdr_t* header;
@@ -67,10 +84,39 @@ private:
 
 	BamAlignment b;
 
+	// Read ahead state.  The read ahead thread fills the back batch while the
+	// caller consumes the front batch.
+	thread readAheadThread;
+	mutex readAheadMutex;
+	condition_variable readAheadCondition;
+	ReadAheadBatch front;
+	ReadAheadBatch back;
+	size_t frontIndex;
+	bool backReady;
+	bool readAheadRunning;
+	bool stopReadAhead;
+
+	void readAhead();
+
+	void startReadAhead();
+
+	void endReadAhead();
+
 public:
 
 	BamReader(const path& _bamFile);
 
+	/**
+	 * Creates a BAM reader which may use additional threads for I/O.  The version
+	 * of htslib we use can only use multiple threads for compression, so when
+	 * reading we use a single helper thread that reads and decodes alignments
+	 * ahead of the caller, so that decompression overlaps with processing.
+	 * @param _bamFile The BAM file to read
+	 * @param _ioThreads Whether to read ahead on a helper thread.  Any value above
+	 * 0 starts the one helper thread, 0 means do everything on the calling thread.
+	 */
+	BamReader(const path& _bamFile, const uint16_t _ioThreads);
+
 	virtual ~BamReader();
 
 	// **** Methods for extracting reference target sequences ********
@@ -93,10 +139,37 @@ public:
 
 	bool next();
 
+	/**
+	 * Reads the next alignment without decoding it into the current BamAlignment.
+	 * The record is owned by this reader and is only valid until the next read.
+	 * @return The next alignment, or nullptr if there are no more alignments
+	 */
+	bam1_t* nextRaw();
+
 	const BamAlignment& current() const;
 
 	void setRegion(const int32_t seqIndex, const int32_t start, const int32_t end);
 
+	/**
+	 * Uses the index to position the reader at the first alignment of the given
+	 * reference sequence.  Unlike setRegion, subsequent calls to next() read
+	 * sequentially through the file, without further seeks, and continue into the
+	 * following reference sequences.  It is up to the caller to decide when to stop.
+	 * @param seqIndex The reference sequence index
+	 * @return True if the reference sequence has any alignments, otherwise false,
+	 * in which case the position of the reader is undefined
+	 */
+	bool seekToSequence(const int32_t seqIndex);
+
+	/**
+	 * Uses the index to get the number of mapped alignments in the given reference
+	 * sequence.  Requires the BAM to be open.
+	 * @param seqIndex The reference sequence index
+	 * @return The number of mapped alignments, 0 if there are no alignments at all,
+	 * or -1 if the index doesn't hold this information
+	 */
+	int64_t getNbMappedAlignments(const int32_t seqIndex) const;
+
 	bool isCoordSortedBam();
 };
 
@@ -0,0 +1,201 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <htslib/sam.h>
+
+namespace portcullis {
+namespace bam {
+
+const uint64_t DEFAULT_SORT_MEMORY = 2ULL << 30;
+const int DEFAULT_SORT_RUN_COMPRESSION = 1;
+
+/**
+ * An alignment held in memory while sorting: its sort key and where its
+ * serialised record starts in the sort buffer.  As records are appended to the
+ * buffer in input order, the offset also breaks ties so that alignments with the
+ * same key stay in input order.
+ */
+struct SortEntry {
+	uint64_t key;
+	uint64_t offset;
+
+	bool operator<(const SortEntry& other) const {
+		return key < other.key || (key == other.key && offset < other.offset);
+	}
+};
+
+/**
+ * Alignments read into memory but not yet sorted.  Each record is serialised as
+ * its core fields, followed by the length of its variable length data and then
+ * the data itself.
+ */
+struct SortBuffer {
+	vector<uint8_t> data;
+	vector<SortEntry> entries;
+
+	/**
+	 * Memory allocated for the buffer, including any room not used yet
+	 */
+	uint64_t bytes() const {
+		return data.capacity() + entries.capacity() * sizeof(SortEntry);
+	}
+
+	/**
+	 * Serialises the alignment onto the end of the buffer
+	 */
+	void add(const bam1_t* b);
+
+	/**
+	 * As above, but only if the memory allocated for the buffer stays within the
+	 * given number of bytes.  The buffer grows by doubling, as a vector would,
+	 * except where that would go over the limit.  An empty buffer always takes
+	 * the alignment.
+	 * @return True if the alignment was added
+	 */
+	bool add(const bam1_t* b, const uint64_t maxBytes);
+
+	/**
+	 * Points the record at a serialised alignment in the buffer, without copying it.
+	 * The record must not be freed or resized.
+	 */
+	void get(const SortEntry& entry, bam1_t* b);
+
+	void clear() {
+		data.clear();
+		entries.clear();
+	}
+};
+
+/**
+ * Sorts a BAM file by coordinate, in the same order as "samtools sort", within a
+ * fixed memory budget.  Alignments are read into one of two buffers, each getting
+ * half of the budget.  When a buffer is full it is sorted and spilt to a
+ * temporary run file in the background, while the other buffer is filled.  The
+ * runs are then merged into the output.  If everything fits in the first buffer
+ * the output is written directly, without any temporary files.  Sorting uses
+ * multiple threads, as does compressing the runs and the output.
+ */
+class BamSorter {
+private:
+	path inputBam;
+	path outputBam;
+	path tempDir;
+	uint16_t threads;
+	uint16_t ioThreads;
+	uint64_t memory;
+	bool index;
+	bool useCsi;
+
+	vector<path> runs;
+	uint64_t nbAlignments;
+
+	void write(SortBuffer& buffer, const path& file, bam_hdr_t* header, const int compressionLevel, const bool indexed);
+
+	void merge();
+
+	/**
+	 * Number of helper threads each BAM writer gets to compress its output
+	 */
+	uint16_t getCompressionThreads() const {
+		return threads - 1 + ioThreads;
+	}
+
+public:
+
+	/**
+	 * Creates a sorter for the given input
+	 * @param _inputBam The BAM file to sort
+	 * @param _outputBam The sorted BAM file to create
+	 * @param _threads Number of threads to use for sorting and compression
+	 * @param _memory Maximum number of bytes to hold in memory for the alignments
+	 */
+	BamSorter(const path& _inputBam, const path& _outputBam, const uint16_t _threads, const uint64_t _memory);
+
+	/**
+	 * Additional threads to use for compressing output.  Any value above 0 also
+	 * reads the input ahead on one helper thread.
+	 */
+	void setIoThreads(const uint16_t ioThreads) {
+		this->ioThreads = ioThreads;
+	}
+
+	/**
+	 * Where to put the temporary run files.  By default these go next to the output.
+	 */
+	void setTempDir(const path& tempDir) {
+		this->tempDir = tempDir;
+	}
+
+	/**
+	 * Indexes the sorted BAM as it is written
+	 * @param useCsi Whether to create a CSI index rather than a BAI index
+	 */
+	void setIndex(const bool useCsi) {
+		this->index = true;
+		this->useCsi = useCsi;
+	}
+
+	/**
+	 * Number of temporary run files used by the last sort, 0 if the alignments
+	 * were sorted entirely in memory
+	 */
+	size_t getNbRuns() const {
+		return runs.size();
+	}
+
+	uint64_t getNbAlignments() const {
+		return nbAlignments;
+	}
+
+	/**
+	 * Sorts the input.  Throws a BamException if anything goes wrong.
+	 */
+	void sort();
+
+	/**
+	 * The key alignments are sorted by: target sequence, with unplaced alignments
+	 * last, then position, then strand.  This is the same as samtools uses.
+	 */
+	static uint64_t sortKey(const bam1_core_t& c) {
+		return ((uint64_t) (uint32_t) c.tid << 32) | ((uint64_t) (uint32_t) (c.pos + 1) << 1) | ((c.flag & BAM_FREVERSE) != 0);
+	}
+
+	/**
+	 * Marks the header as coordinate sorted, in the same way as samtools
+	 */
+	static void setCoordSorted(bam_hdr_t* header);
+
+	/**
+	 * Parses a memory size such as "2G", "768M" or "500000".  Suffixes K, M and G
+	 * are accepted, in either case.
+	 */
+	static uint64_t parseMemory(const string& memory);
+};
+
+}
+}
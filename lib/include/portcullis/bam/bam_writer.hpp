@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <fstream>
 #include <memory>
 #include <sstream>
 #include <string>
@@ -36,29 +37,134 @@ using boost::filesystem::path;
 using boost::lexical_cast;
 
 #include <htslib/faidx.h>
+#include <htslib/hts.h>
+#include <htslib/bgzf.h>
 
 #include <portcullis/bam/bam_alignment.hpp>
 
 namespace portcullis {
 namespace bam {
 
+const int DEFAULT_BGZF_MT_SUB_BLOCKS = 256;
+
+/**
+ * Writes BAM files, optionally building a BAI or CSI index as records are written.
+ * Instead of going through htslib's BGZF writer, this class forms the BGZF blocks
+ * itself, in exactly the same way, and compresses them in batches, in parallel
+ * if requested.  That way the compressed offset of every block is known once its
+ * batch is written, which the index needs.  The multi-threaded BGZF writer in our
+ * version of htslib doesn't keep track of this.  The index is saved when the
+ * writer is closed, so there's no need to read the BAM file again to index it.
+ */
 class BamWriter {
 private:
+
+	// A record whose end offset is still waiting for the compressed address of its block
+	struct PendingRecord {
+		int32_t tid;
+		int32_t beg;
+		int32_t end;
+		uint64_t block;
+		uint32_t offset;
+		bool mapped;
+	};
+
 	path bamFile;
+	uint16_t ioThreads;
+	int compressionLevel;
+	bool index;
+	bool useCsi;
+
+	std::ofstream out;
+
+	// Uncompressed blocks waiting to be compressed.  The block at nbQueued is being filled.
+	vector<vector<uint8_t>> blocks;
+	vector<vector<uint8_t>> compressed;
+	vector<size_t> compressedLengths;
+	size_t nbQueued;
+	uint32_t blockOffset;
+
+	// Compressed bytes and blocks written so far
+	uint64_t address;
+	uint64_t nbBlocksWritten;
+
+	// Compressed address of each block in the last batch written
+	vector<uint64_t> batchAddresses;
+	uint64_t batchStart;
+
+	hts_idx_t* idx;
+	int idxFormat;
+	vector<PendingRecord> pending;
+	bool unsorted;
+
+	void put(const void* data, size_t length);
 
-	BGZF *fp;
+	void endBlock();
+
+	void writeBlocks();
+
+	void pushPending();
 
 public:
-	BamWriter(const path& _bamFile) {
+
+	BamWriter(const path& _bamFile) : BamWriter(_bamFile, 0) {}
+
+	/**
+	 * Creates a BAM writer which may use additional threads to compress output
+	 * @param _bamFile The BAM file to write
+	 * @param _ioThreads Number of helper threads to use for compression.  0 means
+	 * compress on the calling thread.
+	 */
+	BamWriter(const path& _bamFile, const uint16_t _ioThreads) : BamWriter(_bamFile, _ioThreads, -1) {}
+
+	/**
+	 * As above but with a specific compression level
+	 * @param _compressionLevel From 0 (uncompressed) to 9 (best compression).  -1
+	 * uses the htslib default.  Low levels are much faster to write, which is
+	 * worthwhile for intermediate files.
+	 */
+	BamWriter(const path& _bamFile, const uint16_t _ioThreads, const int _compressionLevel) {
 		bamFile = _bamFile;
+		ioThreads = _ioThreads;
+		compressionLevel = _compressionLevel;
+		index = false;
+		useCsi = false;
+		nbQueued = 0;
+		blockOffset = 0;
+		address = 0;
+		nbBlocksWritten = 0;
+		batchStart = 0;
+		idx = nullptr;
+		idxFormat = HTS_FMT_BAI;
+		unsorted = false;
 	}
 
-	virtual ~BamWriter() {}
+	virtual ~BamWriter();
+
+	/**
+	 * Builds an index while writing, which is saved next to the BAM file, as
+	 * "samtools index" would, when the writer is closed.  Records must then be
+	 * written in coordinate order.  Must be called before open.
+	 * @param useCsi Whether to create a CSI index rather than a BAI index
+	 */
+	void setIndex(bool useCsi) {
+		this->index = true;
+		this->useCsi = useCsi;
+	}
 
 	void open(bam_hdr_t* header);
 
 	int write(const BamAlignment& ba);
 
+	/**
+	 * Writes a raw samtools alignment directly
+	 */
+	int write(const bam1_t* b);
+
+	/**
+	 * Flushes everything to disk and saves the index if requested.  Throws a
+	 * BamException if an index was requested but the records were not sorted.
+	 */
 	void close();
 };
 
@@ -43,10 +43,13 @@ namespace portcullis {
 namespace bam {
 
 
+class BamReader;
+
 typedef struct {     // auxiliary data structure
 	BGZF* fp;      // the file handler
 	hts_itr_t* iter; // NULL if a region not specified
 	int min_mapQ, min_len; // mapQ filter; length filter
+	BamReader* reader; // NULL unless reading ahead on a separate thread
 } aux_t;
 
 typedef struct {
@@ -62,6 +65,7 @@ private:
 	path bamFile;
 	uint8_t strandSpecific;
 	bool allowGappedAlignments;
+	uint16_t ioThreads;
 
 	bam_hdr_t *header;
 	aux_t** data;
@@ -73,6 +77,9 @@ private:
 
 protected:
 
+	// Reads the next BAM alignment, either directly or from the read ahead reader
+	static int read_next(aux_t* aux, bam1_t *b);
+
 	// This function reads a BAM alignment from one BAM file.
 	static int read_bam(void *data, bam1_t *b);
 
@@ -84,6 +91,12 @@ public:
 
 	DepthParser(path _bamFile, uint8_t _strandSpecific, bool _allowGappedAlignments);
 
+	/**
+	 * As above, but reads and decodes alignments on a separate thread if
+	 * _ioThreads is greater than 0
+	 */
+	DepthParser(path _bamFile, uint8_t _strandSpecific, bool _allowGappedAlignments, uint16_t _ioThreads);
+
 	virtual ~DepthParser();
 
 
@@ -0,0 +1,220 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/spliced_spill.hpp>
+
+namespace portcullis {
+namespace bam {
+
+/**
+ * Layout of a junction evidence file.  All offsets are in bytes from the start of
+ * the file, and each section is 8 byte aligned.  The records are followed by one
+ * column per field, with an entry per record, and then the target sequences.
+ */
+struct EvidenceFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t nbRefs;
+	uint64_t nbRecords;
+	uint64_t fileSize;
+	uint64_t recordsOffset;
+	uint64_t recordOffsetsOffset;
+	uint64_t positionsOffset;
+	uint64_t flagsOffset;
+	uint64_t mapQualitiesOffset;
+	uint64_t nameHashesOffset;
+	uint64_t refsOffset;
+	uint64_t namesOffset;
+};
+
+/**
+ * A target sequence in a junction evidence file: where its records are, stats for
+ * all its alignments, spliced or not, and the longest stretch of the reference
+ * covered by any of its records
+ */
+struct EvidenceFileRef {
+	uint64_t firstRecord;
+	uint64_t nbRecords;
+	SpillRefStats stats;
+	int32_t length;
+	int32_t maxSpan;
+	uint32_t nameOffset;
+	uint32_t nameLength;
+};
+
+const char EVIDENCE_FILE_MAGIC[8] = {'P', 'C', 'J', 'E', 'V', 'I', 'D', 'E'};
+const uint32_t EVIDENCE_FILE_VERSION = 1;
+
+/**
+ * Writes a junction evidence file from spliced alignments given in coordinate
+ * order.  Each alignment is kept as a raw record without base qualities, and
+ * without any tags other than those junction finding uses (XS and MD).  The
+ * columns are built up in temporary files alongside the output, so memory use
+ * doesn't grow with the number of alignments.
+ */
+class EvidenceFileWriter {
+private:
+	path file;
+	std::ofstream out;
+	std::ofstream recordOffsets;
+	std::ofstream positions;
+	std::ofstream flags;
+	std::ofstream mapQualities;
+	std::ofstream nameHashes;
+	vector<EvidenceFileRef> refs;
+	vector<string> names;
+	uint64_t nbRecords;
+	int32_t lastRefId;
+	int32_t lastPosition;
+	vector<uint8_t> record;
+
+	path getColumnFile(const string& column) const {
+		return path(file.string() + ".tmp." + column);
+	}
+
+	void removeTemporaryFiles();
+
+public:
+
+	EvidenceFileWriter(const path& _file);
+
+	virtual ~EvidenceFileWriter();
+
+	void open(const bam_hdr_t* header);
+
+	/**
+	 * Adds a spliced alignment.  Throws a BamException if the alignments are not
+	 * coordinate sorted.
+	 */
+	void add(const bam1_t* b);
+
+	/**
+	 * Finishes the file
+	 * @param stats Stats for all the alignments on each target sequence
+	 */
+	void close(const vector<SpillRefStats>& stats);
+
+	uint64_t getNbRecords() const {
+		return nbRecords;
+	}
+};
+
+/**
+ * A junction evidence file, memory mapped read only.  This holds just what is
+ * needed to find junctions and calculate all their basic metrics: the spliced
+ * alignments in coordinate order, plus alignment stats for each target
+ * sequence.  Reading it only involves copying memory rather than decompressing
+ * and decoding a BAM file.  Columns of the commonly used fields are available so
+ * that the records needn't be read at all to scan them.
+ */
+class EvidenceFile {
+private:
+	path file;
+	void* data;
+	size_t size;
+	const EvidenceFileHeader* header;
+	const EvidenceFileRef* refs;
+
+	const char* base() const {
+		return (const char*)data;
+	}
+
+	/**
+	 * Checks the header, and that every section, record offset and target sequence
+	 * lies within the file
+	 */
+	bool isValid() const;
+
+public:
+
+	EvidenceFile(const path& _file);
+
+	EvidenceFile(const EvidenceFile&) = delete;
+	EvidenceFile& operator=(const EvidenceFile&) = delete;
+
+	virtual ~EvidenceFile();
+
+	path getFile() const {
+		return file;
+	}
+
+	uint64_t getNbRecords() const {
+		return header->nbRecords;
+	}
+
+	int32_t getNbRefs() const {
+		return header->nbRefs;
+	}
+
+	const EvidenceFileRef& getRef(const int32_t refId) const {
+		return refs[refId];
+	}
+
+	string getRefName(const int32_t refId) const {
+		return string(base() + header->namesOffset + refs[refId].nameOffset, refs[refId].nameLength);
+	}
+
+	const int32_t* getPositions() const {
+		return (const int32_t*)(base() + header->positionsOffset);
+	}
+
+	const uint16_t* getFlags() const {
+		return (const uint16_t*)(base() + header->flagsOffset);
+	}
+
+	const uint8_t* getMapQualities() const {
+		return (const uint8_t*)(base() + header->mapQualitiesOffset);
+	}
+
+	/**
+	 * Hashes of the read names, with mate suffixes, as used to identify alignments
+	 * from the same read
+	 */
+	const uint64_t* getNameHashes() const {
+		return (const uint64_t*)(base() + header->nameHashesOffset);
+	}
+
+	/**
+	 * Gets the index of the first record on the target sequence starting at or after
+	 * the given position
+	 */
+	uint64_t findFirst(const int32_t refId, const int32_t position) const;
+
+	/**
+	 * Copies a record into the alignment, growing its data as required.  The base
+	 * qualities are all missing (0xff).  Throws a BamException if the record runs
+	 * past the end of the records.
+	 */
+	void getRecord(const uint64_t index, bam1_t* b) const;
+};
+
+}
+}
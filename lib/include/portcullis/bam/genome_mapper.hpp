@@ -17,13 +17,19 @@
 
 #pragma once
 
+#include <list>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
+using std::list;
+using std::pair;
 using std::shared_ptr;
 using std::make_shared;
 using std::string;
+using std::unordered_map;
 using std::vector;
 using std::stringstream;
 
@@ -43,6 +49,222 @@ using boost::lexical_cast;
 namespace portcullis {
 namespace bam {
 
+const string PACKED_GENOME_EXTENSION = ".packed";
+
+/**
+ * A run of Ns or lowercase bases in a reference sequence, [start, end)
+ */
+struct SeqRun {
+	int32_t start;
+	int32_t end;
+};
+
+/**
+ * A character in a reference sequence that isn't A, C, G, T or N, in either case
+ */
+struct SeqOther {
+	int32_t pos;
+	int32_t base;
+};
+
+/**
+ * A complete reference sequence.  Bases are packed 2 bits per base (A=0, C=1,
+ * G=2, T=3).  Runs of Ns and of lowercase (soft masked) bases are recorded
+ * separately, as is anything else (e.g. IUPAC codes), so that the original
+ * sequence can be reproduced exactly.  The data is either owned by this object,
+ * or is a view onto a memory mapped packed genome file.
+ */
+class PackedSeq {
+private:
+	int32_t len;
+	const uint8_t* bases;
+	const SeqRun* nRuns;
+	uint32_t nbNRuns;
+	const SeqRun* lowerRuns;
+	uint32_t nbLowerRuns;
+	const SeqOther* others;
+	uint32_t nbOthers;
+
+	// Only used if we packed the sequence ourselves
+	vector<uint8_t> ownBases;
+	vector<SeqRun> ownNRuns;
+	vector<SeqRun> ownLowerRuns;
+	vector<SeqOther> ownOthers;
+
+	static void addToRun(vector<SeqRun>& runs, const int32_t pos);
+
+	static const SeqRun* firstRunEndingAfter(const SeqRun* runs, const uint32_t nbRuns, const int32_t pos);
+
+	const SeqOther* firstOtherFrom(const int32_t pos) const;
+
+public:
+
+	PackedSeq() : PackedSeq(nullptr, 0) {}
+
+	/**
+	 * Packs the given sequence
+	 * @param seq The sequence
+	 * @param _len Length of the sequence
+	 */
+	PackedSeq(const char* seq, const int32_t _len);
+
+	/**
+	 * Creates a view onto an already packed sequence.  The data must outlive this object.
+	 */
+	PackedSeq(const int32_t _len, const uint8_t* _bases,
+			const SeqRun* _nRuns, const uint32_t _nbNRuns,
+			const SeqRun* _lowerRuns, const uint32_t _nbLowerRuns,
+			const SeqOther* _others, const uint32_t _nbOthers) :
+		len(_len), bases(_bases),
+		nRuns(_nRuns), nbNRuns(_nbNRuns),
+		lowerRuns(_lowerRuns), nbLowerRuns(_nbLowerRuns),
+		others(_others), nbOthers(_nbOthers) {}
+
+	// Views may point into our own storage, so don't allow copies
+	PackedSeq(const PackedSeq&) = delete;
+	PackedSeq& operator=(const PackedSeq&) = delete;
+
+	int32_t length() const {
+		return len;
+	}
+
+	/**
+	 * Gets the 2 bit code for the base at the given position.  Note that Ns and
+	 * anything other than ACGT are given a code of 0, so check isN if this matters.
+	 */
+	uint8_t getCode(const int32_t pos) const {
+		return (bases[pos >> 2] >> ((pos & 3) << 1)) & 3;
+	}
+
+	/**
+	 * Whether the base at the given position is anything other than A, C, G or T
+	 * (in either case)
+	 */
+	bool isN(const int32_t pos) const;
+
+	/**
+	 * Whether there are no bases other than A, C, G or T (in either case) between
+	 * start and end inclusive
+	 */
+	bool isACGT(const int32_t start, const int32_t end) const;
+
+	/**
+	 * Extracts the original sequence between start and end (both inclusive), which
+	 * must be within the sequence.  Reuses the storage in seq.
+	 */
+	void extract(const int32_t start, const int32_t end, string& seq) const;
+
+	/**
+	 * Approximate number of bytes used to hold this sequence
+	 */
+	uint64_t memoryUsage() const {
+		return (len + 3) / 4 + (nbNRuns + nbLowerRuns) * sizeof(SeqRun) + nbOthers * sizeof(SeqOther);
+	}
+
+	uint32_t getNbNRuns() const { return nbNRuns; }
+	const SeqRun* getNRuns() const { return nRuns; }
+	uint32_t getNbLowerRuns() const { return nbLowerRuns; }
+	const SeqRun* getLowerRuns() const { return lowerRuns; }
+	uint32_t getNbOthers() const { return nbOthers; }
+	const SeqOther* getOthers() const { return others; }
+	const uint8_t* getBases() const { return bases; }
+};
+
+typedef shared_ptr<PackedSeq> PackedSeqPtr;
+
+/**
+ * Header of a packed genome file.  This is followed by one PackedSeqEntry per
+ * sequence, then the packed data for each sequence and finally the sequence names.
+ * All offsets are from the start of the file and are 8 byte aligned.
+ */
+struct PackedGenomeHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t nbSeqs;
+	uint64_t fileSize;
+};
+
+struct PackedSeqEntry {
+	uint64_t nameOffset;
+	uint64_t basesOffset;
+	uint64_t nRunsOffset;
+	uint64_t lowerRunsOffset;
+	uint64_t othersOffset;
+	int32_t length;
+	uint32_t nameLength;
+	uint32_t nbNRuns;
+	uint32_t nbLowerRuns;
+	uint32_t nbOthers;
+	uint32_t padding;
+};
+
+const char PACKED_GENOME_MAGIC[8] = {'P', 'C', 'G', 'E', 'N', 'O', 'M', 'E'};
+const uint32_t PACKED_GENOME_VERSION = 1;
+
+/**
+ * A packed genome file, memory mapped read only.  Packed genomes are shared by
+ * all genome mappers in this process that refer to the same file, and the OS
+ * shares the mapped pages between processes, so the genome is only held in
+ * memory once.
+ */
+class PackedGenome {
+private:
+	path file;
+	void* data;
+	size_t size;
+	vector<PackedSeqPtr> seqs;
+	vector<string> names;
+	unordered_map<string, int32_t> nameIndex;
+
+public:
+
+	/**
+	 * Maps the given packed genome file.  Use open instead to share mappings.
+	 */
+	PackedGenome(const path& _file);
+
+	PackedGenome(const PackedGenome&) = delete;
+	PackedGenome& operator=(const PackedGenome&) = delete;
+
+	virtual ~PackedGenome();
+
+	/**
+	 * Gets a shared mapping of the given packed genome file, mapping it if it is
+	 * not already mapped by this process
+	 */
+	static shared_ptr<PackedGenome> open(const path& file);
+
+	/**
+	 * Packs all the sequences in the given fasta index and writes them to file
+	 */
+	static void write(faidx_t* fastaIndex, const path& file);
+
+	path getFile() const {
+		return file;
+	}
+
+	int32_t getNbSeqs() const {
+		return seqs.size();
+	}
+
+	/**
+	 * Gets the index of the named sequence, or -1 if not present
+	 */
+	int32_t getIndex(const char* name) const;
+
+	const string& getName(const int32_t index) const {
+		return names[index];
+	}
+
+	const PackedSeqPtr& getSeq(const int32_t index) const {
+		return seqs[index];
+	}
+};
+
+typedef shared_ptr<PackedGenome> PackedGenomePtr;
+
+const uint64_t DEFAULT_GENOME_CACHE_SIZE = 512 * 1024 * 1024;
+
 class GenomeMapper {
 private:
 
@@ -52,6 +274,19 @@ private:
 	// Handle to genome map.  Created by constructor.
 	faidx_t* fastaIndex;
 
+	// Cache of whole reference sequences, most recently used at the front.  Note
+	// that this makes fetching sequences not thread safe, so use one genome mapper
+	// per thread.
+	bool cacheEnabled;
+	uint64_t cacheSize;
+	mutable uint64_t cacheUsage;
+	mutable list<pair<string, PackedSeqPtr>> cache;
+	mutable unordered_map<string, list<pair<string, PackedSeqPtr>>::iterator> cacheIndex;
+
+	// Packed genome file, if available, and the last sequence fetched from it
+	PackedGenomePtr packedGenome;
+	mutable int32_t lastPackedIndex;
+
 protected:
 
 
@@ -82,15 +317,37 @@ public:
 		return path(genomeFile.parent_path()) /= path(genomeFile.leaf().string() + ".fai");
 	}
 
+	path getPackedGenomeFile() const {
+		return path(genomeFile.parent_path()) /= path(genomeFile.leaf().string() + PACKED_GENOME_EXTENSION);
+	}
+
+	bool isPacked() const {
+		return packedGenome != nullptr;
+	}
+
+	/**
+	 * Whether packed reference sequences can be retrieved with getSeq
+	 */
+	bool hasPackedSeqs() const {
+		return packedGenome != nullptr || cacheEnabled;
+	}
+
 
 	/**
 	 * Constructs the index for this fasta genome file
 	 */
 	void buildFastaIndex();
 
+	/**
+	 * Creates a packed copy of this genome, which can be memory mapped for fast
+	 * random access to the sequence.  The fasta index must be loaded first.
+	 */
+	void buildPackedGenome();
+
 	/**
 	 * Loads the index for this genome file.  This must be done before using any
-	 * of the fetch commands.
+	 * of the fetch commands.  If an up to date packed copy of the genome exists
+	 * then that is mapped and used for fetching sequences by name.
 	 */
 	void loadFastaIndex();
 
@@ -111,6 +368,26 @@ public:
 	 */
 	string fetchBases(const char* name, int start, int end) const;
 
+	/**
+	 * Enables caching of whole reference sequences in memory so that fetching
+	 * bases doesn't need to go to disk each time.  Sequences are loaded the first
+	 * time they are requested and the least recently used sequences are discarded
+	 * when the cache exceeds the given size.  The most recently used sequence is
+	 * always kept, so a size of 0 means cache just one sequence, which works well
+	 * when requests are ordered by reference sequence.
+	 * @param maxBytes Maximum size of the cache in bytes
+	 */
+	void enableCache(const uint64_t maxBytes);
+
+	/**
+	 * Gets the given reference sequence, either from the packed genome or by
+	 * loading it into the cache.  Either a packed genome must be loaded or the
+	 * cache must be enabled.
+	 * @param name Name of the reference sequence
+	 * @return The packed sequence, or nullptr if no such sequence exists
+	 */
+	PackedSeqPtr getSeq(const char* name) const;
+
 	/**
 	 * Get the number of sequences / contigs / scaffolds in the genome
 	 * @return
@@ -0,0 +1,160 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_sorter.hpp>
+
+namespace portcullis {
+namespace bam {
+
+const size_t DEFAULT_SPILL_BUCKETS = 64;
+
+/**
+ * Counts and query length statistics for all the alignments on a target sequence,
+ * spliced or not, gathered while spilling
+ */
+struct SpillRefStats {
+	uint64_t splicedCount = 0;
+	uint64_t unsplicedCount = 0;
+	uint64_t sumQueryLengths = 0;
+	int32_t minQueryLength = INT32_MAX;
+	int32_t maxQueryLength = 0;
+
+	void add(const bam1_t* b, const bool spliced) {
+		const int32_t len = b->core.l_qseq;
+		minQueryLength = std::min(minQueryLength, len);
+		maxQueryLength = std::max(maxQueryLength, len);
+		sumQueryLengths += len;
+		if (spliced) {
+			splicedCount++;
+		}
+		else {
+			unsplicedCount++;
+		}
+	}
+};
+
+/**
+ * The spliced alignments for a run of consecutive target sequences, from refId to
+ * lastRefId inclusive, in input order
+ */
+struct SpillBucket {
+	int32_t refId = 0;
+	int32_t lastRefId = 0;
+	uint64_t nbAlignments = 0;
+};
+
+/**
+ * Keeps only the spliced alignments from one or more BAM files, which need not be
+ * sorted, in a single pass over the input.  The spliced alignments are split by
+ * target sequence into buckets, each saved to a small temporary BAM file, while
+ * the unspliced alignments are only counted.  As the buckets are much smaller than
+ * the input they can each be sorted in memory when needed, which avoids sorting
+ * the whole input when only the spliced alignments are of interest.
+ *
+ * The buckets and statistics are described by an index file, from which the
+ * bucket file names are derived.  The index is written last, so if it exists then
+ * the spill is complete.
+ */
+class SplicedSpill {
+private:
+	path indexFile;
+	vector<SpillBucket> buckets;
+	vector<SpillRefStats> refStats;
+	uint64_t nbAlignments;
+
+public:
+
+	/**
+	 * @param _indexFile The index file of the spill to create or load
+	 */
+	SplicedSpill(const path& _indexFile);
+
+	path getIndexFile() const {
+		return indexFile;
+	}
+
+	path getBucketFile(const size_t index) const;
+
+	size_t getNbBuckets() const {
+		return buckets.size();
+	}
+
+	const SpillBucket& getBucket(const size_t index) const {
+		return buckets[index];
+	}
+
+	const SpillRefStats& getRefStats(const int32_t refId) const {
+		return refStats[refId];
+	}
+
+	/**
+	 * Total number of alignments in the input, including those without a target
+	 * sequence
+	 */
+	uint64_t getNbAlignments() const {
+		return nbAlignments;
+	}
+
+	uint64_t getNbSplicedAlignments() const;
+
+	/**
+	 * Spills the spliced alignments from the inputs.  The inputs' headers are
+	 * merged as when merging BAM files, and alignments in a bucket keep the order
+	 * of the inputs, so sorting a bucket gives the same order as sorting and
+	 * merging the inputs.  Throws a BamException if anything goes wrong, in which
+	 * case nothing is left behind.
+	 * @param inputs The BAM files to read
+	 * @param ioThreads Additional threads to use for reading each input
+	 * @param nbBuckets Roughly how many buckets to split the target sequences into,
+	 * by length.  Target sequences are never split between buckets.
+	 */
+	void create(const vector<path>& inputs, const uint16_t ioThreads, const size_t nbBuckets);
+
+	/**
+	 * Loads the index of an existing spill.  Throws a BamException if it can't be
+	 * read.
+	 */
+	void load();
+
+	/**
+	 * Reads a bucket into the buffer and sorts it by coordinate, in the same order
+	 * as "samtools sort"
+	 */
+	void readBucket(const size_t index, SortBuffer& buffer) const;
+
+	/**
+	 * Deletes the index and bucket files of the spill, if they exist
+	 */
+	void remove();
+};
+
+}
+}
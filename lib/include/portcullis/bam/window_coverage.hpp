@@ -0,0 +1,119 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+
+#pragma once
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+using std::pair;
+using std::vector;
+
+#include <htslib/sam.h>
+
+namespace portcullis {
+namespace bam {
+
+/**
+ * Depth of coverage over a set of windows along a single target sequence.  Only
+ * the windows are stored, as difference arrays built directly from the aligned
+ * blocks of each alignment, so memory use is proportional to the size of the
+ * windows rather than the length of the target sequence.
+ *
+ * Usage: add all the windows of interest, call prepare(), add the alignments in
+ * coordinate order, then call finalise() before querying depths.
+ */
+class WindowCoverage {
+private:
+
+	// Windows as requested, as half-open intervals
+	vector<pair<int32_t, int32_t>> requested;
+
+	// Disjoint windows sorted by start, as half-open intervals
+	vector<int32_t> starts;
+	vector<int32_t> ends;
+
+	// Offset of each window into the depth array
+	vector<size_t> offsets;
+
+	// Coverage differences while alignments are being added, depths once finalised
+	vector<int32_t> depths;
+
+	// The first window that alignments still to come might overlap
+	size_t first;
+	int32_t lastPos;
+	bool finalised;
+
+	void addBlock(int32_t start, int32_t end, size_t w);
+
+public:
+
+	WindowCoverage();
+
+	/**
+	 * Requests coverage for the half-open interval [start, end).  Windows may
+	 * overlap one another and be added in any order.
+	 */
+	void addWindow(int32_t start, int32_t end);
+
+	/**
+	 * Merges the requested windows and allocates the storage for them.  Must be
+	 * called after all windows are added and before any alignments are added.
+	 */
+	void prepare();
+
+	/**
+	 * Adds the aligned (M, = and X) blocks of the given alignment to any windows
+	 * they overlap.  Deletions and reference skips don't contribute to coverage.
+	 * Alignments must be added in coordinate order.
+	 * @param b The alignment to add
+	 */
+	void addAlignment(const bam1_t* b);
+
+	/**
+	 * Converts the difference arrays into depths.  No more alignments can be added
+	 * afterwards.
+	 */
+	void finalise();
+
+	/**
+	 * @param pos 0-based position on the target sequence
+	 * @return The depth at the given position, or 0 if it's outside all windows
+	 */
+	uint32_t getDepth(int32_t pos) const;
+
+	/**
+	 * @return The sum of depths over the inclusive range [start, end].  Positions
+	 * outside all windows count as 0.
+	 */
+	uint64_t sumDepths(int32_t start, int32_t end) const;
+
+	size_t getNbWindows() const {
+		return starts.size();
+	}
+
+	/**
+	 * @return The total number of positions covered by windows
+	 */
+	size_t getNbPositions() const {
+		return offsets.empty() ? 0 : depths.size() - offsets.size();
+	}
+};
+
+}
+}
@@ -41,6 +41,38 @@ typedef boost::error_info<struct IntronError, string> IntronErrorInfo;
 struct IntronException: virtual boost::exception, virtual std::exception { };
 
 
+/**
+ * An intron's location packed into two integers, which can be hashed and compared
+ * without touching the target sequence name.  Keys sort in the same order as
+ * IntronComparator, i.e. by target sequence index, then start, then end.  Each
+ * coordinate has its sign bit flipped so that unsigned comparison gives signed
+ * order.
+ */
+struct IntronKey {
+	uint64_t high;  // Target sequence index in the top 32 bits, start in the bottom 32 bits
+	uint64_t low;   // End in the bottom 32 bits
+
+	static uint32_t bias(const int32_t value) {
+		return (uint32_t)value ^ 0x80000000u;
+	}
+
+	static IntronKey of(const int32_t refId, const int32_t start, const int32_t end) {
+		return IntronKey{((uint64_t)bias(refId) << 32) | bias(start), bias(end)};
+	}
+
+	bool operator==(const IntronKey& other) const {
+		return high == other.high && low == other.low;
+	}
+
+	bool operator!=(const IntronKey& other) const {
+		return !((*this) == other);
+	}
+
+	bool operator<(const IntronKey& other) const {
+		return high < other.high || (high == other.high && low < other.low);
+	}
+};
+
 class Intron {
 
 
@@ -82,6 +114,10 @@ public:
 		return end - start + 1;
 	}
 
+	IntronKey key() const {
+		return IntronKey::of(ref.index, start, end);
+	}
+
 	/**
 	 * We probably need to double check this logic.  We say this intron shares a
 	 * donor or acceptor with another intron, if the ref id is the same and we
@@ -43,6 +43,7 @@ typedef std::unordered_map<size_t, uint16_t> SplicedAlignmentMap;
 #include "bam/bam_alignment.hpp"
 #include "bam/bam_reader.hpp"
 #include "bam/genome_mapper.hpp"
+#include "bam/window_coverage.hpp"
 using namespace portcullis::bam;
 
 #include "ml/markov_model.hpp"
@@ -83,6 +84,10 @@ const string SEMI_CANONICAL_SEQ2_RC = SeqUtils::reverseComplement(SEMI_CANONICAL
 // equal and to avoid any issues.
 const uint32_t TRIMMED_COVERAGE_LENGTH = 50;
 
+// Length of each of the regions either side of the donor and acceptor sites used
+// to calculate the coverage metric
+const int32_t COVERAGE_REGION_LENGTH = 10;
+
 enum class CanonicalSS {
 	CANONICAL,
 	SEMI_CANONICAL,
@@ -135,9 +140,120 @@ struct SplicingScores {
 	double splicingSignal = 0.0;
 };
 
+/**
+ * Maximum number of columns from each end of an anchor region for which we record
+ * the positions of mismatches
+ */
+const uint16_t MAX_MISMATCH_POSITIONS = 64;
+
+/**
+ * Tallies matches and mismatches between the query and the reference over the
+ * columns of an anchor region, added in order from left to right.  Mismatch
+ * positions are only kept for the first and last MAX_MISMATCH_POSITIONS columns.
+ */
+struct AnchorMismatches {
+	uint32_t length = 0;
+	uint32_t nbMismatches = 0;
+	uint32_t firstMismatch = 0;
+	uint32_t sinceLastMismatch = 0;
+	uint64_t fromStart = 0; // Bit i is set if column i is a mismatch
+	uint64_t fromEnd = 0; // Bit i is set if column (length - i - 1) is a mismatch
+
+	void add(const bool mismatch) {
+		if (mismatch) {
+			if (nbMismatches++ == 0) firstMismatch = length;
+			if (length < MAX_MISMATCH_POSITIONS) fromStart |= (uint64_t)1 << length;
+			sinceLastMismatch = 0;
+		}
+		else {
+			sinceLastMismatch++;
+		}
+		fromEnd = (fromEnd << 1) | (mismatch ? 1 : 0);
+		length++;
+	}
+
+	void addMismatches(const uint32_t n) {
+		for (uint32_t i = 0; i < n; i++) {
+			add(true);
+		}
+	}
+
+	uint32_t getNbMatches() const {
+		return length - nbMismatches;
+	}
+
+	uint32_t getNbMatchesFromStart() const {
+		return nbMismatches == 0 ? length : firstMismatch;
+	}
+
+	uint32_t getNbMatchesFromEnd() const {
+		return sinceLastMismatch;
+	}
+};
+
+/**
+ * The reference sequence for an anchor region.  The anchor sequence fetched from
+ * the genome must always be provided.  If the packed reference sequence is also
+ * provided it is used directly where the anchor contains only A, C, G and T.
+ */
+struct AnchorRef {
+	int32_t start;
+	const string& seq;
+	const PackedSeq* packed;
+
+	AnchorRef(const int32_t _start, const string& _seq, const PackedSeq* _packed) :
+		start(_start), seq(_seq), packed(_packed) {}
+};
+
+/**
+ * A compact summary of a spliced alignment supporting a junction.  This holds only
+ * what is required to calculate the anchor match statistics once the junction's
+ * anchors are final: the alignment start, aligned length, cigar, the 4-bit packed
+ * query sequence and the MD tag if present.  Read names, qualities and other aux
+ * tags are not kept.
+ */
+struct AlignmentSummary {
+	int32_t position;
+	int32_t alignedLength;
+	int32_t seqLength;
+	vector<CigarOp> cigar;
+	vector<uint8_t> seq;
+	string md;
+
+	AlignmentSummary(const BamAlignment& al);
+
+	int32_t getEnd() const {
+		return position + alignedLength - 1;
+	}
+
+	string getQuerySeq() const;
+
+	/**
+	 * Works out which columns of the alignment within the given reference region
+	 * are mismatches in a single walk along the cigar, comparing the packed query
+	 * sequence with either the MD tag or the reference.  The columns are the same
+	 * as those produced by BamAlignment::getPaddedQuerySeq and
+	 * BamAlignment::getPaddedGenomeSeq, so insertions, deletions and skipped
+	 * regions all count as mismatches.
+	 * @param start Start of the region (inclusive)
+	 * @param end End of the region (inclusive)
+	 * @param ref The reference sequence covering the region
+	 * @param useMD Whether to use the MD tag rather than the reference for aligned bases
+	 * @param mismatches Tally of the mismatches in the region
+	 * @return False if the MD tag is requested but missing, or if the cigar doesn't
+	 * agree with the query, MD tag or reference
+	 */
+	bool calcAnchorMismatches(const int32_t start, const int32_t end, const AnchorRef& ref, const bool useMD, AnchorMismatches& mismatches) const;
+
+	string toString() const;
+};
+
+/**
+ * Match statistics for a single alignment across a junction window.  These are
+ * calculated from an AlignmentSummary when the junction is finalised, folded into
+ * the junction metrics and then discarded.
+ */
 struct AlignmentInfo {
-	BamAlignmentPtr ba;
-	size_t nameCode;
 	uint32_t totalUpstreamMatches; // Total number of upstream matches in this junction window
 	uint32_t totalDownstreamMatches; // Total number of downstream matches in this junction window
 	uint32_t totalUpstreamMismatches;
@@ -148,14 +264,10 @@ struct AlignmentInfo {
 	uint32_t maxMatch; // Distance to first mismatch (maximum of either upstream or downstream)
 	uint32_t nbMismatches; // Total number of mismatches in this junction window
 	uint32_t mmes; // Minimal Match on Either Side of exon junction
-	vector<bool> upstreamMismatchPositions;
-	vector<bool> downstreamMismatchPositions;
-
-	AlignmentInfo(BamAlignmentPtr _ba) {
-		// Copy alignment
-		ba = _ba;
-		// Calculate a hash of the alignment name
-		nameCode = std::hash<std::string>()(ba->deriveName());
+	uint64_t upstreamMismatchPositions; // Bit i is set if there is a mismatch i bases upstream of the junction
+	uint64_t downstreamMismatchPositions; // Bit i is set if there is a mismatch i bases downstream of the junction
+
+	AlignmentInfo() {
 		totalUpstreamMatches = 0;
 		totalDownstreamMatches = 0;
 		totalUpstreamMismatches = 0;
@@ -166,22 +278,59 @@ struct AlignmentInfo {
 		maxMatch = 0;
 		nbMismatches = 0;
 		mmes = 0;
-		upstreamMismatchPositions = vector<bool> (0, false);
-		downstreamMismatchPositions = vector<bool> (0, false);
+		upstreamMismatchPositions = 0;
+		downstreamMismatchPositions = 0;
 	}
 
-	~AlignmentInfo() {
-		ba.reset();
-		upstreamMismatchPositions.clear();
-		downstreamMismatchPositions.clear();
+	/**
+	 * Calculates the match statistics for the given alignment across the junction.
+	 * Uses the MD tag if present, otherwise compares against the reference.
+	 * @param packed The packed reference sequence, or nullptr to only use the anchor sequences
+	 */
+	void calcMatchStats(const AlignmentSummary& al, const Intron& i, const uint32_t leftStart, const uint32_t rightEnd,
+			const string& ancLeft, const string& ancRight, const PackedSeq* packed = nullptr);
+
+	/**
+	 * Sets the match statistics from the mismatches in the left and right anchors
+	 */
+	void setMatchStats(const AnchorMismatches& left, const AnchorMismatches& right);
+};
+
+/**
+ * Running tallies over the alignments supporting a junction that can't be turned
+ * into junction metrics until all alignments have been seen, either because they
+ * depend on the orientation provided by the user or because they need the complete
+ * distribution (entropy).  Everything here is updated in constant (amortised) time
+ * as each alignment is added.
+ */
+struct JunctionEvidence {
+	// Read strand tallies, used to determine the read strand
+	uint32_t nbPosStrand = 0;
+	uint32_t nbNegStrand = 0;
+	uint32_t nbUnkStrand = 0;
+
+	// Portcullis properly paired and reliable alignment counts for each orientation
+	// that supports a proper pair check, indexed by FR, RF, FF
+	uint32_t nbProperlyPaired[3] = {0, 0, 0};
+	uint32_t nbReliable[3] = {0, 0, 0};
+
+	// Counts of alignments at each distinct start position, ordered by position
+	vector<std::pair<int32_t, uint32_t>> startCounts;
+
+	// Used to count distinct alignments
+	int32_t lastStart = -1;
+	int32_t lastEnd = -1;
+
+	static int orientationIndex(Orientation orientation) {
+		return orientation == Orientation::FR ? 0 : orientation == Orientation::RF ? 1 : 2;
 	}
 
-	void calcMatchStats(const Intron& i, const uint32_t leftStart, const uint32_t rightEnd, const string& ancLeft, const string& ancRight);
+	void addStart(int32_t start);
 
-	uint32_t getNbMatchesFromStart(const string& query, const string& anchor);
-	uint32_t getNbMatchesFromEnd(const string& query, const string& anchor);
-	vector<bool> getMismatchPositionFromStart(const string& query, const string& anchor);
-	vector<bool> getMismatchPositionFromEnd(const string& query, const string& anchor);
+	void clear() {
+		startCounts.clear();
+		startCounts.shrink_to_fit();
+	}
 };
 
 typedef shared_ptr<AlignmentInfo> AlignmentInfoPtr;
@@ -191,8 +340,9 @@ private:
 
 	// **** Properties that describe where the junction is ****
 	shared_ptr<Intron> intron;
-	vector<shared_ptr<AlignmentInfo>> alignments;
+	vector<AlignmentSummary> alignments;
 	vector<size_t> alignmentCodes;
+	JunctionEvidence evidence;
 
 
 	// **** Junction metrics ****
@@ -267,6 +417,12 @@ private:
 	uint32_t id; // Unique identifier for the junction
 	bool genuine; // Used as a hidden variable for use with cross validating a trained model instance.
 
+	// Copies metrics to and from its columns directly
+	friend class JunctionTable;
+
+	// Formats junctions without going through iostreams
+	friend class JunctionWriter;
+
 protected:
 
 	/**
@@ -306,10 +462,6 @@ public:
 
 	void clearAlignments();
 
-	const BamAlignment& getFirstAlignment() const {
-		return *(alignments[0]->ba);
-	}
-
 	const Intron& getLocation() const {
 		return *intron;
 	}
@@ -1150,10 +1302,14 @@ public:
 						   const string& rightIntron, const string& rightAnchor);
 
 	/**
-	 * Calculates MaxMMES, mismatches, and junction overhangs.
-	 * Requires alignment information to be populated
+	 * Calculates MaxMMES, mismatches, and junction overhangs.  Match statistics
+	 * for each alignment summary are calculated against the given anchor sequences,
+	 * which must cover the final junction anchors, and folded into the junction metrics.
+	 * @param leftAnc Genomic sequence of the left anchor
+	 * @param rightAnc Genomic sequence of the right anchor
+	 * @param packed The packed reference sequence for this junction, if available
 	 */
-	void calcMismatchStats();
+	void calcMismatchStats(const string& leftAnc, const string& rightAnc, const PackedSeq* packed = nullptr);
 
 	/**
 	 * Calculates metric 18.  Multiple mapping score
@@ -1165,6 +1321,18 @@ public:
 
 	double calcCoverage(const vector<uint32_t>& coverageLevels);
 
+	/**
+	 * Adds the windows needed to calculate the coverage metric for this junction
+	 * @param coverage The coverage over the target sequence of this junction
+	 */
+	void addCoverageWindows(WindowCoverage& coverage) const;
+
+	/**
+	 * As above, using depths from the windows added by addCoverageWindows.  Gives
+	 * exactly the same result as using the full coverage levels of the target sequence.
+	 */
+	double calcCoverage(const WindowCoverage& coverage);
+
 	/**
 	 * Calculates a score for this intron size based on how this intron size fits
 	 * into an expected distribution specified by the length at the threhsold percentile
@@ -1186,17 +1354,48 @@ public:
 	 */
 	double calcCodingPotential(GenomeMapper& gmap, KmerMarkovModel& exon, KmerMarkovModel& intron);
 
+	/**
+	 * As above, for an intron given by location and orientation rather than by a
+	 * junction.  Does not store the result anywhere.
+	 */
+	static double calcCodingPotential(GenomeMapper& gmap, KmerMarkovModel& exon, KmerMarkovModel& intron,
+									  const char* ref, const int32_t start, const int32_t end, const bool neg);
+
 	SplicingScores calcSplicingScores(GenomeMapper& gmap, KmerMarkovModel& donorT, KmerMarkovModel& donorF,
 									  KmerMarkovModel& acceptorT, KmerMarkovModel& acceptorF,
 									  PosMarkovModel& donorP, PosMarkovModel& acceptorP);
 
+	/**
+	 * As above, for an intron given by location and orientation rather than by a
+	 * junction.  Does not store the result anywhere.
+	 */
+	static SplicingScores calcSplicingScores(GenomeMapper& gmap, KmerMarkovModel& donorT, KmerMarkovModel& donorF,
+									  KmerMarkovModel& acceptorT, KmerMarkovModel& acceptorF,
+									  PosMarkovModel& donorP, PosMarkovModel& acceptorP,
+									  const char* ref, const int32_t start, const int32_t end, const bool neg);
+
+	/**
+	 * Intron score for an intron of the given size
+	 */
+	static double calcIntronScore(const uint32_t size, const uint32_t threshold) {
+		return size <= threshold ? 0.0 : log(size - threshold);
+	}
+
 
 	/**
 	 * Calculate the log deviation for the junction anchor depth count at a given location
 	 * @param i
 	 * @return
 	 */
-	double calcJunctionAnchorDepthLogDeviation(size_t i) const;
+	double calcJunctionAnchorDepthLogDeviation(size_t i) const {
+		return calcJunctionAnchorDepthLogDeviation(junctionAnchorDepth[i], i, meanReadLength, nbAlRaw);
+	}
+
+	/**
+	 * As above, from the junction anchor depth count at the given location along
+	 * with the junction's mean read length and number of spliced alignments
+	 */
+	static double calcJunctionAnchorDepthLogDeviation(const uint32_t depth, const size_t i, const double meanReadLength, const uint32_t nbAlRaw);
 
 
 
@@ -0,0 +1,225 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <portcullis/junction.hpp>
+#include <portcullis/junction_table.hpp>
+using portcullis::JunctionTable;
+
+namespace portcullis {
+
+/**
+ * Layout of a binary junction file.  All offsets are in bytes from the start of
+ * the file, and each section is 8 byte aligned.  The header is followed by one
+ * section per column, each holding an entry per junction, then the column
+ * descriptions, the target sequences and finally the target sequence names.
+ * Values are stored in native byte order.
+ */
+struct JunctionFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t nbColumns;
+	uint64_t nbRows;
+	uint64_t fileSize;
+	uint64_t columnsOffset;
+	uint64_t refsOffset;
+	uint64_t namesOffset;
+	uint32_t nbRefs;
+	uint32_t reserved;
+};
+
+/**
+ * Types of column in a binary junction file
+ */
+enum class JunctionColumnType : uint32_t {
+	INT32 = 1,
+	UINT32 = 2,
+	UINT8 = 3,
+	DOUBLE = 4,
+	STRAND = 5,
+	CANONICAL_SS = 6,
+	MOTIF = 7,
+	JAD = 8,
+	JAD_CLARITY = 9
+};
+
+/**
+ * Describes a column in a binary junction file.  The name is the JunctionTable
+ * member name, padded with nulls.  Width is the size of each entry in bytes.
+ */
+struct JunctionFileColumn {
+	char name[48];
+	JunctionColumnType type;
+	uint32_t width;
+	uint64_t offset;
+};
+
+/**
+ * A target sequence in a binary junction file.  The name is held in the names
+ * section, at the given offset from its start.
+ */
+struct JunctionFileRef {
+	int32_t index;
+	uint32_t length;
+	uint32_t nameOffset;
+	uint32_t nameLength;
+};
+
+const char JUNCTION_FILE_MAGIC[8] = {'P', 'C', 'J', 'U', 'N', 'C', 'T', 'B'};
+const uint32_t JUNCTION_FILE_VERSION = 1;
+
+/**
+ * The type of column used to store values of type T
+ */
+template<typename T> struct JunctionColumnTraits;
+template<> struct JunctionColumnTraits<int32_t> { static const JunctionColumnType type = JunctionColumnType::INT32; };
+template<> struct JunctionColumnTraits<uint32_t> { static const JunctionColumnType type = JunctionColumnType::UINT32; };
+template<> struct JunctionColumnTraits<uint8_t> { static const JunctionColumnType type = JunctionColumnType::UINT8; };
+template<> struct JunctionColumnTraits<double> { static const JunctionColumnType type = JunctionColumnType::DOUBLE; };
+template<> struct JunctionColumnTraits<Strand> { static const JunctionColumnType type = JunctionColumnType::STRAND; };
+template<> struct JunctionColumnTraits<CanonicalSS> { static const JunctionColumnType type = JunctionColumnType::CANONICAL_SS; };
+template<> struct JunctionColumnTraits<Motif> { static const JunctionColumnType type = JunctionColumnType::MOTIF; };
+template<> struct JunctionColumnTraits<JunctionAnchorDepths> { static const JunctionColumnType type = JunctionColumnType::JAD; };
+template<> struct JunctionColumnTraits<JunctionAnchorClarities> { static const JunctionColumnType type = JunctionColumnType::JAD_CLARITY; };
+
+/**
+ * A binary junction file, memory mapped read only.  This holds the same junctions
+ * and metrics as a junction tab file, but stored column by column exactly as in a
+ * JunctionTable, so it can be loaded without any parsing.  As each column is
+ * separate, readers only touch the columns they need, either directly with
+ * getColumn or by reading a subset of the columns into a table.
+ */
+class JunctionFile {
+private:
+	path file;
+	void* data;
+	size_t size;
+	const JunctionFileHeader* header;
+	const JunctionFileColumn* columns;
+	const JunctionFileRef* refs;
+
+	// Copy columns between the file and a JunctionTable
+	struct ColumnReader;
+	struct ColumnWriter;
+
+	const char* base() const {
+		return (const char*)data;
+	}
+
+	/**
+	 * Gets the description of the named column
+	 * @return The column, or nullptr if there's no such column
+	 */
+	const JunctionFileColumn* findColumn(const string& name) const;
+
+	/**
+	 * Gets the named column, checking it holds values of the given type and width
+	 */
+	const void* getColumn(const string& name, const JunctionColumnType type, const size_t width) const;
+
+	/**
+	 * Appends all the junctions to the table, reading only the given columns, or
+	 * all of them if columns is nullptr
+	 */
+	void readColumns(JunctionTable& table, const vector<string>* columns) const;
+
+public:
+
+	JunctionFile(const path& _file);
+
+	JunctionFile(const JunctionFile&) = delete;
+	JunctionFile& operator=(const JunctionFile&) = delete;
+
+	virtual ~JunctionFile();
+
+	path getFile() const {
+		return file;
+	}
+
+	uint64_t getNbRows() const {
+		return header->nbRows;
+	}
+
+	uint32_t getNbColumns() const {
+		return header->nbColumns;
+	}
+
+	const JunctionFileColumn& getColumnInfo(const uint32_t i) const {
+		return columns[i];
+	}
+
+	bool hasColumn(const string& name) const {
+		return findColumn(name) != nullptr;
+	}
+
+	/**
+	 * Gets the values for the named column, with an entry for each junction.
+	 * Throws a JunctionException if there's no such column or if it doesn't hold
+	 * values of type T.
+	 */
+	template<typename T>
+	const T* getColumn(const string& name) const {
+		return (const T*)getColumn(name, JunctionColumnTraits<T>::type, sizeof(T));
+	}
+
+	uint32_t getNbRefs() const {
+		return header->nbRefs;
+	}
+
+	/**
+	 * Gets a target sequence.  Note that the "ref" column holds positions in this
+	 * list, not target sequence indices.
+	 */
+	RefSeq getRef(const uint32_t i) const {
+		return RefSeq(refs[i].index, string(base() + header->namesOffset + refs[i].nameOffset, refs[i].nameLength), refs[i].length);
+	}
+
+	/**
+	 * Appends all the junctions to the given table
+	 */
+	void read(JunctionTable& table) const;
+
+	/**
+	 * Appends all the junctions to the given table, only reading the named columns
+	 * plus the target sequences.  Other columns get the same values as for a new
+	 * Junction.  Named columns that aren't in the file are treated in the same way.
+	 * @param columns The names of the columns to read, as for JunctionTable members
+	 */
+	void read(JunctionTable& table, const vector<string>& columns) const;
+
+	/**
+	 * Writes all the junctions in the table to a binary junction file
+	 */
+	static void write(const JunctionTable& table, const path& file);
+
+	/**
+	 * Tests whether the given file looks like a binary junction file
+	 */
+	static bool isJunctionFile(const path& file);
+};
+
+}
@@ -0,0 +1,168 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <htslib/bgzf.h>
+#include <htslib/hts.h>
+#include <htslib/tbx.h>
+
+#include <portcullis/junction.hpp>
+
+namespace portcullis {
+
+/**
+ * Text junction formats that can be written BGZF compressed with an index
+ */
+enum class IndexedJunctionFormat {
+	TAB,
+	BED
+};
+
+/**
+ * Writes a junction tab or BED file BGZF compressed, building a tabix index of
+ * the file as it goes, which is saved as <file>.tbi.  Both formats are indexed by
+ * the intron of each junction.  For BED files these are the thickStart and
+ * thickEnd columns, so the index is exactly the one tabix would build with
+ * "-p bed -s 1 -b 7 -e 8".  The tab file's end column holds the last position of
+ * the intron, so tabix itself treats it as one base shorter than it is.
+ *
+ * Lines must be written in order of target sequence and intron start, as in a
+ * sorted JunctionSystem, and junctions for each target sequence kept together.
+ */
+class IndexedJunctionWriter {
+private:
+	path file;
+	IndexedJunctionFormat format;
+	BGZF* fp;
+	hts_idx_t* idx;
+	vector<string> refs;
+	int32_t nbHeaderLines;
+
+	void startIndex();
+
+public:
+
+	IndexedJunctionWriter(const path& _file, const IndexedJunctionFormat _format);
+
+	IndexedJunctionWriter(const IndexedJunctionWriter&) = delete;
+	IndexedJunctionWriter& operator=(const IndexedJunctionWriter&) = delete;
+
+	/**
+	 * Discards the index if the writer wasn't closed
+	 */
+	virtual ~IndexedJunctionWriter();
+
+	path getFile() const {
+		return file;
+	}
+
+	/**
+	 * Writes a header line, which isn't indexed.  All header lines must come
+	 * before any junctions.
+	 * @param line The line, including its newline
+	 */
+	void writeHeader(const char* line, const size_t length);
+
+	/**
+	 * Writes the line for a junction and adds it to the index
+	 * @param line The line, including its newline
+	 * @param ref Name of the junction's target sequence
+	 * @param start Start of the intron, 0-based
+	 * @param end End of the intron, 0-based and inclusive
+	 */
+	void writeLine(const char* line, const size_t length, const string& ref, const int32_t start, const int32_t end);
+
+	/**
+	 * Finishes the compressed file and saves its index
+	 */
+	void close();
+
+	/**
+	 * Path of the index for the given compressed junction file
+	 */
+	static path indexFile(const path& file) {
+		return path(file.string() + ".tbi");
+	}
+};
+
+/**
+ * Reads junctions overlapping a region from a BGZF compressed junction tab or BED
+ * file, using the index written by IndexedJunctionWriter to seek straight to them.
+ */
+class IndexedJunctionReader {
+private:
+	path file;
+	BGZF* fp;
+	tbx_t* tbx;
+	IndexedJunctionFormat format;
+	vector<string> header;
+
+public:
+
+	IndexedJunctionReader(const path& _file);
+
+	IndexedJunctionReader(const IndexedJunctionReader&) = delete;
+	IndexedJunctionReader& operator=(const IndexedJunctionReader&) = delete;
+
+	virtual ~IndexedJunctionReader();
+
+	path getFile() const {
+		return file;
+	}
+
+	IndexedJunctionFormat getFormat() const {
+		return format;
+	}
+
+	/**
+	 * The header lines at the start of the file, without newlines
+	 */
+	const vector<string>& getHeader() const {
+		return header;
+	}
+
+	/**
+	 * Names of the target sequences with junctions in the file
+	 */
+	vector<string> getRefs() const;
+
+	/**
+	 * Gets the lines for all junctions whose introns overlap the region
+	 * @param region A target sequence name, optionally followed by ":start" or
+	 * ":start-end", with positions 1-based and inclusive as for samtools and tabix
+	 * @param lines Matching lines, without newlines, are added to this in file order
+	 * @return The number of lines added
+	 */
+	size_t query(const string& region, vector<string>& lines);
+
+	/**
+	 * Tests whether the file is BGZF compressed and has an index
+	 */
+	static bool isIndexed(const path& file);
+};
+
+}
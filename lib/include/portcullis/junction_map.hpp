@@ -0,0 +1,116 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+using std::vector;
+
+#include <portcullis/intron.hpp>
+#include <portcullis/junction.hpp>
+using portcullis::IntronKey;
+using portcullis::JunctionPtr;
+
+namespace portcullis {
+
+/**
+ * Maps intron locations to junctions.  This is a flat hash table with open
+ * addressing and linear probing, keyed by the packed intron location, so looking
+ * up a junction never allocates or compares target sequence names.  The table is
+ * kept at most half full.
+ */
+class JunctionMap {
+private:
+
+	struct Slot {
+		IntronKey key;
+		JunctionPtr junction;   // nullptr if the slot is empty
+	};
+
+	vector<Slot> slots;
+	size_t count;
+
+	static size_t hash(const IntronKey& key) {
+		// Mix both halves of the key, then finalise as in splitmix64
+		uint64_t h = key.high * 0x9e3779b97f4a7c15ULL ^ key.low;
+		h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+		return h ^ (h >> 31);
+	}
+
+	/**
+	 * Index of the slot holding the key, or of the empty slot where it would go.
+	 * Requires at least one slot.
+	 */
+	size_t findSlot(const IntronKey& key) const {
+		const size_t mask = slots.size() - 1;
+		size_t i = hash(key) & mask;
+		while (slots[i].junction != nullptr && slots[i].key != key) {
+			i = (i + 1) & mask;
+		}
+		return i;
+	}
+
+	void grow();
+
+public:
+
+	JunctionMap() : count(0) {}
+
+	size_t size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+
+	void clear() {
+		slots.clear();
+		count = 0;
+	}
+
+	/**
+	 * Gets the junction at the given location
+	 * @return The junction, or nullptr if there's none at this location.  Only
+	 * valid until the next call to set.
+	 */
+	const JunctionPtr& find(const IntronKey& key) const;
+
+	/**
+	 * Adds the junction at the given location, replacing any already there
+	 */
+	void set(const IntronKey& key, const JunctionPtr& junction);
+};
+
+/**
+ * A packed intron location along with the index of its junction in a list
+ */
+struct KeyedIndex {
+	IntronKey key;
+	size_t index;
+};
+
+/**
+ * Sorts by key, using a least significant digit radix sort on the packed intron
+ * locations.  The sort is stable.  Bytes that are the same in every key, such as
+ * the high bytes of the target sequence index, are skipped.
+ */
+void radixSort(vector<KeyedIndex>& items);
+
+}
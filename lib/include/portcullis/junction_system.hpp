@@ -18,6 +18,7 @@
 #pragma once
 
 #include <fstream>
+#include <functional>
 #include <vector>
 #include <memory>
 #include <unordered_map>
@@ -30,16 +31,18 @@ using boost::timer::auto_cpu_timer;
 
 #include <portcullis/intron.hpp>
 #include <portcullis/junction.hpp>
+#include <portcullis/junction_map.hpp>
+#include <portcullis/junction_table.hpp>
 #include <portcullis/seq_utils.hpp>
 using portcullis::Intron;
 using portcullis::IntronHasher;
 using portcullis::Junction;
+using portcullis::JunctionMap;
 using portcullis::JunctionPtr;
+using portcullis::JunctionTable;
 using portcullis::SeqUtils;
 
-typedef std::unordered_map<Intron, JunctionPtr, IntronHasher> DistinctJunctions;
-typedef std::unordered_map<Intron, JunctionPtr, IntronHasher>::iterator JunctionMapIterator;
-typedef std::pair<const Intron, JunctionPtr> JunctionMapType;
+typedef JunctionMap DistinctJunctions;
 typedef std::vector<JunctionPtr> JunctionList;
 typedef std::shared_ptr<JunctionList> JunctionListPtr;
 
@@ -56,9 +59,30 @@ private:
 
 	shared_ptr<vector<RefSeqPtr>> refs;
 
+	// Index into the junction list of the first junction on each target sequence,
+	// plus a final entry marking the end of the list.  Only valid while the
+	// junctions on each target sequence are contiguous and the target sequences are
+	// in order, which is the case after sort() or when junctions are added in order.
+	vector<size_t> refOffsets;
+	bool refsGrouped;
+
+	void clearRefIndex();
+
+	void indexJunction(const JunctionPtr& j);
+
 	size_t createJunctionGroup(size_t index, vector<JunctionPtr>& group);
 
-	void findJunctions(const int32_t refId, JunctionList& subset);
+	/**
+	 * Runs the given function over the junctions of each target sequence in turn,
+	 * distributing target sequences over the given number of threads.  Each thread
+	 * has its own reader for the alignments file.
+	 */
+	void forEachReference(const path& alignmentsFile, const uint16_t threads,
+			const std::function<void(BamReader&, const int32_t, JunctionList&)>& func);
+
+	void findFlankingAlignments(BamReader& reader, const int32_t refId, JunctionList& subset);
+
+	void calcCoverage(BamReader& reader, const int32_t refId, JunctionList& subset);
 
 
 public:
@@ -73,12 +97,43 @@ public:
 
 	JunctionSystem(JunctionList& jl);
 
+	/**
+	 * Creates a junction for every row in the table
+	 */
+	JunctionSystem(const JunctionTable& table);
+
 	virtual ~JunctionSystem();
 
 	const JunctionList& getJunctions() const;
 
 	size_t size();
 
+	/**
+	 * Whether the junctions on each target sequence are held contiguously and in
+	 * target sequence order, in which case getRefRange can be used.
+	 */
+	bool isGroupedByRef() const {
+		return refsGrouped;
+	}
+
+	/**
+	 * Gets the half-open range of indices into the junction list holding the
+	 * junctions on the given target sequence in constant time.  Requires the
+	 * junctions to be grouped by target sequence.
+	 * @param refId The target sequence index
+	 * @return The range of junctions, which is empty if there are none on this target
+	 */
+	std::pair<size_t, size_t> getRefRange(const int32_t refId) const;
+
+	/**
+	 * Collects all the junctions on the given target sequence.  This uses the per
+	 * target index if the junctions are grouped by target sequence, otherwise it
+	 * has to scan all the junctions.
+	 * @param refId The target sequence index
+	 * @param subset Filled with the junctions on the given target sequence
+	 */
+	void findJunctions(const int32_t refId, JunctionList& subset) const;
+
 	double getMeanQueryLength() const {
 		return meanQueryLength;
 	}
@@ -129,11 +184,43 @@ public:
 		return addJunctions(al, 0, al.getPosition());
 	}
 
-	bool addJunctions(const BamAlignment& al, const size_t startOp, const int32_t offset);
+	bool addJunctions(const BamAlignment& al, const size_t startOp, const int32_t offset) {
+		return addJunctions(al, startOp, offset, 0, INT32_MAX);
+	}
 
-	void findFlankingAlignments(const path& alignmentsFile);
+	/**
+	 * As above, except that only junctions with an intron starting in the given
+	 * region are added.  Useful when a reference sequence is processed in separate
+	 * chunks, where each junction should belong to only one chunk.
+	 * @param al The alignment to search for junctions
+	 * @param start Start of the region (inclusive)
+	 * @param end End of the region (exclusive)
+	 * @return Whether a junction was found in this alignment or not, regardless
+	 * of whether it was added or not
+	 */
+	bool addJunctionsInRegion(const BamAlignment& al, const int32_t start, const int32_t end) {
+		return addJunctions(al, 0, al.getPosition(), start, end);
+	}
 
-	void calcCoverage(const path& alignmentsFile, Strandedness strandSpecific);
+	bool addJunctions(const BamAlignment& al, const size_t startOp, const int32_t offset, const int32_t regionStart, const int32_t regionEnd);
+
+	/**
+	 * Counts the unspliced alignments flanking each junction.  Each target sequence
+	 * is swept once, in order, rather than querying the region around every
+	 * junction separately.  Target sequences are processed in parallel.
+	 * @param alignmentsFile Coordinate sorted and indexed BAM of unspliced alignments
+	 * @param threads Number of target sequences to process concurrently
+	 */
+	void findFlankingAlignments(const path& alignmentsFile, const uint16_t threads = 1);
+
+	/**
+	 * Calculates the coverage metric for each junction from the unspliced alignments.
+	 * Depths are only collected over the small windows around each junction that the
+	 * metric uses.  Target sequences are processed in parallel.
+	 * @param alignmentsFile Coordinate sorted and indexed BAM of unspliced alignments
+	 * @param threads Number of target sequences to process concurrently
+	 */
+	void calcCoverage(const path& alignmentsFile, uint16_t threads);
 
 	void calcMultipleMappingStats(SplicedAlignmentMap& map);
 
@@ -141,6 +228,10 @@ public:
 
 	std::pair<Orientation, Strandedness> determineStrandedness(bool verbose) const;
 
+	/**
+	 * Sorts the junctions by location, i.e. by target sequence index, then intron
+	 * start, then intron end, using a radix sort on the packed locations
+	 */
 	void sort();
 
 	void index();
@@ -149,6 +240,24 @@ public:
 
 	void saveAll(const path& outputPrefix, const string& source, bool bedscore, bool outputExonGFF, bool outputIntronGFF);
 
+	/**
+	 * As above, optionally also saving the junctions to a binary junction file
+	 * (<prefix>.junctions.bin)
+	 */
+	void saveAll(const path& outputPrefix, const string& source, bool bedscore, bool outputExonGFF, bool outputIntronGFF, bool outputBinary);
+
+	/**
+	 * As above, formatting the text files with the given number of threads
+	 */
+	void saveAll(const path& outputPrefix, const string& source, bool bedscore, bool outputExonGFF, bool outputIntronGFF, bool outputBinary, uint16_t threads);
+
+	/**
+	 * As above, optionally also saving the junction table and BED file BGZF
+	 * compressed, with tabix indices (<prefix>.junctions.tab.gz and
+	 * <prefix>.junctions.bed.gz).  Junctions must be sorted by location.
+	 */
+	void saveAll(const path& outputPrefix, const string& source, bool bedscore, bool outputExonGFF, bool outputIntronGFF, bool outputBinary, bool outputIndexed, uint16_t threads);
+
 	void outputDescription(std::ostream &strm);
 
 	friend std::ostream& operator<<(std::ostream &strm, const JunctionSystem& js) {
@@ -169,9 +278,30 @@ public:
 
 	void outputBED(std::ostream &strm, CanonicalSS type, const string& prefix, bool bedscore);
 
+	/**
+	 * Loads junctions from either a junction tab file or a binary junction file
+	 */
 	void load(const path& junctionTabFile);
 	void load(const path& junctionTabFile, const bool simple);
 
+	/**
+	 * Loads junctions from either a junction tab file or a binary junction file,
+	 * using the given number of threads to parse tab files
+	 */
+	void load(const path& junctionTabFile, const bool simple, const uint16_t threads);
+
+	/**
+	 * Adds a junction for every row in the table
+	 * @param simple If true, junctions aren't indexed by location, so getJunction
+	 * won't find them
+	 */
+	void load(const JunctionTable& table, const bool simple);
+
+	/**
+	 * Appends the location and metrics of every junction to the given table
+	 */
+	void toTable(JunctionTable& table) const;
+
 	JunctionPtr getJunctionAt(uint32_t index) const {
 		return this->junctionList[index];
 	}
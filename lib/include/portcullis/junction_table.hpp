@@ -0,0 +1,367 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+using std::ostream;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <portcullis/bam/bam_master.hpp>
+#include <portcullis/junction.hpp>
+using portcullis::bam::RefSeq;
+using portcullis::bam::Strand;
+using portcullis::CanonicalSS;
+using portcullis::Junction;
+using portcullis::JunctionPtr;
+
+namespace portcullis {
+
+/**
+ * Number of junction anchor depth (and clarity) values held for each junction.
+ * Must match the size of Junction::JAD_NAMES.
+ */
+const size_t JAD_LENGTH = 20;
+
+typedef std::array<uint32_t, JAD_LENGTH> JunctionAnchorDepths;
+typedef std::array<double, JAD_LENGTH> JunctionAnchorClarities;
+
+/**
+ * A splice site dinucleotide, held inline and null terminated.  Motifs cut short by
+ * the end of a target sequence are simply shorter.
+ */
+struct Motif {
+	char bases[3];
+
+	Motif() : bases{0, 0, 0} {}
+
+	/**
+	 * Creates a motif from the given bases.  Throws a JunctionException if there
+	 * are more than 2 bases.
+	 */
+	Motif(const char* seq, const size_t length);
+
+	Motif(const string& seq) : Motif(seq.c_str(), seq.size()) {}
+
+	string toString() const {
+		return string(bases);
+	}
+};
+
+/**
+ * Junctions stored column by column, i.e. as a structure of arrays, rather than as
+ * a list of individually allocated Junction objects.  Each metric lives in its own
+ * contiguous vector indexed by row, and the junction anchor depths and motifs are
+ * held inline, so scanning a metric over all junctions touches only that metric,
+ * and loading a junction file needs a few allocations per column rather than
+ * several per junction.  Target sequences are held once in a dictionary that each
+ * row refers to by position.
+ *
+ * The columns are public so that callers can scan them directly.  They must all be
+ * kept the same length, which add and load take care of.
+ */
+class JunctionTable {
+private:
+
+	// Position of each target sequence in refs, by target sequence index
+	unordered_map<int32_t, uint32_t> refLookup;
+
+	// A field within a line of a junction tab file
+	typedef std::pair<const char*, size_t> Field;
+
+	struct Reserve {
+		size_t n;
+		template<typename C> void operator()(const char* name, C& column) { column.reserve(n); }
+	};
+
+	struct Resize {
+		size_t n;
+		template<typename C> void operator()(const char* name, C& column) { column.resize(n); }
+	};
+
+	/**
+	 * Appends a row with the same default values as a new Junction
+	 */
+	size_t addRow() {
+		resize(size() + 1);
+		return size() - 1;
+	}
+
+	/**
+	 * Appends a row parsed from a line of a junction tab file
+	 * @param fields Buffer for the fields in the line, reused between lines
+	 * @param wanted Whether to convert each field
+	 */
+	void parse(const char* line, const char* lineEnd, vector<Field>& fields, const vector<bool>& wanted);
+
+	/**
+	 * Appends a row for each junction in the given part of a junction tab file
+	 */
+	void parseLines(const char* begin, const char* end, const vector<bool>& wanted);
+
+	/**
+	 * Appends all the junctions in a junction tab file, only converting the fields
+	 * for the given columns, or all of them if columns is nullptr
+	 */
+	void loadColumns(const path& junctionTabFile, const vector<string>* columns, const uint16_t threads);
+
+public:
+
+	// Target sequence dictionary
+	vector<RefSeq> refs;
+
+	// **** Location ****
+	vector<uint32_t> id;
+	vector<uint32_t> ref; // Position of the target sequence in refs
+	vector<int32_t> start; // Intron start
+	vector<int32_t> end; // Intron end
+	vector<int32_t> leftAncStart;
+	vector<int32_t> rightAncEnd;
+
+	// **** Predictions ****
+	vector<Strand> readStrand;
+	vector<Strand> ssStrand;
+	vector<Strand> consensusStrand;
+	vector<Motif> da1;
+	vector<Motif> da2;
+	vector<CanonicalSS> canonicalSpliceSites;
+	vector<double> score;
+	vector<uint8_t> suspicious;
+	vector<uint8_t> pfp;
+
+	// **** Alignment counts ****
+	vector<uint32_t> nbAlRaw;
+	vector<uint32_t> nbAlDistinct;
+	vector<uint32_t> nbAlMultiplySpliced;
+	vector<uint32_t> nbAlUniquelyMapped;
+	vector<uint32_t> nbAlBamProperlyPaired;
+	vector<uint32_t> nbAlPortcullisProperlyPaired;
+	vector<uint32_t> nbAlReliable;
+	vector<uint32_t> nbAlR1Pos;
+	vector<uint32_t> nbAlR1Neg;
+	vector<uint32_t> nbAlR2Pos;
+	vector<uint32_t> nbAlR2Neg;
+
+	// **** RNAseq derived stats ****
+	vector<double> entropy;
+	vector<double> meanMismatches;
+	vector<double> meanReadLength;
+	vector<uint32_t> maxMinAnchor;
+	vector<uint32_t> maxMMES;
+	vector<double> intronScore;
+
+	// **** Genome properties ****
+	vector<uint32_t> hammingDistance5p;
+	vector<uint32_t> hammingDistance3p;
+	vector<double> codingPotential;
+	vector<double> positionWeightScore;
+	vector<double> splicingSignal;
+
+	// **** Junction relationships ****
+	vector<uint8_t> uniqueJunction;
+	vector<uint8_t> primaryJunction;
+	vector<uint32_t> nbUpstreamJunctions;
+	vector<uint32_t> nbDownstreamJunctions;
+	vector<uint32_t> distanceToNextUpstreamJunction;
+	vector<uint32_t> distanceToNextDownstreamJunction;
+	vector<uint32_t> distanceToNearestJunction;
+
+	// **** Metrics derived from extra processing ****
+	vector<double> multipleMappingScore;
+	vector<double> coverage;
+	vector<uint32_t> nbUpstreamFlankingAlignments;
+	vector<uint32_t> nbDownstreamFlankingAlignments;
+	vector<uint32_t> nbSamples;
+
+	// **** Junction anchor depth metrics ****
+	vector<JunctionAnchorDepths> junctionAnchorDepth;
+	vector<JunctionAnchorClarities> junctionAnchorClarity;
+
+	// Hidden variable used when cross validating a trained model
+	vector<uint8_t> genuine;
+
+
+	JunctionTable() {}
+
+	/**
+	 * Loads a junction table from a portcullis junction tab file
+	 * @param junctionTabFile The file to load
+	 */
+	JunctionTable(const path& junctionTabFile) {
+		load(junctionTabFile);
+	}
+
+	size_t size() const {
+		return id.size();
+	}
+
+	bool empty() const {
+		return id.empty();
+	}
+
+	void reserve(const size_t n);
+
+	/**
+	 * Truncates the table, or adds rows with the same default values as a new
+	 * Junction, so that there are n rows
+	 */
+	void resize(const size_t n);
+
+	void clear();
+
+	/**
+	 * Gets the position of the given target sequence in refs, adding it if this
+	 * is the first time it has been seen.  Target sequences are identified by
+	 * index only.
+	 */
+	uint32_t addRef(const int32_t index, const char* name, const size_t nameLength, const uint32_t length);
+
+	/**
+	 * Applies the given function to every column of the table along with its name,
+	 * which is the same as the member name.  The table may be const.
+	 */
+	template<typename Table, typename F>
+	static void forEachColumn(Table& t, F& f) {
+		f("id", t.id); f("ref", t.ref); f("start", t.start); f("end", t.end);
+		f("leftAncStart", t.leftAncStart); f("rightAncEnd", t.rightAncEnd);
+		f("readStrand", t.readStrand); f("ssStrand", t.ssStrand); f("consensusStrand", t.consensusStrand);
+		f("da1", t.da1); f("da2", t.da2); f("canonicalSpliceSites", t.canonicalSpliceSites);
+		f("score", t.score); f("suspicious", t.suspicious); f("pfp", t.pfp);
+		f("nbAlRaw", t.nbAlRaw); f("nbAlDistinct", t.nbAlDistinct); f("nbAlMultiplySpliced", t.nbAlMultiplySpliced);
+		f("nbAlUniquelyMapped", t.nbAlUniquelyMapped); f("nbAlBamProperlyPaired", t.nbAlBamProperlyPaired);
+		f("nbAlPortcullisProperlyPaired", t.nbAlPortcullisProperlyPaired); f("nbAlReliable", t.nbAlReliable);
+		f("nbAlR1Pos", t.nbAlR1Pos); f("nbAlR1Neg", t.nbAlR1Neg); f("nbAlR2Pos", t.nbAlR2Pos); f("nbAlR2Neg", t.nbAlR2Neg);
+		f("entropy", t.entropy); f("meanMismatches", t.meanMismatches); f("meanReadLength", t.meanReadLength);
+		f("maxMinAnchor", t.maxMinAnchor); f("maxMMES", t.maxMMES); f("intronScore", t.intronScore);
+		f("hammingDistance5p", t.hammingDistance5p); f("hammingDistance3p", t.hammingDistance3p);
+		f("codingPotential", t.codingPotential); f("positionWeightScore", t.positionWeightScore);
+		f("splicingSignal", t.splicingSignal);
+		f("uniqueJunction", t.uniqueJunction); f("primaryJunction", t.primaryJunction);
+		f("nbUpstreamJunctions", t.nbUpstreamJunctions); f("nbDownstreamJunctions", t.nbDownstreamJunctions);
+		f("distanceToNextUpstreamJunction", t.distanceToNextUpstreamJunction);
+		f("distanceToNextDownstreamJunction", t.distanceToNextDownstreamJunction);
+		f("distanceToNearestJunction", t.distanceToNearestJunction);
+		f("multipleMappingScore", t.multipleMappingScore); f("coverage", t.coverage);
+		f("nbUpstreamFlankingAlignments", t.nbUpstreamFlankingAlignments);
+		f("nbDownstreamFlankingAlignments", t.nbDownstreamFlankingAlignments); f("nbSamples", t.nbSamples);
+		f("junctionAnchorDepth", t.junctionAnchorDepth); f("junctionAnchorClarity", t.junctionAnchorClarity);
+		f("genuine", t.genuine);
+	}
+
+	/**
+	 * Appends a copy of the given junction's location and metrics as a new row.
+	 * The supporting alignments and coverage profiles are not kept.
+	 */
+	void add(const Junction& j);
+
+	/**
+	 * Appends all the junctions in a portcullis junction tab file.  Each row is
+	 * read in exactly the same way as Junction::parse, including throwing the
+	 * same exceptions for bad input, but straight into the columns without
+	 * splitting the line into strings first.  As with JunctionSystem::load, lines
+	 * containing "index" are taken to be headers and skipped.
+	 * @param junctionTabFile The file to load
+	 */
+	void load(const path& junctionTabFile) {
+		load(junctionTabFile, 1);
+	}
+
+	/**
+	 * Appends all the junctions in a portcullis junction tab file, as above, but
+	 * splits the file into chunks of whole lines which are parsed concurrently.
+	 * If a line can't be parsed, the rows before it are kept and the exception
+	 * is rethrown, exactly as when using a single thread.
+	 * @param junctionTabFile The file to load
+	 * @param threads The number of chunks to parse at once
+	 */
+	void load(const path& junctionTabFile, const uint16_t threads);
+
+	/**
+	 * Appends all the junctions in a portcullis junction tab file, only converting
+	 * the fields for the named columns plus the target sequences.  Other columns
+	 * get the same values as for a new Junction, and their fields aren't checked.
+	 * @param junctionTabFile The file to load
+	 * @param columns The names of the columns to read, as for JunctionTable members
+	 * @param threads The number of chunks to parse at once
+	 */
+	void load(const path& junctionTabFile, const vector<string>& columns, const uint16_t threads);
+
+	/**
+	 * Appends a copy of every row in the given table
+	 */
+	void append(const JunctionTable& other);
+
+	/**
+	 * Creates a new junction object from the given row
+	 */
+	JunctionPtr getJunction(const size_t row) const;
+
+	const RefSeq& getRef(const size_t row) const {
+		return refs[ref[row]];
+	}
+
+	uint32_t getIntronSize(const size_t row) const {
+		return (uint32_t)(end[row] - start[row] + 1);
+	}
+
+	uint32_t getNbUniquelySplicedAlignments(const size_t row) const {
+		return nbAlRaw[row] - nbAlMultiplySpliced[row];
+	}
+
+	uint32_t getNbMultiplyMappedAlignments(const size_t row) const {
+		return nbAlRaw[row] - nbAlUniquelyMapped[row];
+	}
+
+	double getReliable2RawAlignmentRatio(const size_t row) const {
+		return (double) nbAlReliable[row] / (double) nbAlRaw[row];
+	}
+
+	/**
+	 * Calculate the log deviation for the junction anchor depth count at a given
+	 * location, as for Junction::calcJunctionAnchorDepthLogDeviation
+	 */
+	double calcJunctionAnchorDepthLogDeviation(const size_t row, const size_t i) const {
+		return Junction::calcJunctionAnchorDepthLogDeviation(junctionAnchorDepth[row][i], i, meanReadLength[row], nbAlRaw[row]);
+	}
+
+	/**
+	 * Writes the given row in the same format as a Junction table row
+	 */
+	void writeRow(ostream& strm, const size_t row) const;
+
+	friend ostream& operator<<(ostream& strm, const JunctionTable& table) {
+		strm << Junction::junctionOutputHeader() << std::endl;
+		for (size_t i = 0; i < table.size(); i++) {
+			table.writeRow(strm, i);
+			strm << std::endl;
+		}
+		return strm;
+	}
+};
+
+}
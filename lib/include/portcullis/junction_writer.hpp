@@ -0,0 +1,243 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <portcullis/junction.hpp>
+using portcullis::Junction;
+using portcullis::JunctionList;
+
+namespace portcullis {
+
+class IndexedJunctionWriter;
+
+/**
+ * A text buffer with fast number formatting.  Numbers are formatted exactly as an
+ * ostream in the default state would, but without the overhead of iostreams.
+ */
+class TextBuffer {
+private:
+	string data;
+
+public:
+
+	TextBuffer() {}
+
+	TextBuffer(const size_t capacity) {
+		data.reserve(capacity);
+	}
+
+	const string& str() const {
+		return data;
+	}
+
+	size_t size() const {
+		return data.size();
+	}
+
+	void clear() {
+		data.clear();
+	}
+
+	TextBuffer& put(const char c) {
+		data.push_back(c);
+		return *this;
+	}
+
+	TextBuffer& put(const char* s) {
+		data.append(s);
+		return *this;
+	}
+
+	TextBuffer& put(const string& s) {
+		data.append(s);
+		return *this;
+	}
+
+	TextBuffer& put(const int64_t v);
+
+	TextBuffer& put(const uint64_t v);
+
+	TextBuffer& put(const int32_t v) {
+		return put((int64_t)v);
+	}
+
+	TextBuffer& put(const uint32_t v) {
+		return put((uint64_t)v);
+	}
+
+	/**
+	 * Puts a double as an ostream does by default, i.e. as printf's %g, with the
+	 * given number of significant figures
+	 */
+	TextBuffer& put(const double v, const int precision);
+
+	/**
+	 * Puts a double as an ostream does with std::fixed, i.e. as printf's %f, with
+	 * the given number of decimal places
+	 */
+	TextBuffer& putFixed(const double v, const int precision);
+
+	/**
+	 * Puts a bool as 1 or 0, or as true or false for boolalpha
+	 */
+	TextBuffer& put(const bool v, const bool alpha) {
+		return alpha ? put(v ? "true" : "false") : put(v ? '1' : '0');
+	}
+};
+
+/**
+ * Saves junctions in any combination of the output formats in a single pass:
+ * the junction tab file, BED, and the exon and intron based GFF3 files.  Each
+ * file is byte for byte the same as the one produced by the corresponding
+ * JunctionSystem or Junction stream output method.
+ *
+ * The junction tab and BED files can also be written BGZF compressed, with a
+ * tabix index, from the same formatted text.  See IndexedJunctionWriter.
+ *
+ * The junctions are split into chunks, keeping each target sequence together
+ * where possible.  Chunks are formatted in parallel into large buffers, which are
+ * then written out in the original order.
+ */
+class JunctionWriter {
+private:
+	const JunctionList& junctions;
+	path tabFile;
+	path bedFile;
+	path exonGFFFile;
+	path intronGFFFile;
+	path indexedTabFile;
+	path indexedBEDFile;
+	string source;
+	bool bedscore;
+	string version;
+	uint16_t threads;
+
+	// Buffers for a chunk of junctions, one per output format
+	struct Chunk;
+
+	void format(const size_t begin, const size_t end, Chunk& chunk) const;
+
+	// Writes a chunk's lines, starting with junction first, to an indexed file
+	void writeIndexed(IndexedJunctionWriter& out, const size_t first, const TextBuffer& buf, const vector<size_t>& ends) const;
+
+public:
+
+	/**
+	 * The largest number of junctions formatted at once by each thread
+	 */
+	static const size_t CHUNK_SIZE = 20000;
+
+	/**
+	 * Creates a writer for the given junctions.  No files are written unless
+	 * their paths are set.
+	 */
+	JunctionWriter(const JunctionList& _junctions);
+
+	void setTabFile(const path& tabFile) {
+		this->tabFile = tabFile;
+	}
+
+	void setBEDFile(const path& bedFile) {
+		this->bedFile = bedFile;
+	}
+
+	void setExonGFFFile(const path& exonGFFFile) {
+		this->exonGFFFile = exonGFFFile;
+	}
+
+	void setIntronGFFFile(const path& intronGFFFile) {
+		this->intronGFFFile = intronGFFFile;
+	}
+
+	/**
+	 * Also writes the junction tab file BGZF compressed to this path, with an index
+	 */
+	void setIndexedTabFile(const path& indexedTabFile) {
+		this->indexedTabFile = indexedTabFile;
+	}
+
+	/**
+	 * Also writes the BED file BGZF compressed to this path, with an index
+	 */
+	void setIndexedBEDFile(const path& indexedBEDFile) {
+		this->indexedBEDFile = indexedBEDFile;
+	}
+
+	/**
+	 * The value for the source field in GFF files, and the prefix for junction
+	 * names in BED files
+	 */
+	void setSource(const string& source) {
+		this->source = source;
+	}
+
+	/**
+	 * Whether to use the junction score as the BED score, rather than the number
+	 * of spliced alignments
+	 */
+	void setBEDScore(bool bedscore) {
+		this->bedscore = bedscore;
+	}
+
+	/**
+	 * The portcullis version for the BED track line
+	 */
+	void setVersion(const string& version) {
+		this->version = version;
+	}
+
+	void setThreads(uint16_t threads) {
+		this->threads = threads;
+	}
+
+	/**
+	 * Writes all the requested files
+	 */
+	void write() const;
+
+	/**
+	 * Formats a junction as a junction tab file row, as Junction's operator<<
+	 */
+	static void putTabRow(TextBuffer& buf, const Junction& j);
+
+	/**
+	 * Formats a junction as a BED line, as Junction::outputBED
+	 */
+	static void putBED(TextBuffer& buf, const Junction& j, const string& prefix, const bool bedscore);
+
+	/**
+	 * Formats a junction as GFF3 lines, as Junction::outputJunctionGFF
+	 */
+	static void putExonGFF(TextBuffer& buf, const Junction& j, const string& source);
+
+	/**
+	 * Formats a junction as a GFF3 line, as Junction::outputIntronGFF
+	 */
+	static void putIntronGFF(TextBuffer& buf, const Junction& j, const string& source);
+};
+
+}
@@ -74,32 +74,24 @@ void portcullis::bam::BamAlignment::init() {
 	refId = b->core.tid;
 	mateId = b->core.mtid;
 	matePos = b->core.mpos;
-	uint32_t* c = bam_get_cigar(b);
-	alignedLength = 0;
-	// Record the cigar in an easy to access format and calculate the aligned length
-	// along the way
+	alignedLength = bam_cigar2rlen(b->core.n_cigar, bam_get_cigar(b));
+	// Cigar and strand are decoded on demand
+	cigarDecoded = false;
+	strandDecoded = false;
+}
+
+void portcullis::bam::BamAlignment::decodeCigar() const {
+	// Record the cigar in an easy to access format.  Reuse the existing
+	// storage where possible.
+	const uint32_t* c = bam_get_cigar(b);
 	cigar.clear();
 	for (uint32_t i = 0; i < b->core.n_cigar; i++) {
-		CigarOp op(bam_cigar_opchr(c[i]), bam_cigar_oplen(c[i]));
-		cigar.push_back(op);
-		if (CigarOp::opConsumesReference(op.type)) {
-			alignedLength += op.length;
-		}
-	}
-	// Determine actual read strand
-	// Try deriving from XS tag first if it's present.  If not then try to
-	// work it all out from the protocol suggested and the reverse strand
-	// flag.
-	Strand s = getXSStrand();
-	if (s != Strand::UNKNOWN) {
-		strand = s;
-	}
-	else {
-		strand = calcStrand();
+		cigar.push_back(CigarOp(bam_cigar_opchr(c[i]), bam_cigar_oplen(c[i])));
 	}
+	cigarDecoded = true;
 }
 
-portcullis::bam::Strand portcullis::bam::BamAlignment::calcStrand() {
+portcullis::bam::Strand portcullis::bam::BamAlignment::calcStrand() const {
 	Strand strand = Strand::UNKNOWN;
 	if (strandedness == Strandedness::FIRSTSTRAND) {
 		if (orientation == Orientation::FR) {
@@ -162,6 +154,9 @@ portcullis::bam::BamAlignment::BamAlignment() {
 	mateId = -1;
 	strandedness = Strandedness::UNKNOWN;
 	orientation = Orientation::UNKNOWN;
+	cigarDecoded = false;
+	strand = Strand::UNKNOWN;
+	strandDecoded = false;
 }
 
 /**
@@ -254,8 +249,12 @@ string portcullis::bam::BamAlignment::getQuerySeqAfterClipping() const {
 }
 
 string portcullis::bam::BamAlignment::getQuerySeqAfterClipping(const string& seq) const {
-	int32_t start = getStart();
-	int32_t end = getEnd();
+	return getQuerySeqAfterClipping(seq, getCigar(), position, alignedLength);
+}
+
+string portcullis::bam::BamAlignment::getQuerySeqAfterClipping(const string& seq, const vector<CigarOp>& cigar, int32_t position, int32_t alignedLength) {
+	int32_t start = position;
+	int32_t end = position + alignedLength - 1;
 	int32_t clippedStart = cigar.front().type == BAM_CIGAR_SOFTCLIP_CHAR ? start + cigar.front().length : start;
 	int32_t clippedEnd = cigar.back().type == BAM_CIGAR_SOFTCLIP_CHAR ? end - cigar.back().length : end;
 	int32_t deltaStart = clippedStart - start;
@@ -292,6 +291,9 @@ bool portcullis::bam::BamAlignment::calcIfProperPair(Orientation orientation) co
 }
 
 bool portcullis::bam::BamAlignment::isSplicedRead() const {
+	if (!cigarDecoded) {
+		return isSplicedRead(b);
+	}
 	for (const auto & op : cigar) {
 		if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
 			return true;
@@ -302,6 +304,15 @@ bool portcullis::bam::BamAlignment::isSplicedRead() const {
 
 uint32_t portcullis::bam::BamAlignment::getNbJunctionsInRead() const {
 	int32_t nbJunctions = 0;
+	if (!cigarDecoded) {
+		const uint32_t* c = bam_get_cigar(b);
+		for (uint32_t i = 0; i < b->core.n_cigar; i++) {
+			if (bam_cigar_op(c[i]) == BAM_CREF_SKIP) {
+				nbJunctions++;
+			}
+		}
+		return nbJunctions;
+	}
 	for (const auto & op : cigar) {
 		if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
 			nbJunctions++;
@@ -319,7 +330,7 @@ uint32_t portcullis::bam::BamAlignment::calcNbAlignedBases(int32_t start, int32_
 	}
 	int32_t count = 0;
 	int32_t pos = position;
-	for (const auto & op : cigar) {
+	for (const auto & op : getCigar()) {
 		if (pos > end) {
 			break;
 		}
@@ -339,12 +350,16 @@ string portcullis::bam::BamAlignment::getPaddedQuerySeq(int32_t start, int32_t e
 }
 
 string portcullis::bam::BamAlignment::getPaddedQuerySeq(const string& query_seq, int32_t start, int32_t end, int32_t& actual_start, int32_t& actual_end, const bool include_soft_clips) const {
-	if (start > getEnd() || end < position)
+	return getPaddedQuerySeq(getCigar(), position, alignedLength, query_seq, start, end, actual_start, actual_end, include_soft_clips);
+}
+
+string portcullis::bam::BamAlignment::getPaddedQuerySeq(const vector<CigarOp>& cigar, int32_t position, int32_t alignedLength, const string& query_seq, int32_t start, int32_t end, int32_t& actual_start, int32_t& actual_end, const bool include_soft_clips) {
+	if (start > position + alignedLength - 1 || end < position)
 		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
 								  "Found an alignment that does not have a presence in the requested region")));
 	int32_t qPos = 0;
 	int32_t rPos = position;
-	string query = include_soft_clips ? query_seq : this->getQuerySeqAfterClipping(query_seq);
+	string query = include_soft_clips ? query_seq : getQuerySeqAfterClipping(query_seq, cigar, position, alignedLength);
 	stringstream ss;
 	for (const auto & op : cigar) {
 		bool consumesRef = CigarOp::opConsumesReference(op.type);
@@ -365,7 +380,7 @@ string portcullis::bam::BamAlignment::getPaddedQuerySeq(const string& query_seq,
 										  "Can't extract cigar op sequence from query string when length has been calculated as 0.")
 									  + "\nLimits: " + lexical_cast<string>(start) + "," + lexical_cast<string>(end)
 									  + "\nQuery sequence: " + query + " (" + lexical_cast<string>(query.size()) + ")"
-									  + "\nCigar: " + getCigarAsString()
+									  + "\nCigar: " + cigarToString(cigar)
 									  + "\nCurrent op: " + op.toString()
 									  + "\nCurrent position in query: " + lexical_cast<string>(qPos)
 									  + "\nRequested length: " + lexical_cast<string>(len)
@@ -378,7 +393,7 @@ string portcullis::bam::BamAlignment::getPaddedQuerySeq(const string& query_seq,
 										  "Can't extract cigar op sequence from query string.")
 									  + "\nLimits: " + lexical_cast<string>(start) + "," + lexical_cast<string>(end)
 									  + "\nQuery sequence: " + query + " (" + lexical_cast<string>(query.size()) + ")"
-									  + "\nCigar: " + getCigarAsString()
+									  + "\nCigar: " + cigarToString(cigar)
 									  + "\nCurrent op: " + op.toString()
 									  + "\nCurrent position in query: " + lexical_cast<string>(qPos)
 									  + "\nRequested length: " + lexical_cast<string>(len)
@@ -403,7 +418,11 @@ string portcullis::bam::BamAlignment::getPaddedQuerySeq(const string& query_seq,
 }
 
 string portcullis::bam::BamAlignment::getPaddedGenomeSeq(const string& genomeSeq, int32_t start, int32_t end, int32_t q_start, int32_t q_end, const bool include_soft_clips) const {
-	if (start > getEnd() || end < position)
+	return getPaddedGenomeSeq(getCigar(), position, alignedLength, genomeSeq, start, end, q_start, q_end, include_soft_clips);
+}
+
+string portcullis::bam::BamAlignment::getPaddedGenomeSeq(const vector<CigarOp>& cigar, int32_t position, int32_t alignedLength, const string& genomeSeq, int32_t start, int32_t end, int32_t q_start, int32_t q_end, const bool include_soft_clips) {
+	if (start > position + alignedLength - 1 || end < position)
 		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
 								  "Found an alignment that does not have a presence in the requested region")));
 	//int32_t pos = 0;
@@ -439,7 +458,7 @@ string portcullis::bam::BamAlignment::getPaddedGenomeSeq(const string& genomeSeq
 										  "Can't extract cigar op sequence from extracted genome region.\nCurrent position in extracted genome region: ")
 									  + lexical_cast<string>(seqOffset) +
 									  "; Genome region length: " + lexical_cast<string>(genomeSeq.size()) +
-									  "\nFull cigar: " + this->getCigarAsString() +
+									  "\nFull cigar: " + cigarToString(cigar) +
 									  "\nCurrent cigar op: " + op.type + lexical_cast<string>(op.length) +
 									  "\nCurrent genomic position: " + lexical_cast<string>(rPos) +
 									  "\nAlignment region: " + lexical_cast<string>(position) + "," + lexical_cast<string>(position + alignedLength) +
@@ -466,8 +485,8 @@ string portcullis::bam::BamAlignment::toString() const {
 }
 
 string portcullis::bam::BamAlignment::toString(bool afterClipping) const {
-	uint32_t start = afterClipping && cigar.front().type == BAM_CIGAR_SOFTCLIP_CHAR ? position + cigar.front().length : position;
-	uint32_t end = afterClipping && cigar.back().type == BAM_CIGAR_SOFTCLIP_CHAR ? getEnd() - cigar.back().length : getEnd();
+	uint32_t start = afterClipping && getCigar().front().type == BAM_CIGAR_SOFTCLIP_CHAR ? position + getCigar().front().length : position;
+	uint32_t end = afterClipping && getCigar().back().type == BAM_CIGAR_SOFTCLIP_CHAR ? getEnd() - getCigar().back().length : getEnd();
 	stringstream ss;
 	ss << refId << "(" << start << "-" << end << ")" << (this->isReverseStrand() ? "-" : "+");
 	return ss.str();
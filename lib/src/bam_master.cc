@@ -124,5 +124,14 @@ string portcullis::bam::BamHelper::createIndexBamCmd(const path& sortedBam, bool
 	return string("samtools index ") + (useCsi ? "-c " : "") + sortedBam.string();
 }
 
+void portcullis::bam::BamHelper::indexBam(const path& sortedBam, bool useCsi) {
+	// Same minimum interval size as samtools uses for CSI indexes, 0 means BAI
+	const int minShift = useCsi ? 14 : 0;
+	if (sam_index_build(sortedBam.c_str(), minShift) != 0) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not index BAM file: ") + sortedBam.string()));
+	}
+}
+
 
 
@@ -0,0 +1,286 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+using std::pair;
+using std::string;
+using std::unique_ptr;
+using std::unordered_map;
+using std::unordered_set;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+using boost::lexical_cast;
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bam_sorter.hpp>
+#include <portcullis/bam/bam_writer.hpp>
+
+#include <portcullis/bam/bam_merger.hpp>
+
+namespace portcullis {
+namespace bam {
+
+/**
+ * Splits header text into lines, without the line endings
+ */
+static vector<string> headerLines(const bam_hdr_t* header) {
+	vector<string> lines;
+	std::istringstream text(header->l_text > 0 ? string(header->text, header->l_text) : string());
+	string line;
+	while (std::getline(text, line)) {
+		if (!line.empty()) {
+			lines.push_back(line);
+		}
+	}
+	return lines;
+}
+
+/**
+ * Gets the target sequence name from an @SQ line
+ */
+static string sqName(const string& line) {
+	const size_t start = line.find("\tSN:");
+	if (start == string::npos) {
+		return string();
+	}
+	const size_t end = line.find('\t', start + 4);
+	return line.substr(start + 4, end == string::npos ? string::npos : end - start - 4);
+}
+
+}
+}
+
+portcullis::bam::BamMerger::BamMerger(const vector<path>& _inputs, const path& _outputBam, const uint16_t _threads) {
+	inputs = _inputs;
+	outputBam = _outputBam;
+	threads = std::max(_threads, (uint16_t)1);
+	ioThreads = 0;
+	compressionLevel = -1;
+	index = false;
+	useCsi = false;
+	nbAlignments = 0;
+}
+
+void portcullis::bam::BamMerger::merge() {
+	nbAlignments = 0;
+	vector<unique_ptr<BamReader>> readers;
+	vector<bam_hdr_t*> headers;
+	for (const auto& input : inputs) {
+		readers.push_back(unique_ptr<BamReader>(new BamReader(input, ioThreads)));
+		readers.back()->open();
+		headers.push_back(readers.back()->getHeader());
+	}
+	vector<vector<int32_t>> tidMaps;
+	std::unique_ptr<bam_hdr_t, void(*)(bam_hdr_t*)> header(mergeHeaders(headers, tidMaps), bam_hdr_destroy);
+	// Only translate target sequence indices for the inputs that need it
+	vector<bool> translate;
+	for (const auto& m : tidMaps) {
+		bool identity = true;
+		for (size_t t = 0; t < m.size(); t++) {
+			identity = identity && m[t] == (int32_t)t;
+		}
+		translate.push_back(!identity);
+	}
+	auto next = [&](const size_t i) -> bam1_t* {
+		bam1_t* b = readers[i]->nextRaw();
+		if (b != nullptr && translate[i]) {
+			if (b->core.tid >= 0) {
+				b->core.tid = tidMaps[i][b->core.tid];
+			}
+			if (b->core.mtid >= 0) {
+				b->core.mtid = tidMaps[i][b->core.mtid];
+			}
+		}
+		return b;
+	};
+	// Alignments with the same key come from the earliest input first
+	typedef pair<uint64_t, size_t> InputHead;
+	std::priority_queue<InputHead, vector<InputHead>, std::greater<InputHead>> heads;
+	vector<bam1_t*> records(inputs.size(), nullptr);
+	for (size_t i = 0; i < inputs.size(); i++) {
+		records[i] = next(i);
+		if (records[i] != nullptr) {
+			heads.push(InputHead(BamSorter::sortKey(records[i]->core), i));
+		}
+	}
+	BamWriter writer(outputBam, threads - 1 + ioThreads, compressionLevel);
+	if (index) {
+		writer.setIndex(useCsi);
+	}
+	writer.open(header.get());
+	try {
+		while (!heads.empty()) {
+			const uint64_t key = heads.top().first;
+			const size_t i = heads.top().second;
+			heads.pop();
+			writer.write(records[i]);
+			nbAlignments++;
+			records[i] = next(i);
+			if (records[i] != nullptr) {
+				const uint64_t nextKey = BamSorter::sortKey(records[i]->core);
+				if (nextKey < key) {
+					BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+											  "Can't merge BAM file as it is not coordinate sorted: ") + inputs[i].string()));
+				}
+				heads.push(InputHead(nextKey, i));
+			}
+		}
+		for (auto& r : readers) {
+			r->close();
+		}
+		writer.close();
+	}
+	catch (...) {
+		// Don't leave a partial output behind which might be mistaken for a good one
+		boost::filesystem::remove(outputBam);
+		throw;
+	}
+}
+
+bam_hdr_t* portcullis::bam::BamMerger::mergeHeaders(const vector<bam_hdr_t*>& headers, vector<vector<int32_t>>& tidMaps) {
+	if (headers.empty()) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "No BAM headers to merge")));
+	}
+	vector<string> names;
+	vector<uint32_t> lengths;
+	unordered_map<string, int32_t> nameIndex;
+	bool sameTargets = true;
+	tidMaps.clear();
+	for (size_t h = 0; h < headers.size(); h++) {
+		const bam_hdr_t* header = headers[h];
+		sameTargets = sameTargets && header->n_targets == headers[0]->n_targets;
+		vector<int32_t> tidMap;
+		for (int32_t t = 0; t < header->n_targets; t++) {
+			const string name(header->target_name[t]);
+			auto it = nameIndex.find(name);
+			if (it == nameIndex.end()) {
+				nameIndex[name] = names.size();
+				tidMap.push_back(names.size());
+				names.push_back(name);
+				lengths.push_back(header->target_len[t]);
+			}
+			else {
+				if (lengths[it->second] != header->target_len[t]) {
+					BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+											  "Target sequence ") + name + " has different lengths in the BAM files to merge"));
+				}
+				// Alignments in each input are sorted by its own target sequence order,
+				// which must agree with the merged order
+				if (!tidMap.empty() && it->second < tidMap.back()) {
+					BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+											  "Target sequence ") + name + " is in a different order in the BAM files to merge"));
+				}
+				tidMap.push_back(it->second);
+			}
+			sameTargets = sameTargets && tidMap.back() == t;
+		}
+		tidMaps.push_back(tidMap);
+	}
+	// Build the header text.  If the target sequences are the same in all the
+	// headers then the first header's text is kept as it is.
+	vector<vector<string>> lines;
+	for (const auto header : headers) {
+		lines.push_back(headerLines(header));
+	}
+	vector<string> merged;
+	if (sameTargets) {
+		merged = lines[0];
+	}
+	else {
+		unordered_map<string, string> sqLines;
+		for (const auto& ls : lines) {
+			for (const auto& l : ls) {
+				if (l.compare(0, 3, "@SQ") == 0 && sqLines.find(sqName(l)) == sqLines.end()) {
+					sqLines[sqName(l)] = l;
+				}
+			}
+		}
+		for (const auto& l : lines[0]) {
+			if (l.compare(0, 3, "@HD") == 0) {
+				merged.push_back(l);
+			}
+		}
+		for (size_t t = 0; t < names.size(); t++) {
+			auto it = sqLines.find(names[t]);
+			merged.push_back(it != sqLines.end() ? it->second :
+				"@SQ\tSN:" + names[t] + "\tLN:" + lexical_cast<string>(lengths[t]));
+		}
+		for (const auto& l : lines[0]) {
+			if (l.compare(0, 3, "@HD") != 0 && l.compare(0, 3, "@SQ") != 0) {
+				merged.push_back(l);
+			}
+		}
+	}
+	unordered_set<string> present(merged.begin(), merged.end());
+	vector<string> extra;
+	for (size_t h = 1; h < lines.size(); h++) {
+		for (const auto& l : lines[h]) {
+			if (l.compare(0, 3, "@HD") != 0 && l.compare(0, 3, "@SQ") != 0 && present.find(l) == present.end()) {
+				extra.push_back(l);
+				present.insert(l);
+			}
+		}
+	}
+	string text;
+	if (sameTargets) {
+		text = headers[0]->l_text > 0 ? string(headers[0]->text, headers[0]->l_text) : string();
+		if (!extra.empty()) {
+			text.erase(text.find_last_not_of('\0') + 1);
+			if (!text.empty() && text.back() != '\n') {
+				text += "\n";
+			}
+		}
+	}
+	else {
+		for (const auto& l : merged) {
+			text += l + "\n";
+		}
+	}
+	for (const auto& l : extra) {
+		text += l + "\n";
+	}
+	bam_hdr_t* header = bam_hdr_init();
+	header->n_targets = names.size();
+	header->target_len = (uint32_t*)malloc(names.size() * sizeof(uint32_t));
+	header->target_name = (char**)malloc(names.size() * sizeof(char*));
+	for (size_t t = 0; t < names.size(); t++) {
+		header->target_len[t] = lengths[t];
+		header->target_name[t] = strdup(names[t].c_str());
+	}
+	header->l_text = text.size();
+	header->text = (char*)malloc(text.size() + 1);
+	memcpy(header->text, text.c_str(), text.size() + 1);
+	BamSorter::setCoordSorted(header);
+	return header;
+}
@@ -50,15 +50,31 @@ using portcullis::bam::BamAlignmentPtr;
 
 // ****** BamReader methods *********
 
-portcullis::bam::BamReader::BamReader(const path& _bamFile) {
+portcullis::bam::BamReader::BamReader(const path& _bamFile) : BamReader(_bamFile, 0) {
+}
+
+portcullis::bam::BamReader::BamReader(const path& _bamFile, const uint16_t _ioThreads) {
 	bamFile = _bamFile;
+	ioThreads = _ioThreads;
+	fp = nullptr;
 	header = nullptr;
 	index = nullptr;
 	iter = nullptr;
 	c = nullptr;
+	frontIndex = 0;
+	backReady = false;
+	readAheadRunning = false;
+	stopReadAhead = false;
 }
 
 portcullis::bam::BamReader::~BamReader() {
+	endReadAhead();
+	for (auto r : front.records) {
+		bam_destroy1(r);
+	}
+	for (auto r : back.records) {
+		bam_destroy1(r);
+	}
 	if (header != nullptr) {
 		bam_hdr_destroy(header);
 	}
@@ -69,9 +85,7 @@ portcullis::bam::BamReader::~BamReader() {
 		hts_idx_destroy(index);
 	}
 	if (iter != nullptr) {
-		free(iter->off);
-		free(iter->bins.a);
-		free(iter);
+		hts_itr_destroy(iter);
 	}
 }
 
@@ -92,6 +106,7 @@ void portcullis::bam::BamReader::open() {
 }
 
 void portcullis::bam::BamReader::close() {
+	endReadAhead();
 	bgzf_close(fp);
 }
 
@@ -132,9 +147,99 @@ shared_ptr<RefSeqPtrIndexMap> portcullis::bam::BamReader::createRefMap(const Ref
 }
 
 bool portcullis::bam::BamReader::next() {
-	bool res = bam_iter_read(fp, iter, c) >= 0;
-	b.setRaw(c);
-	return res;
+	if (ioThreads == 0) {
+		bool res = bam_iter_read(fp, iter, c) >= 0;
+		b.setRaw(c);
+		return res;
+	}
+	bam1_t* r = nextRaw();
+	if (r == nullptr) {
+		return false;
+	}
+	b.setRaw(r);
+	return true;
+}
+
+bam1_t* portcullis::bam::BamReader::nextRaw() {
+	if (ioThreads == 0) {
+		return bam_iter_read(fp, iter, c) >= 0 ? c : nullptr;
+	}
+	if (!readAheadRunning) {
+		startReadAhead();
+	}
+	if (frontIndex >= front.size) {
+		if (front.eof) {
+			return nullptr;
+		}
+		// Wait for the read ahead thread to fill the back batch, then take it
+		// and hand the exhausted one back to be refilled
+		{
+			std::unique_lock<mutex> lock(readAheadMutex);
+			readAheadCondition.wait(lock, [this] { return backReady; });
+			std::swap(front, back);
+			frontIndex = 0;
+			backReady = false;
+		}
+		readAheadCondition.notify_all();
+		if (front.size == 0) {
+			return nullptr;
+		}
+	}
+	return front.records[frontIndex++];
+}
+
+void portcullis::bam::BamReader::readAhead() {
+	while (true) {
+		// The back batch belongs to us until we mark it as ready
+		if (back.records.empty()) {
+			back.records.resize(DEFAULT_READ_AHEAD_BATCH_SIZE);
+			for (auto & r : back.records) {
+				r = bam_init1();
+			}
+		}
+		back.size = 0;
+		back.eof = false;
+		while (back.size < back.records.size()) {
+			if (bam_iter_read(fp, iter, back.records[back.size]) < 0) {
+				back.eof = true;
+				break;
+			}
+			back.size++;
+		}
+		std::unique_lock<mutex> lock(readAheadMutex);
+		backReady = true;
+		readAheadCondition.notify_all();
+		if (back.eof) {
+			return;
+		}
+		readAheadCondition.wait(lock, [this] { return !backReady || stopReadAhead; });
+		if (stopReadAhead) {
+			return;
+		}
+	}
+}
+
+void portcullis::bam::BamReader::startReadAhead() {
+	front.size = 0;
+	front.eof = false;
+	frontIndex = 0;
+	backReady = false;
+	stopReadAhead = false;
+	readAheadRunning = true;
+	readAheadThread = thread(&portcullis::bam::BamReader::readAhead, this);
+}
+
+void portcullis::bam::BamReader::endReadAhead() {
+	if (!readAheadRunning) {
+		return;
+	}
+	{
+		std::unique_lock<mutex> lock(readAheadMutex);
+		stopReadAhead = true;
+	}
+	readAheadCondition.notify_all();
+	readAheadThread.join();
+	readAheadRunning = false;
 }
 
 const BamAlignment& portcullis::bam::BamReader::current() const {
@@ -142,9 +247,43 @@ const BamAlignment& portcullis::bam::BamReader::current() const {
 }
 
 void portcullis::bam::BamReader::setRegion(const int32_t seqIndex, const int32_t start, const int32_t end) {
+	// Anything read ahead is no longer relevant
+	endReadAhead();
+	if (iter != nullptr) {
+		hts_itr_destroy(iter);
+	}
 	iter = sam_itr_queryi(index, seqIndex, start, end);
 }
 
+bool portcullis::bam::BamReader::seekToSequence(const int32_t seqIndex) {
+	endReadAhead();
+	setRegion(seqIndex, 0, header->target_len[seqIndex]);
+	// Offsets in the iterator are sorted, so the first one is where the alignments
+	// for this sequence start
+	const bool found = iter != nullptr && iter->n_off > 0 && bgzf_seek(fp, iter->off[0].u, SEEK_SET) >= 0;
+	if (iter != nullptr) {
+		hts_itr_destroy(iter);
+		iter = nullptr;
+	}
+	return found;
+}
+
+int64_t portcullis::bam::BamReader::getNbMappedAlignments(const int32_t seqIndex) const {
+	uint64_t mapped = 0, unmapped = 0;
+	if (index == nullptr) {
+		return -1;
+	}
+	if (hts_idx_get_stat(index, seqIndex, &mapped, &unmapped) < 0) {
+		// No stats are recorded for sequences without any alignments, so check
+		// whether that's the case here
+		hts_itr_t* it = sam_itr_queryi(index, seqIndex, 0, header->target_len[seqIndex]);
+		const bool empty = it != nullptr && it->n_off == 0;
+		hts_itr_destroy(it);
+		return empty ? 0 : -1;
+	}
+	return (int64_t)mapped;
+}
+
 
 bool portcullis::bam::BamReader::isCoordSortedBam() {
 	string headerText = header->text;
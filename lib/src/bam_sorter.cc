@@ -0,0 +1,322 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+using std::string;
+using std::thread;
+using std::vector;
+
+#include <boost/algorithm/string.hpp>
+#include <boost/exception/all.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+using boost::lexical_cast;
+namespace bfs = boost::filesystem;
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/bam_merger.hpp>
+#include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bam_writer.hpp>
+
+#include <portcullis/bam/bam_sorter.hpp>
+
+namespace portcullis {
+namespace bam {
+
+/**
+ * Sorts the entries by splitting them into a part for each thread, sorting each
+ * part and then merging neighbouring parts, in parallel, until one is left
+ */
+static void parallelSort(vector<SortEntry>& entries, const uint16_t threads) {
+	const size_t nbParts = std::max((size_t)1, std::min((size_t)threads, entries.size() / 10000));
+	vector<size_t> bounds;
+	for (size_t i = 0; i <= nbParts; i++) {
+		bounds.push_back(entries.size() * i / nbParts);
+	}
+	auto begin = entries.begin();
+	vector<thread> workers;
+	for (size_t i = 1; i < nbParts; i++) {
+		workers.push_back(thread([&, i] { std::sort(begin + bounds[i], begin + bounds[i + 1]); }));
+	}
+	std::sort(begin + bounds[0], begin + bounds[1]);
+	for (auto& w : workers) {
+		w.join();
+	}
+	for (size_t width = 1; width < nbParts; width *= 2) {
+		workers.clear();
+		for (size_t i = 0; i + width < nbParts; i += 2 * width) {
+			const size_t first = bounds[i];
+			const size_t middle = bounds[i + width];
+			const size_t last = bounds[std::min(i + 2 * width, nbParts)];
+			workers.push_back(thread([&, first, middle, last] {
+				std::inplace_merge(begin + first, begin + middle, begin + last);
+			}));
+		}
+		for (auto& w : workers) {
+			w.join();
+		}
+	}
+}
+
+}
+}
+
+portcullis::bam::BamSorter::BamSorter(const path& _inputBam, const path& _outputBam, const uint16_t _threads, const uint64_t _memory) {
+	inputBam = _inputBam;
+	outputBam = _outputBam;
+	tempDir = outputBam.has_parent_path() ? outputBam.parent_path() : path(".");
+	threads = std::max(_threads, (uint16_t)1);
+	ioThreads = 0;
+	memory = _memory;
+	index = false;
+	useCsi = false;
+	nbAlignments = 0;
+}
+
+void portcullis::bam::SortBuffer::add(const bam1_t* b) {
+	const size_t offset = data.size();
+	const int32_t length = b->l_data;
+	data.resize(offset + sizeof(bam1_core_t) + sizeof(int32_t) + length);
+	uint8_t* p = data.data() + offset;
+	memcpy(p, &b->core, sizeof(bam1_core_t));
+	memcpy(p + sizeof(bam1_core_t), &length, sizeof(int32_t));
+	memcpy(p + sizeof(bam1_core_t) + sizeof(int32_t), b->data, length);
+	entries.push_back({BamSorter::sortKey(b->core), offset});
+}
+
+bool portcullis::bam::SortBuffer::add(const bam1_t* b, const uint64_t maxBytes) {
+	const size_t dataSize = data.size() + sizeof(bam1_core_t) + sizeof(int32_t) + b->l_data;
+	const size_t nbEntries = entries.size() + 1;
+	size_t dataCapacity = data.capacity();
+	size_t entriesCapacity = entries.capacity();
+	if (dataSize > dataCapacity) {
+		dataCapacity = std::max(dataSize, 2 * dataCapacity);
+	}
+	if (nbEntries > entriesCapacity) {
+		entriesCapacity = std::max(nbEntries, 2 * entriesCapacity);
+	}
+	// Take back whatever doubling would put over the limit
+	auto allocated = [&]() {
+		return (uint64_t)dataCapacity + (uint64_t)entriesCapacity * sizeof(SortEntry);
+	};
+	if (allocated() > maxBytes && dataCapacity > data.capacity()) {
+		dataCapacity = std::max(dataSize, (size_t)(dataCapacity - std::min(allocated() - maxBytes, (uint64_t)dataCapacity)));
+	}
+	if (allocated() > maxBytes && entriesCapacity > entries.capacity()) {
+		const uint64_t excess = (allocated() - maxBytes + sizeof(SortEntry) - 1) / sizeof(SortEntry);
+		entriesCapacity = std::max(nbEntries, (size_t)(entriesCapacity - std::min(excess, (uint64_t)entriesCapacity)));
+	}
+	if (allocated() > maxBytes && !entries.empty()) {
+		return false;
+	}
+	data.reserve(dataCapacity);
+	entries.reserve(entriesCapacity);
+	add(b);
+	return true;
+}
+
+void portcullis::bam::SortBuffer::get(const SortEntry& entry, bam1_t* b) {
+	uint8_t* p = data.data() + entry.offset;
+	memcpy(&b->core, p, sizeof(bam1_core_t));
+	memcpy(&b->l_data, p + sizeof(bam1_core_t), sizeof(int32_t));
+	b->m_data = b->l_data;
+	b->data = p + sizeof(bam1_core_t) + sizeof(int32_t);
+}
+
+void portcullis::bam::BamSorter::write(SortBuffer& buffer, const path& file, bam_hdr_t* header, const int compressionLevel, const bool indexed) {
+	parallelSort(buffer.entries, threads);
+	BamWriter writer(file, getCompressionThreads(), compressionLevel);
+	if (indexed) {
+		writer.setIndex(useCsi);
+	}
+	writer.open(header);
+	// Point a record at each serialised alignment in turn rather than copying it
+	bam1_t b;
+	memset(&b, 0, sizeof(bam1_t));
+	for (const auto& e : buffer.entries) {
+		buffer.get(e, &b);
+		writer.write(&b);
+	}
+	writer.close();
+	buffer.clear();
+}
+
+void portcullis::bam::BamSorter::merge() {
+	// Runs are in input order, so alignments that sort equally stay in input order
+	BamMerger merger(runs, outputBam, threads);
+	merger.setIoThreads(ioThreads);
+	if (index) {
+		merger.setIndex(useCsi);
+	}
+	merger.merge();
+}
+
+void portcullis::bam::BamSorter::sort() {
+	runs.clear();
+	nbAlignments = 0;
+	BamReader reader(inputBam, ioThreads);
+	reader.open();
+	std::unique_ptr<bam_hdr_t, void(*)(bam_hdr_t*)> header(bam_hdr_dup(reader.getHeader()), bam_hdr_destroy);
+	setCoordSorted(header.get());
+	const uint64_t bufferBytes = std::max(memory / 2, (uint64_t)1);
+	SortBuffer buffers[2];
+	size_t current = 0;
+	// Full buffers are sorted and written to a run in the background
+	thread spill;
+	std::exception_ptr spillError;
+	auto finishSpill = [&]() {
+		if (spill.joinable()) {
+			spill.join();
+		}
+		if (spillError) {
+			std::rethrow_exception(spillError);
+		}
+	};
+	auto startSpill = [&](SortBuffer& buffer) {
+		const path run = tempDir / (outputBam.filename().string() + ".tmp." + lexical_cast<string>(runs.size()) + ".bam");
+		runs.push_back(run);
+		bam_hdr_t* h = header.get();
+		spill = thread([this, &buffer, &spillError, run, h]() {
+			try {
+				write(buffer, run, h, DEFAULT_SORT_RUN_COMPRESSION, false);
+			}
+			catch (...) {
+				spillError = std::current_exception();
+			}
+		});
+	};
+	try {
+		bam1_t* b = nullptr;
+		while ((b = reader.nextRaw()) != nullptr) {
+			// Judge a full buffer by what it has allocated rather than what it holds,
+			// so the two buffers together never take more than the budget
+			if (!buffers[current].add(b, bufferBytes)) {
+				finishSpill();
+				startSpill(buffers[current]);
+				current = 1 - current;
+				buffers[current].add(b, bufferBytes);
+			}
+			nbAlignments++;
+		}
+		reader.close();
+		finishSpill();
+		if (runs.empty()) {
+			// Everything fitted in memory so go straight to the output
+			write(buffers[current], outputBam, header.get(), -1, index);
+		}
+		else {
+			if (!buffers[current].entries.empty()) {
+				startSpill(buffers[current]);
+				finishSpill();
+			}
+			// Release the memory before merging
+			for (auto& buffer : buffers) {
+				vector<uint8_t>().swap(buffer.data);
+				vector<SortEntry>().swap(buffer.entries);
+			}
+			merge();
+		}
+	}
+	catch (...) {
+		if (spill.joinable()) {
+			spill.join();
+		}
+		for (const auto& run : runs) {
+			bfs::remove(run);
+		}
+		bfs::remove(outputBam);
+		throw;
+	}
+	for (const auto& run : runs) {
+		bfs::remove(run);
+	}
+}
+
+void portcullis::bam::BamSorter::setCoordSorted(bam_hdr_t* header) {
+	const string so = "\tSO:coordinate";
+	string text = header->l_text > 0 ? string(header->text, header->l_text) : string();
+	if (text.size() > 3 && text.compare(0, 3, "@HD") == 0) {
+		const size_t eol = text.find('\n');
+		if (eol == string::npos) {
+			return;
+		}
+		const size_t tag = text.find("\tSO:");
+		if (tag != string::npos && tag < eol) {
+			size_t end = tag + 4;
+			while (end < text.size() && text[end] != '\n' && text[end] != '\t') {
+				end++;
+			}
+			if (text.compare(tag, end - tag, so) == 0) {
+				return;
+			}
+			text.replace(tag, end - tag, so);
+		}
+		else {
+			text.insert(eol, so);
+		}
+	}
+	else {
+		text = "@HD\tVN:1.3" + so + "\n" + text;
+	}
+	free(header->text);
+	header->text = (char*)malloc(text.size() + 1);
+	memcpy(header->text, text.c_str(), text.size() + 1);
+	header->l_text = text.size();
+}
+
+uint64_t portcullis::bam::BamSorter::parseMemory(const string& memory) {
+	string m = boost::algorithm::trim_copy(memory);
+	uint64_t multiplier = 1;
+	if (!m.empty()) {
+		switch (toupper(m.back())) {
+		case 'K':
+			multiplier = 1ULL << 10;
+			break;
+		case 'M':
+			multiplier = 1ULL << 20;
+			break;
+		case 'G':
+			multiplier = 1ULL << 30;
+			break;
+		}
+		if (multiplier > 1) {
+			m.pop_back();
+		}
+	}
+	double amount = 0.0;
+	try {
+		amount = lexical_cast<double>(m);
+	}
+	catch (boost::bad_lexical_cast& e) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not parse memory size: ") + memory));
+	}
+	if (amount <= 0.0) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Memory size must be positive: ") + memory));
+	}
+	return (uint64_t)(amount * multiplier);
+}
@@ -15,9 +15,12 @@
 //  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
 //  *******************************************************************
 
+#include <algorithm>
+#include <cstring>
 #include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 using std::make_shared;
 using std::shared_ptr;
@@ -42,24 +45,224 @@ using portcullis::bam::BamAlignment;
 
 #include <portcullis/bam/bam_writer.hpp>
 
+portcullis::bam::BamWriter::~BamWriter() {
+	if (idx != nullptr) {
+		hts_idx_destroy(idx);
+	}
+}
+
 void portcullis::bam::BamWriter::open(bam_hdr_t* header) {
-	// split
-	fp = bgzf_open(bamFile.c_str(), "w");
-	if (fp == NULL) {
+	out.open(bamFile.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) {
 		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
 								  "Could not open output BAM file: ") + bamFile.string()));
 	}
-	if (bam_hdr_write(fp, header) != 0) {
+	if (compressionLevel < 0 || compressionLevel > 9) {
+		compressionLevel = -1;
+	}
+	// Compress the same number of blocks at once as htslib's multi-threaded writer
+	const size_t batchSize = ioThreads > 0 ? DEFAULT_BGZF_MT_SUB_BLOCKS : 1;
+	blocks.assign(batchSize, vector<uint8_t>(BGZF_BLOCK_SIZE));
+	compressed.assign(batchSize, vector<uint8_t>(BGZF_MAX_BLOCK_SIZE));
+	compressedLengths.assign(batchSize, 0);
+	batchAddresses.assign(batchSize, 0);
+	nbQueued = 0;
+	blockOffset = 0;
+	address = 0;
+	nbBlocksWritten = 0;
+	batchStart = 0;
+	pending.clear();
+	unsorted = false;
+	// Same layout as bam_hdr_write
+	put("BAM\1", 4);
+	put(&header->l_text, 4);
+	if (header->l_text) {
+		put(header->text, header->l_text);
+	}
+	put(&header->n_targets, 4);
+	for (int32_t i = 0; i < header->n_targets; i++) {
+		const int32_t nameLength = strlen(header->target_name[i]) + 1;
+		put(&nameLength, 4);
+		put(header->target_name[i], nameLength);
+		put(&header->target_len[i], 4);
+	}
+	endBlock();
+	writeBlocks();
+	if (index) {
+		// Same parameters as used by sam_index_build
+		int minShift = 14;
+		int nbLevels = 5;
+		idxFormat = HTS_FMT_BAI;
+		if (useCsi) {
+			int64_t maxLength = 0;
+			for (int32_t i = 0; i < header->n_targets; i++) {
+				maxLength = std::max(maxLength, (int64_t) header->target_len[i]);
+			}
+			maxLength += 256;
+			nbLevels = 0;
+			for (int64_t s = 1 << minShift; maxLength > s; s <<= 3) {
+				nbLevels++;
+			}
+			idxFormat = HTS_FMT_CSI;
+		}
+		idx = hts_idx_init(header->n_targets, idxFormat, address << 16, minShift, nbLevels);
+	}
+}
+
+void portcullis::bam::BamWriter::put(const void* data, size_t length) {
+	const uint8_t* input = (const uint8_t*) data;
+	while (length > 0) {
+		const size_t copyLength = std::min(length, (size_t) BGZF_BLOCK_SIZE - blockOffset);
+		memcpy(blocks[nbQueued].data() + blockOffset, input, copyLength);
+		blockOffset += copyLength;
+		input += copyLength;
+		length -= copyLength;
+		if (blockOffset == BGZF_BLOCK_SIZE) {
+			endBlock();
+		}
+	}
+}
+
+void portcullis::bam::BamWriter::endBlock() {
+	if (blockOffset == 0) {
+		return;
+	}
+	compressedLengths[nbQueued] = blockOffset;
+	blockOffset = 0;
+	nbQueued++;
+	if (nbQueued == blocks.size()) {
+		writeBlocks();
+	}
+}
+
+void portcullis::bam::BamWriter::writeBlocks() {
+	if (nbQueued == 0) {
+		return;
+	}
+	// Compress the queued blocks, with the calling thread taking every
+	// (ioThreads + 1)th block and each helper thread taking its own share
+	const size_t nbWorkers = std::min((size_t) ioThreads + 1, nbQueued);
+	vector<int> results(nbQueued, 0);
+	auto compress = [&](const size_t first) {
+		for (size_t i = first; i < nbQueued; i += nbWorkers) {
+			size_t uncompressedLength = compressedLengths[i];
+			compressedLengths[i] = BGZF_MAX_BLOCK_SIZE;
+			results[i] = bgzf_compress(compressed[i].data(), &compressedLengths[i],
+					blocks[i].data(), uncompressedLength, compressionLevel);
+		}
+	};
+	vector<std::thread> workers;
+	for (size_t t = 1; t < nbWorkers; t++) {
+		workers.push_back(std::thread(compress, t));
+	}
+	compress(0);
+	for (auto& w : workers) {
+		w.join();
+	}
+	batchStart = nbBlocksWritten;
+	for (size_t i = 0; i < nbQueued; i++) {
+		if (results[i] != 0) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not compress block for: ") + bamFile.string()));
+		}
+		batchAddresses[i] = address;
+		out.write((const char*) compressed[i].data(), compressedLengths[i]);
+		address += compressedLengths[i];
+	}
+	if (!out.good()) {
 		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
-								  "Could not write header into: ") + bamFile.string()));
+								  "Could not write to: ") + bamFile.string()));
+	}
+	nbBlocksWritten += nbQueued;
+	nbQueued = 0;
+	pushPending();
+}
+
+void portcullis::bam::BamWriter::pushPending() {
+	if (idx == nullptr) {
+		pending.clear();
+		return;
+	}
+	size_t i = 0;
+	for (; i < pending.size(); i++) {
+		const PendingRecord& r = pending[i];
+		uint64_t blockAddress = 0;
+		if (r.block < nbBlocksWritten) {
+			blockAddress = batchAddresses[r.block - batchStart];
+		}
+		else if (r.block == nbBlocksWritten && r.offset == 0) {
+			// The record finished exactly at the end of a block
+			blockAddress = address;
+		}
+		else {
+			break;
+		}
+		if (!unsorted && hts_idx_push(idx, r.tid, r.beg, r.end, (blockAddress << 16) | r.offset, r.mapped) < 0) {
+			unsorted = true;
+		}
 	}
+	pending.erase(pending.begin(), pending.begin() + i);
 }
 
 int portcullis::bam::BamWriter::write(const BamAlignment& ba) {
-	return bam_write1(fp, ba.getRaw());
+	return write(ba.getRaw());
 }
 
-void portcullis::bam::BamWriter::close() {
-	bgzf_close(fp);
+int portcullis::bam::BamWriter::write(const bam1_t* b) {
+	// Same layout as bam_write1, including starting a new block if the record
+	// doesn't fit in the current one
+	const bam1_core_t* c = &b->core;
+	const uint32_t blockLength = b->l_data + 32;
+	uint32_t x[8];
+	x[0] = c->tid;
+	x[1] = c->pos;
+	x[2] = (uint32_t) c->bin << 16 | c->qual << 8 | c->l_qname;
+	x[3] = (uint32_t) c->flag << 16 | c->n_cigar;
+	x[4] = c->l_qseq;
+	x[5] = c->mtid;
+	x[6] = c->mpos;
+	x[7] = c->isize;
+	if (blockOffset + 4 + blockLength > BGZF_BLOCK_SIZE) {
+		endBlock();
+	}
+	put(&blockLength, 4);
+	put(x, 32);
+	put(b->data, b->l_data);
+	if (index) {
+		// Records are indexed by the virtual offset just after them
+		pending.push_back({c->tid, c->pos, bam_endpos(b), nbBlocksWritten + nbQueued, blockOffset, !(c->flag & BAM_FUNMAP)});
+	}
+	return 4 + blockLength;
 }
 
+void portcullis::bam::BamWriter::close() {
+	endBlock();
+	writeBlocks();
+	// Empty block marking the end of the file
+	size_t eofLength = BGZF_MAX_BLOCK_SIZE;
+	bgzf_compress(compressed[0].data(), &eofLength, NULL, 0, -1);
+	out.write((const char*) compressed[0].data(), eofLength);
+	address += eofLength;
+	out.close();
+	if (out.fail()) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not close: ") + bamFile.string()));
+	}
+	if (idx != nullptr) {
+		hts_idx_t* finished = idx;
+		idx = nullptr;
+		if (unsorted) {
+			hts_idx_destroy(finished);
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not index BAM file, alignments are not sorted: ") + bamFile.string()));
+		}
+		// Reading the file back ends after the end of file marker
+		hts_idx_finish(finished, address << 16);
+		const int res = hts_idx_save(finished, bamFile.c_str(), idxFormat);
+		hts_idx_destroy(finished);
+		if (res != 0) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not save index for: ") + bamFile.string()));
+		}
+	}
+}
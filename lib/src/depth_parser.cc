@@ -47,9 +47,17 @@ using portcullis::bam::BamReader;
 
 // ******* Depth parser methods ********
 
+int portcullis::bam::DepthParser::read_next(aux_t* aux, bam1_t *b) {
+	if (aux->reader != nullptr) {
+		bam1_t* r = aux->reader->nextRaw();
+		return r != nullptr && bam_copy1(b, r) != nullptr ? 0 : -1;
+	}
+	return aux->iter ? BamReader::bam_iter_read(aux->fp, aux->iter, b) : bam_read1(aux->fp, b);
+}
+
 int portcullis::bam::DepthParser::read_bam(void *data, bam1_t *b) {
 	aux_t *aux = (aux_t*)data; // data in fact is a pointer to an auxiliary structure
-	int ret = aux->iter ? BamReader::bam_iter_read(aux->fp, aux->iter, b) : bam_read1(aux->fp, b);
+	int ret = read_next(aux, b);
 	if (!(b->core.flag & BAM_FUNMAP)) {
 		if ((int)b->core.qual < aux->min_mapQ) b->core.flag |= BAM_FUNMAP;
 		else if (aux->min_len && bam_cigar2qlen(b->core.n_cigar, bam_get_cigar(b)) < aux->min_len) b->core.flag |= BAM_FUNMAP;
@@ -63,7 +71,7 @@ int portcullis::bam::DepthParser::read_bam_skip_gapped(void *data, bam1_t *b) {
 	bool skip = false;
 	do {
 		skip = false;
-		ret = aux->iter ? BamReader::bam_iter_read(aux->fp, aux->iter, b) : bam_read1(aux->fp, b);
+		ret = read_next(aux, b);
 		uint32_t *cigar = bam_get_cigar(b);
 		for (int k = 0; k < b->core.n_cigar; ++k) {
 			int cop = cigar[k] & BAM_CIGAR_MASK; // operation
@@ -83,13 +91,24 @@ int portcullis::bam::DepthParser::read_bam_skip_gapped(void *data, bam1_t *b) {
 
 
 portcullis::bam::DepthParser::DepthParser(path _bamFile, uint8_t _strandSpecific, bool _allowGappedAlignments) :
-	bamFile(_bamFile), strandSpecific(_strandSpecific), allowGappedAlignments(_allowGappedAlignments) {
+	DepthParser(_bamFile, _strandSpecific, _allowGappedAlignments, 0) {
+}
+
+portcullis::bam::DepthParser::DepthParser(path _bamFile, uint8_t _strandSpecific, bool _allowGappedAlignments, uint16_t _ioThreads) :
+	bamFile(_bamFile), strandSpecific(_strandSpecific), allowGappedAlignments(_allowGappedAlignments), ioThreads(_ioThreads) {
 	data = (aux_t**)calloc(1, sizeof(aux_t**));
 	data[0] = (aux_t*)calloc(1, sizeof(aux_t));
-	data[0]->fp = bgzf_open(bamFile.c_str(), "r");
 	data[0]->min_mapQ = 0;
 	data[0]->min_len  = 0;
-	header = bam_hdr_read(data[0]->fp);
+	if (ioThreads > 0) {
+		data[0]->reader = new BamReader(bamFile, ioThreads);
+		data[0]->reader->open();
+		header = bam_hdr_dup(data[0]->reader->getHeader());
+	}
+	else {
+		data[0]->fp = bgzf_open(bamFile.c_str(), "r");
+		header = bam_hdr_read(data[0]->fp);
+	}
 	mplp = allowGappedAlignments ?
 		   bam_mplp_init(1, read_bam, (void**)data) :
 		   bam_mplp_init(1, read_bam_skip_gapped, (void**)data);
@@ -100,10 +119,17 @@ portcullis::bam::DepthParser::DepthParser(path _bamFile, uint8_t _strandSpecific
 portcullis::bam::DepthParser::~DepthParser() {
 	bam_mplp_destroy(mplp);
 	bam_hdr_destroy(header);
-	bgzf_close(data[0]->fp);
+	if (data[0]->reader) {
+		data[0]->reader->close();
+		delete data[0]->reader;
+	}
+	else {
+		bgzf_close(data[0]->fp);
+	}
 	if (data[0]->iter) {
 		bam_itr_destroy(data[0]->iter);
 	}
+	free(data[0]);
 	free(data);
 }
 
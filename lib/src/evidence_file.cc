@@ -0,0 +1,376 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+namespace bfs = boost::filesystem;
+using boost::lexical_cast;
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_alignment.hpp>
+#include <portcullis/bam/bam_master.hpp>
+
+#include <portcullis/bam/evidence_file.hpp>
+
+namespace portcullis {
+namespace bam {
+
+/**
+ * Each record starts with its core fields and then the length of the data that
+ * follows
+ */
+static const size_t RECORD_HEADER_SIZE = sizeof(bam1_core_t) + sizeof(int32_t);
+
+/**
+ * Tests whether a section of a file of the given size lies entirely within it
+ */
+static inline bool inFile(const uint64_t offset, const uint64_t bytes, const uint64_t size) {
+	return offset <= size && bytes <= size - offset;
+}
+
+/**
+ * Size of a tag's value in a raw record, given a pointer to its type
+ */
+static size_t auxValueSize(const uint8_t* type) {
+	switch (*type) {
+	case 'A':
+	case 'c':
+	case 'C':
+		return 2;
+	case 's':
+	case 'S':
+		return 3;
+	case 'i':
+	case 'I':
+	case 'f':
+		return 5;
+	case 'd':
+		return 9;
+	case 'Z':
+	case 'H':
+		return strlen((const char*)type + 1) + 2;
+	case 'B': {
+		int32_t count;
+		memcpy(&count, type + 2, sizeof(int32_t));
+		const char sub = type[1];
+		const size_t width = sub == 'c' || sub == 'C' ? 1 : sub == 's' || sub == 'S' ? 2 : 4;
+		return 6 + count * width;
+	}
+	default:
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Unknown tag type in alignment: ") + (char)*type));
+	}
+}
+
+/**
+ * Writes the given data followed by enough padding to keep the next section 8
+ * byte aligned
+ * @return Offset of the data in the file
+ */
+static uint64_t writeAligned(std::ofstream& out, const void* data, const size_t bytes) {
+	const uint64_t offset = out.tellp();
+	out.write((const char*)data, bytes);
+	const char padding[8] = {0};
+	out.write(padding, (8 - bytes % 8) % 8);
+	return offset;
+}
+
+/**
+ * Copies a temporary column file onto the end of the output, keeping the next
+ * section 8 byte aligned
+ * @return Offset of the column in the file
+ */
+static uint64_t appendColumn(std::ofstream& out, const path& column) {
+	const uint64_t offset = out.tellp();
+	std::ifstream in(column.c_str(), std::ios::binary);
+	if (bfs::file_size(column) > 0) {
+		out << in.rdbuf();
+	}
+	const uint64_t bytes = (uint64_t)out.tellp() - offset;
+	const char padding[8] = {0};
+	out.write(padding, (8 - bytes % 8) % 8);
+	return offset;
+}
+
+}
+}
+
+// ******** Writer ********
+
+portcullis::bam::EvidenceFileWriter::EvidenceFileWriter(const path& _file) : file(_file) {
+	nbRecords = 0;
+	lastRefId = 0;
+	lastPosition = 0;
+}
+
+portcullis::bam::EvidenceFileWriter::~EvidenceFileWriter() {
+	// Only left open if something went wrong
+	if (out.is_open()) {
+		out.close();
+		bfs::remove(file);
+		removeTemporaryFiles();
+	}
+}
+
+void portcullis::bam::EvidenceFileWriter::removeTemporaryFiles() {
+	for (auto& c : {"offsets", "positions", "flags", "mapq", "names"}) {
+		bfs::remove(getColumnFile(c));
+	}
+}
+
+void portcullis::bam::EvidenceFileWriter::open(const bam_hdr_t* header) {
+	out.open(file.c_str(), std::ios::binary | std::ios::trunc);
+	recordOffsets.open(getColumnFile("offsets").c_str(), std::ios::binary | std::ios::trunc);
+	positions.open(getColumnFile("positions").c_str(), std::ios::binary | std::ios::trunc);
+	flags.open(getColumnFile("flags").c_str(), std::ios::binary | std::ios::trunc);
+	mapQualities.open(getColumnFile("mapq").c_str(), std::ios::binary | std::ios::trunc);
+	nameHashes.open(getColumnFile("names").c_str(), std::ios::binary | std::ios::trunc);
+	if (!out || !recordOffsets || !positions || !flags || !mapQualities || !nameHashes) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not create junction evidence file: ") + file.string()));
+	}
+	refs.assign(header->n_targets, EvidenceFileRef());
+	names.clear();
+	for (int32_t t = 0; t < header->n_targets; t++) {
+		refs[t].length = header->target_len[t];
+		names.push_back(header->target_name[t]);
+	}
+	nbRecords = 0;
+	lastRefId = 0;
+	lastPosition = 0;
+	// Leave space for the header, we fill it in at the end
+	EvidenceFileHeader h;
+	memset(&h, 0, sizeof(EvidenceFileHeader));
+	writeAligned(out, &h, sizeof(EvidenceFileHeader));
+}
+
+void portcullis::bam::EvidenceFileWriter::add(const bam1_t* b) {
+	const bam1_core_t& c = b->core;
+	if (c.tid < 0 || c.tid < lastRefId || (c.tid == lastRefId && c.pos < lastPosition)) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Alignments for junction evidence must be coordinate sorted: ") + bam_get_qname(b)));
+	}
+	lastRefId = c.tid;
+	lastPosition = c.pos;
+	// Keep everything up to the sequence, then skip the qualities and only keep
+	// the tags we need
+	const int32_t fixed = c.l_qname + c.n_cigar * 4 + (c.l_qseq + 1) / 2;
+	record.resize(RECORD_HEADER_SIZE + fixed);
+	const uint8_t* aux = bam_get_aux(b);
+	const uint8_t* end = b->data + b->l_data;
+	while (aux + 3 <= end) {
+		const size_t size = 2 + auxValueSize(aux + 2);
+		if ((aux[0] == 'X' && aux[1] == 'S') || (aux[0] == 'M' && aux[1] == 'D')) {
+			record.insert(record.end(), aux, aux + size);
+		}
+		aux += size;
+	}
+	const int32_t length = record.size() - RECORD_HEADER_SIZE;
+	memcpy(record.data(), &c, sizeof(bam1_core_t));
+	memcpy(record.data() + sizeof(bam1_core_t), &length, sizeof(int32_t));
+	memcpy(record.data() + RECORD_HEADER_SIZE, b->data, fixed);
+	const uint64_t offset = out.tellp();
+	out.write((const char*)record.data(), record.size());
+	// Now the columns
+	BamAlignment al;
+	al.setRaw(const_cast<bam1_t*>(b));
+	const uint64_t nameHash = std::hash<string>()(al.deriveName());
+	recordOffsets.write((const char*)&offset, sizeof(uint64_t));
+	positions.write((const char*)&c.pos, sizeof(int32_t));
+	const uint16_t flag = c.flag;
+	const uint8_t mapQuality = c.qual;
+	flags.write((const char*)&flag, sizeof(uint16_t));
+	mapQualities.write((const char*)&mapQuality, sizeof(uint8_t));
+	nameHashes.write((const char*)&nameHash, sizeof(uint64_t));
+	EvidenceFileRef& r = refs[c.tid];
+	if (r.nbRecords == 0) {
+		r.firstRecord = nbRecords;
+	}
+	r.nbRecords++;
+	r.maxSpan = std::max(r.maxSpan, (int32_t)bam_cigar2rlen(c.n_cigar, bam_get_cigar(b)));
+	nbRecords++;
+}
+
+void portcullis::bam::EvidenceFileWriter::close(const vector<SpillRefStats>& stats) {
+	EvidenceFileHeader h;
+	memset(&h, 0, sizeof(EvidenceFileHeader));
+	memcpy(h.magic, EVIDENCE_FILE_MAGIC, sizeof(EVIDENCE_FILE_MAGIC));
+	h.version = EVIDENCE_FILE_VERSION;
+	h.nbRefs = refs.size();
+	h.nbRecords = nbRecords;
+	h.recordsOffset = sizeof(EvidenceFileHeader);
+	// Pad the records, then add the columns
+	const uint64_t recordBytes = (uint64_t)out.tellp() - h.recordsOffset;
+	const char padding[8] = {0};
+	out.write(padding, (8 - recordBytes % 8) % 8);
+	for (auto* column : {&recordOffsets, &positions, &flags, &mapQualities, &nameHashes}) {
+		column->close();
+	}
+	h.recordOffsetsOffset = appendColumn(out, getColumnFile("offsets"));
+	h.positionsOffset = appendColumn(out, getColumnFile("positions"));
+	h.flagsOffset = appendColumn(out, getColumnFile("flags"));
+	h.mapQualitiesOffset = appendColumn(out, getColumnFile("mapq"));
+	h.nameHashesOffset = appendColumn(out, getColumnFile("names"));
+	// Target sequences without records start where the next records would
+	uint64_t next = 0;
+	string allNames;
+	for (size_t t = 0; t < refs.size(); t++) {
+		EvidenceFileRef& r = refs[t];
+		if (r.nbRecords == 0) {
+			r.firstRecord = next;
+		}
+		next = r.firstRecord + r.nbRecords;
+		if (t < stats.size()) {
+			r.stats = stats[t];
+		}
+		r.nameOffset = allNames.size();
+		r.nameLength = names[t].size();
+		allNames += names[t];
+	}
+	h.refsOffset = writeAligned(out, refs.data(), refs.size() * sizeof(EvidenceFileRef));
+	h.namesOffset = writeAligned(out, allNames.data(), allNames.size());
+	h.fileSize = out.tellp();
+	out.seekp(0);
+	out.write((const char*)&h, sizeof(EvidenceFileHeader));
+	out.close();
+	removeTemporaryFiles();
+	if (!out) {
+		bfs::remove(file);
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not write junction evidence file: ") + file.string()));
+	}
+}
+
+// ******** Reader ********
+
+portcullis::bam::EvidenceFile::EvidenceFile(const path& _file) : file(_file) {
+	int fd = ::open(file.c_str(), O_RDONLY);
+	if (fd < 0) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not open junction evidence file: ") + file.string()));
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(EvidenceFileHeader)) {
+		::close(fd);
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Invalid junction evidence file: ") + file.string()));
+	}
+	size = st.st_size;
+	data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not memory map junction evidence file: ") + file.string()));
+	}
+	header = (const EvidenceFileHeader*)base();
+	if (!isValid()) {
+		munmap(data, size);
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Invalid or unsupported junction evidence file: ") + file.string()));
+	}
+	refs = (const EvidenceFileRef*)(base() + header->refsOffset);
+}
+
+bool portcullis::bam::EvidenceFile::isValid() const {
+	const EvidenceFileHeader& h = *header;
+	if (memcmp(h.magic, EVIDENCE_FILE_MAGIC, sizeof(EVIDENCE_FILE_MAGIC)) != 0 ||
+			h.version != EVIDENCE_FILE_VERSION ||
+			h.fileSize != size) {
+		return false;
+	}
+	// Every record takes more than a byte, so this keeps the column sizes below
+	// from overflowing
+	const uint64_t n = h.nbRecords;
+	if (n > size ||
+			h.recordsOffset < sizeof(EvidenceFileHeader) || h.recordOffsetsOffset < h.recordsOffset ||
+			!inFile(h.recordOffsetsOffset, n * sizeof(uint64_t), size) ||
+			!inFile(h.positionsOffset, n * sizeof(int32_t), size) ||
+			!inFile(h.flagsOffset, n * sizeof(uint16_t), size) ||
+			!inFile(h.mapQualitiesOffset, n * sizeof(uint8_t), size) ||
+			!inFile(h.nameHashesOffset, n * sizeof(uint64_t), size) ||
+			!inFile(h.refsOffset, (uint64_t)h.nbRefs * sizeof(EvidenceFileRef), size) ||
+			!inFile(h.namesOffset, 0, size)) {
+		return false;
+	}
+	// Each record's fixed part must lie in the records section, the rest is
+	// checked as it's read
+	const uint64_t* offsets = (const uint64_t*)(base() + h.recordOffsetsOffset);
+	for (uint64_t i = 0; i < n; i++) {
+		if (offsets[i] < h.recordsOffset ||
+				!inFile(offsets[i], RECORD_HEADER_SIZE, h.recordOffsetsOffset)) {
+			return false;
+		}
+	}
+	const EvidenceFileRef* r = (const EvidenceFileRef*)(base() + h.refsOffset);
+	for (uint32_t t = 0; t < h.nbRefs; t++) {
+		if (!inFile(r[t].firstRecord, r[t].nbRecords, n) ||
+				!inFile(r[t].nameOffset, r[t].nameLength, size - h.namesOffset)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+portcullis::bam::EvidenceFile::~EvidenceFile() {
+	munmap(data, size);
+}
+
+uint64_t portcullis::bam::EvidenceFile::findFirst(const int32_t refId, const int32_t position) const {
+	const int32_t* first = getPositions() + refs[refId].firstRecord;
+	return std::lower_bound(first, first + refs[refId].nbRecords, position) - getPositions();
+}
+
+void portcullis::bam::EvidenceFile::getRecord(const uint64_t index, bam1_t* b) const {
+	const uint64_t offset = ((const uint64_t*)(base() + header->recordOffsetsOffset))[index];
+	const uint8_t* p = (const uint8_t*)base() + offset;
+	int32_t length;
+	memcpy(&b->core, p, sizeof(bam1_core_t));
+	memcpy(&length, p + sizeof(bam1_core_t), sizeof(int32_t));
+	p += RECORD_HEADER_SIZE;
+	const bam1_core_t& c = b->core;
+	const int64_t fixed = (int64_t)c.l_qname + (int64_t)c.n_cigar * 4 + ((int64_t)c.l_qseq + 1) / 2;
+	if (c.l_qseq < 0 || length < fixed ||
+			!inFile(offset + RECORD_HEADER_SIZE, length, header->recordOffsetsOffset)) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Invalid record ") + lexical_cast<string>(index) + " in junction evidence file: " + file.string()));
+	}
+	b->l_data = length + c.l_qseq;
+	if (b->m_data < b->l_data) {
+		b->m_data = b->l_data;
+		kroundup32(b->m_data);
+		b->data = (uint8_t*)realloc(b->data, b->m_data);
+	}
+	memcpy(b->data, p, fixed);
+	memset(b->data + fixed, 0xff, c.l_qseq);
+	memcpy(b->data + fixed + c.l_qseq, p + fixed, length - fixed);
+}
@@ -15,7 +15,11 @@
 //  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
 //  *******************************************************************
 
+#include <algorithm>
+#include <cstring>
+#include <fstream>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -32,12 +36,262 @@ using std::stringstream;
 using boost::filesystem::exists;
 using boost::filesystem::path;
 using boost::lexical_cast;
+namespace bfs = boost::filesystem;
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <htslib/faidx.h>
 #include <htslib/sam.h>
 
 #include <portcullis/bam/genome_mapper.hpp>
 
+// ******** Packed sequence ********
+
+portcullis::bam::PackedSeq::PackedSeq(const char* seq, const int32_t _len) : len(_len) {
+	ownBases.resize((len + 3) / 4, 0);
+	for (int32_t i = 0; i < len; i++) {
+		const char c = seq[i];
+		uint8_t code = 0;
+		switch (c) {
+		case 'A': case 'a': code = 0; break;
+		case 'C': case 'c': code = 1; break;
+		case 'G': case 'g': code = 2; break;
+		case 'T': case 't': code = 3; break;
+		case 'N': case 'n': addToRun(ownNRuns, i); break;
+		default: ownOthers.push_back({i, c}); continue;
+		}
+		if (c >= 'a' && c <= 'z') {
+			addToRun(ownLowerRuns, i);
+		}
+		ownBases[i >> 2] |= code << ((i & 3) << 1);
+	}
+	ownNRuns.shrink_to_fit();
+	ownLowerRuns.shrink_to_fit();
+	ownOthers.shrink_to_fit();
+	bases = ownBases.data();
+	nRuns = ownNRuns.data();
+	nbNRuns = ownNRuns.size();
+	lowerRuns = ownLowerRuns.data();
+	nbLowerRuns = ownLowerRuns.size();
+	others = ownOthers.data();
+	nbOthers = ownOthers.size();
+}
+
+void portcullis::bam::PackedSeq::addToRun(vector<SeqRun>& runs, const int32_t pos) {
+	if (!runs.empty() && runs.back().end == pos) {
+		runs.back().end++;
+	}
+	else {
+		runs.push_back({pos, pos + 1});
+	}
+}
+
+const portcullis::bam::SeqRun* portcullis::bam::PackedSeq::firstRunEndingAfter(const SeqRun* runs, const uint32_t nbRuns, const int32_t pos) {
+	return std::upper_bound(runs, runs + nbRuns, pos,
+			[](const int32_t p, const SeqRun& run) { return p < run.end; });
+}
+
+const portcullis::bam::SeqOther* portcullis::bam::PackedSeq::firstOtherFrom(const int32_t pos) const {
+	return std::lower_bound(others, others + nbOthers, pos,
+			[](const SeqOther& other, const int32_t p) { return other.pos < p; });
+}
+
+bool portcullis::bam::PackedSeq::isN(const int32_t pos) const {
+	const SeqRun* r = firstRunEndingAfter(nRuns, nbNRuns, pos);
+	if (r != nRuns + nbNRuns && r->start <= pos) {
+		return true;
+	}
+	const SeqOther* o = firstOtherFrom(pos);
+	return o != others + nbOthers && o->pos == pos;
+}
+
+bool portcullis::bam::PackedSeq::isACGT(const int32_t start, const int32_t end) const {
+	const SeqRun* r = firstRunEndingAfter(nRuns, nbNRuns, start);
+	if (r != nRuns + nbNRuns && r->start <= end) {
+		return false;
+	}
+	const SeqOther* o = firstOtherFrom(start);
+	return o == others + nbOthers || o->pos > end;
+}
+
+void portcullis::bam::PackedSeq::extract(const int32_t start, const int32_t end, string& seq) const {
+	static const char BASES[] = {'A', 'C', 'G', 'T'};
+	seq.resize(end - start + 1);
+	for (int32_t i = start; i <= end; i++) {
+		seq[i - start] = BASES[getCode(i)];
+	}
+	for (const SeqRun* r = firstRunEndingAfter(nRuns, nbNRuns, start); r != nRuns + nbNRuns && r->start <= end; ++r) {
+		for (int32_t i = std::max(r->start, start); i < std::min(r->end, end + 1); i++) {
+			seq[i - start] = 'N';
+		}
+	}
+	for (const SeqRun* r = firstRunEndingAfter(lowerRuns, nbLowerRuns, start); r != lowerRuns + nbLowerRuns && r->start <= end; ++r) {
+		for (int32_t i = std::max(r->start, start); i < std::min(r->end, end + 1); i++) {
+			seq[i - start] += 'a' - 'A';
+		}
+	}
+	for (const SeqOther* o = firstOtherFrom(start); o != others + nbOthers && o->pos <= end; ++o) {
+		seq[o->pos - start] = (char)o->base;
+	}
+}
+
+// ******** Packed genome ********
+
+/**
+ * Tests whether a section of a file of the given size lies entirely within it
+ */
+static inline bool inFile(const uint64_t offset, const uint64_t bytes, const uint64_t size) {
+	return offset <= size && bytes <= size - offset;
+}
+
+portcullis::bam::PackedGenome::PackedGenome(const path& _file) : file(_file) {
+	int fd = ::open(file.c_str(), O_RDONLY);
+	if (fd < 0) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not open packed genome file: ") + file.string()));
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(PackedGenomeHeader)) {
+		::close(fd);
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Invalid packed genome file: ") + file.string()));
+	}
+	size = st.st_size;
+	data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not memory map packed genome file: ") + file.string()));
+	}
+	const char* base = (const char*)data;
+	const PackedGenomeHeader* header = (const PackedGenomeHeader*)base;
+	if (memcmp(header->magic, PACKED_GENOME_MAGIC, sizeof(PACKED_GENOME_MAGIC)) != 0 ||
+			header->version != PACKED_GENOME_VERSION ||
+			header->fileSize != size ||
+			sizeof(PackedGenomeHeader) + header->nbSeqs * sizeof(PackedSeqEntry) > size) {
+		munmap(data, size);
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Invalid or unsupported packed genome file: ") + file.string()));
+	}
+	const PackedSeqEntry* entries = (const PackedSeqEntry*)(base + sizeof(PackedGenomeHeader));
+	// Make sure nothing points outside the mapping before handing out any pointers
+	for (uint32_t i = 0; i < header->nbSeqs; i++) {
+		const PackedSeqEntry& e = entries[i];
+		if (e.length < 0 ||
+				!inFile(e.basesOffset, ((uint64_t)e.length + 3) / 4, size) ||
+				!inFile(e.nRunsOffset, (uint64_t)e.nbNRuns * sizeof(SeqRun), size) ||
+				!inFile(e.lowerRunsOffset, (uint64_t)e.nbLowerRuns * sizeof(SeqRun), size) ||
+				!inFile(e.othersOffset, (uint64_t)e.nbOthers * sizeof(SeqOther), size) ||
+				!inFile(e.nameOffset, e.nameLength, size)) {
+			munmap(data, size);
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Invalid packed genome file, sequence ") + lexical_cast<string>(i) + " lies outside the file: " + file.string()));
+		}
+	}
+	seqs.reserve(header->nbSeqs);
+	names.reserve(header->nbSeqs);
+	for (uint32_t i = 0; i < header->nbSeqs; i++) {
+		const PackedSeqEntry& e = entries[i];
+		seqs.push_back(make_shared<PackedSeq>(e.length, (const uint8_t*)(base + e.basesOffset),
+				(const SeqRun*)(base + e.nRunsOffset), e.nbNRuns,
+				(const SeqRun*)(base + e.lowerRunsOffset), e.nbLowerRuns,
+				(const SeqOther*)(base + e.othersOffset), e.nbOthers));
+		names.push_back(string(base + e.nameOffset, e.nameLength));
+		nameIndex[names.back()] = i;
+	}
+}
+
+portcullis::bam::PackedGenome::~PackedGenome() {
+	munmap(data, size);
+}
+
+portcullis::bam::PackedGenomePtr portcullis::bam::PackedGenome::open(const path& file) {
+	static std::mutex mappedMutex;
+	static unordered_map<string, std::weak_ptr<PackedGenome>> mapped;
+	std::lock_guard<std::mutex> lock(mappedMutex);
+	const string key = bfs::canonical(file).string();
+	PackedGenomePtr pg = mapped[key].lock();
+	if (pg == nullptr) {
+		pg = make_shared<PackedGenome>(file);
+		mapped[key] = pg;
+	}
+	return pg;
+}
+
+int32_t portcullis::bam::PackedGenome::getIndex(const char* name) const {
+	auto i = nameIndex.find(name);
+	return i == nameIndex.end() ? -1 : i->second;
+}
+
+/**
+ * Writes the given data followed by enough padding to keep the next section 8
+ * byte aligned
+ * @return Offset of the data in the file
+ */
+static uint64_t writeAligned(std::ofstream& out, const void* data, const size_t bytes) {
+	const uint64_t offset = out.tellp();
+	out.write((const char*)data, bytes);
+	const char padding[8] = {0};
+	out.write(padding, (8 - bytes % 8) % 8);
+	return offset;
+}
+
+void portcullis::bam::PackedGenome::write(faidx_t* fastaIndex, const path& file) {
+	std::ofstream out(file.c_str(), std::ios::binary | std::ios::trunc);
+	if (!out) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not create packed genome file: ") + file.string()));
+	}
+	PackedGenomeHeader header;
+	memcpy(header.magic, PACKED_GENOME_MAGIC, sizeof(PACKED_GENOME_MAGIC));
+	header.version = PACKED_GENOME_VERSION;
+	header.nbSeqs = faidx_nseq(fastaIndex);
+	header.fileSize = 0;
+	vector<PackedSeqEntry> entries(header.nbSeqs);
+	// Leave space for the header and entries, we fill these in at the end
+	writeAligned(out, &header, sizeof(PackedGenomeHeader));
+	writeAligned(out, entries.data(), entries.size() * sizeof(PackedSeqEntry));
+	for (uint32_t i = 0; i < header.nbSeqs; i++) {
+		const char* name = faidx_iseq(fastaIndex, i);
+		const int seqLen = faidx_seq_len(fastaIndex, name);
+		int len = 0;
+		char* cseq = seqLen > 0 ? faidx_fetch_seq(fastaIndex, name, 0, seqLen - 1, &len) : nullptr;
+		if (seqLen > 0 && (cseq == NULL || len < 0)) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not load reference sequence: ") + name));
+		}
+		PackedSeq seq(cseq, len);
+		free(cseq);
+		PackedSeqEntry& e = entries[i];
+		memset(&e, 0, sizeof(PackedSeqEntry));
+		e.length = seq.length();
+		e.nbNRuns = seq.getNbNRuns();
+		e.nbLowerRuns = seq.getNbLowerRuns();
+		e.nbOthers = seq.getNbOthers();
+		e.basesOffset = writeAligned(out, seq.getBases(), (seq.length() + 3) / 4);
+		e.nRunsOffset = writeAligned(out, seq.getNRuns(), e.nbNRuns * sizeof(SeqRun));
+		e.lowerRunsOffset = writeAligned(out, seq.getLowerRuns(), e.nbLowerRuns * sizeof(SeqRun));
+		e.othersOffset = writeAligned(out, seq.getOthers(), e.nbOthers * sizeof(SeqOther));
+	}
+	for (uint32_t i = 0; i < header.nbSeqs; i++) {
+		const char* name = faidx_iseq(fastaIndex, i);
+		entries[i].nameLength = strlen(name);
+		entries[i].nameOffset = writeAligned(out, name, entries[i].nameLength);
+	}
+	header.fileSize = out.tellp();
+	out.seekp(0);
+	writeAligned(out, &header, sizeof(PackedGenomeHeader));
+	writeAligned(out, entries.data(), entries.size() * sizeof(PackedSeqEntry));
+	out.close();
+	if (!out) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not write packed genome file: ") + file.string()));
+	}
+}
+
 // ******** Genome mapper ********
 
 /**
@@ -48,6 +302,10 @@ using boost::lexical_cast;
 portcullis::bam::GenomeMapper::GenomeMapper(path _genomeFile) :
 	genomeFile(_genomeFile) {
 	fastaIndex = nullptr;
+	cacheEnabled = false;
+	cacheSize = 0;
+	cacheUsage = 0;
+	lastPackedIndex = -1;
 }
 
 portcullis::bam::GenomeMapper::~GenomeMapper() {
@@ -83,7 +341,32 @@ void portcullis::bam::GenomeMapper::loadFastaIndex() {
 		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
 								  "Genome index file does not exist: ") + fastaIndexFile.string()));
 	}
+	if (fastaIndex != nullptr) {
+		fai_destroy(fastaIndex);
+	}
 	fastaIndex = fai_load(genomeFile.c_str());
+	cache.clear();
+	cacheIndex.clear();
+	cacheUsage = 0;
+	// Use the packed genome if there is one and it's at least as new as the genome
+	path packedFile = getPackedGenomeFile();
+	packedGenome = nullptr;
+	lastPackedIndex = -1;
+	if (exists(packedFile) && bfs::last_write_time(packedFile) >= bfs::last_write_time(genomeFile)) {
+		packedGenome = PackedGenome::open(packedFile);
+	}
+}
+
+/**
+ * Creates a packed copy of this genome, which can be memory mapped for fast
+ * random access to the sequence
+ */
+void portcullis::bam::GenomeMapper::buildPackedGenome() {
+	if (fastaIndex == nullptr) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Genome index must be loaded before creating packed genome: ") + genomeFile.string()));
+	}
+	PackedGenome::write(fastaIndex, getPackedGenomeFile());
 }
 
 
@@ -109,6 +392,21 @@ string portcullis::bam::GenomeMapper::fetchBases(const char* reg) const {
  * @return      The sequence as a string; empty string if no seq found
  */
 string portcullis::bam::GenomeMapper::fetchBases(const char* name, int start, int end) const {
+	if (packedGenome != nullptr || cacheEnabled) {
+		PackedSeqPtr seq = getSeq(name);
+		if (seq == nullptr || seq->length() == 0) {
+			return string("");
+		}
+		// Adjust coordinates in the same way as faidx_fetch_seq
+		if (end < start) start = end;
+		if (start < 0) start = 0;
+		else if (start >= seq->length()) start = seq->length() - 1;
+		if (end < 0) end = 0;
+		else if (end >= seq->length()) end = seq->length() - 1;
+		string strseq;
+		seq->extract(start, end, strseq);
+		return strseq;
+	}
 	int len = 0;
 	char* cseq = faidx_fetch_seq(fastaIndex, name, start, end, &len);
 	string strseq = cseq == NULL ? string("") : string(cseq);
@@ -116,3 +414,59 @@ string portcullis::bam::GenomeMapper::fetchBases(const char* name, int start, in
 		free(cseq);
 	return strseq;
 }
+
+void portcullis::bam::GenomeMapper::enableCache(const uint64_t maxBytes) {
+	cacheEnabled = true;
+	cacheSize = maxBytes;
+}
+
+portcullis::bam::PackedSeqPtr portcullis::bam::GenomeMapper::getSeq(const char* name) const {
+	if (packedGenome != nullptr) {
+		// Most of the time we want the same sequence as last time
+		if (lastPackedIndex < 0 || packedGenome->getName(lastPackedIndex) != name) {
+			lastPackedIndex = packedGenome->getIndex(name);
+			if (lastPackedIndex < 0) {
+				return nullptr;
+			}
+		}
+		return packedGenome->getSeq(lastPackedIndex);
+	}
+	if (!cacheEnabled) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Reference sequence cache is not enabled for genome: ") + genomeFile.string()));
+	}
+	// Most of the time we want the same sequence as last time
+	if (!cache.empty() && cache.front().first == name) {
+		return cache.front().second;
+	}
+	auto c = cacheIndex.find(name);
+	if (c != cacheIndex.end()) {
+		cache.splice(cache.begin(), cache, c->second);
+		return cache.front().second;
+	}
+	const int seqLen = faidx_seq_len(fastaIndex, name);
+	if (seqLen < 0) {
+		return nullptr;
+	}
+	PackedSeqPtr seq = make_shared<PackedSeq>();
+	if (seqLen > 0) {
+		int len = 0;
+		char* cseq = faidx_fetch_seq(fastaIndex, name, 0, seqLen - 1, &len);
+		if (cseq == NULL || len < 0) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not load reference sequence: ") + name));
+		}
+		seq = make_shared<PackedSeq>(cseq, len);
+		free(cseq);
+	}
+	cache.push_front(pair<string, PackedSeqPtr>(string(name), seq));
+	cacheIndex[string(name)] = cache.begin();
+	cacheUsage += seq->memoryUsage();
+	// Drop least recently used sequences, but always keep the one we just loaded
+	while (cacheUsage > cacheSize && cache.size() > 1) {
+		cacheUsage -= cache.back().second->memoryUsage();
+		cacheIndex.erase(cache.back().first);
+		cache.pop_back();
+	}
+	return seq;
+}
@@ -15,6 +15,8 @@
 //  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
 //  *******************************************************************
 
+#include <algorithm>
+#include <cctype>
 #include <cstdint>
 #include <iostream>
 #include <math.h>
@@ -144,7 +146,187 @@ const vector<string> portcullis::Junction::STRAND_NAMES = {
 	"consensus-strand"
 };
 
-void portcullis::AlignmentInfo::calcMatchStats(const Intron& i, const uint32_t leftStart, const uint32_t rightEnd, const string& ancLeft, const string& ancRight) {
+portcullis::AlignmentSummary::AlignmentSummary(const BamAlignment& al) {
+	position = al.getPosition();
+	alignedLength = al.getEnd() - al.getPosition() + 1;
+	cigar = al.getCigar();
+	const bam1_t* b = al.getRaw();
+	seqLength = b->core.l_qseq;
+	const uint8_t* packed = bam_get_seq(b);
+	seq.assign(packed, packed + (seqLength + 1) / 2);
+	uint8_t* mdTag = bam_aux_get(b, "MD");
+	if (mdTag != NULL && *mdTag == 'Z') {
+		md = bam_aux2Z(mdTag);
+	}
+}
+
+/**
+ * Steps through an MD tag one reference position at a time
+ */
+class MDCursor {
+private:
+	const char* p;
+	uint32_t matchesLeft;
+
+	void readMatches() {
+		while (*p >= '0' && *p <= '9') {
+			matchesLeft = matchesLeft * 10 + (*p++ - '0');
+		}
+	}
+
+public:
+	MDCursor(const char* md) : p(md), matchesLeft(0) {
+		readMatches();
+	}
+
+	/**
+	 * Moves past the next aligned (M, = or X) reference position
+	 * @param refBase Set to the reference base if this is a mismatch, otherwise 0
+	 * @return False if the MD tag doesn't have an aligned position here
+	 */
+	bool nextAligned(char& refBase) {
+		if (matchesLeft > 0) {
+			matchesLeft--;
+			refBase = 0;
+		}
+		else if (isalpha(*p)) {
+			refBase = toupper(*p++);
+			readMatches();
+		}
+		else {
+			return false;
+		}
+		return true;
+	}
+
+	/**
+	 * Moves past a deletion of the given length
+	 * @return False if the MD tag doesn't have a deletion of this length here
+	 */
+	bool nextDeletion(const uint32_t length) {
+		if (matchesLeft > 0 || *p != '^') {
+			return false;
+		}
+		p++;
+		for (uint32_t i = 0; i < length; i++) {
+			if (!isalpha(*p++)) {
+				return false;
+			}
+		}
+		readMatches();
+		return true;
+	}
+};
+
+bool portcullis::AlignmentSummary::calcAnchorMismatches(const int32_t start, const int32_t end, const AnchorRef& ref, const bool useMD, AnchorMismatches& mismatches) const {
+	mismatches = AnchorMismatches();
+	if ((useMD && md.empty()) || cigar.empty() || start > getEnd() || end < position) {
+		return false;
+	}
+	// Soft clips are removed from the query in the same way as getQuerySeqAfterClipping
+	const int32_t deltaStart = cigar.front().type == BAM_CIGAR_SOFTCLIP_CHAR ? cigar.front().length : 0;
+	const int32_t deltaEnd = cigar.back().type == BAM_CIGAR_SOFTCLIP_CHAR ? cigar.back().length : 0;
+	const int32_t clippedLength = min(seqLength - deltaStart, seqLength - deltaStart - deltaEnd + 1);
+	const int32_t refLength = ref.seq.size();
+	// We can compare directly against the packed reference as long as there are no
+	// Ns or other odd bases to worry about
+	const bool usePacked = !useMD && ref.packed != nullptr && refLength > 0 &&
+			ref.start + refLength <= ref.packed->length() && ref.packed->isACGT(ref.start, ref.start + refLength - 1);
+	MDCursor cursor(md.c_str());
+	int32_t qPos = 0;
+	int32_t rPos = position;
+	char refBase = 0;
+	for (const auto & op : cigar) {
+		const bool consumesRef = CigarOp::opConsumesReference(op.type);
+		const bool consumesQuery = CigarOp::opConsumesQuery(op.type) && op.type != BAM_CIGAR_SOFTCLIP_CHAR;
+		const bool aligned = consumesRef && consumesQuery;
+		// Skips any cigar ops before start position, keeping the MD tag in step
+		if (rPos < start) {
+			if (useMD && aligned) {
+				for (int32_t i = 0; i < op.length; i++) {
+					if (!cursor.nextAligned(refBase)) return false;
+				}
+			}
+			else if (useMD && op.type == BAM_CIGAR_DEL_CHAR && !cursor.nextDeletion(op.length)) {
+				return false;
+			}
+			if (consumesRef) rPos += op.length;
+			if (consumesQuery) qPos += op.length;
+			continue;
+		}
+		// Stop once we get to the end of the region, and make sure we don't end on a refskip that exceeds our limit
+		if (((rPos > end && op.type != BAM_CIGAR_INS_CHAR) || (op.type == BAM_CIGAR_REFSKIP_CHAR && rPos + op.length > end))) break;
+		if (consumesQuery) {
+			// Don't go past the end of the region, unless this is an insertion
+			const int32_t len = rPos + op.length > end && op.type != BAM_CIGAR_INS_CHAR ? end - rPos + 1 : op.length;
+			if (qPos < 0 || qPos + len > clippedLength) {
+				return false;
+			}
+			if (!aligned) {
+				mismatches.addMismatches(len);
+			}
+			else if (useMD) {
+				for (int32_t i = 0; i < len; i++) {
+					if (!cursor.nextAligned(refBase)) return false;
+					mismatches.add(refBase != 0 && refBase != seq_nt16_str[bam_seqi(seq.data(), deltaStart + qPos + i)]);
+				}
+			}
+			else {
+				const int32_t refOffset = rPos - ref.start;
+				if (refOffset < 0 || refOffset + len > refLength) {
+					return false;
+				}
+				if (usePacked) {
+					// A, C, G and T are 1, 2, 4 and 8 in the 4-bit encoding
+					for (int32_t i = 0; i < len; i++) {
+						mismatches.add(bam_seqi(seq.data(), deltaStart + qPos + i) != 1 << ref.packed->getCode(rPos + i));
+					}
+				}
+				else {
+					for (int32_t i = 0; i < len; i++) {
+						mismatches.add(seq_nt16_str[bam_seqi(seq.data(), deltaStart + qPos + i)] != ref.seq[refOffset + i]);
+					}
+				}
+			}
+		}
+		else if (consumesRef) {   // i.e. consumes reference but not query (DEL or REF_SKIP ops)
+			const int32_t len = rPos + op.length > end ? end - rPos + 1 : op.length;
+			if (useMD) {
+				if (op.type == BAM_CIGAR_DEL_CHAR && !cursor.nextDeletion(op.length)) {
+					return false;
+				}
+				mismatches.addMismatches(len);
+			}
+			else {
+				const int32_t refOffset = rPos - ref.start;
+				if (refOffset < 0 || refOffset + len > refLength) {
+					return false;
+				}
+				for (int32_t i = 0; i < len; i++) {
+					mismatches.add(ref.seq[refOffset + i] != BAM_CIGAR_DIFF_CHAR);
+				}
+			}
+		}
+		if (consumesRef) rPos += op.length;
+		if (consumesQuery) qPos += op.length;
+	}
+	return true;
+}
+
+string portcullis::AlignmentSummary::getQuerySeq() const {
+	string query(seqLength, 'N');
+	for (int32_t i = 0; i < seqLength; i++) {
+		query[i] = seq_nt16_str[bam_seqi(seq.data(), i)];
+	}
+	return query;
+}
+
+string portcullis::AlignmentSummary::toString() const {
+	return string("(") + lexical_cast<string>(position) + "-" + lexical_cast<string>(getEnd()) + ")";
+}
+
+void portcullis::AlignmentInfo::calcMatchStats(const AlignmentSummary& al, const Intron& i, const uint32_t leftStart, const uint32_t rightEnd,
+		const string& ancLeft, const string& ancRight, const PackedSeq* packed) {
 
     if (leftStart > std::numeric_limits<int32_t>::max()) {
         BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
@@ -159,20 +341,15 @@ void portcullis::AlignmentInfo::calcMatchStats(const Intron& i, const uint32_t l
 
     int32_t leftEnd = i.start - 1;
 	int32_t rightStart = i.end + 1;
-	int32_t qLeftStart = (int32_t)leftStart;
-	int32_t qLeftEnd = leftEnd;
-	int32_t qRightStart = rightStart;
-	int32_t qRightEnd = (int32_t)rightEnd;
 
-    string query = ba->getQuerySeq();
-    if (query.size() <= 1) {
+    if (al.seqLength <= 1) {
         // In this case the genome and query sequences do not correspond with one another.  Most
         // likely the cause of this is that the query sequence is not present in the alignment.
         // In which case just assume everything is fine.
 		totalUpstreamMismatches = 0;
         totalDownstreamMismatches = 0;
-        upstreamMismatchPositions = vector<bool> (portcullis::Junction::AJAD_NAMES.size(), false);
-        downstreamMismatchPositions = vector<bool> (portcullis::Junction::AJAD_NAMES.size(), false);
+        upstreamMismatchPositions = 0;
+        downstreamMismatchPositions = 0;
         totalUpstreamMatches = leftEnd - leftStart + 1;
         totalDownstreamMatches = rightEnd - rightStart + 1;
         nbMismatches = totalUpstreamMismatches + totalDownstreamMismatches;
@@ -181,102 +358,50 @@ void portcullis::AlignmentInfo::calcMatchStats(const Intron& i, const uint32_t l
         minMatch = min(upstreamMatches, downstreamMatches);
         maxMatch = max(upstreamMatches, downstreamMatches);
         mmes = min(totalUpstreamMatches, totalDownstreamMatches);
+        return;
+    }
 
+    const AnchorRef leftRef(leftStart, ancLeft, packed);
+    const AnchorRef rightRef(rightStart, ancRight, packed);
+    AnchorMismatches left;
+    AnchorMismatches right;
+    // Use the MD tag if we can, otherwise compare against the reference
+    bool ok = !al.md.empty() &&
+            al.calcAnchorMismatches(leftStart, leftEnd, leftRef, true, left) &&
+            al.calcAnchorMismatches(rightStart, rightEnd, rightRef, true, right);
+    if (!ok) {
+        ok = al.calcAnchorMismatches(leftStart, leftEnd, leftRef, false, left) &&
+             al.calcAnchorMismatches(rightStart, rightEnd, rightRef, false, right);
+    }
+    if (ok && left.length > 0 && right.length > 0) {
+        setMatchStats(left, right);
     }
     else {
-        string qAnchorLeft = ba->getPaddedQuerySeq(query, leftStart, leftEnd, qLeftStart, qLeftEnd, false);
-        string qAnchorRight = ba->getPaddedQuerySeq(query, rightStart, rightEnd, qRightStart, qRightEnd, false);
-        string gAnchorLeft = ba->getPaddedGenomeSeq(ancLeft, leftStart, leftEnd, qLeftStart, qLeftEnd, false);
-        string gAnchorRight = ba->getPaddedGenomeSeq(ancRight, rightStart, rightEnd, qRightStart, qRightEnd, false);
-        bool error = false;
-        if (qAnchorLeft.size() != gAnchorLeft.size() || qAnchorLeft.empty()) {
-            error = true;
-            std::cerr << endl << "WARNING:  Skipping problematic alignment:" << endl
-                                  <<  "Left anchor region for query and genome are not the same size." << endl
-                                  << "Intron: " + i.toString() << endl
-                                  << "Junction anchor limits: " + lexical_cast<string>(leftStart) + "," + lexical_cast<string>(rightEnd) << endl
-                                  << "Genomic sequence: " + ancLeft << endl
-                                  << "Alignment coords (before soft clipping): " + ba->toString(false) << endl
-                                  << "Alignment coords (after soft clipping): " + ba->toString(true) << endl
-                                  << "Read name: " + ba->deriveName() << endl
-                                  << "Read seq (before soft clipping): " + ba->getQuerySeq() + " (" + lexical_cast<string>(ba->getQuerySeq().size()) + ")" << endl
-                                  << "Read seq (after soft clipping): " + ba->getQuerySeqAfterClipping() + " (" + lexical_cast<string>(ba->getQuerySeqAfterClipping().size()) + ")" << endl
-                                  << "Cigar: " + ba->getCigarAsString() << endl
-                                  << "Left Anchor query seq:  \n" + qAnchorLeft + " (" + lexical_cast<string>(qAnchorLeft.size()) + ")" << endl
-                                  << "Left Anchor genome seq: \n" + gAnchorLeft + " (" + lexical_cast<string>(gAnchorLeft.size()) + ")" << endl << endl;
-        }
-        if (qAnchorRight.size() != gAnchorRight.size() || qAnchorRight.empty()) {
-            error = true;
-            std::cerr << endl << "WARNING:  Skipping problematic alignment:" << endl
-                                  << "Right Anchor region for query and genome are not the same size." << endl
-                                  << "Intron: " + i.toString() << endl
-                                  << "Junction anchor limits: " + lexical_cast<string>(leftStart) + "," + lexical_cast<string>(rightEnd) << endl
-                                  << "Genomic sequence: " + ancRight << endl
-                                  << "Alignment coords (before soft clipping): " + ba->toString(false) << endl
-                                  << "Alignment coords (after soft clipping): " + ba->toString(true) << endl
-                                  << "Read name: " + ba->deriveName() << endl
-                                  << "Read seq (before soft clipping): " + ba->getQuerySeq() + " (" + lexical_cast<string>(ba->getQuerySeq().size()) + ")" << endl
-                                  << "Read seq (after soft clipping): " + ba->getQuerySeqAfterClipping() + " (" + lexical_cast<string>(ba->getQuerySeqAfterClipping().size()) + ")" << endl
-                                  << "Cigar: " + ba->getCigarAsString() << endl
-                                  << "Right Anchor query seq:  \n" + qAnchorRight + " (" + lexical_cast<string>(qAnchorRight.size()) + ")" << endl
-                                  << "Right Anchor genome seq: \n" + gAnchorRight + " (" + lexical_cast<string>(gAnchorRight.size()) + ")" << endl << endl;
-        }
-        if (!error) {
-            totalUpstreamMismatches = SeqUtils::hammingDistance(qAnchorLeft, gAnchorLeft);
-            totalDownstreamMismatches = SeqUtils::hammingDistance(qAnchorRight, gAnchorRight);
-            totalUpstreamMatches = qAnchorLeft.size() - totalUpstreamMismatches;
-            totalDownstreamMatches = qAnchorRight.size() - totalDownstreamMismatches;
-            nbMismatches = totalUpstreamMismatches + totalDownstreamMismatches;
-            upstreamMatches = getNbMatchesFromEnd(qAnchorLeft, gAnchorLeft);
-            downstreamMatches = getNbMatchesFromStart(qAnchorRight, gAnchorRight);
-            upstreamMismatchPositions = getMismatchPositionFromEnd(qAnchorLeft, gAnchorLeft);
-            downstreamMismatchPositions = getMismatchPositionFromStart(qAnchorRight, gAnchorRight);
-            minMatch = min(upstreamMatches, downstreamMatches);
-            maxMatch = max(upstreamMatches, downstreamMatches);
-            mmes = min(totalUpstreamMatches, totalDownstreamMatches);
-
-        }
+        std::cerr << endl << "WARNING:  Skipping problematic alignment:" << endl
+                          << "Could not compare " << (left.length == 0 ? "left" : "right") << " anchor region for query and genome." << endl
+                          << "Intron: " + i.toString() << endl
+                          << "Junction anchor limits: " + lexical_cast<string>(leftStart) + "," + lexical_cast<string>(rightEnd) << endl
+                          << "Genomic sequence: " + ancLeft + " / " + ancRight << endl
+                          << "Alignment coords: " + al.toString() << endl
+                          << "Read seq: " + al.getQuerySeq() + " (" + lexical_cast<string>(al.seqLength) + ")" << endl
+                          << "Cigar: " + BamAlignment::cigarToString(al.cigar) << endl << endl;
     }
 }
 
-vector<bool> portcullis::AlignmentInfo::getMismatchPositionFromStart(const string& query, const string& anchor) {
-	vector<bool> mask (query.size(), false);
-	for (size_t i = 0; i < query.size(); i++) {
-		if (query[i] != anchor[i]) {
-			mask[i] = true;
-		}
-	}
-	return mask;
-}
-
-vector<bool> portcullis::AlignmentInfo::getMismatchPositionFromEnd(const string& query, const string& anchor) {
-	vector<bool> mask (query.size(), false);
-	for (size_t j = query.size(); j > 0; j--) {
-		size_t i = j-1;
-		if (query[i] != anchor[i]) {
-			mask[query.size() - i - 1] = true;
-		}
-	}
-	return mask;
-}
-
-uint32_t portcullis::AlignmentInfo::getNbMatchesFromStart(const string& query, const string& anchor) {
-	for (size_t i = 0; i < query.size(); i++) {
-		if (query[i] != anchor[i]) {
-			return i;
-		}
-	}
-	return query.size();
-}
-
-uint32_t portcullis::AlignmentInfo::getNbMatchesFromEnd(const string& query, const string& anchor) {
-	for (size_t j = query.size(); j > 0; j--) {
-		size_t i = j-1;
-        if (query[i] != anchor[i]) {
-			return query.size() - i - 1;
-		}
-	}
-	return query.size();
+void portcullis::AlignmentInfo::setMatchStats(const AnchorMismatches& left, const AnchorMismatches& right) {
+	totalUpstreamMismatches = left.nbMismatches;
+	totalDownstreamMismatches = right.nbMismatches;
+	totalUpstreamMatches = left.getNbMatches();
+	totalDownstreamMatches = right.getNbMatches();
+	nbMismatches = totalUpstreamMismatches + totalDownstreamMismatches;
+	// Upstream is counted back from the junction, downstream forward from the junction
+	upstreamMatches = left.getNbMatchesFromEnd();
+	downstreamMatches = right.getNbMatchesFromStart();
+	upstreamMismatchPositions = left.fromEnd;
+	downstreamMismatchPositions = right.fromStart;
+	minMatch = min(upstreamMatches, downstreamMatches);
+	maxMatch = max(upstreamMatches, downstreamMatches);
+	mmes = min(totalUpstreamMatches, totalDownstreamMatches);
 }
 
 /**
@@ -439,10 +564,9 @@ portcullis::Junction::Junction(const Junction& j, bool withAlignments) {
 	nbDownstreamFlankingAlignments = j.nbDownstreamFlankingAlignments;
 	nbSamples = j.nbSamples;
 	if (withAlignments) {
-		for (size_t i = 0; i < j.alignments.size(); i++) {
-			this->alignments.push_back(make_shared<AlignmentInfo>(j.alignments[i]->ba));
-			this->alignmentCodes.push_back(j.alignments[i]->nameCode);
-		}
+		alignments = j.alignments;
+		alignmentCodes = j.alignmentCodes;
+		evidence = j.evidence;
 	}
 	trimmedCoverage.clear();
 	for (auto & x : j.trimmedCoverage) {
@@ -472,14 +596,37 @@ portcullis::Junction::~Junction() {
 
 void portcullis::Junction::clearAlignments() {
 	alignments.clear();
+	alignments.shrink_to_fit();
+	evidence.clear();
+}
+
+void portcullis::JunctionEvidence::addStart(int32_t start) {
+	// Alignments normally arrive in position order, so this is almost always a
+	// case of incrementing or appending the last entry
+	if (startCounts.empty() || start > startCounts.back().first) {
+		startCounts.push_back(std::make_pair(start, 1));
+		return;
+	}
+	if (start == startCounts.back().first) {
+		startCounts.back().second++;
+		return;
+	}
+	auto it = std::lower_bound(startCounts.begin(), startCounts.end(), std::make_pair(start, (uint32_t)0));
+	if (it != startCounts.end() && it->first == start) {
+		it->second++;
+	}
+	else {
+		startCounts.insert(it, std::make_pair(start, 1));
+	}
 }
 
 void portcullis::Junction::addJunctionAlignment(const BamAlignment& al) {
-	// Make sure we take a proper copy of this alignment for safe storage
-	AlignmentInfoPtr aip = make_shared<AlignmentInfo>(make_shared<BamAlignment>(al));
-	this->alignments.push_back(aip);
-	this->alignmentCodes.push_back(aip->nameCode);
-	this->nbAlRaw = this->alignments.size();
+	// Only keep a compact summary of this alignment.  This is all we need to
+	// calculate match statistics once the junction anchors are final.  Everything
+	// else is updated as we go.
+	this->alignments.push_back(AlignmentSummary(al));
+	this->alignmentCodes.push_back(std::hash<std::string>()(al.deriveName()));
+	this->nbAlRaw++;
 	if (al.isFirstMate()) {
 		if (!al.isReverseStrand()) {
 			this->nbAlR1Pos++;
@@ -499,6 +646,63 @@ void portcullis::Junction::addJunctionAlignment(const BamAlignment& al) {
 	if (al.getNbJunctionsInRead() > 1) {
 		this->nbAlMultiplySpliced++;
 	}
+	switch (al.getStrand()) {
+	case Strand::POSITIVE:
+		evidence.nbPosStrand++;
+		break;
+	case Strand::NEGATIVE:
+		evidence.nbNegStrand++;
+		break;
+	case Strand::UNKNOWN:
+		evidence.nbUnkStrand++;
+		break;
+	}
+	const int32_t start = al.getStart();
+	const int32_t end = al.getEnd();
+	if (start != evidence.lastStart || end != evidence.lastEnd) {
+		this->nbAlDistinct++;
+		evidence.lastStart = start;
+		evidence.lastEnd = end;
+	}
+	evidence.addStart(start);
+	const bool uniquelyMapped = al.getMapQuality() >= MAP_QUALITY_THRESHOLD;
+	if (uniquelyMapped) {
+		this->nbAlUniquelyMapped++;
+	}
+	// Get properly paired BAM flag regardless
+	if (al.isProperPair()) {
+		this->nbAlBamProperlyPaired++;
+	}
+	// We don't know the orientation yet, so record proper pairs for all orientations
+	// that support a proper pair check
+	const Orientation orientations[3] = {Orientation::FR, Orientation::RF, Orientation::FF};
+	for (const auto & o : orientations) {
+		if (al.calcIfProperPair(o)) {
+			const int index = JunctionEvidence::orientationIndex(o);
+			evidence.nbProperlyPaired[index]++;
+			if (uniquelyMapped) {
+				evidence.nbReliable[index]++;
+			}
+		}
+	}
+	uint32_t upjuncs = 0;
+	uint32_t downjuncs = 0;
+	int32_t pos = start;
+	for (const auto & op : al.getCigar()) {
+		if (CigarOp::opConsumesReference(op.type)) {
+			pos += op.length;
+		}
+		if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
+			if (pos < intron->start) {
+				upjuncs++;
+			}
+			else if (pos > intron->end + 1) {
+				downjuncs++;
+			}
+		}
+	}
+	this->nbUpstreamJunctions = max(this->nbUpstreamJunctions, upjuncs);
+	this->nbDownstreamJunctions = max(this->nbDownstreamJunctions, downjuncs);
 }
 
 portcullis::CanonicalSS portcullis::Junction::setDonorAndAcceptorMotif(string seq1, string seq2) {
@@ -529,22 +733,9 @@ void portcullis::Junction::extendAnchors(int32_t otherStart, int32_t otherEnd) {
 }
 
 void portcullis::Junction::determineStrandFromReads() {
-	uint32_t nb_pos = 0;
-	uint32_t nb_neg = 0;
-	uint32_t nb_unk = 0;
-	for (const auto & a : alignments) {
-		switch (a->ba->getStrand()) {
-		case Strand::POSITIVE:
-			nb_pos++;
-			break;
-		case Strand::NEGATIVE:
-			nb_neg++;
-			break;
-		case Strand::UNKNOWN:
-			nb_unk++;
-			break;
-		}
-	}
+	const uint32_t nb_pos = evidence.nbPosStrand;
+	const uint32_t nb_neg = evidence.nbNegStrand;
+	const uint32_t nb_unk = evidence.nbUnkStrand;
 	uint32_t total = nb_pos + nb_neg + nb_unk;
 	const double threshold = 0.95;
 	if ((double) nb_pos / (double) total >= threshold) {
@@ -639,13 +830,11 @@ void portcullis::Junction::processJunctionWindow(const GenomeMapper& genomeMappe
 	string leftAnchor10 = leftAncLen < 10 ? leftAnc : leftAnc.substr(leftAncLen - 10, 10);
 	string rightAnchor10 = rightAncLen < 10 ? rightAnc : rightAnc.substr(0, 10);
 	this->calcHammingScores(leftAnchor10, leftInt, rightInt, rightAnchor10);
-	// Update match statistics for each alignment
-	for (const auto & a : alignments) {
-		a->calcMatchStats(*getIntron(), this->getLeftAncStart(), this->getRightAncEnd(), leftAnc, rightAnc);
-		// a->calcAJadVector(*getIntron(), this->getLeftAncStart(), this->getRightAncEnd(), leftAnc, rightAnc);
-	}
-	// MaxMMES can now use info in alignments
-	this->calcMismatchStats();
+	// Now the anchors are final we can calculate match statistics for each alignment
+	// and derive MaxMMES, mismatch and junction anchor depth metrics from them.  Use
+	// the packed reference if the genome mapper has one for fast comparisons.
+	PackedSeqPtr packed = genomeMapper.hasPackedSeqs() ? genomeMapper.getSeq(intron->ref.name.c_str()) : nullptr;
+	this->calcMismatchStats(leftAnc, rightAnc, packed.get());
 }
 
 void portcullis::Junction::processJunctionVicinity(BamReader& reader, int32_t refLength, int32_t maxQueryLength) {
@@ -716,15 +905,38 @@ void portcullis::Junction::calcMetrics(Orientation orientation) {
  * @return The entropy of this junction
  */
 double portcullis::Junction::calcEntropy() {
-	vector<int32_t> junctionPositions;
-	for (const auto & a : alignments) {
-		junctionPositions.push_back(a->ba->getStart());
-	}
-	// Should already be sorted but let's be sure.  This is critical to the rest
-	// of the algorithm.  It's possible after soft clips are removed that the reads
-	// are not strictly in the correct order.
-	std::sort(junctionPositions.begin(), junctionPositions.end());
-	return calcEntropy(junctionPositions);
+	// Works directly from the counts of alignments at each start position, which
+	// are kept in position order.  Equivalent to expanding the counts into a sorted
+	// list of positions and calling calcEntropy(positions) below.
+	const vector<std::pair<int32_t, uint32_t>>& counts = evidence.startCounts;
+	uint64_t total = 0;
+	for (const auto & c : counts) {
+		total += c.second;
+	}
+	if (total <= 1)
+		return 0;
+	double sum = 0.0;
+	const double n = (double) total;
+	if (counts.size() == 1) {
+		double pI = (double) total / n;
+		sum += pI * log2(pI);
+	}
+	else {
+		// Groups are closed on the first alignment at each new offset, so the first group
+		// also takes in that alignment, with each later group taking in the first alignment
+		// of the next.  The final group is closed on the very last alignment.
+		for (size_t i = 1; i < counts.size(); i++) {
+			uint32_t readsAtOffset = i == 1 ? counts[0].second + 1 : counts[i - 1].second;
+			double pI = (double) readsAtOffset / n;
+			sum += pI * log2(pI);
+		}
+		if (counts.back().second > 1) {
+			double pI = (double) (counts.back().second - 1) / n;
+			sum += pI * log2(pI);
+		}
+	}
+	entropy = fabs(sum);
+	return entropy;
 }
 
 double portcullis::Junction::calcEntropy(const vector<int32_t> junctionPositions) {
@@ -749,67 +961,19 @@ double portcullis::Junction::calcEntropy(const vector<int32_t> junctionPositions
 }
 
 /**
- * Metrics: # Distinct Alignments, # Unique/Reliable Alignments, #mismatches
+ * Metrics: # Portcullis properly paired alignments, # Reliable Alignments.  The
+ * tallies for these are collected as alignments are added, this picks the ones
+ * relevant to the given orientation.
  * @return
  */
 void portcullis::Junction::calcAlignmentStats(Orientation orientation) {
-	int32_t lastStart = -1, lastEnd = -1;
-	nbAlDistinct = 0;
-	nbAlReliable = 0;
-	nbUpstreamJunctions = 0;
-	nbDownstreamJunctions = 0;
-	const bool properPairedCheck = doProperPairCheck(orientation);
-	//cout << junctionAlignments.size() << endl;
-	for (const auto & a : alignments) {
-		BamAlignmentPtr ba = a->ba;
-		const int32_t start = ba->getStart();
-		const int32_t end = ba->getEnd();
-		if (start != lastStart || end != lastEnd) {
-			nbAlDistinct++;
-			lastStart = start;
-			lastEnd = end;
-		}
-		bool reliable = true;
-		if (ba->getMapQuality() >= MAP_QUALITY_THRESHOLD) {
-			nbAlUniquelyMapped++;
-		}
-		else {
-			reliable = false;
-		}
-		// Get properly paired BAM flag regardless
-		if (ba->isProperPair()) {
-			nbAlBamProperlyPaired++;
-		}
-		if (properPairedCheck) {
-			bool pp = ba->calcIfProperPair(orientation);
-			if (pp) {
-				nbAlPortcullisProperlyPaired++;
-			}
-			else {
-				reliable = false;
-			}
-		}
-		if (reliable) {
-			nbAlReliable++;
-		}
-		uint32_t upjuncs = 0;
-		uint32_t downjuncs = 0;
-		int32_t pos = start;
-		for (CigarOp op : ba->getCigar()) {
-			if (CigarOp::opConsumesReference(op.type)) {
-				pos += op.length;
-			}
-			if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
-				if (pos < intron->start) {
-					upjuncs++;
-				}
-				else if (pos > intron->end + 1) {
-					downjuncs++;
-				}
-			}
-		}
-		nbUpstreamJunctions = max(nbUpstreamJunctions, upjuncs);
-		nbDownstreamJunctions = max(nbDownstreamJunctions, downjuncs);
+	if (doProperPairCheck(orientation)) {
+		const int index = JunctionEvidence::orientationIndex(orientation);
+		nbAlPortcullisProperlyPaired = evidence.nbProperlyPaired[index];
+		nbAlReliable = evidence.nbReliable[index];
+	}
+	else {
+		nbAlReliable = nbAlUniquelyMapped;
 	}
 }
 
@@ -859,26 +1023,31 @@ void portcullis::Junction::calcHammingScores(const string& leftAnchor, const str
 /**
  * Calculates MaxMMES, mismatches, and junction overhangs.
  */
-void portcullis::Junction::calcMismatchStats() {
+void portcullis::Junction::calcMismatchStats(const string& leftAnc, const string& rightAnc, const PackedSeq* packed) {
 	uint32_t nbMismatches = 0;
 	uint32_t firstMismatch = 100000000;
-	for (const auto & a : alignments) {
+	uint32_t maxMinMatch = 0;
+	for (const auto & al : alignments) {
+		AlignmentInfo a;
+		a.calcMatchStats(al, *intron, leftAncStart, rightAncEnd, leftAnc, rightAnc, packed);
 		// Update maxMMES for this alignment
-		maxMMES = max(maxMMES, a->mmes);
+		maxMMES = max(maxMMES, a.mmes);
 		// Update total number of mismatches in this junction
-		nbMismatches += a->nbMismatches;
+		nbMismatches += a.nbMismatches;
 		// Keep a record of the first mismatch detected
-		if (a->minMatch > 0) {
-			firstMismatch = min(firstMismatch, a->minMatch);
+		if (a.minMatch > 0) {
+			firstMismatch = min(firstMismatch, a.minMatch);
 		}
+		maxMinMatch = max(maxMinMatch, a.minMatch);
 		// Update junction overhang vector
-		for (uint16_t i = 0; i < JAD_NAMES.size() && i < a->minMatch; i++) {
+		for (uint16_t i = 0; i < JAD_NAMES.size() && i < a.minMatch; i++) {
 			junctionAnchorDepth[i]++;
 		}
 
 		uint32_t prev_mismatches = 0;
 		for (uint16_t i = 0; i < AJAD_NAMES.size(); i++) {
-			bool is_mismatch = a->upstreamMismatchPositions[i] || a->downstreamMismatchPositions[i];
+			bool is_mismatch = i < MAX_MISMATCH_POSITIONS &&
+							   (((a.upstreamMismatchPositions | a.downstreamMismatchPositions) >> i) & 1);
 			if (is_mismatch) {
 				prev_mismatches++;
 			}
@@ -894,17 +1063,8 @@ void portcullis::Junction::calcMismatchStats() {
 	// Assuming we have some mismatches determine if this junction has no overhangs
 	// extending beyond first mismatch.  If so determine if that distance is small
 	// enough to consider the junction as suspicious
-	if (nbMismatches > 0 && firstMismatch < 20) {
-		bool found = false;
-		for (const auto & a : alignments) {
-			if (a->minMatch > firstMismatch) {
-				found = true;
-				break;
-			}
-		}
-		if (!found) {
-			suspicious = true;
-		}
+	if (nbMismatches > 0 && firstMismatch < 20 && maxMinMatch <= firstMismatch) {
+		suspicious = true;
 	}
 }
 
@@ -933,13 +1093,12 @@ double portcullis::Junction::calcCoverage(int32_t a, int32_t b, const vector<uin
 }
 
 double portcullis::Junction::calcCoverage(const vector<uint32_t>& coverageLevels) {
-	const uint32_t REGION_LENGTH = 10;
-	int32_t donorStart = intron->start - 2 * REGION_LENGTH;
-	int32_t donorMid = intron->start - REGION_LENGTH;
+	int32_t donorStart = intron->start - 2 * COVERAGE_REGION_LENGTH;
+	int32_t donorMid = intron->start - COVERAGE_REGION_LENGTH;
 	int32_t donorEnd = intron->start;
 	int32_t acceptorStart = intron->end;
-	int32_t acceptorMid = intron->end + REGION_LENGTH;
-	int32_t acceptorEnd = intron->end + 2 * REGION_LENGTH;
+	int32_t acceptorMid = intron->end + COVERAGE_REGION_LENGTH;
+	int32_t acceptorEnd = intron->end + 2 * COVERAGE_REGION_LENGTH;
 	double donorCoverage =
 		calcCoverage(donorStart, donorMid - 1, coverageLevels) -
 		calcCoverage(donorMid, donorEnd, coverageLevels);
@@ -950,8 +1109,37 @@ double portcullis::Junction::calcCoverage(const vector<uint32_t>& coverageLevels
 	return coverage;
 }
 
+// Coverage levels from the pileup are indexed by 1-based position, so level i
+// holds the depth of the 0-based position i - 1.  The windows are shifted to
+// match, so that the metric is unchanged.
+void portcullis::Junction::addCoverageWindows(WindowCoverage& cov) const {
+	cov.addWindow(intron->start - 2 * COVERAGE_REGION_LENGTH - 1, intron->start);
+	cov.addWindow(intron->end - 1, intron->end + 2 * COVERAGE_REGION_LENGTH);
+}
+
+double portcullis::Junction::calcCoverage(const WindowCoverage& cov) {
+	const int32_t refLength = intron->ref.length;
+	auto calc = [&](int32_t a, int32_t b) {
+		// Same bounds as for the full coverage levels
+		const int32_t first = std::max(a, 0);
+		const int32_t last = std::min(b, refLength - 1);
+		const uint32_t readCount = first <= last ? (uint32_t)cov.sumDepths(first - 1, last - 1) : 0;
+		return (1.0 / (b - a)) * (double) readCount;
+	};
+	int32_t donorStart = intron->start - 2 * COVERAGE_REGION_LENGTH;
+	int32_t donorMid = intron->start - COVERAGE_REGION_LENGTH;
+	int32_t donorEnd = intron->start;
+	int32_t acceptorStart = intron->end;
+	int32_t acceptorMid = intron->end + COVERAGE_REGION_LENGTH;
+	int32_t acceptorEnd = intron->end + 2 * COVERAGE_REGION_LENGTH;
+	double donorCoverage = calc(donorStart, donorMid - 1) - calc(donorMid, donorEnd);
+	double acceptorCoverage = calc(acceptorMid, acceptorEnd) - calc(acceptorStart, acceptorMid - 1);
+	coverage = donorCoverage + acceptorCoverage;
+	return coverage;
+}
+
 double portcullis::Junction::calcIntronScore(const uint32_t threshold) {
-	this->setIntronScore((uint32_t)this->intron->size() <= threshold ? 0.0 : log(this->intron->size() - threshold));
+	this->setIntronScore(calcIntronScore((uint32_t)this->intron->size(), threshold));
 	return this->intronScore;
 }
 
@@ -1326,47 +1514,54 @@ shared_ptr<portcullis::Junction> portcullis::Junction::parse(const string& line)
 }
 
 double portcullis::Junction::calcCodingPotential(GenomeMapper& gmap, KmerMarkovModel& exon, KmerMarkovModel& intron) {
-	const char* ref = this->intron->ref.name.c_str();
-	const bool neg = getConsensusStrand() == Strand::NEGATIVE;
-	string left_exon = gmap.fetchBases(ref, this->intron->start - 82, this->intron->start - 2);
+	this->codingPotential = calcCodingPotential(gmap, exon, intron, this->intron->ref.name.c_str(),
+			this->intron->start, this->intron->end, getConsensusStrand() == Strand::NEGATIVE);
+	return this->codingPotential;
+}
+
+double portcullis::Junction::calcCodingPotential(GenomeMapper& gmap, KmerMarkovModel& exon, KmerMarkovModel& intron,
+		const char* ref, const int32_t start, const int32_t end, const bool neg) {
+	string left_exon = gmap.fetchBases(ref, start - 82, start - 2);
 	if (neg) {
 		left_exon = SeqUtils::reverseComplement(left_exon);
 	}
-	string left_intron = gmap.fetchBases(ref, this->intron->start, this->intron->start + 80);
+	string left_intron = gmap.fetchBases(ref, start, start + 80);
 	if (neg) {
 		left_intron = SeqUtils::reverseComplement(left_intron);
 	}
-	string right_intron = gmap.fetchBases(ref, this->intron->end - 80, this->intron->end);
+	string right_intron = gmap.fetchBases(ref, end - 80, end);
 	if (neg) {
 		right_intron = SeqUtils::reverseComplement(right_intron);
 	}
-	string right_exon = gmap.fetchBases(ref, this->intron->end + 1, this->intron->end + 81);
+	string right_exon = gmap.fetchBases(ref, end + 1, end + 81);
 	if (neg) {
 		right_exon = SeqUtils::reverseComplement(right_exon);
 	}
-	/*
-	cout << "Left exon   : " << this->consensusStrand << " : " << left_exon << endl;
-	cout << "Left intron : " << this->consensusStrand << " : " << left_intron << endl;
-	cout << "Right intron: " << this->consensusStrand << " : " << right_intron << endl;
-	cout << "Right exon  : " << this->consensusStrand << " : " << right_exon << endl;
-	 */
-	this->codingPotential = (exon.getScore(left_exon) - intron.getScore(left_exon))
-							+ (intron.getScore(left_intron) - exon.getScore(left_intron))
-							+ (intron.getScore(right_intron) - exon.getScore(right_intron))
-							+ (exon.getScore(right_exon) - intron.getScore(right_exon));
-	return this->codingPotential;
+	return (exon.getScore(left_exon) - intron.getScore(left_exon))
+		   + (intron.getScore(left_intron) - exon.getScore(left_intron))
+		   + (intron.getScore(right_intron) - exon.getScore(right_intron))
+		   + (exon.getScore(right_exon) - intron.getScore(right_exon));
 }
 
 portcullis::SplicingScores portcullis::Junction::calcSplicingScores(GenomeMapper& gmap, KmerMarkovModel& donorT, KmerMarkovModel& donorF,
 		KmerMarkovModel& acceptorT, KmerMarkovModel& acceptorF,
 		PosMarkovModel& donorP, PosMarkovModel& acceptorP) {
-	const char* ref = this->intron->ref.name.c_str();
-	const bool neg = getConsensusStrand() == Strand::NEGATIVE;
-	string left = gmap.fetchBases(ref, intron->start - 3, intron->start + 20);
+	SplicingScores ss = calcSplicingScores(gmap, donorT, donorF, acceptorT, acceptorF, donorP, acceptorP,
+			this->intron->ref.name.c_str(), intron->start, intron->end, getConsensusStrand() == Strand::NEGATIVE);
+	this->setPositionWeightScore(ss.positionWeighting);
+	this->setSplicingSignal(ss.splicingSignal);
+	return ss;
+}
+
+portcullis::SplicingScores portcullis::Junction::calcSplicingScores(GenomeMapper& gmap, KmerMarkovModel& donorT, KmerMarkovModel& donorF,
+		KmerMarkovModel& acceptorT, KmerMarkovModel& acceptorF,
+		PosMarkovModel& donorP, PosMarkovModel& acceptorP,
+		const char* ref, const int32_t start, const int32_t end, const bool neg) {
+	string left = gmap.fetchBases(ref, start - 3, start + 20);
 	if (neg) {
 		left = SeqUtils::reverseComplement(left);
 	}
-	string right = gmap.fetchBases(ref, intron->end - 20, intron->end + 2);
+	string right = gmap.fetchBases(ref, end - 20, end + 2);
 	if (neg) {
 		right = SeqUtils::reverseComplement(right);
 	}
@@ -1376,16 +1571,14 @@ portcullis::SplicingScores portcullis::Junction::calcSplicingScores(GenomeMapper
 	ss.positionWeighting = donorP.getScore(donorseq) + acceptorP.getScore(acceptorseq);
 	ss.splicingSignal = (donorT.getScore(donorseq) - donorF.getScore(donorseq))
 						+ (acceptorT.getScore(acceptorseq) - acceptorF.getScore(acceptorseq));
-	this->setPositionWeightScore(ss.positionWeighting);
-	this->setSplicingSignal(ss.splicingSignal);
 	return ss;
 }
 
-double portcullis::Junction::calcJunctionAnchorDepthLogDeviation(size_t i) const {
-	double Ni = junctionAnchorDepth[i]; // Actual count at this position
+double portcullis::Junction::calcJunctionAnchorDepthLogDeviation(const uint32_t depth, const size_t i, const double meanReadLength, const uint32_t nbAlRaw) {
+	double Ni = depth; // Actual count at this position
 	if (Ni == 0.0) Ni = 0.000000000001; // Ensure some value > 0 here otherwise we get -infinity later.
-	double Pi = 1.0 - ((double) i / (double) (this->meanReadLength / 2.0)); // Likely scale at this position
-	double Ei = (double) this->getNbSplicedAlignments() * Pi; // Expected count at this position
+	double Pi = 1.0 - ((double) i / (double) (meanReadLength / 2.0)); // Likely scale at this position
+	double Ei = (double) nbAlRaw * Pi; // Expected count at this position
 	double Xi = log2(Ni / Ei);
 	return Xi;
 }
@@ -0,0 +1,226 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+
+#include <portcullis/junction_file.hpp>
+
+namespace portcullis {
+
+/**
+ * Writes the data followed by enough padding to keep the next section 8 byte
+ * aligned
+ * @return Offset of the data in the file
+ */
+static uint64_t writeAligned(std::ofstream& out, const void* data, const size_t bytes) {
+	const uint64_t offset = out.tellp();
+	out.write((const char*)data, bytes);
+	const char padding[8] = {0};
+	out.write(padding, (8 - bytes % 8) % 8);
+	return offset;
+}
+
+}
+
+struct portcullis::JunctionFile::ColumnWriter {
+	std::ofstream& out;
+	vector<JunctionFileColumn> columns;
+
+	template<typename T>
+	void operator()(const char* name, const vector<T>& column) {
+		JunctionFileColumn c;
+		memset(&c, 0, sizeof(JunctionFileColumn));
+		strncpy(c.name, name, sizeof(c.name) - 1);
+		c.type = JunctionColumnTraits<T>::type;
+		c.width = sizeof(T);
+		c.offset = writeAligned(out, column.data(), column.size() * sizeof(T));
+		columns.push_back(c);
+	}
+};
+
+struct portcullis::JunctionFile::ColumnReader {
+	const JunctionFile& file;
+	const vector<string>* names;    // nullptr to read all columns
+	size_t first;
+
+	template<typename T>
+	void operator()(const char* name, vector<T>& column) {
+		if (names != nullptr && strcmp(name, "ref") != 0 && std::find(names->begin(), names->end(), name) == names->end()) {
+			return;
+		}
+		if (file.findColumn(name) == nullptr || file.getNbRows() == 0) {
+			return;
+		}
+		memcpy(&column[first], file.getColumn<T>(name), file.getNbRows() * sizeof(T));
+	}
+};
+
+portcullis::JunctionFile::JunctionFile(const path& _file) : file(_file) {
+	int fd = ::open(file.c_str(), O_RDONLY);
+	if (fd < 0) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Could not open binary junction file: ") + file.string()));
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(JunctionFileHeader)) {
+		::close(fd);
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Invalid binary junction file: ") + file.string()));
+	}
+	size = st.st_size;
+	data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Could not memory map binary junction file: ") + file.string()));
+	}
+	header = (const JunctionFileHeader*)base();
+	if (memcmp(header->magic, JUNCTION_FILE_MAGIC, sizeof(JUNCTION_FILE_MAGIC)) != 0 ||
+			header->version != JUNCTION_FILE_VERSION ||
+			header->fileSize != size ||
+			header->columnsOffset + header->nbColumns * sizeof(JunctionFileColumn) > size ||
+			header->refsOffset + header->nbRefs * sizeof(JunctionFileRef) > size ||
+			header->namesOffset > size) {
+		munmap(data, size);
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Invalid or unsupported binary junction file: ") + file.string()));
+	}
+	columns = (const JunctionFileColumn*)(base() + header->columnsOffset);
+	refs = (const JunctionFileRef*)(base() + header->refsOffset);
+}
+
+portcullis::JunctionFile::~JunctionFile() {
+	munmap(data, size);
+}
+
+const portcullis::JunctionFileColumn* portcullis::JunctionFile::findColumn(const string& name) const {
+	for (uint32_t i = 0; i < header->nbColumns; i++) {
+		if (strncmp(columns[i].name, name.c_str(), sizeof(columns[i].name)) == 0) {
+			return &columns[i];
+		}
+	}
+	return nullptr;
+}
+
+const void* portcullis::JunctionFile::getColumn(const string& name, const JunctionColumnType type, const size_t width) const {
+	const JunctionFileColumn* c = findColumn(name);
+	if (c == nullptr) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Binary junction file has no column named ") + name + ": " + file.string()));
+	}
+	if (c->type != type || c->width != width || c->offset + c->width * header->nbRows > size) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Unexpected type for column ") + name + " in binary junction file: " + file.string()));
+	}
+	return base() + c->offset;
+}
+
+void portcullis::JunctionFile::read(JunctionTable& table) const {
+	readColumns(table, nullptr);
+}
+
+void portcullis::JunctionFile::read(JunctionTable& table, const vector<string>& columns) const {
+	readColumns(table, &columns);
+}
+
+void portcullis::JunctionFile::readColumns(JunctionTable& table, const vector<string>* columns) const {
+	// Without target sequences the junctions can't be placed
+	if (findColumn("ref") == nullptr) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Invalid binary junction file, no ref column: ") + file.string()));
+	}
+	ColumnReader reader = {*this, columns, table.size()};
+	// Make room for the new rows, then copy the columns straight in
+	table.resize(table.size() + getNbRows());
+	try {
+		JunctionTable::forEachColumn(table, reader);
+		// Target sequence positions in this file may differ from those in the table
+		for (size_t i = reader.first; i < table.size(); i++) {
+			const uint32_t r = table.ref[i];
+			if (r >= header->nbRefs ||
+					(uint64_t)refs[r].nameOffset + refs[r].nameLength > size - header->namesOffset) {
+				BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+										  "Invalid target sequence in binary junction file: ") + file.string()));
+			}
+			table.ref[i] = table.addRef(refs[r].index, base() + header->namesOffset + refs[r].nameOffset, refs[r].nameLength, refs[r].length);
+		}
+	}
+	catch (...) {
+		// Don't leave partial rows behind
+		table.resize(reader.first);
+		throw;
+	}
+}
+
+void portcullis::JunctionFile::write(const JunctionTable& table, const path& file) {
+	std::ofstream out(file.c_str(), std::ios::binary);
+	if (!out) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Could not open binary junction file for writing: ") + file.string()));
+	}
+	JunctionFileHeader h;
+	memset(&h, 0, sizeof(JunctionFileHeader));
+	memcpy(h.magic, JUNCTION_FILE_MAGIC, sizeof(JUNCTION_FILE_MAGIC));
+	h.version = JUNCTION_FILE_VERSION;
+	h.nbRows = table.size();
+	h.nbRefs = table.refs.size();
+	writeAligned(out, &h, sizeof(JunctionFileHeader));
+	ColumnWriter writer = {out, vector<JunctionFileColumn>()};
+	JunctionTable::forEachColumn(table, writer);
+	h.nbColumns = writer.columns.size();
+	h.columnsOffset = writeAligned(out, writer.columns.data(), writer.columns.size() * sizeof(JunctionFileColumn));
+	vector<JunctionFileRef> refs;
+	string names;
+	for (const auto& r : table.refs) {
+		JunctionFileRef ref;
+		ref.index = r.index;
+		ref.length = r.length;
+		ref.nameOffset = names.size();
+		ref.nameLength = r.name.size();
+		refs.push_back(ref);
+		names += r.name;
+	}
+	h.refsOffset = writeAligned(out, refs.data(), refs.size() * sizeof(JunctionFileRef));
+	h.namesOffset = writeAligned(out, names.data(), names.size());
+	h.fileSize = out.tellp();
+	out.seekp(0);
+	out.write((const char*)&h, sizeof(JunctionFileHeader));
+	out.close();
+	if (!out) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Could not write binary junction file: ") + file.string()));
+	}
+}
+
+bool portcullis::JunctionFile::isJunctionFile(const path& file) {
+	std::ifstream in(file.c_str(), std::ios::binary);
+	char magic[sizeof(JUNCTION_FILE_MAGIC)];
+	return in.read(magic, sizeof(magic)) && memcmp(magic, JUNCTION_FILE_MAGIC, sizeof(magic)) == 0;
+}
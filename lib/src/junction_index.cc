@@ -0,0 +1,227 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem.hpp>
+
+#include <portcullis/junction_index.hpp>
+
+namespace portcullis {
+
+// Columns holding the target sequence and intron in each format, as tabix
+// configurations.  Both use UCSC style 0-based start positions.
+static const tbx_conf_t TAB_INDEX_CONF = {TBX_UCSC, 3, 5, 6, '#', 1};
+static const tbx_conf_t BED_INDEX_CONF = {TBX_UCSC, 1, 7, 8, '#', 1};
+
+static inline bool sameColumns(const tbx_conf_t& a, const tbx_conf_t& b) {
+	return a.sc == b.sc && a.bc == b.bc && a.ec == b.ec;
+}
+
+/**
+ * Reads a line from an indexed junction file, as tbx_readrec, but with the end
+ * position exclusive for junction tab files as well as BED files
+ */
+static int readJunctionRecord(BGZF* fp, void* tbxv, void* sv, int* tid, int* beg, int* end) {
+	const int ret = tbx_readrec(fp, tbxv, sv, tid, beg, end);
+	if (ret >= 0 && sameColumns(((tbx_t*)tbxv)->conf, TAB_INDEX_CONF)) {
+		(*end)++;
+	}
+	return ret;
+}
+
+}
+
+portcullis::IndexedJunctionWriter::IndexedJunctionWriter(const path& _file, const IndexedJunctionFormat _format) :
+	file(_file), format(_format), idx(nullptr), nbHeaderLines(0) {
+	fp = bgzf_open(file.c_str(), "w");
+	if (fp == nullptr) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Could not open file for writing: ") + file.string()));
+	}
+}
+
+portcullis::IndexedJunctionWriter::~IndexedJunctionWriter() {
+	if (idx != nullptr) {
+		hts_idx_destroy(idx);
+	}
+	if (fp != nullptr) {
+		bgzf_close(fp);
+	}
+}
+
+void portcullis::IndexedJunctionWriter::startIndex() {
+	// TBI format, with the same bin sizes as tabix
+	idx = hts_idx_init(0, HTS_FMT_TBI, bgzf_tell(fp), 14, 5);
+	if (idx == nullptr) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Could not create index for: ") + file.string()));
+	}
+}
+
+void portcullis::IndexedJunctionWriter::writeHeader(const char* line, const size_t length) {
+	if (idx != nullptr) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Header lines must be written before any junctions: ") + file.string()));
+	}
+	if (bgzf_write(fp, line, length) < 0) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Error writing to: ") + file.string()));
+	}
+	nbHeaderLines++;
+}
+
+void portcullis::IndexedJunctionWriter::writeLine(const char* line, const size_t length, const string& ref, const int32_t start, const int32_t end) {
+	if (idx == nullptr) {
+		startIndex();
+	}
+	if (refs.empty() || refs.back() != ref) {
+		if (std::find(refs.begin(), refs.end(), ref) != refs.end()) {
+			BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+									  "Junctions must be sorted by location to be indexed, found ") + ref + " again after other target sequences in: " + file.string()));
+		}
+		refs.push_back(ref);
+	}
+	if (bgzf_write(fp, line, length) < 0) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Error writing to: ") + file.string()));
+	}
+	// The index holds half open intervals, and the offset of the end of each line
+	if (hts_idx_push(idx, refs.size() - 1, start, end + 1, bgzf_tell(fp), 1) < 0) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Junctions must be sorted by location to be indexed: ") + file.string()));
+	}
+}
+
+void portcullis::IndexedJunctionWriter::close() {
+	if (idx == nullptr) {
+		startIndex();
+	}
+	hts_idx_finish(idx, bgzf_tell(fp));
+	// Describe the columns and list the target sequences, as tabix does
+	tbx_conf_t conf = format == IndexedJunctionFormat::TAB ? TAB_INDEX_CONF : BED_INDEX_CONF;
+	conf.line_skip = nbHeaderLines;
+	string names;
+	for (const auto& r : refs) {
+		names.append(r.c_str(), r.size() + 1);
+	}
+	const int32_t fields[7] = {conf.preset, conf.sc, conf.bc, conf.ec, conf.meta_char, conf.line_skip, (int32_t)names.size()};
+	vector<uint8_t> meta(sizeof(fields) + names.size());
+	memcpy(meta.data(), fields, sizeof(fields));
+	memcpy(meta.data() + sizeof(fields), names.data(), names.size());
+	hts_idx_set_meta(idx, meta.size(), meta.data(), 1);
+	const int closed = bgzf_close(fp);
+	fp = nullptr;
+	const int saved = closed == 0 ? hts_idx_save(idx, file.c_str(), HTS_FMT_TBI) : -1;
+	hts_idx_destroy(idx);
+	idx = nullptr;
+	if (closed != 0) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Error writing to: ") + file.string()));
+	}
+	if (saved != 0) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Could not save index: ") + indexFile(file).string()));
+	}
+}
+
+
+portcullis::IndexedJunctionReader::IndexedJunctionReader(const path& _file) : file(_file) {
+	if (!isIndexed(file)) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Not a BGZF compressed file with an index: ") + file.string()));
+	}
+	tbx = tbx_index_load(file.c_str());
+	if (tbx == nullptr) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Could not load index: ") + IndexedJunctionWriter::indexFile(file).string()));
+	}
+	if (sameColumns(tbx->conf, TAB_INDEX_CONF)) {
+		format = IndexedJunctionFormat::TAB;
+	}
+	else if (sameColumns(tbx->conf, BED_INDEX_CONF)) {
+		format = IndexedJunctionFormat::BED;
+	}
+	else {
+		tbx_destroy(tbx);
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Index does not describe a junction tab or BED file: ") + IndexedJunctionWriter::indexFile(file).string()));
+	}
+	fp = bgzf_open(file.c_str(), "r");
+	if (fp == nullptr) {
+		tbx_destroy(tbx);
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Could not open file: ") + file.string()));
+	}
+	// Header lines are only ever at the start of the file, so read them now
+	kstring_t line = {0, 0, nullptr};
+	for (int32_t i = 0; i < tbx->conf.line_skip && bgzf_getline(fp, '\n', &line) >= 0; i++) {
+		header.push_back(string(line.s, line.l));
+	}
+	free(line.s);
+}
+
+portcullis::IndexedJunctionReader::~IndexedJunctionReader() {
+	bgzf_close(fp);
+	tbx_destroy(tbx);
+}
+
+vector<string> portcullis::IndexedJunctionReader::getRefs() const {
+	int n = 0;
+	const char** names = tbx_seqnames(tbx, &n);
+	vector<string> refs(names, names + n);
+	free(names);
+	return refs;
+}
+
+size_t portcullis::IndexedJunctionReader::query(const string& region, vector<string>& lines) {
+	int beg, end;
+	if (hts_parse_reg(region.c_str(), &beg, &end) == nullptr && tbx_name2id(tbx, region.c_str()) < 0) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Invalid region: ") + region));
+	}
+	// No iterator means there are no junctions on the target sequence
+	hts_itr_t* itr = hts_itr_querys(tbx->idx, region.c_str(), (hts_name2id_f)tbx_name2id, tbx, hts_itr_query, readJunctionRecord);
+	if (itr == nullptr) {
+		return 0;
+	}
+	const size_t first = lines.size();
+	kstring_t line = {0, 0, nullptr};
+	int ret;
+	while ((ret = hts_itr_next(fp, itr, &line, tbx)) >= 0) {
+		lines.push_back(string(line.s, line.l));
+	}
+	free(line.s);
+	hts_itr_destroy(itr);
+	if (ret < -1) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Error reading: ") + file.string()));
+	}
+	return lines.size() - first;
+}
+
+bool portcullis::IndexedJunctionReader::isIndexed(const path& file) {
+	return boost::filesystem::exists(file) && boost::filesystem::exists(IndexedJunctionWriter::indexFile(file)) &&
+		   bgzf_is_bgzf(file.c_str()) == 1;
+}
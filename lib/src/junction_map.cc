@@ -0,0 +1,91 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <utility>
+#include <vector>
+using std::vector;
+
+#include <portcullis/junction_map.hpp>
+
+namespace portcullis {
+
+/**
+ * Gets a byte of a key, counting from the least significant byte of the low
+ * half.  Only the bottom 4 bytes of the low half are used.
+ */
+static inline uint8_t keyByte(const IntronKey& key, const size_t byte) {
+	return byte < 4 ? (uint8_t)(key.low >> (byte * 8)) : (uint8_t)(key.high >> ((byte - 4) * 8));
+}
+
+}
+
+const JunctionPtr& portcullis::JunctionMap::find(const IntronKey& key) const {
+	static const JunctionPtr none;
+	if (slots.empty()) {
+		return none;
+	}
+	return slots[findSlot(key)].junction;
+}
+
+void portcullis::JunctionMap::set(const IntronKey& key, const JunctionPtr& junction) {
+	if ((count + 1) * 2 > slots.size()) {
+		grow();
+	}
+	Slot& slot = slots[findSlot(key)];
+	if (slot.junction == nullptr) {
+		slot.key = key;
+		count++;
+	}
+	slot.junction = junction;
+}
+
+void portcullis::JunctionMap::grow() {
+	vector<Slot> old;
+	old.swap(slots);
+	slots.resize(old.empty() ? 16 : old.size() * 2);
+	for (auto& s : old) {
+		if (s.junction != nullptr) {
+			Slot& slot = slots[findSlot(s.key)];
+			slot.key = s.key;
+			slot.junction = std::move(s.junction);
+		}
+	}
+}
+
+void portcullis::radixSort(vector<KeyedIndex>& items) {
+	vector<KeyedIndex> buffer(items.size());
+	for (size_t byte = 0; byte < 12; byte++) {
+		size_t counts[256] = {0};
+		for (const auto& item : items) {
+			counts[keyByte(item.key, byte)]++;
+		}
+		// Nothing to do if every key has the same value for this byte
+		if (items.empty() || counts[keyByte(items[0].key, byte)] == items.size()) {
+			continue;
+		}
+		size_t offset = 0;
+		for (size_t i = 0; i < 256; i++) {
+			const size_t c = counts[i];
+			counts[i] = offset;
+			offset += c;
+		}
+		for (const auto& item : items) {
+			buffer[counts[keyByte(item.key, byte)]++] = item;
+		}
+		items.swap(buffer);
+	}
+}
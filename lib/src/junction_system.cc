@@ -15,9 +15,14 @@
 //  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
 //  *******************************************************************
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <queue>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
@@ -26,6 +31,7 @@ using std::cout;
 using std::endl;
 using std::ifstream;
 using std::ofstream;
+using std::thread;
 using std::shared_ptr;
 using std::unordered_set;
 
@@ -38,15 +44,19 @@ using boost::lexical_cast;
 using boost::timer::auto_cpu_timer;
 namespace bfs = boost::filesystem;
 
-#include <portcullis/bam/depth_parser.hpp>
-using portcullis::bam::DepthParser;
+#include <portcullis/bam/window_coverage.hpp>
+using portcullis::bam::WindowCoverage;
 
 #include <portcullis/intron.hpp>
 #include <portcullis/junction.hpp>
+#include <portcullis/junction_file.hpp>
+#include <portcullis/junction_writer.hpp>
 #include <portcullis/seq_utils.hpp>
 using portcullis::Intron;
 using portcullis::IntronHasher;
 using portcullis::Junction;
+using portcullis::JunctionFile;
+using portcullis::JunctionWriter;
 using portcullis::JunctionPtr;
 using portcullis::SeqUtils;
 
@@ -69,8 +79,49 @@ size_t portcullis::JunctionSystem::createJunctionGroup(size_t index, vector<Junc
 	return foundMore ? index : junctionList.size() - 1;
 }
 
-void portcullis::JunctionSystem::findJunctions(const int32_t refId, JunctionList& subset) {
+void portcullis::JunctionSystem::clearRefIndex() {
+	refOffsets.assign(1, 0);
+	refsGrouped = true;
+}
+
+void portcullis::JunctionSystem::indexJunction(const JunctionPtr& j) {
+	if (!refsGrouped) {
+		return;
+	}
+	const int32_t refId = j->getIntron()->ref.index;
+	// The last target sequence in the index so far
+	const int64_t lastRef = (int64_t)refOffsets.size() - 2;
+	if (refId < lastRef || refId < 0) {
+		// Out of order, so we'll need to sort before the index can be used again
+		refsGrouped = false;
+		refOffsets.clear();
+		return;
+	}
+	// Add empty ranges for any target sequences in between
+	while ((int64_t)refOffsets.size() < (int64_t)refId + 2) {
+		refOffsets.push_back(refOffsets.back());
+	}
+	refOffsets.back()++;
+}
+
+std::pair<size_t, size_t> portcullis::JunctionSystem::getRefRange(const int32_t refId) const {
+	if (!refsGrouped) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Junctions must be sorted before looking up junctions by target sequence")));
+	}
+	if (refId < 0 || (size_t)refId + 1 >= refOffsets.size()) {
+		return std::pair<size_t, size_t>(junctionList.size(), junctionList.size());
+	}
+	return std::pair<size_t, size_t>(refOffsets[refId], refOffsets[refId + 1]);
+}
+
+void portcullis::JunctionSystem::findJunctions(const int32_t refId, JunctionList& subset) const {
 	subset.clear();
+	if (refsGrouped) {
+		const auto range = getRefRange(refId);
+		subset.insert(subset.end(), junctionList.begin() + range.first, junctionList.begin() + range.second);
+		return;
+	}
 	for (JunctionPtr j : junctionList) {
 		if (j->getIntron()->ref.index == refId) {
 			subset.push_back(j);
@@ -84,6 +135,7 @@ portcullis::JunctionSystem::JunctionSystem() {
 	maxQueryLength = 0;
 	distinctJunctions.clear();
 	junctionList.clear();
+	clearRefIndex();
 }
 
 portcullis::JunctionSystem::JunctionSystem(shared_ptr<vector<RefSeqPtr>> refs) : JunctionSystem() {
@@ -100,6 +152,10 @@ portcullis::JunctionSystem::JunctionSystem(JunctionList& jl) : JunctionSystem()
 	}
 }
 
+portcullis::JunctionSystem::JunctionSystem(const JunctionTable& table) : JunctionSystem() {
+	load(table, false);
+}
+
 portcullis::JunctionSystem::~JunctionSystem() {
 	distinctJunctions.clear();
 	junctionList.clear();
@@ -122,8 +178,9 @@ void portcullis::JunctionSystem::setQueryLengthStats(int32_t min, double mean, i
 
 void portcullis::JunctionSystem::addJunction(JunctionPtr j) {
 	j->clearAlignments();
-	distinctJunctions[*(j->getIntron())] = j;
+	distinctJunctions.set(j->getIntron()->key(), j);
 	junctionList.push_back(j);
+	indexJunction(j);
 }
 
 /**
@@ -137,7 +194,7 @@ void portcullis::JunctionSystem::append(JunctionSystem& other) {
 	}
 }
 
-bool portcullis::JunctionSystem::addJunctions(const BamAlignment& al, const size_t startOp, const int32_t offset) {
+bool portcullis::JunctionSystem::addJunctions(const BamAlignment& al, const size_t startOp, const int32_t offset, const int32_t regionStart, const int32_t regionEnd) {
 	bool foundJunction = false;
 	const size_t nbOps = al.getNbCigarOps();
 	const int32_t refId = al.getReferenceId();
@@ -172,32 +229,37 @@ bool portcullis::JunctionSystem::addJunctions(const BamAlignment& al, const size
 			if (rEndExc - 1 >= refLength) {
 				rEndExc = refLength;
 			}
-			// Create the intron
-			shared_ptr<Intron> location = make_shared<Intron>(
-											  RefSeq(refId, refs->at(refId)->name, refLength),
-											  lEndExc,
-											  rStart - 1);
-			// We should now have the complete junction location information
-			JunctionMapIterator it = distinctJunctions.find(*location);
-			// If we couldn't find this location in the hashmap, add a new
-			// location / junction pair.  If we've seen this location before
-			// then add this alignment to the existing junction
-			if (it == distinctJunctions.end()) {
-				JunctionPtr junction = make_shared<Junction>(location, lStart, rEndExc - 1);
-				junction->addJunctionAlignment(al);
-				distinctJunctions[*location] = junction;
-				junctionList.push_back(junction);
-			}
-			else {
-				JunctionPtr junction = it->second;
-				junction->addJunctionAlignment(al);
-				junction->extendAnchors(lStart, rEndExc - 1);
+			// We should now have the complete junction location information.
+			// Junctions outside the region of interest belong to someone else
+			// so we just skip them.
+			const int32_t intronStart = lEndExc;
+			const int32_t intronEnd = rStart - 1;
+			if (intronStart >= regionStart && intronStart < regionEnd) {
+				// Only create the intron if we haven't seen this location before,
+				// otherwise add this alignment to the existing junction
+				const IntronKey key = IntronKey::of(refId, intronStart, intronEnd);
+				const JunctionPtr& existing = distinctJunctions.find(key);
+				if (existing == nullptr) {
+					shared_ptr<Intron> location = make_shared<Intron>(
+													  RefSeq(refId, refs->at(refId)->name, refLength),
+													  intronStart,
+													  intronEnd);
+					JunctionPtr junction = make_shared<Junction>(location, lStart, rEndExc - 1);
+					junction->addJunctionAlignment(al);
+					distinctJunctions.set(key, junction);
+					junctionList.push_back(junction);
+					indexJunction(junction);
+				}
+				else {
+					existing->addJunctionAlignment(al);
+					existing->extendAnchors(lStart, rEndExc - 1);
+				}
 			}
 			// Check if we have fully processed the cigar or not.  If not, then
 			// that means that this cigar contains additional junctions, so
 			// process those using recursion
 			if (j < nbOps) {
-				addJunctions(al, i + 1, rStart);
+				addJunctions(al, i + 1, rStart, regionStart, regionEnd);
 				break;
 			}
 		}
@@ -209,36 +271,213 @@ bool portcullis::JunctionSystem::addJunctions(const BamAlignment& al, const size
 	return foundJunction;
 }
 
-void portcullis::JunctionSystem::findFlankingAlignments(const path& alignmentsFile) {
+void portcullis::JunctionSystem::forEachReference(const path& alignmentsFile, const uint16_t threads,
+		const std::function<void(BamReader&, const int32_t, JunctionList&)>& func) {
+	// Group the junctions by target sequence, so that each target sequence can be
+	// processed independently of the others
+	vector<JunctionList> byRef;
+	if (refsGrouped) {
+		byRef.resize(refOffsets.size() - 1);
+		for (size_t i = 0; i < byRef.size(); i++) {
+			byRef[i].assign(junctionList.begin() + refOffsets[i], junctionList.begin() + refOffsets[i + 1]);
+		}
+	}
+	else {
+		for (JunctionPtr j : junctionList) {
+			const size_t refId = (size_t)j->getIntron()->ref.index;
+			if (refId >= byRef.size()) {
+				byRef.resize(refId + 1);
+			}
+			byRef[refId].push_back(j);
+		}
+	}
+	vector<int32_t> refIds;
+	for (size_t i = 0; i < byRef.size(); i++) {
+		if (!byRef[i].empty()) {
+			refIds.push_back((int32_t)i);
+		}
+	}
+	std::atomic<size_t> nextRef(0);
+	const size_t nbWorkers = std::max<size_t>(1, std::min<size_t>(threads, refIds.size()));
+	vector<std::exception_ptr> errors(nbWorkers);
+	auto worker = [&](const size_t w) {
+		try {
+			BamReader reader(alignmentsFile);
+			reader.open();
+			for (size_t i = nextRef++; i < refIds.size(); i = nextRef++) {
+				func(reader, refIds[i], byRef[refIds[i]]);
+			}
+			reader.close();
+		}
+		catch (...) {
+			errors[w] = std::current_exception();
+			// Stop the other workers taking any more target sequences
+			nextRef = refIds.size();
+		}
+	};
+	vector<thread> workers;
+	for (size_t i = 1; i < nbWorkers; i++) {
+		workers.push_back(thread(worker, i));
+	}
+	worker(0);
+	for (auto& t : workers) {
+		t.join();
+	}
+	for (const auto& e : errors) {
+		if (e) {
+			std::rethrow_exception(e);
+		}
+	}
+}
+
+void portcullis::JunctionSystem::findFlankingAlignments(const path& alignmentsFile, const uint16_t threads) {
 	auto_cpu_timer timer(1, " done. Wall time taken: %ws\n");
-	// Maybe try to multi-thread this part
-	BamReader reader(alignmentsFile);
-	// Open the file
-	reader.open();
-	// Read the alignments around every junction and set appropriate metrics
-	//size_t count = 0;
-	//cout << endl;
-	for (JunctionPtr j : junctionList) {
-		j->processJunctionVicinity(
-			reader,
-			j->getIntron()->ref.length,
-			maxQueryLength);
-		//cout << count++ << endl;
+	forEachReference(alignmentsFile, threads, [this](BamReader& reader, const int32_t refId, JunctionList& subset) {
+		findFlankingAlignments(reader, refId, subset);
+	});
+}
+
+void portcullis::JunctionSystem::findFlankingAlignments(BamReader& reader, const int32_t refId, JunctionList& subset) {
+	// Each junction needs the number of alignments starting before a handful of
+	// positions, plus the number of alignments spanning the start of its left
+	// anchor.  Rather than querying the region around each junction separately,
+	// we resolve all those positions in a single pass through the target sequence.
+	enum { ANC_START, ANC_START_NEXT, INTRON_START, INTRON_END_NEXT, ANC_END_NEXT };
+	struct FlankEvent {
+		int32_t pos;
+		uint32_t junction;
+		uint32_t type;
+		bool operator<(const FlankEvent& other) const { return pos < other.pos; }
+	};
+	// For each junction, the counts recorded at each event: the number of
+	// alignments covering at least one base starting before the left anchor, the
+	// number of those still spanning it, the number of alignments covering no
+	// bases at all starting before the base after the left anchor start, the same
+	// two counts before the intron start, and the number of all alignments
+	// starting before the base after the intron end and after the right anchor end.
+	struct FlankCounts {
+		uint64_t spanningBeforeAnc, spanningAnc, emptyBeforeAncNext;
+		uint64_t spanningBeforeIntron, emptyBeforeIntron;
+		uint64_t beforeIntronEndNext, beforeAncEndNext;
+	};
+	vector<FlankEvent> events;
+	events.reserve(subset.size() * 5);
+	vector<FlankCounts> counts(subset.size(), FlankCounts());
+	for (size_t i = 0; i < subset.size(); i++) {
+		const Junction& j = *subset[i];
+		const int32_t refLength = j.getIntron()->ref.length;
+		// Only alignments starting before the end of the region that would be
+		// queried around the junction are counted
+		int32_t regionEnd = j.getRightAncEnd() + maxQueryLength + 1;
+		regionEnd = regionEnd >= refLength ? refLength - 1 : regionEnd;
+		const int32_t ancEnd = std::min(j.getRightAncEnd(), regionEnd - 1);
+		events.push_back(FlankEvent{j.getLeftAncStart(), (uint32_t)i, ANC_START});
+		events.push_back(FlankEvent{j.getLeftAncStart() + 1, (uint32_t)i, ANC_START_NEXT});
+		events.push_back(FlankEvent{j.getIntron()->start, (uint32_t)i, INTRON_START});
+		events.push_back(FlankEvent{j.getIntron()->end + 1, (uint32_t)i, INTRON_END_NEXT});
+		events.push_back(FlankEvent{ancEnd + 1, (uint32_t)i, ANC_END_NEXT});
+	}
+	std::sort(events.begin(), events.end());
+	// Ends of alignments which may still span an upcoming event
+	std::priority_queue<int32_t, vector<int32_t>, std::greater<int32_t>> live;
+	uint64_t nbSpanning = 0, nbEmpty = 0;
+	size_t e = 0;
+	auto resolveTo = [&](const int64_t pos) {
+		for (; e < events.size() && events[e].pos <= pos; e++) {
+			const FlankEvent& ev = events[e];
+			FlankCounts& c = counts[ev.junction];
+			switch (ev.type) {
+			case ANC_START:
+				while (!live.empty() && live.top() < ev.pos) {
+					live.pop();
+				}
+				c.spanningBeforeAnc = nbSpanning;
+				c.spanningAnc = live.size();
+				break;
+			case ANC_START_NEXT:
+				c.emptyBeforeAncNext = nbEmpty;
+				break;
+			case INTRON_START:
+				c.spanningBeforeIntron = nbSpanning;
+				c.emptyBeforeIntron = nbEmpty;
+				break;
+			case INTRON_END_NEXT:
+				c.beforeIntronEndNext = nbSpanning + nbEmpty;
+				break;
+			case ANC_END_NEXT:
+				c.beforeAncEndNext = nbSpanning + nbEmpty;
+				break;
+			}
+		}
+	};
+	if (!events.empty() && reader.seekToSequence(refId)) {
+		while (reader.next()) {
+			const BamAlignment& ba = reader.current();
+			if (ba.getReferenceId() != refId) {
+				break;
+			}
+			const int32_t pos = ba.getStart();
+			resolveTo(pos);
+			// Anything ending before this alignment starts can't span any event
+			// still to come
+			while (!live.empty() && live.top() < pos) {
+				live.pop();
+			}
+			if (ba.getEnd() >= pos) {
+				nbSpanning++;
+				live.push(ba.getEnd());
+			}
+			else {
+				nbEmpty++;
+			}
+		}
+	}
+	resolveTo(INT64_MAX);
+	for (size_t i = 0; i < subset.size(); i++) {
+		const Junction& j = *subset[i];
+		const FlankCounts& c = counts[i];
+		// Left flanking alignments start before the intron and end at or after the
+		// start of the left anchor
+		uint64_t left = c.spanningAnc;
+		if (j.getIntron()->start > j.getLeftAncStart()) {
+			left += (c.spanningBeforeIntron - c.spanningBeforeAnc) +
+					(c.emptyBeforeIntron > c.emptyBeforeAncNext ? c.emptyBeforeIntron - c.emptyBeforeAncNext : 0);
+		}
+		// Right flanking alignments start after the intron and no later than the
+		// end of the right anchor
+		const uint64_t right = c.beforeAncEndNext > c.beforeIntronEndNext ? c.beforeAncEndNext - c.beforeIntronEndNext : 0;
+		subset[i]->setNbUpstreamFlankingAlignments((uint32_t)left);
+		subset[i]->setNbDownstreamFlankingAlignments((uint32_t)right);
 	}
-	reader.close();
 }
 
-void portcullis::JunctionSystem::calcCoverage(const path& alignmentsFile, Strandedness strandSpecific) {
+void portcullis::JunctionSystem::calcCoverage(const path& alignmentsFile, uint16_t threads) {
 	auto_cpu_timer timer(1, " done. Wall time taken: %ws\n");
-	DepthParser dp(alignmentsFile, static_cast<uint8_t> (strandSpecific), false);
-	vector<uint32_t> batch;
-	while (dp.loadNextBatch(batch)) {
-		JunctionList subset;
-		findJunctions(dp.getCurrentRefIndex(), subset);
-		for (JunctionPtr j : subset) {
-			j->calcCoverage(batch);
+	forEachReference(alignmentsFile, threads, [this](BamReader& reader, const int32_t refId, JunctionList& subset) {
+		calcCoverage(reader, refId, subset);
+	});
+}
+
+void portcullis::JunctionSystem::calcCoverage(BamReader& reader, const int32_t refId, JunctionList& subset) {
+	// Only hold coverage for the windows the junctions on this target sequence need
+	WindowCoverage coverage;
+	for (JunctionPtr j : subset) {
+		j->addCoverageWindows(coverage);
+	}
+	coverage.prepare();
+	if (reader.seekToSequence(refId)) {
+		bam1_t* b = nullptr;
+		while ((b = reader.nextRaw()) != nullptr && b->core.tid == refId) {
+			// Like the pileup this replaces, ignore unmapped and gapped alignments
+			if ((b->core.flag & BAM_FUNMAP) == 0 && !BamAlignment::isSplicedRead(b)) {
+				coverage.addAlignment(b);
+			}
 		}
 	}
+	coverage.finalise();
+	for (JunctionPtr j : subset) {
+		j->calcCoverage(coverage);
+	}
 }
 
 void portcullis::JunctionSystem::calcMultipleMappingStats(SplicedAlignmentMap& map) {
@@ -320,7 +559,22 @@ void portcullis::JunctionSystem::calcJunctionStats() {
 }
 
 void portcullis::JunctionSystem::sort() {
-	std::sort(junctionList.begin(), junctionList.end(), JunctionComparator());
+	vector<KeyedIndex> keys;
+	keys.reserve(junctionList.size());
+	for (size_t i = 0; i < junctionList.size(); i++) {
+		keys.push_back({junctionList[i]->getIntron()->key(), i});
+	}
+	radixSort(keys);
+	JunctionList sorted;
+	sorted.reserve(junctionList.size());
+	for (const auto& k : keys) {
+		sorted.push_back(std::move(junctionList[k.index]));
+	}
+	junctionList.swap(sorted);
+	clearRefIndex();
+	for (const auto& j : junctionList) {
+		indexJunction(j);
+	}
 }
 
 void portcullis::JunctionSystem::index() {
@@ -334,12 +588,25 @@ void portcullis::JunctionSystem::saveAll(const path& outputPrefix, const string&
 }
 
 void portcullis::JunctionSystem::saveAll(const path& outputPrefix, const string& source, bool bedscore, bool outputExonGFF, bool outputIntronGFF) {
+	saveAll(outputPrefix, source, bedscore, outputExonGFF, outputIntronGFF, false);
+}
+
+void portcullis::JunctionSystem::saveAll(const path& outputPrefix, const string& source, bool bedscore, bool outputExonGFF, bool outputIntronGFF, bool outputBinary) {
+	saveAll(outputPrefix, source, bedscore, outputExonGFF, outputIntronGFF, outputBinary, 1);
+}
+
+void portcullis::JunctionSystem::saveAll(const path& outputPrefix, const string& source, bool bedscore, bool outputExonGFF, bool outputIntronGFF, bool outputBinary, uint16_t threads) {
+	saveAll(outputPrefix, source, bedscore, outputExonGFF, outputIntronGFF, outputBinary, false, threads);
+}
+
+void portcullis::JunctionSystem::saveAll(const path& outputPrefix, const string& source, bool bedscore, bool outputExonGFF, bool outputIntronGFF, bool outputBinary, bool outputIndexed, uint16_t threads) {
 	auto_cpu_timer timer(1, " = Wall time taken: %ws\n\n");
 	string junctionReportPath = outputPrefix.string() + ".junctions.txt";
 	string junctionFilePath = outputPrefix.string() + ".junctions.tab";
 	string junctionGFFPath = outputPrefix.string() + ".junctions.exon.gff3";
 	string intronGFFPath = outputPrefix.string() + ".junctions.intron.gff3";
 	string junctionBEDAllPath = outputPrefix.string() + ".junctions.bed";
+	string junctionBinPath = outputPrefix.string() + ".junctions.bin";
 	/*cout << " - Saving junction report to: " << junctionReportPath << " ... ";
 	cout.flush();
 
@@ -349,37 +616,42 @@ void portcullis::JunctionSystem::saveAll(const path& outputPrefix, const string&
 	junctionReportStream.close();
 
 	cout << "done." << endl;*/
-	cout << " - Saving junction table to: " << junctionFilePath << " ... ";
-	cout.flush();
-	// Print junction stats to file
-	ofstream junctionFileStream(junctionFilePath.c_str());
-	junctionFileStream << (*this) << endl;
-	junctionFileStream.close();
-	cout << "done." << endl;
+	// All the text files are written in a single pass over the junctions
+	JunctionWriter writer(junctionList);
+	writer.setSource(source);
+	writer.setBEDScore(bedscore);
+	writer.setVersion(version);
+	writer.setThreads(threads);
+	cout << " - Saving junction table to: " << junctionFilePath << endl;
+	writer.setTabFile(junctionFilePath);
 	if (outputExonGFF) {
-		cout << " - Saving junction GFF file to: " << junctionGFFPath << " ... ";
-		cout.flush();
-		// Print junction stats to file
-		ofstream junctionGFFStream(junctionGFFPath.c_str());
-		writeExonGFF(junctionGFFStream, source);
-		junctionGFFStream.close();
-		cout << "done." << endl;
+		cout << " - Saving junction GFF file to: " << junctionGFFPath << endl;
+		writer.setExonGFFFile(junctionGFFPath);
 	}
 	if (outputIntronGFF) {
-		cout << " - Saving intron GFF file to: " << intronGFFPath << " ... ";
-		cout.flush();
-		// Print junction stats to file
-		ofstream intronGFFStream(intronGFFPath.c_str());
-		writeIntronGFF(intronGFFStream, source);
-		intronGFFStream.close();
-		cout << "done." << endl;
+		cout << " - Saving intron GFF file to: " << intronGFFPath << endl;
+		writer.setIntronGFFFile(intronGFFPath);
+	}
+	cout << " - Saving BED file with all junctions to: " << junctionBEDAllPath << endl;
+	writer.setBEDFile(junctionBEDAllPath);
+	if (outputIndexed) {
+		cout << " - Saving compressed and indexed junction table to: " << junctionFilePath << ".gz" << endl;
+		writer.setIndexedTabFile(junctionFilePath + ".gz");
+		cout << " - Saving compressed and indexed BED file to: " << junctionBEDAllPath << ".gz" << endl;
+		writer.setIndexedBEDFile(junctionBEDAllPath + ".gz");
 	}
-	// Output BED files
-	cout << " - Saving BED file with all junctions to: " << junctionBEDAllPath << " ... ";
+	cout << " - Writing " << junctionList.size() << " junctions ... ";
 	cout.flush();
-	// Print junctions in BED format to file
-	outputBED(junctionBEDAllPath, CanonicalSS::ALL, source, bedscore);
+	writer.write();
 	cout << "done." << endl;
+	if (outputBinary) {
+		cout << " - Saving binary junction table to: " << junctionBinPath << " ... ";
+		cout.flush();
+		JunctionTable table;
+		toTable(table);
+		JunctionFile::write(table, junctionBinPath);
+		cout << "done." << endl;
+	}
 }
 
 void portcullis::JunctionSystem::outputDescription(std::ostream &strm) {
@@ -422,36 +694,43 @@ void portcullis::JunctionSystem::load(const path& junctionTabFile) {
 }
 
 void portcullis::JunctionSystem::load(const path& junctionTabFile, const bool simple) {
+	load(junctionTabFile, simple, 1);
+}
 
-    if (!bfs::exists(junctionTabFile)) {
-        BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
-                                  "Could not find Portcullis junction tab file at: ") + junctionTabFile.string()));
-    }
-    ifstream ifs(junctionTabFile.c_str());
-	string line;
-	// Loop through until end of file or we move onto the next ref seq
-	while (std::getline(ifs, line)) {
-		boost::trim(line);
-		if (!line.empty() && line.find("index") == std::string::npos) {
-			shared_ptr<Junction> j = Junction::parse(line);
-			junctionList.push_back(j);
-			if (!simple) {
-				distinctJunctions[*(j->getIntron())] = j;
-			}
-		}
+void portcullis::JunctionSystem::load(const path& junctionTabFile, const bool simple, const uint16_t threads) {
+	JunctionTable table;
+	if (JunctionFile::isJunctionFile(junctionTabFile)) {
+		JunctionFile(junctionTabFile).read(table);
 	}
-	ifs.close();
+	else {
+		table.load(junctionTabFile, threads);
+	}
+	load(table, simple);
 }
 
-JunctionPtr portcullis::JunctionSystem::getJunction(Intron& intron) const {
-	try {
-		return this->distinctJunctions.at(intron);
+void portcullis::JunctionSystem::load(const JunctionTable& table, const bool simple) {
+	junctionList.reserve(junctionList.size() + table.size());
+	for (size_t i = 0; i < table.size(); i++) {
+		JunctionPtr j = table.getJunction(i);
+		junctionList.push_back(j);
+		indexJunction(j);
+		if (!simple) {
+			distinctJunctions.set(j->getIntron()->key(), j);
+		}
 	}
-	catch (std::out_of_range ex) {
-		return nullptr;
+}
+
+void portcullis::JunctionSystem::toTable(JunctionTable& table) const {
+	table.reserve(table.size() + junctionList.size());
+	for (const auto& j : junctionList) {
+		table.add(*j);
 	}
 }
 
+JunctionPtr portcullis::JunctionSystem::getJunction(Intron& intron) const {
+	return this->distinctJunctions.find(intron.key());
+}
+
 std::pair<Orientation, Strandedness> portcullis::JunctionSystem::determineStrandedness(bool verbose) const {
 	uint32_t tot_r1_pos_when_ss_pos = 0;
 	uint32_t tot_r1_neg_when_ss_pos = 0;
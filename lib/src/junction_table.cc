@@ -0,0 +1,708 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+using std::make_shared;
+using std::string;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+namespace bfs = boost::filesystem;
+
+#include <portcullis/intron.hpp>
+using portcullis::Intron;
+
+#include <portcullis/junction_table.hpp>
+
+namespace portcullis {
+
+typedef std::pair<const char*, size_t> TabField;
+
+/**
+ * The column filled from each field of a junction tab file, in file order, or
+ * nullptr for fields derived from other columns.  The junction anchor depths
+ * follow these.
+ */
+static const char* const TAB_FIELD_COLUMNS[] = {
+	"id", "ref", "ref", "ref", "start", "end", nullptr, "leftAncStart", "rightAncEnd",
+	"readStrand", "ssStrand", "consensusStrand", "da1", "da2", "canonicalSpliceSites",
+	"score", "suspicious", "pfp",
+	"nbAlRaw", "nbAlDistinct", nullptr, "nbAlMultiplySpliced", "nbAlUniquelyMapped", nullptr,
+	"nbAlBamProperlyPaired", "nbAlPortcullisProperlyPaired", "nbAlReliable", nullptr,
+	"nbAlR1Pos", "nbAlR1Neg", "nbAlR2Pos", "nbAlR2Neg",
+	"entropy", "meanMismatches", "meanReadLength", "maxMinAnchor", "maxMMES", "intronScore",
+	"hammingDistance5p", "hammingDistance3p", "codingPotential", "positionWeightScore", "splicingSignal",
+	"uniqueJunction", "primaryJunction", "nbUpstreamJunctions", "nbDownstreamJunctions",
+	"distanceToNextUpstreamJunction", "distanceToNextDownstreamJunction", "distanceToNearestJunction",
+	"multipleMappingScore", "coverage", "nbUpstreamFlankingAlignments", "nbDownstreamFlankingAlignments",
+	"nbSamples"
+};
+
+const size_t NB_TAB_FIELDS = sizeof(TAB_FIELD_COLUMNS) / sizeof(TAB_FIELD_COLUMNS[0]) + JAD_LENGTH;
+
+// Powers of ten that are exactly representable as doubles
+static const double EXACT_POWERS_OF_TEN[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/**
+ * Converts a plain decimal integer, i.e. digits with an optional minus sign for
+ * signed types, that is short enough that it can't overflow
+ * @return False if the field isn't such a number
+ */
+template<typename T>
+static inline bool parseInteger(const char* p, const char* e, T& value) {
+	bool negative = false;
+	if (std::numeric_limits<T>::is_signed && p < e && *p == '-') {
+		negative = true;
+		p++;
+	}
+	if (p == e || e - p > std::numeric_limits<T>::digits10) {
+		return false;
+	}
+	int64_t v = 0;
+	for (; p < e; p++) {
+		const uint32_t d = (uint32_t)(*p - '0');
+		if (d > 9) {
+			return false;
+		}
+		v = v * 10 + d;
+	}
+	value = (T)(negative ? -v : v);
+	return true;
+}
+
+static inline bool parseNumber(const char* p, const char* e, int32_t& value) {
+	return parseInteger(p, e, value);
+}
+
+static inline bool parseNumber(const char* p, const char* e, uint32_t& value) {
+	return parseInteger(p, e, value);
+}
+
+static inline bool parseNumber(const char* p, const char* e, uint16_t& value) {
+	return parseInteger(p, e, value);
+}
+
+static inline bool parseNumber(const char* p, const char* e, bool& value) {
+	if (e - p != 1 || (*p != '0' && *p != '1')) {
+		return false;
+	}
+	value = *p == '1';
+	return true;
+}
+
+/**
+ * Converts a plain decimal number, such as -12.345 or 1.5e-07, when the digits
+ * fit in 53 bits and the power of ten is exactly representable.  The result is
+ * then a single correctly rounded multiplication or division, which is what
+ * strtod, and so lexical_cast, gives.  Numbers written by portcullis nearly always
+ * qualify.
+ * @return False if the field isn't such a number
+ */
+static inline bool parseNumber(const char* p, const char* e, double& value) {
+	bool negative = false;
+	if (p < e && *p == '-') {
+		negative = true;
+		p++;
+	}
+	uint64_t mantissa = 0;
+	int32_t digits = 0;
+	int32_t exponent = 0;
+	const char* s = p;
+	for (; p < e && (uint32_t)(*p - '0') <= 9; p++, digits++) {
+		mantissa = mantissa * 10 + (*p - '0');
+	}
+	if (p == s) {
+		return false;
+	}
+	if (p < e && *p == '.') {
+		s = ++p;
+		for (; p < e && (uint32_t)(*p - '0') <= 9; p++, digits++) {
+			mantissa = mantissa * 10 + (*p - '0');
+		}
+		if (p == s) {
+			return false;
+		}
+		exponent = -(int32_t)(p - s);
+	}
+	if (p < e && (*p == 'e' || *p == 'E')) {
+		p++;
+		bool negativeExponent = false;
+		if (p < e && (*p == '-' || *p == '+')) {
+			negativeExponent = *p == '-';
+			p++;
+		}
+		int32_t ex = 0;
+		s = p;
+		for (; p < e && (uint32_t)(*p - '0') <= 9 && p - s < 4; p++) {
+			ex = ex * 10 + (*p - '0');
+		}
+		if (p == s) {
+			return false;
+		}
+		exponent += negativeExponent ? -ex : ex;
+	}
+	if (p != e || digits > 19 || mantissa > (1ull << 53) || exponent < -22 || exponent > 22) {
+		return false;
+	}
+	double v = (double)mantissa;
+	v = exponent < 0 ? v / EXACT_POWERS_OF_TEN[-exponent] : v * EXACT_POWERS_OF_TEN[exponent];
+	value = negative ? -v : v;
+	return true;
+}
+
+/**
+ * Converts a field in the same way as lexical_cast does for a string holding it.
+ * Plain numbers are converted directly, anything else goes through lexical_cast
+ * so that the result, or the exception thrown, is exactly the same.
+ */
+template<typename T>
+static inline T fieldAs(const TabField& field) {
+	T value;
+	if (parseNumber(field.first, field.first + field.second, value)) {
+		return value;
+	}
+	return boost::lexical_cast<T>(field.first, field.second);
+}
+
+/**
+ * Converts the given field into the column, if it is wanted, as type V
+ */
+template<typename V, typename C>
+static inline void readField(C& column, const size_t row, const vector<TabField>& fields, const vector<bool>& wanted, const size_t i) {
+	if (wanted[i]) {
+		column[row] = fieldAs<V>(fields[i]);
+	}
+}
+
+// Whitespace as removed by boost::trim
+static inline bool isTrimmed(const char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r';
+}
+
+/**
+ * Gets whether each field of a junction tab file is needed to fill the given
+ * columns, or all of them if columns is nullptr.  The target sequence is always
+ * needed.
+ */
+static vector<bool> wantedFields(const vector<string>* columns) {
+	vector<bool> wanted(NB_TAB_FIELDS, columns == nullptr);
+	if (columns != nullptr) {
+		const size_t nbNamed = sizeof(TAB_FIELD_COLUMNS) / sizeof(TAB_FIELD_COLUMNS[0]);
+		for (size_t i = 0; i < NB_TAB_FIELDS; i++) {
+			const char* name = i < nbNamed ? TAB_FIELD_COLUMNS[i] : "junctionAnchorDepth";
+			wanted[i] = name != nullptr && (strcmp(name, "ref") == 0 ||
+											std::find(columns->begin(), columns->end(), name) != columns->end());
+		}
+	}
+	return wanted;
+}
+
+}
+
+portcullis::Motif::Motif(const char* seq, const size_t length) : Motif() {
+	if (length > 2) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Splice site motif is longer than 2 bases: ") + string(seq, length)));
+	}
+	std::copy(seq, seq + length, bases);
+}
+
+void portcullis::JunctionTable::reserve(const size_t n) {
+	Reserve f = {n};
+	forEachColumn(*this, f);
+}
+
+void portcullis::JunctionTable::clear() {
+	resize(0);
+	refs.clear();
+	refLookup.clear();
+}
+
+uint32_t portcullis::JunctionTable::addRef(const int32_t index, const char* name, const size_t nameLength, const uint32_t length) {
+	auto it = refLookup.find(index);
+	if (it != refLookup.end()) {
+		return it->second;
+	}
+	const uint32_t pos = (uint32_t)refs.size();
+	refs.push_back(RefSeq(index, string(name, nameLength), length));
+	refLookup[index] = pos;
+	return pos;
+}
+
+void portcullis::JunctionTable::resize(const size_t n) {
+	const size_t first = size();
+	Resize f = {n};
+	forEachColumn(*this, f);
+	// Everything else starts at zero, as for a new Junction
+	for (size_t row = first; row < n; row++) {
+		readStrand[row] = Strand::UNKNOWN;
+		ssStrand[row] = Strand::UNKNOWN;
+		consensusStrand[row] = Strand::UNKNOWN;
+		canonicalSpliceSites[row] = CanonicalSS::NO;
+		hammingDistance5p[row] = 10;
+		hammingDistance3p[row] = 10;
+		nbSamples[row] = 1;
+	}
+}
+
+void portcullis::JunctionTable::add(const Junction& j) {
+	const Motif donor(j.da1);
+	const Motif acceptor(j.da2);
+	const size_t row = addRow();
+	const Intron& intron = *j.intron;
+	id[row] = j.id;
+	ref[row] = addRef(intron.ref.index, intron.ref.name.c_str(), intron.ref.name.size(), intron.ref.length);
+	start[row] = intron.start;
+	end[row] = intron.end;
+	leftAncStart[row] = j.leftAncStart;
+	rightAncEnd[row] = j.rightAncEnd;
+	readStrand[row] = j.readStrand;
+	ssStrand[row] = j.ssStrand;
+	consensusStrand[row] = j.consensusStrand;
+	da1[row] = donor;
+	da2[row] = acceptor;
+	canonicalSpliceSites[row] = j.canonicalSpliceSites;
+	score[row] = j.score;
+	suspicious[row] = j.suspicious;
+	pfp[row] = j.pfp;
+	nbAlRaw[row] = j.nbAlRaw;
+	nbAlDistinct[row] = j.nbAlDistinct;
+	nbAlMultiplySpliced[row] = j.nbAlMultiplySpliced;
+	nbAlUniquelyMapped[row] = j.nbAlUniquelyMapped;
+	nbAlBamProperlyPaired[row] = j.nbAlBamProperlyPaired;
+	nbAlPortcullisProperlyPaired[row] = j.nbAlPortcullisProperlyPaired;
+	nbAlReliable[row] = j.nbAlReliable;
+	nbAlR1Pos[row] = j.nbAlR1Pos;
+	nbAlR1Neg[row] = j.nbAlR1Neg;
+	nbAlR2Pos[row] = j.nbAlR2Pos;
+	nbAlR2Neg[row] = j.nbAlR2Neg;
+	entropy[row] = j.entropy;
+	meanMismatches[row] = j.meanMismatches;
+	meanReadLength[row] = j.meanReadLength;
+	maxMinAnchor[row] = j.maxMinAnchor;
+	maxMMES[row] = j.maxMMES;
+	intronScore[row] = j.intronScore;
+	hammingDistance5p[row] = j.hammingDistance5p;
+	hammingDistance3p[row] = j.hammingDistance3p;
+	codingPotential[row] = j.codingPotential;
+	positionWeightScore[row] = j.positionWeightScore;
+	splicingSignal[row] = j.splicingSignal;
+	uniqueJunction[row] = j.uniqueJunction;
+	primaryJunction[row] = j.primaryJunction;
+	nbUpstreamJunctions[row] = j.nbUpstreamJunctions;
+	nbDownstreamJunctions[row] = j.nbDownstreamJunctions;
+	distanceToNextUpstreamJunction[row] = j.distanceToNextUpstreamJunction;
+	distanceToNextDownstreamJunction[row] = j.distanceToNextDownstreamJunction;
+	distanceToNearestJunction[row] = j.distanceToNearestJunction;
+	multipleMappingScore[row] = j.multipleMappingScore;
+	coverage[row] = j.coverage;
+	nbUpstreamFlankingAlignments[row] = j.nbUpstreamFlankingAlignments;
+	nbDownstreamFlankingAlignments[row] = j.nbDownstreamFlankingAlignments;
+	nbSamples[row] = j.nbSamples;
+	std::copy_n(j.junctionAnchorDepth.begin(), std::min(JAD_LENGTH, j.junctionAnchorDepth.size()), junctionAnchorDepth[row].begin());
+	std::copy_n(j.junctionAnchorClarity.begin(), std::min(JAD_LENGTH, j.junctionAnchorClarity.size()), junctionAnchorClarity[row].begin());
+	genuine[row] = j.genuine;
+}
+
+JunctionPtr portcullis::JunctionTable::getJunction(const size_t row) const {
+	JunctionPtr j = make_shared<Junction>(make_shared<Intron>(getRef(row), start[row], end[row]), leftAncStart[row], rightAncEnd[row]);
+	j->id = id[row];
+	j->readStrand = readStrand[row];
+	j->ssStrand = ssStrand[row];
+	j->consensusStrand = consensusStrand[row];
+	j->da1 = da1[row].toString();
+	j->da2 = da2[row].toString();
+	j->canonicalSpliceSites = canonicalSpliceSites[row];
+	j->score = score[row];
+	j->suspicious = suspicious[row];
+	j->pfp = pfp[row];
+	j->nbAlRaw = nbAlRaw[row];
+	j->nbAlDistinct = nbAlDistinct[row];
+	j->nbAlMultiplySpliced = nbAlMultiplySpliced[row];
+	j->nbAlUniquelyMapped = nbAlUniquelyMapped[row];
+	j->nbAlBamProperlyPaired = nbAlBamProperlyPaired[row];
+	j->nbAlPortcullisProperlyPaired = nbAlPortcullisProperlyPaired[row];
+	j->nbAlReliable = nbAlReliable[row];
+	j->nbAlR1Pos = nbAlR1Pos[row];
+	j->nbAlR1Neg = nbAlR1Neg[row];
+	j->nbAlR2Pos = nbAlR2Pos[row];
+	j->nbAlR2Neg = nbAlR2Neg[row];
+	j->entropy = entropy[row];
+	j->meanMismatches = meanMismatches[row];
+	j->meanReadLength = meanReadLength[row];
+	j->maxMinAnchor = maxMinAnchor[row];
+	j->maxMMES = maxMMES[row];
+	j->intronScore = intronScore[row];
+	j->hammingDistance5p = hammingDistance5p[row];
+	j->hammingDistance3p = hammingDistance3p[row];
+	j->codingPotential = codingPotential[row];
+	j->positionWeightScore = positionWeightScore[row];
+	j->splicingSignal = splicingSignal[row];
+	j->uniqueJunction = uniqueJunction[row];
+	j->primaryJunction = primaryJunction[row];
+	j->nbUpstreamJunctions = nbUpstreamJunctions[row];
+	j->nbDownstreamJunctions = nbDownstreamJunctions[row];
+	j->distanceToNextUpstreamJunction = distanceToNextUpstreamJunction[row];
+	j->distanceToNextDownstreamJunction = distanceToNextDownstreamJunction[row];
+	j->distanceToNearestJunction = distanceToNearestJunction[row];
+	j->multipleMappingScore = multipleMappingScore[row];
+	j->coverage = coverage[row];
+	j->nbUpstreamFlankingAlignments = nbUpstreamFlankingAlignments[row];
+	j->nbDownstreamFlankingAlignments = nbDownstreamFlankingAlignments[row];
+	j->nbSamples = nbSamples[row];
+	std::copy_n(junctionAnchorDepth[row].begin(), std::min(JAD_LENGTH, j->junctionAnchorDepth.size()), j->junctionAnchorDepth.begin());
+	std::copy_n(junctionAnchorClarity[row].begin(), std::min(JAD_LENGTH, j->junctionAnchorClarity.size()), j->junctionAnchorClarity.begin());
+	j->genuine = genuine[row];
+	return j;
+}
+
+namespace portcullis {
+
+// Gathers the data of each column in a table
+struct ColumnSources {
+	vector<const void*> data;
+	template<typename C> void operator()(const char* name, const C& column) { data.push_back(column.data()); }
+};
+
+// Copies gathered column data to the end of each column in another table
+struct ColumnCopy {
+	const vector<const void*>& data;
+	size_t n, first, k;
+	template<typename T> void operator()(const char* name, vector<T>& column) {
+		const T* src = (const T*)data[k++];
+		std::copy(src, src + n, column.begin() + first);
+	}
+};
+
+}
+
+void portcullis::JunctionTable::append(const JunctionTable& other) {
+	ColumnSources sources;
+	forEachColumn(other, sources);
+	const size_t first = size();
+	resize(first + other.size());
+	ColumnCopy copy = {sources.data, other.size(), first, 0};
+	forEachColumn(*this, copy);
+	// Target sequence positions may differ between the tables
+	for (size_t i = first; i < size(); i++) {
+		const RefSeq& r = other.refs[ref[i]];
+		ref[i] = addRef(r.index, r.name.c_str(), r.name.size(), r.length);
+	}
+}
+
+void portcullis::JunctionTable::load(const path& junctionTabFile, const uint16_t threads) {
+	loadColumns(junctionTabFile, nullptr, threads);
+}
+
+void portcullis::JunctionTable::load(const path& junctionTabFile, const vector<string>& columns, const uint16_t threads) {
+	loadColumns(junctionTabFile, &columns, threads);
+}
+
+void portcullis::JunctionTable::loadColumns(const path& junctionTabFile, const vector<string>* columns, const uint16_t threads) {
+	if (!bfs::exists(junctionTabFile)) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Could not find Portcullis junction tab file at: ") + junctionTabFile.string()));
+	}
+	int fd = ::open(junctionTabFile.c_str(), O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		if (fd >= 0) ::close(fd);
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Could not open Portcullis junction tab file: ") + junctionTabFile.string()));
+	}
+	const size_t fileSize = st.st_size;
+	if (fileSize == 0) {
+		::close(fd);
+		return;
+	}
+	void* data = mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Could not memory map Portcullis junction tab file: ") + junctionTabFile.string()));
+	}
+	madvise(data, fileSize, MADV_SEQUENTIAL);
+	const char* begin = (const char*)data;
+	const char* end = begin + fileSize;
+	const vector<bool> wanted = wantedFields(columns);
+	try {
+		if (threads <= 1) {
+			parseLines(begin, end, wanted);
+		}
+		else {
+			// Split into chunks of whole lines, each parsed into its own table
+			vector<const char*> bounds(1, begin);
+			for (uint16_t i = 1; i < threads; i++) {
+				const char* p = std::max(bounds.back(), begin + fileSize / threads * i);
+				p = std::find(p, end, '\n');
+				bounds.push_back(p == end ? end : p + 1);
+			}
+			bounds.push_back(end);
+			vector<JunctionTable> chunks(threads);
+			vector<std::exception_ptr> errors(threads);
+			vector<std::thread> workers;
+			for (uint16_t i = 0; i < threads; i++) {
+				workers.push_back(std::thread([&, i]() {
+					try {
+						chunks[i].parseLines(bounds[i], bounds[i + 1], wanted);
+					}
+					catch (...) {
+						errors[i] = std::current_exception();
+					}
+				}));
+			}
+			for (auto& w : workers) {
+				w.join();
+			}
+			// Keep everything before the first bad line, as for a single thread
+			size_t total = size();
+			for (const auto& c : chunks) {
+				total += c.size();
+			}
+			reserve(total);
+			for (uint16_t i = 0; i < threads; i++) {
+				append(chunks[i]);
+				if (errors[i]) {
+					std::rethrow_exception(errors[i]);
+				}
+			}
+		}
+	}
+	catch (...) {
+		munmap(data, fileSize);
+		throw;
+	}
+	munmap(data, fileSize);
+}
+
+void portcullis::JunctionTable::parseLines(const char* begin, const char* end, const vector<bool>& wanted) {
+	reserve(size() + std::count(begin, end, '\n') + 1);
+	static const char HEADER[] = "index";
+	vector<Field> fields;
+	const char* p = begin;
+	while (p < end) {
+		const char* lineEnd = std::find(p, end, '\n');
+		const char* next = lineEnd == end ? end : lineEnd + 1;
+		// Trim, then skip empty lines and headers
+		while (p < lineEnd && isTrimmed(*p)) p++;
+		while (lineEnd > p && isTrimmed(lineEnd[-1])) lineEnd--;
+		if (p < lineEnd && std::search(p, lineEnd, HEADER, HEADER + sizeof(HEADER) - 1) == lineEnd) {
+			parse(p, lineEnd, fields, wanted);
+		}
+		p = next;
+	}
+}
+
+void portcullis::JunctionTable::parse(const char* line, const char* lineEnd, vector<Field>& fields, const vector<bool>& wanted) {
+	// Split on runs of tabs, as boost::split does with token_compress_on
+	fields.clear();
+	const char* p = line;
+	const char* e = lineEnd;
+	const char* fieldStart = p;
+	while (p < e) {
+		if (*p == '\t') {
+			fields.push_back(Field(fieldStart, p - fieldStart));
+			while (p < e && *p == '\t') p++;
+			fieldStart = p;
+		}
+		else {
+			p++;
+		}
+	}
+	fields.push_back(Field(fieldStart, e - fieldStart));
+	const size_t expected_cols = 11 + Junction::STRAND_NAMES.size() + Junction::METRIC_NAMES.size() + Junction::JAD_NAMES.size();
+	if (fields.size() != expected_cols) {
+		std::string sparts;
+		for (const auto& f : fields) {
+			sparts.append(f.first, f.second);
+		}
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Could not parse line due to incorrect number of columns.  This is probably a version mismatch.  Check file and portcullis versions.  Expected ")
+					+ std::to_string(expected_cols) + " columns.  Found "
+					+ std::to_string(fields.size()) + ".  Line:\n" + sparts));
+	}
+	const auto firstChar = [&](const size_t i) {
+		return fields[i].second > 0 ? fields[i].first[0] : '\0';
+	};
+	// Location, converted in the same order as Junction::parse
+	const int32_t refIndex = fieldAs<int32_t>(fields[1]);
+	const int32_t refLength = fieldAs<int32_t>(fields[3]);
+	const int32_t intronStart = wanted[4] ? fieldAs<int32_t>(fields[4]) : 0;
+	const int32_t intronEnd = wanted[5] ? fieldAs<int32_t>(fields[5]) : 0;
+	const int32_t left = wanted[7] ? fieldAs<int32_t>(fields[7]) : 0;
+	const int32_t right = wanted[8] ? fieldAs<int32_t>(fields[8]) : 0;
+	const uint32_t junctionId = wanted[0] ? fieldAs<uint32_t>(fields[0]) : 0;
+	const size_t row = addRow();
+	ref[row] = addRef(refIndex, fields[2].first, fields[2].second, refLength);
+	start[row] = intronStart;
+	end[row] = intronEnd;
+	leftAncStart[row] = left;
+	rightAncEnd[row] = right;
+	id[row] = junctionId;
+	try {
+		// Index... saves having to remember the column numbers
+		size_t i = 9;
+		// Predictions
+		if (wanted[i]) readStrand[row] = strandFromChar(firstChar(i));
+		i++;
+		if (wanted[i]) ssStrand[row] = strandFromChar(firstChar(i));
+		i++;
+		if (wanted[i]) consensusStrand[row] = strandFromChar(firstChar(i));
+		i++;
+		// Splice site properties
+		if (wanted[i]) da1[row] = Motif(fields[i].first, fields[i].second);
+		i++;
+		if (wanted[i]) da2[row] = Motif(fields[i].first, fields[i].second);
+		i++;
+		if (wanted[i]) canonicalSpliceSites[row] = cssFromChar(firstChar(i));
+		i++;
+		// Confidence properties
+		readField<double>(score, row, fields, wanted, i++);
+		readField<bool>(suspicious, row, fields, wanted, i++);
+		readField<bool>(pfp, row, fields, wanted, i++);
+		// Alignment counts
+		readField<uint32_t>(nbAlRaw, row, fields, wanted, i++);
+		readField<uint32_t>(nbAlDistinct, row, fields, wanted, i++);
+		i++; // uniquely spliced alignments not required
+		readField<uint32_t>(nbAlMultiplySpliced, row, fields, wanted, i++);
+		readField<uint32_t>(nbAlUniquelyMapped, row, fields, wanted, i++);
+		i++; // multiply mapped alignments not required
+		readField<uint32_t>(nbAlBamProperlyPaired, row, fields, wanted, i++);
+		readField<uint32_t>(nbAlPortcullisProperlyPaired, row, fields, wanted, i++);
+		readField<uint32_t>(nbAlReliable, row, fields, wanted, i++);
+		i++; // reliable2raw ratio not required
+		readField<uint32_t>(nbAlR1Pos, row, fields, wanted, i++);
+		readField<uint32_t>(nbAlR1Neg, row, fields, wanted, i++);
+		readField<uint32_t>(nbAlR2Pos, row, fields, wanted, i++);
+		readField<uint32_t>(nbAlR2Neg, row, fields, wanted, i++);
+		// RNAseq derived junction stats.  Mean read length is held as a whole number
+		// by Junction::setMeanReadLength.
+		readField<double>(entropy, row, fields, wanted, i++);
+		readField<double>(meanMismatches, row, fields, wanted, i++);
+		if (wanted[i]) meanReadLength[row] = (uint32_t)fieldAs<double>(fields[i]);
+		i++;
+		readField<int32_t>(maxMinAnchor, row, fields, wanted, i++);
+		readField<uint32_t>(maxMMES, row, fields, wanted, i++);
+		readField<double>(intronScore, row, fields, wanted, i++);
+		// Genome derived junction stats
+		readField<uint32_t>(hammingDistance5p, row, fields, wanted, i++);
+		readField<uint32_t>(hammingDistance3p, row, fields, wanted, i++);
+		readField<double>(codingPotential, row, fields, wanted, i++);
+		readField<double>(positionWeightScore, row, fields, wanted, i++);
+		readField<double>(splicingSignal, row, fields, wanted, i++);
+		// Junction group properties
+		readField<bool>(uniqueJunction, row, fields, wanted, i++);
+		readField<bool>(primaryJunction, row, fields, wanted, i++);
+		readField<uint16_t>(nbUpstreamJunctions, row, fields, wanted, i++);
+		readField<uint16_t>(nbDownstreamJunctions, row, fields, wanted, i++);
+		readField<uint32_t>(distanceToNextUpstreamJunction, row, fields, wanted, i++);
+		readField<uint32_t>(distanceToNextDownstreamJunction, row, fields, wanted, i++);
+		readField<uint32_t>(distanceToNearestJunction, row, fields, wanted, i++);
+		// Extra metrics requiring additional processing
+		readField<double>(multipleMappingScore, row, fields, wanted, i++);
+		readField<double>(coverage, row, fields, wanted, i++);
+		readField<uint32_t>(nbUpstreamFlankingAlignments, row, fields, wanted, i++);
+		readField<uint32_t>(nbDownstreamFlankingAlignments, row, fields, wanted, i++);
+		readField<uint32_t>(nbSamples, row, fields, wanted, i++);
+		// Junction anchor depths
+		if (wanted[i]) {
+			for (size_t k = 0; k < JAD_LENGTH; k++) {
+				junctionAnchorDepth[row][k] = fieldAs<uint32_t>(fields[i + k]);
+			}
+		}
+	}
+	catch (...) {
+		// Don't leave a partial row behind
+		resize(row);
+		throw;
+	}
+}
+
+void portcullis::JunctionTable::writeRow(ostream& strm, const size_t row) const {
+	const RefSeq& r = getRef(row);
+	strm << id[row] << "\t"
+		 << r.index << "\t" << r.name << "\t" << r.length << "\t" << start[row] << "\t" << end[row] << "\t"
+		 << getIntronSize(row) << "\t"
+		 << leftAncStart[row] << "\t"
+		 << rightAncEnd[row] << "\t"
+		 << strandToChar(readStrand[row]) << "\t"
+		 << strandToChar(ssStrand[row]) << "\t"
+		 << strandToChar(consensusStrand[row]) << "\t"
+		 << da1[row].bases << "\t"
+		 << da2[row].bases << "\t"
+		 << cssToChar(canonicalSpliceSites[row]) << "\t"
+		 << score[row] << "\t"
+		 << (bool)suspicious[row] << "\t"
+		 << (bool)pfp[row] << "\t"
+		 << nbAlRaw[row] << "\t"
+		 << nbAlDistinct[row] << "\t"
+		 << getNbUniquelySplicedAlignments(row) << "\t"
+		 << nbAlMultiplySpliced[row] << "\t"
+		 << nbAlUniquelyMapped[row] << "\t"
+		 << getNbMultiplyMappedAlignments(row) << "\t"
+		 << nbAlBamProperlyPaired[row] << "\t"
+		 << nbAlPortcullisProperlyPaired[row] << "\t"
+		 << nbAlReliable[row] << "\t"
+		 << getReliable2RawAlignmentRatio(row) << "\t"
+		 << nbAlR1Pos[row] << "\t"
+		 << nbAlR1Neg[row] << "\t"
+		 << nbAlR2Pos[row] << "\t"
+		 << nbAlR2Neg[row] << "\t"
+		 << entropy[row] << "\t"
+		 << meanMismatches[row] << "\t"
+		 << meanReadLength[row] << "\t"
+		 << maxMinAnchor[row] << "\t"
+		 << maxMMES[row] << "\t"
+		 << intronScore[row] << "\t"
+		 << hammingDistance5p[row] << "\t"
+		 << hammingDistance3p[row] << "\t"
+		 << codingPotential[row] << "\t"
+		 << positionWeightScore[row] << "\t"
+		 << splicingSignal[row] << "\t"
+		 << (bool)uniqueJunction[row] << "\t"
+		 << (bool)primaryJunction[row] << "\t"
+		 << nbUpstreamJunctions[row] << "\t"
+		 << nbDownstreamJunctions[row] << "\t"
+		 << distanceToNextUpstreamJunction[row] << "\t"
+		 << distanceToNextDownstreamJunction[row] << "\t"
+		 << distanceToNearestJunction[row] << "\t"
+		 << multipleMappingScore[row] << "\t"
+		 << coverage[row] << "\t"
+		 << nbUpstreamFlankingAlignments[row] << "\t"
+		 << nbDownstreamFlankingAlignments[row] << "\t"
+		 << nbSamples[row];
+	for (size_t i = 0; i < JAD_LENGTH; i++) {
+		strm << "\t" << junctionAnchorDepth[row][i];
+	}
+}
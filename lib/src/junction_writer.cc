@@ -0,0 +1,425 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+using std::ofstream;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+
+#include <portcullis/intron.hpp>
+#include <portcullis/junction_index.hpp>
+#include <portcullis/junction_writer.hpp>
+
+namespace portcullis {
+
+// Powers of ten up to the largest integer held exactly by a double
+static const double WRITER_POWERS_OF_TEN[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
+
+/**
+ * Tests whether the value is a whole number that %g or %f would print without an
+ * exponent, and that can be converted to an integer exactly.  Negative zero is
+ * excluded as it prints as "-0".
+ */
+static inline bool isPlainInteger(const double v, const int digits) {
+	return digits >= 0 && digits < 16 && std::fabs(v) < WRITER_POWERS_OF_TEN[digits] &&
+		   v == std::floor(v) && !(v == 0.0 && std::signbit(v));
+}
+
+/**
+ * Opens an output file, throwing if it can't be created
+ */
+static unique_ptr<ofstream> openOutput(const path& file) {
+	unique_ptr<ofstream> out(new ofstream(file.c_str(), std::ios::binary));
+	if (!*out) {
+		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+								  "Could not open file for writing: ") + file.string()));
+	}
+	return out;
+}
+
+}
+
+portcullis::TextBuffer& portcullis::TextBuffer::put(const uint64_t v) {
+	char tmp[20];
+	char* p = tmp + sizeof(tmp);
+	uint64_t x = v;
+	do {
+		*--p = (char)('0' + x % 10);
+		x /= 10;
+	}
+	while (x != 0);
+	data.append(p, tmp + sizeof(tmp) - p);
+	return *this;
+}
+
+portcullis::TextBuffer& portcullis::TextBuffer::put(const int64_t v) {
+	if (v < 0) {
+		data.push_back('-');
+		return put((uint64_t)0 - (uint64_t)v);
+	}
+	return put((uint64_t)v);
+}
+
+portcullis::TextBuffer& portcullis::TextBuffer::put(const double v, const int precision) {
+	if (isPlainInteger(v, precision)) {
+		return put((int64_t)v);
+	}
+	char tmp[64];
+	const int n = snprintf(tmp, sizeof(tmp), "%.*g", precision, v);
+	if (n < (int)sizeof(tmp)) {
+		data.append(tmp, n);
+	}
+	else {
+		const size_t offset = data.size();
+		data.resize(offset + n + 1);
+		snprintf(&data[offset], n + 1, "%.*g", precision, v);
+		data.resize(offset + n);
+	}
+	return *this;
+}
+
+portcullis::TextBuffer& portcullis::TextBuffer::putFixed(const double v, const int precision) {
+	if (isPlainInteger(v, 15)) {
+		put((int64_t)v);
+		if (precision > 0) {
+			data.push_back('.');
+			data.append(precision, '0');
+		}
+		return *this;
+	}
+	char tmp[64];
+	const int n = snprintf(tmp, sizeof(tmp), "%.*f", precision, v);
+	if (n < (int)sizeof(tmp)) {
+		data.append(tmp, n);
+	}
+	else {
+		const size_t offset = data.size();
+		data.resize(offset + n + 1);
+		snprintf(&data[offset], n + 1, "%.*f", precision, v);
+		data.resize(offset + n);
+	}
+	return *this;
+}
+
+
+struct portcullis::JunctionWriter::Chunk {
+	TextBuffer tab;
+	TextBuffer bed;
+	TextBuffer exonGFF;
+	TextBuffer intronGFF;
+	// Where each junction's line ends, for the indexed files
+	vector<size_t> tabEnds;
+	vector<size_t> bedEnds;
+};
+
+const size_t portcullis::JunctionWriter::CHUNK_SIZE;
+
+portcullis::JunctionWriter::JunctionWriter(const JunctionList& _junctions) : junctions(_junctions) {
+	source = "portcullis";
+	bedscore = false;
+	threads = 1;
+}
+
+void portcullis::JunctionWriter::format(const size_t begin, const size_t end, Chunk& chunk) const {
+	for (size_t i = begin; i < end; i++) {
+		const Junction& j = *junctions[i];
+		if (!tabFile.empty() || !indexedTabFile.empty()) {
+			putTabRow(chunk.tab, j);
+			chunk.tab.put('\n');
+			if (!indexedTabFile.empty()) {
+				chunk.tabEnds.push_back(chunk.tab.size());
+			}
+		}
+		if (!bedFile.empty() || !indexedBEDFile.empty()) {
+			putBED(chunk.bed, j, source, bedscore);
+			if (!indexedBEDFile.empty()) {
+				chunk.bedEnds.push_back(chunk.bed.size());
+			}
+		}
+		if (!exonGFFFile.empty()) {
+			putExonGFF(chunk.exonGFF, j, source);
+		}
+		if (!intronGFFFile.empty()) {
+			putIntronGFF(chunk.intronGFF, j, source);
+		}
+	}
+}
+
+void portcullis::JunctionWriter::writeIndexed(IndexedJunctionWriter& out, const size_t first, const TextBuffer& buf, const vector<size_t>& ends) const {
+	size_t begin = 0;
+	for (size_t k = 0; k < ends.size(); k++) {
+		const Intron& intron = *junctions[first + k]->getIntron();
+		out.writeLine(buf.str().data() + begin, ends[k] - begin, intron.ref.name, intron.start, intron.end);
+		begin = ends[k];
+	}
+}
+
+void portcullis::JunctionWriter::write() const {
+	unique_ptr<ofstream> tab, bed, exonGFF, intronGFF;
+	unique_ptr<IndexedJunctionWriter> indexedTab, indexedBED;
+	const string tabHeader = Junction::junctionOutputHeader() + "\n";
+	const string bedHeader = string("track name=\"junctions\" description=\"Portcullis V") + (version.empty() ? "X.X.X" : version) + " junctions\"\n";
+	if (!tabFile.empty()) {
+		tab = openOutput(tabFile);
+		*tab << tabHeader;
+	}
+	if (!bedFile.empty()) {
+		bed = openOutput(bedFile);
+		*bed << bedHeader;
+	}
+	if (!indexedTabFile.empty()) {
+		indexedTab.reset(new IndexedJunctionWriter(indexedTabFile, IndexedJunctionFormat::TAB));
+		indexedTab->writeHeader(tabHeader.data(), tabHeader.size());
+	}
+	if (!indexedBEDFile.empty()) {
+		indexedBED.reset(new IndexedJunctionWriter(indexedBEDFile, IndexedJunctionFormat::BED));
+		indexedBED->writeHeader(bedHeader.data(), bedHeader.size());
+	}
+	if (!exonGFFFile.empty()) {
+		exonGFF = openOutput(exonGFFFile);
+	}
+	if (!intronGFFFile.empty()) {
+		intronGFF = openOutput(intronGFFFile);
+	}
+	// Split into chunks, starting a new chunk at the start of each target
+	// sequence as well as every CHUNK_SIZE junctions
+	vector<size_t> bounds(1, 0);
+	for (size_t i = 1; i < junctions.size(); i++) {
+		if (i - bounds.back() >= CHUNK_SIZE || junctions[i]->getIntron()->ref.index != junctions[i - 1]->getIntron()->ref.index) {
+			bounds.push_back(i);
+		}
+	}
+	bounds.push_back(junctions.size());
+	const size_t nbChunks = junctions.empty() ? 0 : bounds.size() - 1;
+	// Format up to one chunk per thread at a time, then write them out in order
+	const size_t batchSize = std::max<size_t>(threads, 1);
+	vector<Chunk> chunks(std::min(batchSize, nbChunks));
+	for (size_t first = 0; first < nbChunks; first += batchSize) {
+		const size_t n = std::min(batchSize, nbChunks - first);
+		if (n == 1) {
+			format(bounds[first], bounds[first + 1], chunks[0]);
+		}
+		else {
+			vector<std::thread> workers;
+			for (size_t c = 0; c < n; c++) {
+				workers.push_back(std::thread(&JunctionWriter::format, this, bounds[first + c], bounds[first + c + 1], std::ref(chunks[c])));
+			}
+			for (auto& w : workers) {
+				w.join();
+			}
+		}
+		for (size_t c = 0; c < n; c++) {
+			Chunk& chunk = chunks[c];
+			if (tab) tab->write(chunk.tab.str().data(), chunk.tab.size());
+			if (bed) bed->write(chunk.bed.str().data(), chunk.bed.size());
+			if (exonGFF) exonGFF->write(chunk.exonGFF.str().data(), chunk.exonGFF.size());
+			if (intronGFF) intronGFF->write(chunk.intronGFF.str().data(), chunk.intronGFF.size());
+			if (indexedTab) writeIndexed(*indexedTab, bounds[first + c], chunk.tab, chunk.tabEnds);
+			if (indexedBED) writeIndexed(*indexedBED, bounds[first + c], chunk.bed, chunk.bedEnds);
+			chunk.tab.clear();
+			chunk.bed.clear();
+			chunk.exonGFF.clear();
+			chunk.intronGFF.clear();
+			chunk.tabEnds.clear();
+			chunk.bedEnds.clear();
+		}
+	}
+	if (tab) {
+		// The junction table has always ended with an empty line.  This is left
+		// out of the compressed table, as tabix can't index it.
+		*tab << "\n";
+	}
+	if (indexedTab) indexedTab->close();
+	if (indexedBED) indexedBED->close();
+	for (auto* out : {tab.get(), bed.get(), exonGFF.get(), intronGFF.get()}) {
+		if (out != nullptr) {
+			out->close();
+			if (!*out) {
+				BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
+										  "Error writing junction output files")));
+			}
+		}
+	}
+}
+
+void portcullis::JunctionWriter::putTabRow(TextBuffer& buf, const Junction& j) {
+	const Intron& intron = *j.intron;
+	buf.put(j.id).put('\t')
+	.put(intron.ref.index).put('\t').put(intron.ref.name).put('\t').put(intron.ref.length).put('\t')
+	.put(intron.start).put('\t').put(intron.end).put('\t')
+	.put(j.getIntronSize()).put('\t')
+	.put(j.leftAncStart).put('\t')
+	.put(j.rightAncEnd).put('\t')
+	.put(strandToChar(j.readStrand)).put('\t')
+	.put(strandToChar(j.ssStrand)).put('\t')
+	.put(strandToChar(j.consensusStrand)).put('\t')
+	.put(j.da1).put('\t')
+	.put(j.da2).put('\t')
+	.put(cssToChar(j.canonicalSpliceSites)).put('\t')
+	.put(j.score, 6).put('\t')
+	.put(j.suspicious, false).put('\t')
+	.put(j.pfp, false).put('\t')
+	.put(j.nbAlRaw).put('\t')
+	.put(j.nbAlDistinct).put('\t')
+	.put(j.getNbUniquelySplicedAlignments()).put('\t')
+	.put(j.nbAlMultiplySpliced).put('\t')
+	.put(j.nbAlUniquelyMapped).put('\t')
+	.put(j.getNbMultiplyMappedAlignments()).put('\t')
+	.put(j.nbAlBamProperlyPaired).put('\t')
+	.put(j.nbAlPortcullisProperlyPaired).put('\t')
+	.put(j.nbAlReliable).put('\t')
+	.put(j.getReliable2RawAlignmentRatio(), 6).put('\t')
+	.put(j.nbAlR1Pos).put('\t')
+	.put(j.nbAlR1Neg).put('\t')
+	.put(j.nbAlR2Pos).put('\t')
+	.put(j.nbAlR2Neg).put('\t')
+	.put(j.entropy, 6).put('\t')
+	.put(j.meanMismatches, 6).put('\t')
+	.put(j.meanReadLength, 6).put('\t')
+	.put(j.maxMinAnchor).put('\t')
+	.put(j.maxMMES).put('\t')
+	.put(j.intronScore, 6).put('\t')
+	.put(j.hammingDistance5p).put('\t')
+	.put(j.hammingDistance3p).put('\t')
+	.put(j.codingPotential, 6).put('\t')
+	.put(j.positionWeightScore, 6).put('\t')
+	.put(j.splicingSignal, 6).put('\t')
+	.put(j.uniqueJunction, false).put('\t')
+	.put(j.primaryJunction, false).put('\t')
+	.put(j.nbUpstreamJunctions).put('\t')
+	.put(j.nbDownstreamJunctions).put('\t')
+	.put(j.distanceToNextUpstreamJunction).put('\t')
+	.put(j.distanceToNextDownstreamJunction).put('\t')
+	.put(j.distanceToNearestJunction).put('\t')
+	.put(j.multipleMappingScore, 6).put('\t')
+	.put(j.coverage, 6).put('\t')
+	.put(j.nbUpstreamFlankingAlignments).put('\t')
+	.put(j.nbDownstreamFlankingAlignments).put('\t')
+	.put(j.nbSamples);
+	for (size_t i = 0; i < Junction::JAD_NAMES.size(); i++) {
+		buf.put('\t').put(j.junctionAnchorDepth[i]);
+	}
+}
+
+void portcullis::JunctionWriter::putBED(TextBuffer& buf, const Junction& j, const string& prefix, const bool bedscore) {
+	// Use intron strand if known, otherwise use the predicted strand,
+	// if predicted strand is also unknown then use "." to indicated unstranded
+	const char strand = j.consensusStrand == Strand::UNKNOWN ? '.' : strandToChar(j.consensusStrand);
+	const Intron& intron = *j.intron;
+	buf.put(intron.ref.name).put('\t') // chrom
+	.put(j.leftAncStart).put('\t') // chromstart
+	.put(j.rightAncEnd + 1).put('\t') // chromend (adding 1 as end position is exclusive)
+	.put(prefix).put('_').put(j.id).put('\t') // name
+	.putFixed(bedscore ? j.getScore() : j.getNbSplicedAlignments(), 3).put('\t') // Use the depth as the score for the moment
+	.put(strand).put('\t') // strand
+	.put(intron.start).put('\t') // thickstart
+	.put(intron.end + 1).put('\t') // thickend  (adding 1 as end position is exclusive)
+	.put("255,0,0\t") // Just use red for the moment
+	.put("2\t") // 2 blocks: Left and right block
+	.put(intron.start - j.leftAncStart).put(',').put(j.rightAncEnd - intron.end).put('\t') // block sizes
+	.put("0,").put(intron.end - j.leftAncStart + 1).put('\n'); // block starts
+}
+
+void portcullis::JunctionWriter::putExonGFF(TextBuffer& buf, const Junction& j, const string& source) {
+	const char strand = j.consensusStrand == Strand::UNKNOWN ? '?' : strandToChar(j.consensusStrand);
+	const Intron& intron = *j.intron;
+	// Junction parent, with coordinates 1-based and end inclusive
+	buf.put(intron.ref.name).put('\t')
+	.put(source).put('\t')
+	.put("match\t")
+	.put(j.leftAncStart + 1).put('\t')
+	.put(j.rightAncEnd + 1).put('\t')
+	.put("0.0\t")
+	.put(strand).put('\t')
+	.put(".\t")
+	.put("ID=junc_").put(j.id).put(';')
+	.put("Name=junc_").put(j.id).put(';')
+	.put("Note=cov:").put(j.nbAlRaw)
+	.put("|rel:").put(j.nbAlReliable)
+	.put("|ent:").put(j.entropy, 4)
+	.put("|maxmmes:").put(j.maxMMES)
+	.put("|ham:").put(std::min(j.hammingDistance3p, j.hammingDistance5p)).put(';')
+	.put("mult=").put(j.nbAlRaw).put(';')
+	.put("grp=junc_").put(j.id).put(';')
+	.put("src=E;")
+	// Condensed description, as Junction::condensedOutputDescription with ";"
+	.put("Strand: ").put(strandToString(j.consensusStrand)).put(';')
+	.put("Canonical?=").put(cssToString(j.canonicalSpliceSites)).put(';')
+	.put("Score=").put(j.score, 9).put(';')
+	.put("NbAlignments=").put(j.getNbSplicedAlignments()).put(';')
+	.put("NbDistinct=").put(j.nbAlDistinct).put(';')
+	.put("NbReliable=").put(j.nbAlReliable).put(';')
+	.put("Entropy=").put(j.entropy, 9).put(';')
+	.put("MaxMMES=").put(j.maxMMES).put(';')
+	.put("HammingDistance5=").put(j.hammingDistance5p).put(';')
+	.put("HammingDistance3=").put(j.hammingDistance3p).put(';')
+	.put("UniqueJunction=").put(j.uniqueJunction, true).put(';')
+	.put("PrimaryJunction=").put(j.primaryJunction, true).put(';')
+	.put('\n');
+	// Left exonic region
+	buf.put(intron.ref.name).put('\t')
+	.put(source).put('\t')
+	.put("match_part\t")
+	.put(j.leftAncStart + 1).put('\t')
+	.put(intron.start).put('\t')
+	.put("0.0\t")
+	.put(strand).put('\t')
+	.put(".\t")
+	.put("ID=junc_").put(j.id).put("_left;")
+	.put("Parent=junc_").put(j.id).put('\n');
+	// Right exonic region
+	buf.put(intron.ref.name).put('\t')
+	.put(source).put('\t')
+	.put("match_part\t")
+	.put(intron.end + 2).put('\t')
+	.put(j.rightAncEnd + 1).put('\t')
+	.put("0.0\t")
+	.put(strand).put('\t')
+	.put(".\t")
+	.put("ID=junc_").put(j.id).put("_right;")
+	.put("Parent=junc_").put(j.id).put('\n');
+}
+
+void portcullis::JunctionWriter::putIntronGFF(TextBuffer& buf, const Junction& j, const string& source) {
+	const char strand = j.consensusStrand == Strand::UNKNOWN ? '?' : strandToChar(j.consensusStrand);
+	const Intron& intron = *j.intron;
+	// Coordinates are 1-based and end inclusive
+	buf.put(intron.ref.name).put('\t')
+	.put(source).put('\t')
+	.put("intron\t")
+	.put(intron.start + 1).put('\t')
+	.put(intron.end + 1).put('\t')
+	.put(j.nbAlRaw).put('\t')
+	.put(strand).put('\t')
+	.put(".\t")
+	.put("mult=").put(j.nbAlRaw).put(';') // Coverage for augustus
+	.put("grp=junc_").put(j.id).put(';') // ID for augustus
+	.put("src=E") // Source for augustus
+	.put('\n');
+}
@@ -62,6 +62,8 @@ void portcullis::ml::ModelFeatures::initGenomeMapper(const path& genomeFile) {
 	gmap.setGenomeFile(genomeFile);
 	// Load the fasta index
 	gmap.loadFastaIndex();
+	// Keep reference sequences in memory, we do lots of small fetches
+	gmap.enableCache(DEFAULT_GENOME_CACHE_SIZE);
 }
 
 uint32_t portcullis::ml::ModelFeatures::calcIntronThreshold(const JunctionList& juncs) {
@@ -0,0 +1,224 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+using std::endl;
+using std::ifstream;
+using std::ofstream;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+using boost::lexical_cast;
+namespace bfs = boost::filesystem;
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_alignment.hpp>
+#include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/bam_merger.hpp>
+#include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bam_writer.hpp>
+
+#include <portcullis/bam/spliced_spill.hpp>
+
+portcullis::bam::SplicedSpill::SplicedSpill(const path& _indexFile) {
+	indexFile = _indexFile;
+	nbAlignments = 0;
+}
+
+path portcullis::bam::SplicedSpill::getBucketFile(const size_t index) const {
+	return path(indexFile.string() + "." + lexical_cast<string>(index) + ".bam");
+}
+
+uint64_t portcullis::bam::SplicedSpill::getNbSplicedAlignments() const {
+	uint64_t count = 0;
+	for (const auto& b : buckets) {
+		count += b.nbAlignments;
+	}
+	return count;
+}
+
+void portcullis::bam::SplicedSpill::create(const vector<path>& inputs, const uint16_t ioThreads, const size_t nbBuckets) {
+	buckets.clear();
+	refStats.clear();
+	nbAlignments = 0;
+	vector<unique_ptr<BamReader>> readers;
+	vector<bam_hdr_t*> headers;
+	for (const auto& input : inputs) {
+		readers.push_back(unique_ptr<BamReader>(new BamReader(input, ioThreads)));
+		readers.back()->open();
+		headers.push_back(readers.back()->getHeader());
+	}
+	vector<vector<int32_t>> tidMaps;
+	std::unique_ptr<bam_hdr_t, void(*)(bam_hdr_t*)> header(BamMerger::mergeHeaders(headers, tidMaps), bam_hdr_destroy);
+	// Split the target sequences into buckets covering roughly equal lengths of
+	// the genome
+	uint64_t totalLength = 0;
+	for (int32_t t = 0; t < header->n_targets; t++) {
+		totalLength += header->target_len[t];
+	}
+	const uint64_t bucketLength = std::max((uint64_t)1, totalLength / std::max(nbBuckets, (size_t)1));
+	vector<size_t> bucketOf(header->n_targets);
+	uint64_t length = 0;
+	for (int32_t t = 0; t < header->n_targets; t++) {
+		if (buckets.empty() || (length > 0 && length + header->target_len[t] > bucketLength)) {
+			buckets.push_back(SpillBucket());
+			buckets.back().refId = t;
+			length = 0;
+		}
+		buckets.back().lastRefId = t;
+		bucketOf[t] = buckets.size() - 1;
+		length += header->target_len[t];
+	}
+	refStats.resize(header->n_targets);
+	vector<unique_ptr<BamWriter>> writers;
+	try {
+		for (size_t i = 0; i < buckets.size(); i++) {
+			// Buckets are small and there may be many of them, so don't use extra threads
+			writers.push_back(unique_ptr<BamWriter>(new BamWriter(getBucketFile(i), 0, DEFAULT_SORT_RUN_COMPRESSION)));
+			writers.back()->open(header.get());
+		}
+		for (size_t i = 0; i < readers.size(); i++) {
+			const vector<int32_t>& tidMap = tidMaps[i];
+			bam1_t* b = nullptr;
+			while ((b = readers[i]->nextRaw()) != nullptr) {
+				nbAlignments++;
+				// Alignments without a target sequence play no part in junction finding
+				if (b->core.tid < 0) {
+					continue;
+				}
+				b->core.tid = tidMap[b->core.tid];
+				if (b->core.mtid >= 0) {
+					b->core.mtid = tidMap[b->core.mtid];
+				}
+				const bool spliced = BamAlignment::isSplicedRead(b);
+				refStats[b->core.tid].add(b, spliced);
+				if (spliced) {
+					const size_t bucket = bucketOf[b->core.tid];
+					buckets[bucket].nbAlignments++;
+					writers[bucket]->write(b);
+				}
+			}
+			readers[i]->close();
+		}
+		for (auto& w : writers) {
+			w->close();
+		}
+		// Write the index last, so it only exists if the spill is complete
+		ofstream out(indexFile.string());
+		out << "# Portcullis spliced alignment spill" << endl
+			<< "alignments\t" << nbAlignments << endl;
+		for (const auto& bucket : buckets) {
+			out << "bucket\t" << bucket.refId << "\t" << bucket.lastRefId << "\t" << bucket.nbAlignments << endl;
+		}
+		for (size_t t = 0; t < refStats.size(); t++) {
+			const SpillRefStats& s = refStats[t];
+			out << "ref\t" << t << "\t" << s.splicedCount << "\t" << s.unsplicedCount << "\t"
+				<< s.sumQueryLengths << "\t" << s.minQueryLength << "\t" << s.maxQueryLength << endl;
+		}
+		out.close();
+		if (!out) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not write spliced alignment index: ") + indexFile.string()));
+		}
+	}
+	catch (...) {
+		writers.clear();
+		for (size_t i = 0; i < buckets.size(); i++) {
+			bfs::remove(getBucketFile(i));
+		}
+		bfs::remove(indexFile);
+		throw;
+	}
+}
+
+void portcullis::bam::SplicedSpill::load() {
+	buckets.clear();
+	refStats.clear();
+	nbAlignments = 0;
+	ifstream in(indexFile.string());
+	if (!in) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not open spliced alignment index: ") + indexFile.string()));
+	}
+	string line;
+	while (std::getline(in, line)) {
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+		std::istringstream fields(line);
+		string type;
+		fields >> type;
+		bool valid = false;
+		if (type == "alignments") {
+			valid = (bool)(fields >> nbAlignments);
+		}
+		else if (type == "bucket") {
+			SpillBucket bucket;
+			valid = (bool)(fields >> bucket.refId >> bucket.lastRefId >> bucket.nbAlignments);
+			buckets.push_back(bucket);
+		}
+		else if (type == "ref") {
+			// Target sequences are listed in order
+			size_t t = 0;
+			SpillRefStats s;
+			valid = (fields >> t >> s.splicedCount >> s.unsplicedCount >> s.sumQueryLengths >> s.minQueryLength >> s.maxQueryLength) && t == refStats.size();
+			refStats.push_back(s);
+		}
+		if (!valid) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Invalid line in spliced alignment index ") + indexFile.string() + ": " + line));
+		}
+	}
+}
+
+void portcullis::bam::SplicedSpill::readBucket(const size_t index, SortBuffer& buffer) const {
+	buffer.clear();
+	BamReader reader(getBucketFile(index));
+	reader.open();
+	bam1_t* b = nullptr;
+	while ((b = reader.nextRaw()) != nullptr) {
+		buffer.add(b);
+	}
+	reader.close();
+	// Alignments were added in input order, which breaks any ties
+	std::sort(buffer.entries.begin(), buffer.entries.end());
+}
+
+void portcullis::bam::SplicedSpill::remove() {
+	if (bfs::exists(indexFile)) {
+		try {
+			load();
+		}
+		catch (BamException& e) {
+			// Nothing useful can be salvaged from a bad index, so just remove it
+		}
+		for (size_t i = 0; i < buckets.size(); i++) {
+			bfs::remove(getBucketFile(i));
+		}
+		bfs::remove(indexFile);
+	}
+}
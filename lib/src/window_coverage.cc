@@ -0,0 +1,157 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+using std::pair;
+using std::string;
+using std::vector;
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/window_coverage.hpp>
+
+portcullis::bam::WindowCoverage::WindowCoverage() : first(0), lastPos(INT32_MIN), finalised(false) {
+}
+
+void portcullis::bam::WindowCoverage::addWindow(int32_t start, int32_t end) {
+	start = std::max(start, 0);
+	if (end > start) {
+		requested.push_back(pair<int32_t, int32_t>(start, end));
+	}
+}
+
+void portcullis::bam::WindowCoverage::prepare() {
+	std::sort(requested.begin(), requested.end());
+	starts.clear();
+	ends.clear();
+	for (const auto& w : requested) {
+		if (!ends.empty() && w.first <= ends.back()) {
+			ends.back() = std::max(ends.back(), w.second);
+		}
+		else {
+			starts.push_back(w.first);
+			ends.push_back(w.second);
+		}
+	}
+	requested.clear();
+	requested.shrink_to_fit();
+	// Each window gets an extra slot to hold the difference at its end
+	offsets.resize(starts.size());
+	size_t total = 0;
+	for (size_t w = 0; w < starts.size(); w++) {
+		offsets[w] = total;
+		total += ends[w] - starts[w] + 1;
+	}
+	depths.assign(total, 0);
+	first = 0;
+	lastPos = INT32_MIN;
+	finalised = false;
+}
+
+void portcullis::bam::WindowCoverage::addBlock(int32_t start, int32_t end, size_t w) {
+	for (; w < starts.size() && starts[w] < end; w++) {
+		if (ends[w] > start) {
+			const int32_t s = std::max(start, starts[w]);
+			const int32_t e = std::min(end, ends[w]);
+			depths[offsets[w] + s - starts[w]]++;
+			depths[offsets[w] + e - starts[w]]--;
+		}
+	}
+}
+
+void portcullis::bam::WindowCoverage::addAlignment(const bam1_t* b) {
+	if (finalised) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Can't add alignments to coverage after it has been finalised")));
+	}
+	const int32_t pos = b->core.pos;
+	if (pos < lastPos) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Alignments must be added to coverage in coordinate order")));
+	}
+	lastPos = pos;
+	// Windows ending before this alignment starts can't be touched by this or any
+	// later alignment
+	while (first < starts.size() && ends[first] <= pos) {
+		first++;
+	}
+	if (first >= starts.size()) {
+		return;
+	}
+	const uint32_t* cigar = bam_get_cigar(b);
+	int32_t rPos = pos;
+	size_t w = first;
+	for (uint32_t i = 0; i < b->core.n_cigar && w < starts.size(); i++) {
+		const int op = bam_cigar_op(cigar[i]);
+		const int32_t len = bam_cigar_oplen(cigar[i]);
+		if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) {
+			// Blocks are in order, so skip windows ending before this one
+			while (w < starts.size() && ends[w] <= rPos) {
+				w++;
+			}
+			addBlock(rPos, rPos + len, w);
+		}
+		if (bam_cigar_type(op) & 2) {
+			rPos += len;
+		}
+	}
+}
+
+void portcullis::bam::WindowCoverage::finalise() {
+	if (finalised) {
+		return;
+	}
+	for (size_t w = 0; w < starts.size(); w++) {
+		int32_t depth = 0;
+		const size_t end = offsets[w] + ends[w] - starts[w];
+		for (size_t i = offsets[w]; i < end; i++) {
+			depth += depths[i];
+			depths[i] = depth;
+		}
+		depths[end] = 0;
+	}
+	finalised = true;
+}
+
+uint32_t portcullis::bam::WindowCoverage::getDepth(int32_t pos) const {
+	// Find the last window starting at or before pos
+	auto it = std::upper_bound(starts.begin(), starts.end(), pos);
+	if (it == starts.begin()) {
+		return 0;
+	}
+	const size_t w = (it - starts.begin()) - 1;
+	return pos < ends[w] ? (uint32_t)depths[offsets[w] + pos - starts[w]] : 0;
+}
+
+uint64_t portcullis::bam::WindowCoverage::sumDepths(int32_t start, int32_t end) const {
+	uint64_t sum = 0;
+	auto it = std::upper_bound(starts.begin(), starts.end(), start);
+	size_t w = it == starts.begin() ? 0 : (it - starts.begin()) - 1;
+	for (; w < starts.size() && starts[w] <= end; w++) {
+		const int32_t s = std::max(start, starts[w]);
+		const int32_t e = std::min(end + 1, ends[w]);
+		for (int32_t p = s; p < e; p++) {
+			sum += depths[offsets[w] + p - starts[w]];
+		}
+	}
+	return sum;
+}
@@ -38,7 +38,11 @@ namespace po = boost::program_options;
 
 #include <portcullis/bam/bam_reader.hpp>
 #include <portcullis/bam/bam_writer.hpp>
+#include <portcullis/junction_file.hpp>
+#include <portcullis/junction_table.hpp>
 using namespace portcullis::bam;
+using portcullis::JunctionFile;
+using portcullis::JunctionTable;
 
 #include "bam_filter.hpp"
 
@@ -53,6 +57,7 @@ portcullis::BamFilter::BamFilter(const path& _junctionFile, const path& _bamFile
 	clipMode = ClipMode::HARD;
 	saveMSRs = false;
 	useCsi = false;
+	ioThreads = 0;
 	// Test if provided genome exists
 	if (!bfs::exists(junctionFile)) {
 		BOOST_THROW_EXCEPTION(BamFilterException() << BamFilterErrorInfo(string(
@@ -151,10 +156,19 @@ BamAlignmentPtr portcullis::BamFilter::clipMSR(const BamAlignment& al, const Ref
 
 void portcullis::BamFilter::filter() {
 	cout << "Loading junctions from: " << junctionFile << endl;
-	// Load junction system
-	JunctionSystem js(junctionFile);
+	// Load junction system.  We only need the junction locations, so avoid
+	// reading any of the other columns.
+	const vector<string> locationColumns = {"start", "end", "leftAncStart", "rightAncEnd"};
+	JunctionTable table;
+	if (JunctionFile::isJunctionFile(junctionFile)) {
+		JunctionFile(junctionFile).read(table, locationColumns);
+	}
+	else {
+		table.load(junctionFile, locationColumns, 1);
+	}
+	JunctionSystem js(table);
 	cout << " - Found " << js.size() << " junctions" << endl << endl;
-	BamReader reader(bamFile);
+	BamReader reader(bamFile, ioThreads);
 	reader.open();
 	shared_ptr<RefSeqPtrList> refs = reader.createRefList();
 	js.setRefs(refs);
@@ -173,11 +187,12 @@ void portcullis::BamFilter::filter() {
 								  "File exists with name of suggested output directory: ") + outDir.string()));
 	}
 	cout << " - Processing alignments from: " << bamFile << endl;
-	BamWriter writer(outputBam);
+	BamWriter writer(outputBam, ioThreads);
+	writer.setIndex(useCsi);
 	writer.open(reader.getHeader());
 	cout << " - Saving filtered alignments to: " << outputBam << endl;
-	BamWriter mod(outputBam.string() + ".mod.bam");
-	BamWriter unmod(outputBam.string() + ".unmod.bam");
+	BamWriter mod(outputBam.string() + ".mod.bam", ioThreads);
+	BamWriter unmod(outputBam.string() + ".unmod.bam", ioThreads);
 	if (saveMSRs) {
 		mod.open(reader.getHeader());
 		unmod.open(reader.getHeader());
@@ -221,7 +236,17 @@ void portcullis::BamFilter::filter() {
 		}
 	}
 	reader.close();
-	writer.close();
+	try {
+		// Also saves the index
+		writer.close();
+	}
+	catch (BamException& e) {
+		// Pass on what went wrong, which may be writing, sorting or indexing
+		const string* info = boost::get_error_info<BamErrorInfo>(e);
+		BOOST_THROW_EXCEPTION(BamFilterException() << BamFilterErrorInfo(string(
+								  "Problem finishing output BAM: ") + outputBam.string() + "\n" +
+								  (info != nullptr ? *info : boost::diagnostic_information(e))));
+	}
 	if (saveMSRs) {
 		mod.close();
 		unmod.close();
@@ -229,18 +254,6 @@ void portcullis::BamFilter::filter() {
 	cout << "done." << endl;
 	uint32_t diff = nbReadsIn - nbReadsOut;
 	cout << "Filtered out " << diff << " alignments.  In: " << nbReadsIn << "; Out: " << nbReadsOut << " (Modified: " << nbReadsModifiedOut << ");" << endl << endl;
-	cout << "Indexing:" << endl;
-	cout << " - filtered alignments ... ";
-	cout.flush();
-	// Create BAM index
-	string indexCmd = BamHelper::createIndexBamCmd(outputBam, useCsi);
-	int indexExitCode = system(indexCmd.c_str());
-	if (indexExitCode != 0) {
-        BOOST_THROW_EXCEPTION(BamFilterException() << BamFilterErrorInfo(string(
-									  "Problem indexing output BAM: ") + outputBam.string()));
-    }
-    
-    cout << "done." << endl;
 }
 
 
@@ -254,6 +267,7 @@ int portcullis::BamFilter::main(int argc, char *argv[]) {
 	string clipMode;
 	bool saveMSRs;
 	bool useCsi;
+	uint16_t ioThreads;
 	bool verbose;
 	bool help;
 	struct winsize w;
@@ -275,6 +289,8 @@ int portcullis::BamFilter::main(int argc, char *argv[]) {
 	 "Whether or not to output modified MSRs to a separate file.  If true will output to a file with name specified by output with \".msr.bam\" extension")
 	("use_csi,c", po::bool_switch(&useCsi)->default_value(false),
 	 "Whether to use CSI indexing rather than BAI indexing.  CSI has the advantage that it supports very long target sequences (probably not an issue unless you are working on huge genomes).  BAI has the advantage that it is more widely supported (useful for viewing in genome browsers).")
+	("io_threads", po::value<uint16_t>(&ioThreads)->default_value(0),
+	 "The number of additional threads to use for compressing each BAM file written.  Reading only ever uses one extra thread per BAM file, which reads ahead when this is greater than 0.")
 	("verbose,v", po::bool_switch(&verbose)->default_value(false),
 	 "Print extra information")
 	("help", po::bool_switch(&help)->default_value(false), "Produce help message")
@@ -283,7 +299,7 @@ int portcullis::BamFilter::main(int argc, char *argv[]) {
 	// in config file, but will not be shown to the user.
 	po::options_description hidden_options("Hidden options");
 	hidden_options.add_options()
-	("junction-file,g", po::value<path>(&junctionFile), "Path to the junction file containing good junctions.")
+	("junction-file,g", po::value<path>(&junctionFile), "Path to the junction tab or binary junction file containing good junctions.")
 	("bam-file,g", po::value<path>(&bamFile), "Path to the BAM file to filter.")
 	;
 	// Positional option for the input bam file
@@ -315,6 +331,7 @@ int portcullis::BamFilter::main(int argc, char *argv[]) {
 	filter.setClipMode(clipFromString(clipMode));
 	filter.setSaveMSRs(saveMSRs);
 	filter.setUseCsi(useCsi);
+	filter.setIoThreads(ioThreads);
 	filter.setVerbose(verbose);
 	filter.filter();
 	return 0;
@@ -91,6 +91,7 @@ private:
 	ClipMode clipMode;
 	bool saveMSRs;
 	bool useCsi;
+	uint16_t ioThreads;
 	bool verbose;
 
 public:
@@ -181,6 +182,14 @@ public:
 		this->useCsi = useCsi;
 	}
 
+	uint16_t getIoThreads() const {
+		return ioThreads;
+	}
+
+	void setIoThreads(uint16_t ioThreads) {
+		this->ioThreads = ioThreads;
+	}
+
 	bool isVerbose() const {
 		return verbose;
 	}
@@ -16,6 +16,8 @@
 //  *******************************************************************
 
 #include <sys/ioctl.h>
+#include <atomic>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
@@ -29,6 +31,7 @@ using std::cerr;
 using std::endl;
 using std::ofstream;
 using std::unique_lock;
+using std::lock_guard;
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/path.hpp>
@@ -47,6 +50,8 @@ namespace po = boost::program_options;
 #include <portcullis/bam/bam_writer.hpp>
 #include <portcullis/bam/depth_parser.hpp>
 #include <portcullis/bam/genome_mapper.hpp>
+#include <portcullis/bam/evidence_file.hpp>
+#include <portcullis/bam/spliced_spill.hpp>
 #include <portcullis/seq_utils.hpp>
 using namespace portcullis::bam;
 
@@ -65,8 +70,14 @@ portcullis::JunctionBuilder::JunctionBuilder(const path& _prepDir, const path& _
 	outputDir = _output.empty() ? path(".") : _output.parent_path();
 	outputPrefix = _output.empty() ? "portcullis" : _output.leaf().string();
 	threads = 1;
+	chunkSize = DEFAULT_JUNC_CHUNK_SIZE;
+	batchSize = DEFAULT_JUNC_BATCH_SIZE;
+	ioThreads = 0;
+	bamCompression = DEFAULT_JUNC_BAM_COMPRESSION;
 	extra = false;
 	useCsi = false;
+	outputBinary = false;
+	outputIndexed = false;
 	strandSpecific = Strandedness::UNKNOWN;
 	source = "portcullis";
 	verbose = false;
@@ -89,31 +100,53 @@ void portcullis::JunctionBuilder::process() {
 									  "Could not create output directory at: ") + outputDir.string()));
 		}
 	}
-	if (!bfs::exists(prepData.getSortedBamFilePath())) {
-		BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
-								  "Could not find prepared BAM file at: ") + prepData.getSortedBamFilePath().string()));
-	}
-	// Test if we have all the required data
-	if (!prepData.valid(useCsi)) {
-		BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
-								  "Prepared data is not complete: ") + prepData.getPrepDir().string()));
+	// Must separate BAMs if extra metrics are requested
+	if (extra && !separate) {
+		separate = true;
+		cerr << "Warning: User requested that separated BAMS should not be output but user did request extra metrics to be calculated.  This requires separated BAMs to be produced." << endl << endl;
 	}
+	// If only the spliced alignments were prepared then use those, as long as
+	// nothing needs the unspliced alignments
 	const path sortedBamFile = prepData.getSortedBamFilePath();
+	spill.reset();
+	if (!bfs::exists(sortedBamFile) && !bfs::symbolic_link_exists(sortedBamFile) && bfs::exists(prepData.getSplicedSpillFilePath())) {
+		if (separate) {
+			BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+									  "Prepared data only contains the spliced alignments, which is not enough to separate BAMs or calculate extra metrics.  Run \"portcullis prep\" without --spliced_only first: ") + prepData.getPrepDir().string()));
+		}
+		if (!prepData.validSpliced()) {
+			BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+									  "Prepared data is not complete: ") + prepData.getPrepDir().string()));
+		}
+		spill = make_shared<SplicedSpill>(prepData.getSplicedSpillFilePath());
+		spill->load();
+	}
+	else {
+		if (!bfs::exists(sortedBamFile)) {
+			BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+									  "Could not find prepared BAM file at: ") + sortedBamFile.string()));
+		}
+		// Test if we have all the required data
+		if (!prepData.valid(useCsi)) {
+			BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+									  "Prepared data is not complete: ") + prepData.getPrepDir().string()));
+		}
+	}
 	// Acquire list of reference sequences
-	BamReader reader(prepData.getSortedBamFilePath());
+	BamReader reader(spill ? spill->getBucketFile(0) : sortedBamFile);
 	reader.open();
 	refs = reader.createRefList();
 	refMap = reader.createRefMap(*refs);
 	reader.close();
 	junctionSystem.setRefs(refs);
-	if (refs->size() < threads) {
-		cerr << "Warning: User requested " << threads << " threads but there are only " << refs->size() << " target sequences to process.  Setting number of threads to " << refs->size() << "." << endl << endl;
-		threads = refs->size();
-	}
-	// Must separate BAMs if extra metrics are requested
-	if (extra && !separate) {
-		separate = true;
-		cerr << "Warning: User requested that separated BAMS should not be output but user did request extra metrics to be calculated.  This requires separated BAMs to be produced." << endl << endl;
+	// Prefer the junction evidence, if prepared, to reading alignments
+	evidence.reset();
+	if (bfs::exists(prepData.getJunctionEvidenceFilePath())) {
+		evidence = make_shared<EvidenceFile>(prepData.getJunctionEvidenceFilePath());
+		if ((size_t)evidence->getNbRefs() != refs->size()) {
+			BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+									  "Junction evidence does not match the prepared alignments: ") + evidence->getFile().string()));
+		}
 	}
 	// Output settings requested
 	cout << "Settings:" << endl
@@ -122,7 +155,10 @@ void portcullis::JunctionBuilder::process() {
 		 << " - BAM Read Orientation: " << orientationToString(orientation) << endl
 		 << " - BAM Indexing mode: " << (useCsi ? "CSI" : "BAI") << endl
 		 << " - Threads: " << threads << endl
+		 << " - I/O threads (per BAM file): " << ioThreads << endl
 		 << " - Separate BAMs: " << separate << endl
+		 << " - Spliced alignments only: " << isSplicedOnly() << endl
+		 << " - Junction evidence: " << hasJunctionEvidence() << endl
 		 //<< " - Calculate additional metrics: " << extra << endl
 		 << endl;
 	cout << reader.bamDetails() << endl;
@@ -136,7 +172,7 @@ void portcullis::JunctionBuilder::process() {
 		calcExtraMetrics();
 	}
 	cout << "Saving junctions: " << endl;
-	junctionSystem.saveAll(path(outputDir.string() + "/" + outputPrefix), source, false, this->outputExonGFF, this->outputIntronGFF);
+	junctionSystem.saveAll(path(outputDir.string() + "/" + outputPrefix), source, false, this->outputExonGFF, this->outputIntronGFF, this->outputBinary, this->outputIndexed, this->threads);
 
 	// Also do a strand analysis as this is cheap and quick to do.
 	std::pair<Orientation, Strandedness> actual_config = junctionSystem.determineStrandedness(true);
@@ -151,47 +187,153 @@ void portcullis::JunctionBuilder::process() {
 
 void portcullis::JunctionBuilder::separateBams() {
 	auto_cpu_timer timer(1, " = Wall time taken: %ws\n\n");
-	uint64_t splicedCount = 0;
-	uint64_t unsplicedCount = 0;
-	uint64_t unmappedCount = 0;
+	const path sortedBamFile = prepData.getSortedBamFilePath();
 	const path unsplicedFile = getUnsplicedBamFile();
 	const path splicedFile = getSplicedBamFile();
 	const path unmappedFile = getUnmappedBamFile();
-	BamWriter unsplicedWriter(unsplicedFile);
-	BamWriter splicedWriter(splicedFile);
-	BamWriter unmappedWriter(unmappedFile);
-	BamReader reader(prepData.getSortedBamFilePath());
+	BamReader reader(sortedBamFile);
 	reader.open();
-	cout << "Splitting BAM:" << endl;
-	if (threads > 1) {
-		cerr << " - Note: this part of the pipeline is single threaded." << endl;
+	// Split the target sequences into groups of roughly equal numbers of alignments,
+	// according to the BAM index, with a few groups per thread so the load stays
+	// balanced.  Targets without stats in the index get a group to themselves.
+	uint64_t total = 0;
+	vector<int64_t> mapped(refs->size());
+	for (size_t i = 0; i < refs->size(); i++) {
+		mapped[i] = reader.getNbMappedAlignments(refs->at(i)->index);
+		total += max((int64_t)0, mapped[i]);
 	}
+	const uint64_t groupSize = max(DEFAULT_JUNC_BATCH_SIZE, total / (threads * 4 + 1));
+	vector<shared_ptr<SeparateGroup>> groups;
+	uint64_t groupCount = groupSize;
+	for (size_t i = 0; i < refs->size(); i++) {
+		if (mapped[i] < 0 || groupCount >= groupSize) {
+			groups.push_back(make_shared<SeparateGroup>());
+			groups.back()->refId = refs->at(i)->index;
+			groupCount = 0;
+		}
+		groups.back()->lastRefId = refs->at(i)->index;
+		groupCount = mapped[i] < 0 ? groupSize : groupCount + mapped[i];
+	}
+	// Finally any alignments without a position
+	groups.push_back(make_shared<SeparateGroup>());
+	groups.back()->refId = -1;
+	groups.back()->lastRefId = -1;
+	cout << "Splitting BAM:" << endl;
+	BamWriter unsplicedWriter(unsplicedFile, ioThreads, bamCompression);
+	BamWriter splicedWriter(splicedFile, ioThreads, bamCompression);
+	BamWriter unmappedWriter(unmappedFile, ioThreads, bamCompression);
+	// Alignments come out in the same order as the input, so the spliced and
+	// unspliced BAMs can be indexed as they are written
+	unsplicedWriter.setIndex(useCsi);
+	splicedWriter.setIndex(useCsi);
 	cout << " - Saving unspliced alignments to: " << unsplicedFile << endl;
 	unsplicedWriter.open(reader.getHeader());
 	cout << " - Saving spliced alignments to: " << splicedFile << endl;
 	splicedWriter.open(reader.getHeader());
 	cout << " - Saving unmapped reads to: " << unmappedFile << endl;
 	unmappedWriter.open(reader.getHeader());
-	cout << " - Processing BAM ...";
+	cout << " - Processing BAM in " << groups.size() << " groups of target sequences ...";
 	cout.flush();
-	while (reader.next()) {
-		const BamAlignment& al = reader.current();
-		if (al.isSplicedRead()) {
-			splicedWriter.write(al);
-			splicedCount++;
-			if (extra) {
-				// Record alignment name in map
-				size_t code = std::hash<string>()(al.deriveName());
-				splicedAlignmentMap[code]++;
+	// Classify the alignments in parallel, each thread taking the next group in
+	// order, while this thread writes out the groups in order as they become
+	// available
+	std::atomic<size_t> nextGroup(0);
+	const size_t nbWorkers = min((size_t)threads, groups.size());
+	// If any thread fails, stop handing out groups and wake everything waiting on
+	// one, so that all the workers can be joined before rethrowing the error.  The
+	// last error slot is for this thread.
+	vector<std::exception_ptr> errors(nbWorkers + 1);
+	auto cancel = [&]() {
+		nextGroup = groups.size();
+		for (auto& group : groups) {
+			{
+				lock_guard<mutex> lock(group->chunksMutex);
+				group->cancelled = true;
 			}
+			group->chunksCondition.notify_all();
 		}
-		else if (al.isMapped()) {
-			unsplicedWriter.write(al);
-			unsplicedCount++;
+	};
+	auto worker = [&](const size_t w) {
+		try {
+			BamReader groupReader(sortedBamFile);
+			groupReader.open();
+			for (size_t g = nextGroup++; g < groups.size(); g = nextGroup++) {
+				classifyAlignments(groupReader, *groups[g]);
+			}
+			groupReader.close();
 		}
-		else {
-			unmappedWriter.write(al);
-			unmappedCount++;
+		catch (...) {
+			errors[w] = std::current_exception();
+			cancel();
+		}
+	};
+	vector<thread> workers;
+	for (size_t i = 0; i < nbWorkers; i++) {
+		workers.push_back(thread(worker, i));
+	}
+	uint64_t splicedCount = 0;
+	uint64_t unsplicedCount = 0;
+	uint64_t unmappedCount = 0;
+	bam1_t b;
+	try {
+		bool cancelled = false;
+		for (size_t g = 0; g < groups.size(); g++) {
+			SeparateGroup& group = *groups[g];
+			while (true) {
+				shared_ptr<vector<uint8_t>> chunk;
+				{
+					unique_lock<mutex> lock(group.chunksMutex);
+					group.chunksCondition.wait(lock, [&] { return !group.chunks.empty() || group.done || group.cancelled; });
+					cancelled = group.cancelled;
+					if (cancelled || group.chunks.empty()) {
+						break;
+					}
+					chunk = group.chunks.front();
+					group.chunks.pop();
+				}
+				group.chunksCondition.notify_all();
+				const uint8_t* p = chunk->data();
+				const uint8_t* end = p + chunk->size();
+				while (p < end) {
+					const SeparatedBam dest = (SeparatedBam) * p++;
+					std::memcpy(&b.core, p, sizeof(bam1_core_t));
+					p += sizeof(bam1_core_t);
+					std::memcpy(&b.l_data, p, sizeof(int));
+					p += sizeof(int);
+					b.m_data = b.l_data;
+					b.data = const_cast<uint8_t*>(p);
+					p += b.l_data;
+					BamWriter& writer = dest == SeparatedBam::SPLICED ? splicedWriter :
+										dest == SeparatedBam::UNSPLICED ? unsplicedWriter : unmappedWriter;
+					if (writer.write(&b) < 0) {
+						BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+												  "Problem writing separated BAMs to: ") + outputDir.string()));
+					}
+				}
+			}
+			if (cancelled) {
+				break;
+			}
+			splicedCount += group.splicedCount;
+			unsplicedCount += group.unsplicedCount;
+			unmappedCount += group.unmappedCount;
+			for (const auto& n : group.names) {
+				splicedAlignmentMap[n.first] += n.second;
+			}
+			// Free up anything this group was holding
+			SplicedAlignmentMap().swap(group.names);
+		}
+	}
+	catch (...) {
+		errors.back() = std::current_exception();
+		cancel();
+	}
+	for (auto& t : workers) {
+		t.join();
+	}
+	for (const auto& e : errors) {
+		if (e) {
+			std::rethrow_exception(e);
 		}
 	}
 	cout << " done." << endl;
@@ -202,46 +344,189 @@ void portcullis::JunctionBuilder::separateBams() {
 	unsplicedWriter.close();
 	splicedWriter.close();
 	unmappedWriter.close();
-	cout << " - Indexing unspliced alignments ... ";
-	cout.flush();
-	// Create BAM index
-	string unsplicedIndexCmd = BamHelper::createIndexBamCmd(unsplicedFile, useCsi);
-	int unsExitCode = system(unsplicedIndexCmd.c_str());
-	if (unsExitCode != 0) {
-        BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
-									  "Problem indexing unspliced BAM: ") + unsplicedFile.string()));
-    }
+}
 
-    cout << "done." << endl;
-	cout << " - Indexing spliced alignments ... ";
-	cout.flush();
-	// Create BAM index
-	string splicedIndexCmd = BamHelper::createIndexBamCmd(splicedFile, useCsi);
-	int sExitCode = system(splicedIndexCmd.c_str());
-    if (sExitCode != 0) {
-        BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
-									  "Problem indexing spliced BAM: ") + splicedFile.string()));
-    }
-	cout << "done." << endl;
+void portcullis::JunctionBuilder::classifyAlignments(BamReader& reader, SeparateGroup& group) {
+	// Returns false if separating has been cancelled, in which case we give up
+	auto push = [&group](shared_ptr<vector<uint8_t>> chunk) {
+		{
+			unique_lock<mutex> lock(group.chunksMutex);
+			group.chunksCondition.wait(lock, [&] { return group.chunks.size() < DEFAULT_SEPARATE_MAX_CHUNKS || group.cancelled; });
+			if (group.cancelled) {
+				return false;
+			}
+			group.chunks.push(chunk);
+		}
+		group.chunksCondition.notify_all();
+		return true;
+	};
+	bool found = false;
+	if (group.refId < 0) {
+		reader.setRegion(HTS_IDX_NOCOOR, 0, 0);
+		found = true;
+	}
+	else {
+		for (int32_t refId = group.refId; refId <= group.lastRefId && !found; refId++) {
+			found = reader.seekToSequence(refId);
+		}
+	}
+	auto chunk = make_shared<vector<uint8_t>>();
+	chunk->reserve(DEFAULT_SEPARATE_CHUNK_BYTES + 65536);
+	while (found && reader.next()) {
+		const BamAlignment& al = reader.current();
+		const int32_t refId = al.getReferenceId();
+		if (group.refId < 0 ? refId >= 0 : refId < 0 || refId > group.lastRefId) {
+			if (group.refId < 0) {
+				continue;
+			}
+			break;
+		}
+		SeparatedBam dest;
+		if (al.isSplicedRead()) {
+			dest = SeparatedBam::SPLICED;
+			group.splicedCount++;
+			if (extra) {
+				// Record alignment name in map
+				size_t code = std::hash<string>()(al.deriveName());
+				group.names[code]++;
+			}
+		}
+		else if (al.isMapped()) {
+			dest = SeparatedBam::UNSPLICED;
+			group.unsplicedCount++;
+		}
+		else {
+			dest = SeparatedBam::UNMAPPED;
+			group.unmappedCount++;
+		}
+		const bam1_t* b = al.getRaw();
+		const size_t offset = chunk->size();
+		chunk->resize(offset + 1 + sizeof(bam1_core_t) + sizeof(int) + b->l_data);
+		uint8_t* p = chunk->data() + offset;
+		*p++ = (uint8_t)dest;
+		std::memcpy(p, &b->core, sizeof(bam1_core_t));
+		p += sizeof(bam1_core_t);
+		std::memcpy(p, &b->l_data, sizeof(int));
+		p += sizeof(int);
+		std::memcpy(p, b->data, b->l_data);
+		if (chunk->size() >= DEFAULT_SEPARATE_CHUNK_BYTES) {
+			if (!push(chunk)) {
+				return;
+			}
+			chunk = make_shared<vector<uint8_t>>();
+			chunk->reserve(DEFAULT_SEPARATE_CHUNK_BYTES + 65536);
+		}
+	}
+	if (!chunk->empty() && !push(chunk)) {
+		return;
+	}
+	{
+		lock_guard<mutex> lock(group.chunksMutex);
+		group.done = true;
+	}
+	group.chunksCondition.notify_all();
 }
 
 void portcullis::JunctionBuilder::findJunctions() {
 	auto_cpu_timer timer(1, " = Wall time taken: %ws\n\n");
-	// Add each target sequence as a chunk of work for the thread pool
+	// Add each target sequence as a chunk of work for the thread pool.  If we are
+	// running multi-threaded then split large target sequences into several regions
+	// based on the number of alignments recorded in the BAM index, so that a
+	// single large chromosome doesn't keep one thread busy while the others idle.
+	// Each region owns the junctions whose intron starts within it.  At the other
+	// end of the scale, runs of consecutive small target sequences, common in
+	// fragmented assemblies, are batched together into a single task.
 	results.clear();
-	results.resize(refs->size());
+	if (spill && !evidence) {
+		// The spliced alignments were prepared in buckets of consecutive target
+		// sequences, each of which is small enough to sort in memory
+		for (size_t i = 0; i < spill->getNbBuckets(); i++) {
+			const SpillBucket& bucket = spill->getBucket(i);
+			RegionResult res;
+			res.refId = bucket.refId;
+			res.lastRefId = bucket.lastRefId;
+			res.end = refs->at(bucket.lastRefId)->length;
+			res.name = refs->at(bucket.refId)->name;
+			res.js.setRefs(refs); // Make sure junction system has reference sequence list available
+			results.push_back(res);
+		}
+	}
+	else {
+		// Count the alignments on each target sequence from the junction evidence,
+		// if prepared, otherwise from the BAM index
+		std::unique_ptr<BamReader> indexReader;
+		if (!evidence) {
+			indexReader.reset(new BamReader(prepData.getSortedBamFilePath()));
+			indexReader->open();
+		}
+		uint64_t batchCount = 0;
+		for (size_t i = 0; i < refs->size(); i++) {
+			const int32_t refId = refs->at(i)->index;
+			const int32_t refLength = refs->at(i)->length;
+			int64_t mapped = 0;
+			if (evidence) {
+				const SpillRefStats& stats = evidence->getRef(refId).stats;
+				mapped = stats.splicedCount + stats.unsplicedCount;
+			}
+			else {
+				mapped = indexReader->getNbMappedAlignments(refId);
+			}
+			if (mapped >= 0 && (uint64_t)mapped < batchSize) {
+				// Extend the current batch if there's room, otherwise start a new one
+				if (batchCount > 0 && batchCount + mapped <= batchSize) {
+					results.back().lastRefId = refId;
+					results.back().end = refLength;
+					batchCount += mapped;
+				}
+				else {
+					RegionResult res;
+					res.refId = refId;
+					res.lastRefId = refId;
+					res.end = refLength;
+					res.name = refs->at(i)->name;
+					res.js.setRefs(refs); // Make sure junction system has reference sequence list available
+					results.push_back(res);
+					// Make sure a batch gets started even if there are no alignments
+					batchCount = max((uint64_t)1, (uint64_t)mapped);
+				}
+				continue;
+			}
+			batchCount = 0;
+			int32_t nbChunks = 1;
+			if (threads > 1 && chunkSize > 0 && mapped > 0) {
+				nbChunks = (int32_t)min((int64_t)((mapped + chunkSize - 1) / chunkSize),
+										(int64_t)max(1, refLength / DEFAULT_JUNC_MIN_CHUNK_LENGTH));
+			}
+			const int32_t chunkLength = refLength / nbChunks;
+			for (int32_t c = 0; c < nbChunks; c++) {
+				RegionResult res;
+				res.refId = refId;
+				res.lastRefId = refId;
+				res.start = c * chunkLength;
+				res.end = c == nbChunks - 1 ? refLength : (c + 1) * chunkLength;
+				res.name = refs->at(i)->name;
+				res.js.setRefs(refs); // Make sure junction system has reference sequence list available
+				results.push_back(res);
+			}
+		}
+		if (indexReader) {
+			indexReader->close();
+		}
+	}
 	// Create the thread pool and start the threads
-	cout << "Creating " << threads << " threads, each with BAM and genome indicies loaded ...";
+	if (results.size() < threads) {
+		cerr << "Warning: User requested " << threads << " threads but there are only " << results.size() << " regions to process.  Setting number of threads to " << results.size() << "." << endl << endl;
+	}
+	const uint16_t poolThreads = min((size_t)threads, max((size_t)1, results.size()));
+	cout << "Creating " << poolThreads << " threads, each with BAM and genome indicies loaded ...";
 	cout.flush();
-	JBThreadPool pool(this, threads);
+	JBThreadPool pool(this, poolThreads);
 	cout << " done." << endl;
 	cout << "Finding junctions and calculating basic metrics:" << endl;
-	cout << " - Queueing " << refs->size() << " target sequences for processing in the thread pool" << endl;
+	cout << " - Queueing " << refs->size() << " target sequences, as " << results.size() << " regions or batches, for processing in the thread pool" << endl;
 	cout << " - Processing: " << endl;
-	for (size_t i = 0; i < refs->size(); i++) {
-		results[i].js.setRefs(refs); // Make sure junction system has reference sequence list available
-		results[i].name = refs->at(i)->name;
-		pool.enqueue(refs->at(i)->index);
+	for (size_t i = 0; i < results.size(); i++) {
+		pool.enqueue(i);
 	}
 	// Waits for all threads to complete
 	pool.shutDown();
@@ -254,18 +539,37 @@ void portcullis::JunctionBuilder::findJunctions() {
 	cout << std::left << std::setw(12) << "Sequence" << "\t"
 		 << std::right << std::setw(12) << "unspliced" << "\t"
 		 << std::right << std::setw(12) << "spliced" << "\t"
-		 << std::right << std::setw(12) << "total" << endl;
-	for (auto & res : results) {
+		 << std::right << std::setw(12) << "total" << "\t"
+		 << std::right << std::setw(16) << "max_live_juncs" << "\t"
+		 << std::right << std::setw(16) << "max_live_alns" << endl;
+	// Regions from the same target sequence are adjacent, so combine them as
+	// we go, reporting per target sequence, or per batch of target sequences
+	RegionResult seqRes;
+	for (size_t i = 0; i < results.size(); i++) {
+		RegionResult& res = results[i];
 		junctionSystem.append(res.js);
+		res.js = JunctionSystem(); // Free memory as we go
+		if (res.start == 0) {
+			seqRes = RegionResult();
+			seqRes.name = res.lastRefId == res.refId ? res.name : getRegionName(i);
+		}
+		seqRes.unsplicedCount += res.unsplicedCount;
+		seqRes.splicedCount += res.splicedCount;
+		seqRes.maxLiveJunctions = max(seqRes.maxLiveJunctions, res.maxLiveJunctions);
+		seqRes.maxLiveAlignments = max(seqRes.maxLiveAlignments, res.maxLiveAlignments);
 		unsplicedCount += res.unsplicedCount;
 		splicedCount += res.splicedCount;
 		sumQueryLengths += res.sumQueryLengths;
 		minQueryLength = min(minQueryLength, res.minQueryLength);
 		maxQueryLength = max(maxQueryLength, res.maxQueryLength);
-		cout << std::left << std::setw(12) << res.name << "\t"
-			 << std::right << std::setw(12) << res.unsplicedCount << "\t"
-			 << std::right << std::setw(12) << res.splicedCount << "\t"
-			 << std::right << std::setw(12) << res.splicedCount + res.unsplicedCount << endl;
+		if (i + 1 == results.size() || results[i + 1].refId != res.refId) {
+			cout << std::left << std::setw(12) << seqRes.name << "\t"
+				 << std::right << std::setw(12) << seqRes.unsplicedCount << "\t"
+				 << std::right << std::setw(12) << seqRes.splicedCount << "\t"
+				 << std::right << std::setw(12) << seqRes.splicedCount + seqRes.unsplicedCount << "\t"
+				 << std::right << std::setw(16) << seqRes.maxLiveJunctions << "\t"
+				 << std::right << std::setw(16) << seqRes.maxLiveAlignments << endl;
+		}
 	}
 	cout << endl << "Sorting and reindexing merged junctions...";
 	cout.flush();
@@ -293,9 +597,6 @@ void portcullis::JunctionBuilder::findJunctions() {
 void portcullis::JunctionBuilder::calcExtraMetrics() {
 	auto_cpu_timer timer(1, " = Wall time taken: %ws\n\n");
 	cout << "Calculating extra junction metrics:" << endl;
-	if (threads > 1) {
-		cerr << " - Note: this part of the pipeline is single threaded." << endl;
-	}
 	// Requires BAMs to be separated
 	cout << " - Calculating multiple mapping stats ...";
 	cout.flush();
@@ -305,55 +606,217 @@ void portcullis::JunctionBuilder::calcExtraMetrics() {
 	// regions for each junction
 	cout << " - Analysing unspliced alignments around junctions ...";
 	cout.flush();
-	junctionSystem.findFlankingAlignments(getUnsplicedBamFile());
+	junctionSystem.findFlankingAlignments(getUnsplicedBamFile(), threads);
 	cout << " - Calculating unspliced alignment coverage around junctions ...";
 	cout.flush();
-	junctionSystem.calcCoverage(getUnsplicedBamFile(), strandSpecific);
+	junctionSystem.calcCoverage(getUnsplicedBamFile(), threads);
+}
+
+string portcullis::JunctionBuilder::getRegionName(const size_t index) const {
+	const RegionResult& res = results[index];
+	if (res.lastRefId != res.refId) {
+		return res.name + ".." + refs->at(res.lastRefId)->name;
+	}
+	if (res.start == 0 && res.end == (int32_t)refs->at(res.refId)->length) {
+		return res.name;
+	}
+	return res.name + ":" + lexical_cast<string>(res.start) + "-" + lexical_cast<string>(res.end);
+}
+
+void portcullis::JunctionBuilder::findJuncs(BamReader& reader, GenomeMapper& gmap, const size_t index) {
+	const RegionResult& res = results[index];
+	const bool batch = res.lastRefId != res.refId;
+	// The index query returns all alignments overlapping this region, which includes
+	// all the alignments supporting junctions starting in this region.  For batches
+	// we seek to the first target sequence with alignments and then simply read
+	// through the file until we pass the last one.
+	bool found = true;
+	if (batch) {
+		found = false;
+		for (int32_t refId = res.refId; !found && refId <= res.lastRefId; refId++) {
+			found = reader.seekToSequence(refId);
+		}
+	}
+	else {
+		reader.setRegion(res.refId, res.start, res.end);
+	}
+	findJuncs(gmap, index, [&]() -> const BamAlignment* {
+		return found && reader.next() ? &reader.current() : nullptr;
+	});
 }
 
-void portcullis::JunctionBuilder::findJuncs(BamReader& reader, GenomeMapper& gmap, int32_t seq) {
+void portcullis::JunctionBuilder::findSplicedJuncs(GenomeMapper& gmap, const size_t index) {
+	SortBuffer buffer;
+	spill->readBucket(index, buffer);
+	bam1_t b;
+	memset(&b, 0, sizeof(bam1_t));
+	BamAlignment al;
+	size_t i = 0;
+	findJuncs(gmap, index, [&]() -> const BamAlignment* {
+		if (i >= buffer.entries.size()) {
+			return nullptr;
+		}
+		buffer.get(buffer.entries[i++], &b);
+		al.setRaw(&b);
+		return &al;
+	});
+	// The unspliced alignments were only counted when preparing, so take all the
+	// alignment stats from there
+	setPreparedStats(results[index]);
+}
+
+void portcullis::JunctionBuilder::findEvidenceJuncs(GenomeMapper& gmap, const size_t index) {
+	RegionResult& res = results[index];
+	const EvidenceFileRef& ref = evidence->getRef(res.refId);
+	uint64_t i = ref.firstRecord;
+	uint64_t last = ref.firstRecord + ref.nbRecords;
+	if (res.lastRefId != res.refId) {
+		const EvidenceFileRef& lastRef = evidence->getRef(res.lastRefId);
+		last = lastRef.firstRecord + lastRef.nbRecords;
+	}
+	else {
+		// Alignments supporting junctions starting in this region can start no
+		// further before it than the longest span of any alignment
+		if (res.start > 0) {
+			i = evidence->findFirst(res.refId, max(0, res.start - ref.maxSpan));
+		}
+		if (res.end < ref.length) {
+			last = evidence->findFirst(res.refId, res.end);
+		}
+	}
+	std::unique_ptr<bam1_t, void(*)(bam1_t*)> b(bam_init1(), bam_destroy1);
+	BamAlignment al;
+	findJuncs(gmap, index, [&]() -> const BamAlignment* {
+		if (i >= last) {
+			return nullptr;
+		}
+		evidence->getRecord(i++, b.get());
+		al.setRaw(b.get());
+		return &al;
+	});
+	// Only the spliced alignments were kept, so take all the alignment stats from
+	// those recorded when preparing
+	setPreparedStats(res);
+}
+
+void portcullis::JunctionBuilder::setPreparedStats(RegionResult& res) {
+	res.splicedCount = 0;
+	res.unsplicedCount = 0;
+	res.sumQueryLengths = 0;
+	res.minQueryLength = INT32_MAX;
+	res.maxQueryLength = 0;
+	if (res.start > 0) {
+		return;
+	}
+	for (int32_t refId = res.refId; refId <= res.lastRefId; refId++) {
+		const SpillRefStats& stats = evidence ? evidence->getRef(refId).stats : spill->getRefStats(refId);
+		res.splicedCount += stats.splicedCount;
+		res.unsplicedCount += stats.unsplicedCount;
+		res.sumQueryLengths += stats.sumQueryLengths;
+		res.minQueryLength = min(res.minQueryLength, stats.minQueryLength);
+		res.maxQueryLength = max(res.maxQueryLength, stats.maxQueryLength);
+	}
+}
+
+void portcullis::JunctionBuilder::findJuncs(GenomeMapper& gmap, const size_t index, const std::function<const BamAlignment*()>& next) {
+	RegionResult& res = results[index];
+	// Only the last region of a target sequence owns anything beyond the end of it
+	const bool batch = res.lastRefId != res.refId;
+	const int32_t regionEnd = batch || res.end == (int32_t)refs->at(res.refId)->length ? INT32_MAX : res.end;
 	uint64_t splicedCount = 0;
 	uint64_t unsplicedCount = 0;
-	uint32_t lastCalculatedJunctionIndex = 0;
 	uint64_t sumQueryLengths = 0;
 	int32_t minQueryLength = INT32_MAX;
 	int32_t maxQueryLength = 0;
-	reader.setRegion(seq, 0, refs->at(seq)->length);
-	while (reader.next()) {
-		const BamAlignment& al = reader.current();
-		while (results[seq].js.size() > 0 && lastCalculatedJunctionIndex < results[seq].js.size() &&
-				al.getPosition() > results[seq].js.getJunctionAt(lastCalculatedJunctionIndex)->getIntron()->end) {
-			JunctionPtr j = results[seq].js.getJunctionAt(lastCalculatedJunctionIndex);
+	JunctionSystem& js = res.js;
+	// A junction can be finalised as soon as we see an alignment starting beyond
+	// the end of its intron, as no later alignment can support it.  Keep unfinalised
+	// junctions ordered by intron end so that each is finalised and its alignments
+	// released as soon as possible, regardless of the order in which it was found.
+	ActiveJunctionQueue active;
+	size_t nbQueued = 0;
+	uint64_t liveAlignments = 0;
+	uint32_t maxLiveJunctions = 0;
+	uint64_t maxLiveAlignments = 0;
+	auto finaliseUpTo = [&](const int32_t position) {
+		while (!active.empty() && position > active.top().first) {
+			JunctionPtr j = js.getJunctionAt(active.top().second);
+			active.pop();
+			liveAlignments -= j->getNbSplicedAlignments();
 			j->calcMetrics(this->orientation);
 			j->processJunctionWindow(gmap);
 			j->clearAlignments();
-			lastCalculatedJunctionIndex++;
 		}
-		// Calc alignment stats
-		int32_t len = al.getLength();
-		minQueryLength = min(minQueryLength, len);
-		maxQueryLength = max(maxQueryLength, len);
-		sumQueryLengths += len;
-		if (results[seq].js.addJunctions(al)) {
-			splicedCount++;
+	};
+	auto nbJunctionsInRegion = [&](const BamAlignment& al) {
+		uint32_t nbJunctions = 0;
+		int32_t pos = al.getPosition();
+		for (const auto & op : al.getCigar()) {
+			if (op.type == BAM_CIGAR_REFSKIP_CHAR && pos >= res.start && pos < regionEnd) {
+				nbJunctions++;
+			}
+			if (CigarOp::opConsumesReference(op.type)) {
+				pos += op.length;
+			}
 		}
-		else {
-			unsplicedCount++;
+		return nbJunctions;
+	};
+	int32_t currentRefId = res.refId;
+	const BamAlignment* current = nullptr;
+	while ((current = next()) != nullptr) {
+		const BamAlignment& al = *current;
+		if (batch) {
+			const int32_t refId = al.getReferenceId();
+			if (refId < 0 || refId > res.lastRefId) {
+				break;
+			}
+			// Positions start again on a new target sequence
+			if (refId != currentRefId) {
+				finaliseUpTo(INT32_MAX);
+				currentRefId = refId;
+			}
+		}
+		finaliseUpTo(al.getPosition());
+		// Checking the raw cigar first means unspliced alignments never need
+		// to be fully decoded
+		const bool spliced = al.isSplicedRead();
+		if (spliced) {
+			js.addJunctionsInRegion(al, res.start, regionEnd);
+			// Each junction in this region held by the read keeps a summary of it
+			liveAlignments += nbJunctionsInRegion(al);
+		}
+		// Alignments starting before this region have already been counted by
+		// the previous region
+		if (batch || al.getPosition() >= res.start) {
+			// Calc alignment stats
+			int32_t len = al.getLength();
+			minQueryLength = min(minQueryLength, len);
+			maxQueryLength = max(maxQueryLength, len);
+			sumQueryLengths += len;
+			if (spliced) {
+				splicedCount++;
+			}
+			else {
+				unsplicedCount++;
+			}
+		}
+		if (spliced) {
+			for (; nbQueued < js.size(); nbQueued++) {
+				active.push(JunctionEnd(js.getJunctionAt(nbQueued)->getIntron()->end, nbQueued));
+			}
+			maxLiveJunctions = max(maxLiveJunctions, (uint32_t)active.size());
+			maxLiveAlignments = max(maxLiveAlignments, liveAlignments);
 		}
 	}
-	while (results[seq].js.size() > 0 && lastCalculatedJunctionIndex < results[seq].js.size()) {
-		JunctionPtr j = results[seq].js.getJunctionAt(lastCalculatedJunctionIndex);
-		j->calcMetrics(this->orientation);
-		j->processJunctionWindow(gmap);
-		j->clearAlignments();
-		lastCalculatedJunctionIndex++;
-	}
+	finaliseUpTo(INT32_MAX);
 	// Update result vector
-	results[seq].splicedCount = splicedCount;
-	results[seq].unsplicedCount = unsplicedCount;
-	results[seq].minQueryLength = minQueryLength;
-	results[seq].maxQueryLength = maxQueryLength;
-	results[seq].sumQueryLengths = sumQueryLengths;
+	res.splicedCount = splicedCount;
+	res.unsplicedCount = unsplicedCount;
+	res.minQueryLength = minQueryLength;
+	res.maxQueryLength = maxQueryLength;
+	res.sumQueryLengths = sumQueryLengths;
+	res.maxLiveJunctions = maxLiveJunctions;
+	res.maxLiveAlignments = maxLiveAlignments;
 }
 
 int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
@@ -361,13 +824,18 @@ int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
 	string prepDir;
 	string output;
 	uint16_t threads;
+	uint64_t chunkSize;
+	uint16_t ioThreads;
 	bool extra;
 	bool separate;
+	int bamCompression;
 	string strandSpecific;
 	string orientation;
 	bool useCsi;
 	bool exongff;
 	bool introngff;
+	bool binary;
+	bool bgzip;
 	string source;
 	bool verbose;
 	bool help;
@@ -378,8 +846,14 @@ int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
 	system_options.add_options()
 	("threads,t", po::value<uint16_t>(&threads)->default_value(1),
 	 "The number of threads to use.  Note that increasing the number of threads will also increase memory requirements.")
+	("chunk_size", po::value<uint64_t>(&chunkSize)->default_value(DEFAULT_JUNC_CHUNK_SIZE),
+	 "When using multiple threads, target sequences containing more than this many alignments are split into several regions which are processed in parallel.  Set to 0 to process each target sequence in a single thread.")
+	("io_threads", po::value<uint16_t>(&ioThreads)->default_value(0),
+	 "The number of additional threads to use for compressing each separated BAM file.  When this is greater than 0, each junction finding thread also gets one extra thread that reads the BAM ahead.")
 	("separate", po::bool_switch(&separate)->default_value(false),
 	 "Separate spliced from unspliced reads.  Creates two new BAM files.")
+	("bam_compression", po::value<int>(&bamCompression)->default_value(DEFAULT_JUNC_BAM_COMPRESSION),
+	 "Compression level, from 0 (none) to 9 (best), for the separated BAM files.  Low levels are much faster to write.  Use a higher level if you intend to keep the separated BAMs.")
 	("orientation", po::value<string>(&orientation)->default_value(orientationToString(Orientation::UNKNOWN)),
 	 "The orientation of the reads that produced the BAM alignments: \"F\" (Single-end forward orientation); \"R\" (single-end reverse orientation); \"FR\" (paired-end, with reads sequenced towards center of fragment -> <-.  This is usual setting for most Illumina paired end sequencing); \"RF\" (paired-end, reads sequenced away from center of fragment <- ->); \"FF\" (paired-end, reads both sequenced in forward orientation); \"RR\" (paired-end, reads both sequenced in reverse orientation); \"UNKNOWN\" (default, portcullis will workaround any calculations requiring orientation information)")
 	("strandedness", po::value<string>(&strandSpecific)->default_value(strandednessToString(Strandedness::UNKNOWN)),
@@ -398,6 +872,10 @@ int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
 	 "Output exon-based junctions in GFF format.")
 	("intron_gff", po::bool_switch(&introngff)->default_value(false),
 	 "Output intron-based junctions in GFF format.")
+	("binary", po::bool_switch(&binary)->default_value(false),
+	 "Also output junctions in portcullis' binary junction format (<prefix>.junctions.bin).  This loads much faster than the junction tab file and can be given to filter and bamfilt in its place.")
+	("bgzip", po::bool_switch(&bgzip)->default_value(false),
+	 "Also output the junction table and BED file BGZF compressed, with tabix indices (<prefix>.junctions.tab.gz and <prefix>.junctions.bed.gz).  Junctions in a region can then be extracted quickly using \"portcullis query\".")
 	("source", po::value<string>(&source)->default_value(DEFAULT_JUNC_SOURCE),
 	 "The value to enter into the \"source\" field in GFF files.")
 	;
@@ -440,14 +918,19 @@ int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
 	// Do the work ...
 	JunctionBuilder jb(prepDir, output);
 	jb.setThreads(threads);
+	jb.setChunkSize(chunkSize);
+	jb.setIoThreads(ioThreads);
 	jb.setExtra(extra);
 	jb.setSeparate(separate);
+	jb.setBamCompression(bamCompression);
 	jb.setSource(source);
 	jb.setStrandSpecific(strandednessFromString(strandSpecific));
 	jb.setOrientation(orientationFromString(orientation));
 	jb.setUseCsi(useCsi);
 	jb.setOutputExonGFF(exongff);
 	jb.setOutputIntronGFF(introngff);
+	jb.setOutputBinary(binary);
+	jb.setOutputIndexed(bgzip);
 	jb.setVerbose(verbose);
 	jb.process();
 	return 0;
@@ -456,7 +939,7 @@ int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
 
 // ********* Thread Pool ************
 
-portcullis::JBThreadPool::JBThreadPool(JunctionBuilder* jb, const uint16_t threads) : terminate(false), stopped(false) {
+portcullis::JBThreadPool::JBThreadPool(JunctionBuilder* jb, const uint16_t threads) : nbStarted(0), terminate(false), stopped(false) {
 	junctionBuilder = jb;
 	// Create number of required threads and add them to the thread pool vector.
 	for (int i = 0; i < threads; i++) {
@@ -465,7 +948,7 @@ portcullis::JBThreadPool::JBThreadPool(JunctionBuilder* jb, const uint16_t threa
 	}
 }
 
-void portcullis::JBThreadPool::enqueue(const int32_t index) {
+void portcullis::JBThreadPool::enqueue(const size_t index) {
 	// Scope based locking.
 	{
 		// Put unique lock on task mutex.
@@ -482,11 +965,20 @@ void portcullis::JBThreadPool::invoke() {
 	GenomeMapper gmap(junctionBuilder->getPreparedFiles().getGenomeFilePath());
 	// Load the fasta index
 	gmap.loadFastaIndex();
-	// Create a BAM reader for this thread
-	BamReader reader(junctionBuilder->getPreparedFiles().getSortedBamFilePath());
-	// Open the BAM file... this will load the index, which might take some time on large BAMs
-	reader.open();
-	int32_t id;
+	// Regions are handed out in order, so we only need to keep the current
+	// reference sequence in memory
+	gmap.enableCache(0);
+	// Create a BAM reader for this thread, unless we have the junction evidence,
+	// or only the spliced alignments, which are read a bucket at a time
+	const bool evidence = junctionBuilder->hasJunctionEvidence();
+	const bool splicedOnly = junctionBuilder->isSplicedOnly();
+	const bool useReader = !evidence && !splicedOnly;
+	BamReader reader(junctionBuilder->getPreparedFiles().getSortedBamFilePath(), junctionBuilder->getIoThreads());
+	if (useReader) {
+		// Open the BAM file... this will load the index, which might take some time on large BAMs
+		reader.open();
+	}
+	size_t id;
 	while (true) {
 		// Scope based locking.
 		{
@@ -499,17 +991,36 @@ void portcullis::JBThreadPool::invoke() {
 			// If termination signal received and queue is empty then exit else continue clearing the queue.
 			// Make sure we close the reader before exiting
 			if (terminate && tasks.empty()) {
-				reader.close();
+				if (useReader) {
+					reader.close();
+				}
 				return;
 			}
 			// Get next task in the queue.
 			id = tasks.front();
-			cout << "   - " << junctionBuilder->getRefName(id) << endl;
+			// Don't flood the output when there are many tasks, e.g. fragmented assemblies
+			const size_t nbTasks = junctionBuilder->getNbRegions();
+			const size_t step = nbTasks / DEFAULT_JUNC_MAX_PROGRESS_LINES + 1;
+			if (nbTasks <= DEFAULT_JUNC_MAX_PROGRESS_LINES) {
+				cout << "   - " << junctionBuilder->getRegionName(id) << endl;
+			}
+			else if (nbStarted % step == 0) {
+				cout << "   - " << junctionBuilder->getRegionName(id) << " (" << nbStarted + 1 << " / " << nbTasks << ")" << endl;
+			}
+			nbStarted++;
 			// Remove it from the queue.
 			tasks.pop();
 		}
 		// Execute the task.
-		junctionBuilder->findJuncs(reader, gmap, id);
+		if (evidence) {
+			junctionBuilder->findEvidenceJuncs(gmap, id);
+		}
+		else if (splicedOnly) {
+			junctionBuilder->findSplicedJuncs(gmap, id);
+		}
+		else {
+			junctionBuilder->findJuncs(reader, gmap, id);
+		}
 	}
 }
 
@@ -21,8 +21,10 @@
 #include <iostream>
 #include <vector>
 #include <memory>
+#include <functional>
 #include <queue>
 #include <thread>
+#include <utility>
 #include <mutex>
 #include <condition_variable>
 using std::boolalpha;
@@ -57,6 +59,8 @@ using portcullis::JunctionSystem;
 
 #include "prepare.hpp"
 using portcullis::PreparedFiles;
+using portcullis::bam::EvidenceFile;
+using portcullis::bam::SplicedSpill;
 
 
 
@@ -65,20 +69,81 @@ namespace portcullis {
 const string DEFAULT_JUNC_OUTPUT = "portcullis_junc/portcullis";
 const string DEFAULT_JUNC_SOURCE = "portcullis";
 const uint16_t DEFAULT_JUNC_THREADS = 1;
+const uint64_t DEFAULT_JUNC_CHUNK_SIZE = 1000000;
+const int32_t DEFAULT_JUNC_MIN_CHUNK_LENGTH = 10000;
+const uint64_t DEFAULT_JUNC_BATCH_SIZE = 10000;
+const size_t DEFAULT_JUNC_MAX_PROGRESS_LINES = 100;
+const int DEFAULT_JUNC_BAM_COMPRESSION = 1;
+const size_t DEFAULT_SEPARATE_CHUNK_BYTES = 1 << 22;
+const size_t DEFAULT_SEPARATE_MAX_CHUNKS = 4;
 
 typedef boost::error_info<struct JunctionBuilderError, string> JunctionBuilderErrorInfo;
 struct JunctionBuilderException: virtual boost::exception, virtual std::exception { };
 
+/**
+ * The results from processing a single region of a target sequence.  Large target
+ * sequences may be split into several regions, each owning the junctions with an
+ * intron starting in [start, end).  Alternatively, a run of consecutive small
+ * target sequences, from refId to lastRefId inclusive, may be processed as a single
+ * batch, in which case start and end are not used.
+ */
 struct RegionResult {
+	int32_t refId = 0;
+	int32_t lastRefId = 0;
+	int32_t start = 0;
+	int32_t end = 0;
 	uint64_t splicedCount = 0;
 	uint64_t unsplicedCount = 0;
 	uint64_t sumQueryLengths = 0;
 	int32_t minQueryLength = 100000;
 	int32_t maxQueryLength = 0;
+	uint32_t maxLiveJunctions = 0;
+	uint64_t maxLiveAlignments = 0;
 	string name;
 	JunctionSystem js;
 };
 
+/**
+ * Where each alignment goes when separating BAMs
+ */
+enum class SeparatedBam : uint8_t {
+	SPLICED,
+	UNSPLICED,
+	UNMAPPED
+};
+
+/**
+ * A run of consecutive target sequences, from refId to lastRefId inclusive, whose
+ * alignments are classified by a single thread when separating BAMs.  A refId of
+ * -1 stands for the alignments without a position at the end of the BAM.  The
+ * classified alignments are handed over in chunks of raw records, each preceded
+ * by the destination, the core fields and the data length, so that a single
+ * writer can output every group in order.  At most DEFAULT_SEPARATE_MAX_CHUNKS
+ * chunks are held for each group.  If any thread fails, every group is cancelled
+ * so that nothing is left waiting on another.
+ */
+struct SeparateGroup {
+	int32_t refId = 0;
+	int32_t lastRefId = 0;
+	uint64_t splicedCount = 0;
+	uint64_t unsplicedCount = 0;
+	uint64_t unmappedCount = 0;
+	SplicedAlignmentMap names;
+	queue<shared_ptr<vector<uint8_t>>> chunks;
+	bool done = false;
+	bool cancelled = false;
+	mutex chunksMutex;
+	condition_variable chunksCondition;
+};
+
+/**
+ * Junctions waiting to be finalised, as pairs of intron end and index into the
+ * junction system, ordered so that the junction with the smallest intron end is
+ * on top
+ */
+typedef std::pair<int32_t, size_t> JunctionEnd;
+typedef std::priority_queue<JunctionEnd, vector<JunctionEnd>, std::greater<JunctionEnd>> ActiveJunctionQueue;
+
 class JunctionBuilder {
 private:
 
@@ -87,6 +152,10 @@ private:
 	path outputDir;
 	string outputPrefix;
 	uint16_t threads;
+	uint64_t chunkSize;
+	uint64_t batchSize;
+	uint16_t ioThreads;
+	int bamCompression;
 	Strandedness strandSpecific;
 	Orientation orientation;
 	bool extra;
@@ -94,6 +163,8 @@ private:
 	bool useCsi;
 	bool outputExonGFF;
 	bool outputIntronGFF;
+	bool outputBinary;
+	bool outputIndexed;
 	string source;
 	bool verbose;
 
@@ -110,6 +181,12 @@ private:
 	// Results from threads
 	vector<RegionResult> results;
 
+	// The spliced alignments, if only they were prepared, rather than a sorted BAM
+	shared_ptr<SplicedSpill> spill;
+
+	// The junction evidence, if it was prepared, which is used instead of the BAM
+	shared_ptr<EvidenceFile> evidence;
+
 
 
 protected:
@@ -132,8 +209,25 @@ protected:
 
 	void separateBams();
 
+	void classifyAlignments(BamReader& reader, SeparateGroup& group);
+
 	void findJunctions();
 
+	/**
+	 * Finds the junctions in a region, or batch, from its alignments in coordinate
+	 * order, and gathers the basic alignment stats
+	 * @param gmap Genome mapper for this thread
+	 * @param index The region to process
+	 * @param next Gives the next alignment, or nullptr when there are no more
+	 */
+	void findJuncs(GenomeMapper& gmap, const size_t index, const std::function<const BamAlignment*()>& next);
+
+	/**
+	 * Replaces the alignment stats of a region with those recorded when preparing.
+	 * Only the first region of a target sequence gets any.
+	 */
+	void setPreparedStats(RegionResult& res);
+
 	void calcExtraMetrics();
 
 
@@ -146,7 +240,36 @@ public:
 
 	string getRefName(const int32_t seqId) { return refs->at(seqId)->name; }
 
-	void findJuncs(BamReader& reader, GenomeMapper& gmap, const int32_t seq);
+	string getRegionName(const size_t index) const;
+
+	size_t getNbRegions() const { return results.size(); }
+
+	void findJuncs(BamReader& reader, GenomeMapper& gmap, const size_t index);
+
+	/**
+	 * Finds the junctions in a bucket of prepared spliced alignments, taking the
+	 * unspliced alignment stats from those recorded when preparing
+	 */
+	void findSplicedJuncs(GenomeMapper& gmap, const size_t index);
+
+	/**
+	 * Finds the junctions in a region, or batch, from the prepared junction evidence
+	 */
+	void findEvidenceJuncs(GenomeMapper& gmap, const size_t index);
+
+	/**
+	 * Whether junctions are found from the prepared junction evidence
+	 */
+	bool hasJunctionEvidence() const {
+		return evidence != nullptr;
+	}
+
+	/**
+	 * Whether only the spliced alignments were prepared, rather than a sorted BAM
+	 */
+	bool isSplicedOnly() const {
+		return spill != nullptr;
+	}
 
 	PreparedFiles& getPreparedFiles() { return prepData; }
 
@@ -166,6 +289,52 @@ public:
 		this->threads = threads;
 	}
 
+	uint64_t getChunkSize() const {
+		return chunkSize;
+	}
+
+	/**
+	 * Approximate number of alignments to process in each task.  Target sequences
+	 * containing more alignments than this are split into several regions which
+	 * can be processed in parallel.  Set to 0 to process each target sequence as
+	 * a single task.
+	 */
+	void setChunkSize(uint64_t chunkSize) {
+		this->chunkSize = chunkSize;
+	}
+
+	uint64_t getBatchSize() const {
+		return batchSize;
+	}
+
+	/**
+	 * Maximum number of alignments in a batch of consecutive small target
+	 * sequences processed as a single task.  Set to 0 to process each target
+	 * sequence separately.
+	 */
+	void setBatchSize(uint64_t batchSize) {
+		this->batchSize = batchSize;
+	}
+
+	uint16_t getIoThreads() const {
+		return ioThreads;
+	}
+
+	void setIoThreads(uint16_t ioThreads) {
+		this->ioThreads = ioThreads;
+	}
+
+	int getBamCompression() const {
+		return bamCompression;
+	}
+
+	/**
+	 * Compression level, from 0 to 9, used for the separated BAM files
+	 */
+	void setBamCompression(int bamCompression) {
+		this->bamCompression = bamCompression;
+	}
+
 	bool isVerbose() const {
 		return verbose;
 	}
@@ -231,6 +400,22 @@ public:
 		this->outputIntronGFF = outputIntronGFF;
 	}
 
+	bool isOutputBinary() const {
+		return outputBinary;
+	}
+
+	void setOutputBinary(bool outputBinary) {
+		this->outputBinary = outputBinary;
+	}
+
+	bool isOutputIndexed() const {
+		return outputIndexed;
+	}
+
+	void setOutputIndexed(bool outputIndexed) {
+		this->outputIndexed = outputIndexed;
+	}
+
 
 
 
@@ -268,7 +453,7 @@ public:
 	~JBThreadPool();
 
 	// Adds task to a task queue.
-	void enqueue(const int32_t index);
+	void enqueue(const size_t index);
 
 	// Shut down the pool.
 	void shutDown();
@@ -282,7 +467,10 @@ private:
 	vector<thread> threadPool;
 
 	// Queue to keep track of incoming tasks and task index.
-	queue<int32_t> tasks;
+	queue<size_t> tasks;
+
+	// Number of tasks taken from the queue so far, used for reporting progress.
+	size_t nbStarted;
 
 	// Task queue mutex.
 	mutex tasksMutex;
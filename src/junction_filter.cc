@@ -29,6 +29,7 @@
 #include <vector>
 using std::boolalpha;
 using std::ifstream;
+using std::ofstream;
 using std::string;
 using std::stoi;
 using std::pair;
@@ -59,10 +60,14 @@ namespace po = boost::program_options;
 
 #include <portcullis/intron.hpp>
 #include <portcullis/junction.hpp>
+#include <portcullis/junction_file.hpp>
 #include <portcullis/junction_system.hpp>
+#include <portcullis/junction_table.hpp>
 #include <portcullis/portcullis_fs.hpp>
 #include <portcullis/python_helper.hpp>
 using portcullis::PortcullisFS;
+using portcullis::JunctionFile;
+using portcullis::JunctionTable;
 using portcullis::Intron;
 using portcullis::IntronHasher;
 using portcullis::PyHelper;
@@ -81,6 +86,8 @@ portcullis::JunctionFilter::JunctionFilter(const path& _prepDir, const path& _ju
     filterFile = "";
     referenceFile = "";
     saveBad = false;
+    outputBinary = false;
+    outputIndexed = false;
     threads = 1;
     maxLength = 0;
     filterCanonical = false;
@@ -194,7 +201,8 @@ void portcullis::JunctionFilter::filter() {
     cout << "Loading junctions from " << junctionFile.string() << " ...";
     cout.flush();
     // Load junction system
-    JunctionSystem originalJuncs(junctionFile);
+    JunctionSystem originalJuncs;
+    originalJuncs.load(junctionFile, false, threads);
     cout << " done." << endl
             << "Found " << originalJuncs.getJunctions().size() << " junctions." << endl << endl;
 
@@ -324,7 +332,18 @@ void portcullis::JunctionFilter::filter() {
 	    if (this->saveLayers) {
 		    args.push_back("--save_layers");
 	    }
-            args.push_back(junctionFile.string());
+
+            // The python script can only read junction tab files
+            path trainingFile = junctionFile;
+            if (JunctionFile::isJunctionFile(junctionFile)) {
+                trainingFile = path(output.string() + ".selftrain.input.junctions.tab");
+                JunctionTable table;
+                originalJuncs.toTable(table);
+                ofstream out(trainingFile.c_str());
+                out << table;
+                out.close();
+            }
+            args.push_back(trainingFile.string());
 
             char* char_args[50];
 
@@ -584,13 +603,13 @@ void portcullis::JunctionFilter::filter() {
             discardedJuncs.getJunctions(),
             string("Overall results"));
     cout << endl << "Saving junctions passing filter to disk:" << endl;
-    filteredJuncs.saveAll(outputDir.string() + "/" + outputPrefix + ".pass", source + "_pass", true, this->outputExonGFF, this->outputIntronGFF);
+    filteredJuncs.saveAll(outputDir.string() + "/" + outputPrefix + ".pass", source + "_pass", true, this->outputExonGFF, this->outputIntronGFF, this->outputBinary, this->outputIndexed, this->threads);
     if (saveBad) {
         cout << "Saving junctions failing filter to disk:" << endl;
-        discardedJuncs.saveAll(outputDir.string() + "/" + outputPrefix + ".fail", source + "_fail", true, this->outputExonGFF, this->outputIntronGFF);
+        discardedJuncs.saveAll(outputDir.string() + "/" + outputPrefix + ".fail", source + "_fail", true, this->outputExonGFF, this->outputIntronGFF, this->outputBinary, this->outputIndexed, this->threads);
         if (!referenceFile.empty()) {
             cout << "Saving junctions failing filters but present in reference:" << endl;
-            refKeptJuncs.saveAll(outputDir.string() + "/" + outputPrefix + ".ref", source + "_ref", true, this->outputExonGFF, this->outputIntronGFF);
+            refKeptJuncs.saveAll(outputDir.string() + "/" + outputPrefix + ".ref", source + "_ref", true, this->outputExonGFF, this->outputIntronGFF, this->outputBinary, this->outputIndexed, this->threads);
         }
     }
 }
@@ -765,6 +784,8 @@ int portcullis::JunctionFilter::main(int argc, char *argv[]) {
     bool save_layers;
     bool exongff;
     bool introngff;
+    bool binary;
+    bool bgzip;
     uint32_t max_length;
     string canonical;
     bool balanced;
@@ -782,7 +803,7 @@ int portcullis::JunctionFilter::main(int argc, char *argv[]) {
     po::options_description system_options("System options", w.ws_col, w.ws_col / 1.5);
     system_options.add_options()
             ("threads,t", po::value<uint16_t>(&threads)->default_value(DEFAULT_FILTER_THREADS),
-            "The number of threads to use during testing (only applies if using forest model).")
+            "The number of threads to use for loading junction tab files and during testing (only applies if using forest model).")
             ("verbose,v", po::bool_switch(&verbose)->default_value(false),
             "Print extra information")
             ("help", po::bool_switch(&help)->default_value(false), "Produce help message")
@@ -797,6 +818,10 @@ int portcullis::JunctionFilter::main(int argc, char *argv[]) {
             "Output exon-based junctions in GFF format.")
             ("intron_gff", po::bool_switch(&introngff)->default_value(false),
             "Output intron-based junctions in GFF format.")
+            ("binary", po::bool_switch(&binary)->default_value(false),
+            "Also output junctions in portcullis' binary junction format (<prefix>.pass.junctions.bin).")
+            ("bgzip", po::bool_switch(&bgzip)->default_value(false),
+            "Also output the junction table and BED file BGZF compressed, with tabix indices (<prefix>.pass.junctions.tab.gz and <prefix>.pass.junctions.bed.gz).")
             ("source", po::value<string>(&source)->default_value(DEFAULT_FILTER_SOURCE),
             "The value to enter into the \"source\" field in GFF files.")
             ;
@@ -824,7 +849,7 @@ int portcullis::JunctionFilter::main(int argc, char *argv[]) {
     po::options_description hidden_options("Hidden options");
     hidden_options.add_options()
             ("prep_data_dir", po::value<path>(&prepDir), "Path to directory containing prepared data.")
-            ("junction_file", po::value<path>(&junctionFile), "Path to the junction tab file to process.")
+            ("junction_file", po::value<path>(&junctionFile), "Path to the junction tab or binary junction file to process.")
             ("no_smote", po::bool_switch(&no_smote)->default_value(false),
             "Use this flag to disable synthetic oversampling")
             ("enn", po::bool_switch(&enn)->default_value(false),
@@ -874,6 +899,8 @@ int portcullis::JunctionFilter::main(int argc, char *argv[]) {
     filter.setMinCov(mincov);
     filter.setOutputExonGFF(exongff);
     filter.setOutputIntronGFF(introngff);
+    filter.setOutputBinary(binary);
+    filter.setOutputIndexed(bgzip);
     // Only set the filter rules if specified.
     filter.setFilterFile(filterFile);
     filter.setGenuineFile(genuineFile);
@@ -100,6 +100,8 @@ namespace portcullis {
         bool saveLayers;
         bool outputExonGFF;
         bool outputIntronGFF;
+        bool outputBinary;
+        bool outputIndexed;
         uint32_t maxLength;
         bool filterCanonical;
         uint32_t minCov;
@@ -226,6 +228,22 @@ namespace portcullis {
             this->outputIntronGFF = outputIntronGFF;
         }
 
+        bool isOutputBinary() const {
+            return outputBinary;
+        }
+
+        void setOutputBinary(bool outputBinary) {
+            this->outputBinary = outputBinary;
+        }
+
+        bool isOutputIndexed() const {
+            return outputIndexed;
+        }
+
+        void setOutputIndexed(bool outputIndexed) {
+            this->outputIndexed = outputIndexed;
+        }
+
         bool isVerbose() const {
             return verbose;
         }
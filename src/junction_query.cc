@@ -0,0 +1,119 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <sys/ioctl.h>
+#include <iostream>
+#include <string>
+#include <vector>
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+#include <portcullis/junction_index.hpp>
+using portcullis::IndexedJunctionReader;
+
+#include "junction_query.hpp"
+
+
+portcullis::JunctionQuery::JunctionQuery(const path& _junctionFile) {
+	junctionFile = _junctionFile;
+	printHeader = false;
+	listRefs = false;
+}
+
+size_t portcullis::JunctionQuery::query(const vector<string>& regions, ostream& out) {
+	IndexedJunctionReader reader(junctionFile);
+	if (printHeader) {
+		for (const auto& h : reader.getHeader()) {
+			out << h << "\n";
+		}
+	}
+	if (listRefs) {
+		for (const auto& r : reader.getRefs()) {
+			out << r << "\n";
+		}
+	}
+	size_t nbJunctions = 0;
+	vector<string> lines;
+	for (const auto& region : regions) {
+		lines.clear();
+		nbJunctions += reader.query(region, lines);
+		for (const auto& l : lines) {
+			out << l << "\n";
+		}
+	}
+	out.flush();
+	return nbJunctions;
+}
+
+int portcullis::JunctionQuery::main(int argc, char *argv[]) {
+	// Portcullis args
+	path junctionFile;
+	vector<string> regions;
+	bool header;
+	bool refs;
+	bool help;
+	struct winsize w;
+	ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+	// Declare the supported options.
+	po::options_description generic_options("Options", w.ws_col, (unsigned)((double)w.ws_col / 1.7));
+	generic_options.add_options()
+	("header,H", po::bool_switch(&header)->default_value(false),
+	 "Also output the header lines of the junction file, i.e. the column names of a junction tab file or the track line of a BED file.")
+	("list_refs,l", po::bool_switch(&refs)->default_value(false),
+	 "List the names of the target sequences that have junctions in the file.")
+	("help", po::bool_switch(&help)->default_value(false), "Produce help message")
+	;
+	// Hidden options, will be allowed both on command line and
+	// in config file, but will not be shown to the user.
+	po::options_description hidden_options("Hidden options");
+	hidden_options.add_options()
+	("junction-file", po::value<path>(&junctionFile), "Path to the compressed and indexed junction tab or BED file.")
+	("region", po::value<vector<string>>(&regions), "Regions to extract junctions for.")
+	;
+	// Positional options for the junction file and regions
+	po::positional_options_description p;
+	p.add("junction-file", 1);
+	p.add("region", -1);
+	// Combine non-positional options
+	po::options_description cmdline_options;
+	cmdline_options.add(generic_options).add(hidden_options);
+	// Parse command line
+	po::variables_map vm;
+	po::store(po::command_line_parser(argc, argv).options(cmdline_options).positional(p).run(), vm);
+	po::notify(vm);
+	// Output help information the exit if requested
+	if (help || argc <= 1 || (regions.empty() && !refs)) {
+		cout << title() << endl << endl
+			 << description() << endl << endl
+			 << "Usage: " << usage() << endl << endl
+			 << generic_options << endl;
+		return 1;
+	}
+	// Nothing but junctions goes to standard output, so it can be piped elsewhere
+	JunctionQuery query(junctionFile);
+	query.setPrintHeader(header);
+	query.setListRefs(refs);
+	query.query(regions, cout);
+	return 0;
+}
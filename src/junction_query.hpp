@@ -0,0 +1,103 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <vector>
+using std::ostream;
+using std::string;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem.hpp>
+using boost::filesystem::path;
+
+namespace portcullis {
+
+typedef boost::error_info<struct JunctionQueryError, string> JunctionQueryErrorInfo;
+struct JunctionQueryException: virtual boost::exception, virtual std::exception { };
+
+/**
+ * Extracts the junctions overlapping some regions from a BGZF compressed and
+ * indexed junction tab or BED file, as written with the --bgzip option.
+ */
+class JunctionQuery {
+
+private:
+
+	path junctionFile;
+	bool printHeader;
+	bool listRefs;
+
+public:
+
+	JunctionQuery(const path& _junctionFile);
+
+	virtual ~JunctionQuery() {
+	}
+
+	path getJunctionFile() const {
+		return junctionFile;
+	}
+
+	void setJunctionFile(path junctionFile) {
+		this->junctionFile = junctionFile;
+	}
+
+	bool isPrintHeader() const {
+		return printHeader;
+	}
+
+	void setPrintHeader(bool printHeader) {
+		this->printHeader = printHeader;
+	}
+
+	bool isListRefs() const {
+		return listRefs;
+	}
+
+	void setListRefs(bool listRefs) {
+		this->listRefs = listRefs;
+	}
+
+	/**
+	 * Writes the lines for junctions whose introns overlap any of the regions, in
+	 * the order the regions are given
+	 * @return The number of junctions written
+	 */
+	size_t query(const vector<string>& regions, ostream& out);
+
+	static string title() {
+		return string("Portcullis Junction Query Mode Help.");
+	}
+
+	static string description() {
+		return string("Extracts junctions whose introns overlap the given regions from a compressed and\n") +
+			   "indexed junction tab or BED file, as produced using the --bgzip option.  Regions\n" +
+			   "are given as \"ref\", \"ref:start\" or \"ref:start-end\", with positions 1-based\n" +
+			   "and inclusive.  Matching lines are written to standard output.";
+	}
+
+	static string usage() {
+		return string("portcullis query [options] <junction-file> (<region>)+");
+	}
+
+	static int main(int argc, char *argv[]);
+};
+}
@@ -47,10 +47,12 @@ using portcullis::PortcullisFS;
 #include "prepare.hpp"
 #include "junction_filter.hpp"
 #include "bam_filter.hpp"
+#include "junction_query.hpp"
 using portcullis::JunctionBuilder;
 using portcullis::Prepare;
 using portcullis::JunctionFilter;
 using portcullis::BamFilter;
+using portcullis::JunctionQuery;
 
 typedef boost::error_info<struct PortcullisError, string> PortcullisErrorInfo;
 
@@ -59,8 +61,6 @@ struct PortcullisException : virtual boost::exception, virtual std::exception {
 
 // Default values for arguments
 const uint16_t DEFAULT_THREADS = 4;
-const uint32_t DEFAULT_CHUNK_SIZE_PER_THREAD = 10000;
-const uint32_t DEFAULT_GAP_SIZE = 100;
 
 // Global variable! :(
 portcullis::PortcullisFS portcullis::pfs;
@@ -70,6 +70,7 @@ enum class Mode {
     JUNC,
     FILTER,
     BAM_FILT,
+    QUERY,
     FULL
 };
 
@@ -118,6 +119,8 @@ Mode parseMode(string mode) {
         return Mode::FILTER;
     } else if (upperMode == string("BAMFILT")) {
         return Mode::BAM_FILT;
+    } else if (upperMode == string("QUERY")) {
+        return Mode::QUERY;
     } else if (upperMode == string("FULL")) {
         return Mode::FULL;
     } else {
@@ -145,7 +148,9 @@ string modes() {
             " - junc    - Step 2: Perform junction analysis on prepared data\n" +
             " - filt    - Step 3: Discard unlikely junctions\n" +
             " - bamfilt - Step 4: Filters a BAM to remove any reads associated with invalid\n" +
-            "             junctions";
+            "             junctions\n" +
+            " - query   - Extracts junctions in a region from compressed and indexed junction\n" +
+            "             files";
 }
 
 string fulltitle() {
@@ -179,6 +184,8 @@ int mainFull(int argc, char *argv[]) {
     bool saveBad;
     bool exongff;
     bool introngff;
+    bool binary;
+    bool bgzip;
     bool bamFilter;
     string source;
     uint32_t max_length;
@@ -210,6 +217,10 @@ int mainFull(int argc, char *argv[]) {
             "Output exon-based junctions in GFF format.")
             ("intron_gff", po::bool_switch(&introngff)->default_value(false),
             "Output intron-based junctions in GFF format.")
+            ("binary", po::bool_switch(&binary)->default_value(false),
+            "Also output junctions in portcullis' binary junction format.  If filtering BAMs, the binary file of passed junctions is used to do this.")
+            ("bgzip", po::bool_switch(&bgzip)->default_value(false),
+            "Also output the junction tables and BED files BGZF compressed, with tabix indices, for fast region queries using \"portcullis query\".")
             ("source", po::value<string>(&source)->default_value("portcullis"),
             "The value to enter into the \"source\" field in GFF files.")
             ;
@@ -321,6 +332,9 @@ int mainFull(int argc, char *argv[]) {
     prep.setUseLinks(!copy);
     prep.setUseCsi(useCsi);
     prep.setThreads(threads);
+    // Unless the unspliced alignments are needed later, only keep the spliced
+    // alignments rather than sorting the whole BAM
+    prep.setSplicedOnly(!extra && !separate && !bamFilter);
     prep.setVerbose(verbose);
     // Prep the input to produce a usable indexed and sorted bam plus, indexed
     // genome and queryable coverage information
@@ -344,6 +358,8 @@ int mainFull(int argc, char *argv[]) {
     jb.setUseCsi(useCsi);
     jb.setOutputExonGFF(exongff);
     jb.setOutputIntronGFF(introngff);
+    jb.setOutputBinary(binary);
+    jb.setOutputIndexed(bgzip);
     jb.setVerbose(verbose);
     jb.process();
 
@@ -363,6 +379,8 @@ int mainFull(int argc, char *argv[]) {
     filter.setENN(false);
     filter.setOutputExonGFF(exongff);
     filter.setOutputIntronGFF(introngff);
+    filter.setOutputBinary(binary);
+    filter.setOutputIndexed(bgzip);
     filter.setSaveBad(saveBad);
     filter.setSaveLayers(save_layers);
     filter.setSaveFeatures(save_features);
@@ -372,7 +390,7 @@ int mainFull(int argc, char *argv[]) {
     if (bamFilter) {
         cout << "Filtering BAMs" << endl
                 << "--------------" << endl << endl;
-        path filtJuncTab = path(filtOut.string() + ".pass.junctions.tab");
+        path filtJuncTab = path(filtOut.string() + (binary ? ".pass.junctions.bin" : ".pass.junctions.tab"));
         path bamFile = path(prepDir.string() + "/portcullis.sorted.alignments.bam");
         path filteredBam = path(outputDir.string() + "/portcullis.filtered.bam");
         BamFilter bamFilter(filtJuncTab.string(), bamFile.string(), filteredBam.string());
@@ -470,11 +488,13 @@ int main(int argc, char *argv[]) {
         if (version) {
             cout << PACKAGE_NAME << " " << PACKAGE_VERSION << endl;
             return 0;
-        } else {
-            cout << "Portcullis V" << PACKAGE_VERSION << endl << endl;
         }
         // If we've got this far parse the command line properly
         Mode mode = parseMode(modeStr);
+        // Query mode writes junctions to stdout, so leave out the banner
+        if (mode != Mode::QUERY) {
+            cout << "Portcullis V" << PACKAGE_VERSION << endl << endl;
+        }
         const int modeArgC = argc - 1;
         char** modeArgV = argv + 1;
         // Set static variables in downstream subtools so they know where to get their resources from
@@ -488,6 +508,8 @@ int main(int argc, char *argv[]) {
             JunctionFilter::main(modeArgC, modeArgV);
         } else if (mode == Mode::BAM_FILT) {
             BamFilter::main(modeArgC, modeArgV);
+        } else if (mode == Mode::QUERY) {
+            return JunctionQuery::main(modeArgC, modeArgV);
         } else if (mode == Mode::FULL) {
             mainFull(modeArgC, modeArgV);
         } else {
@@ -17,6 +17,7 @@
 
 #include <sys/ioctl.h>
 #include <glob.h>
+#include <cstring>
 #include <fstream>
 #include <string>
 #include <memory>
@@ -47,6 +48,8 @@ using bfs::path;
 namespace po = boost::program_options;
 
 #include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/bam_alignment.hpp>
+#include <portcullis/bam/bam_reader.hpp>
 #include <portcullis/bam/genome_mapper.hpp>
 #include <portcullis/portcullis_fs.hpp>
 using portcullis::PortcullisFS;
@@ -74,6 +77,22 @@ bool portcullis::PreparedFiles::valid(bool useCsi) const {
 	return true;
 }
 
+bool portcullis::PreparedFiles::validSpliced() const {
+	if (!bfs::exists(getSplicedSpillFilePath())) {
+		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
+								  "Could not find spliced alignments at: ") + getSplicedSpillFilePath().string()));
+	}
+	if (!bfs::exists(getGenomeFilePath()) && !bfs::symbolic_link_exists(getGenomeFilePath())) {
+		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
+								  "Could not find genome file at: ") + getGenomeFilePath().string()));
+	}
+	if (!bfs::exists(getGenomeIndexFilePath()) && !bfs::symbolic_link_exists(getGenomeIndexFilePath())) {
+		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
+								  "Could not find genome index at: ") + getGenomeIndexFilePath().string()));
+	}
+	return true;
+}
+
 void portcullis::PreparedFiles::clean() {
 	bfs::remove(getUnsortedBamFilePath());
 	bfs::remove(getSortedBamFilePath());
@@ -81,8 +100,11 @@ void portcullis::PreparedFiles::clean() {
 	bfs::remove(getBamIndexFilePath(true));
 	bfs::remove(getGenomeFilePath());
 	bfs::remove(getGenomeIndexFilePath());
+	bfs::remove(getPackedGenomeFilePath());
 	bfs::remove(getBcfFilePath());
 	bfs::remove(getBcfIndexFilePath());
+	SplicedSpill(getSplicedSpillFilePath()).remove();
+	bfs::remove(getJunctionEvidenceFilePath());
 }
 
 
@@ -92,6 +114,10 @@ portcullis::Prepare::Prepare(const path& _outputPrefix) {
 	useLinks = true;
 	useCsi = false;
 	threads = 1;
+	ioThreads = 0;
+	sortMemory = DEFAULT_SORT_MEMORY;
+	splicedOnly = false;
+	junctionEvidence = false;
 	verbose = false;
 }
 
@@ -144,6 +170,23 @@ bool portcullis::Prepare::genomeIndex() {
 	return bfs::exists(indexFile);
 }
 
+void portcullis::Prepare::genomePack() {
+	const path packedFile = output->getPackedGenomeFilePath();
+	if (bfs::exists(packedFile) && bfs::last_write_time(packedFile) >= bfs::last_write_time(output->getGenomeFilePath())) {
+		cout << "Packed genome detected: " << packedFile << endl;
+	}
+	else {
+		auto_cpu_timer timer(1, " - Genome Pack - Wall time taken: %ws\n\n");
+		cout << "Packing genome " << output->getGenomeFilePath() << " ... ";
+		cout.flush();
+		GenomeMapper gmap(output->getGenomeFilePath());
+		gmap.loadFastaIndex();
+		gmap.buildPackedGenome();
+		cout << "done." << endl
+			 << "Packed genome file created at: " << packedFile << endl;
+	}
+}
+
 
 /**
  * Merge together a set of BAM files, use the output prefix to construct a
@@ -167,21 +210,25 @@ bool portcullis::Prepare::bamMerge(vector<path> bamFiles) {
 			path tempSorted = path(output->getPrepDir());
 			tempSorted /= "temp" + lexical_cast<string>(inCount++) + ".bam";
 			// Sort the data (if required, will auto-detect if necessary)
-			if (!bamSort(f, tempSorted)) {
+			if (!bamSort(f, tempSorted, false)) {
 				BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 										  "Could not sort: ") + output->getUnsortedBamFilePath().string()));
 			}
 			mergeIn.push_back(tempSorted);
 		}
-		string mergeCmd = BamHelper::createMergeBamCmd(mergeIn, mergedBam, threads);
-		cout << "Merging BAM using command \"" << mergeCmd << "\" ... ";
+		// Merge the sorted inputs, indexing as we go
+		cout << "Merging BAMs ... ";
 		cout.flush();
-		int exitCode = system(mergeCmd.c_str());
-		if (exitCode != 0 || !bfs::exists(mergedBam)) {
+		BamMerger merger(mergeIn, mergedBam, threads);
+		merger.setIoThreads(ioThreads);
+		merger.setIndex(useCsi);
+		merger.merge();
+		if (!bfs::exists(mergedBam)) {
 			BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 									  "Failed to successfully merge: ") + mergedBam.string()));
 		}
 		cout << "done." << endl
+			 << "Merged " << merger.getNbAlignments() << " alignments." << endl
 			 << "Merged BAM file created at: " << mergedBam << endl;
 		cout << "Deleteing temporary unmerged files ...";
 		cout.flush();
@@ -199,7 +246,7 @@ bool portcullis::Prepare::bamMerge(vector<path> bamFiles) {
  * @param inputBam
  * @return
  */
-bool portcullis::Prepare::bamSort(const path& input, const path& output) {
+bool portcullis::Prepare::bamSort(const path& input, const path& output, const bool index) {
 	const path unsortedBam = input;
 	const path sortedBam = output;
 	bool sortedBamExists = bfs::exists(sortedBam) || bfs::symbolic_link_exists(sortedBam);
@@ -215,19 +262,21 @@ bool portcullis::Prepare::bamSort(const path& input, const path& output) {
 		else {
 			auto_cpu_timer timer(1, " - BAM Sort - Wall time taken: %ws\n\n");
 			// Sort the BAM file by coordinate
-            string sortCmd = BamHelper::createSortBamCmd(unsortedBam, sortedBam, false, threads, "2G");
-			cout << "Sorting BAM using command \"" << sortCmd << "\" ... ";
+			cout << "Sorting BAM ... ";
 			cout.flush();
-			int exitCode = system(sortCmd.c_str());
-			path badNameMergeFile = path(sortedBam.string() + ".bam");
-			if (bfs::exists(badNameMergeFile) || bfs::symbolic_link_exists(badNameMergeFile)) {
-				boost::filesystem::rename(badNameMergeFile, sortedBam);
+			BamSorter sorter(unsortedBam, sortedBam, threads, sortMemory);
+			sorter.setIoThreads(ioThreads);
+			sorter.setTempDir(this->output->getPrepDir());
+			if (index) {
+				sorter.setIndex(useCsi);
 			}
-			if (exitCode != 0 || !bfs::exists(sortedBam) || !BamHelper::isCoordSortedBam(sortedBam)) {
+			sorter.sort();
+			if (!bfs::exists(sortedBam)) {
 				BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 										  "Failed to successfully sort: ") + unsortedBam.string()));
 			}
 			cout << "done." << endl
+				 << "Sorted " << sorter.getNbAlignments() << " alignments using " << sorter.getNbRuns() << " temporary files." << endl
 				 << "Sorted BAM file created at: " << sortedBam << endl;
 		}
 	}
@@ -245,11 +294,16 @@ bool portcullis::Prepare::bamIndex(const bool copied) {
 	else if (!indexedBamExists) {
 		auto_cpu_timer timer(1, " - BAM Index - Wall time taken: %ws\n\n");
 		// Create BAM index
-		string indexCmd = BamHelper::createIndexBamCmd(sortedBam, useCsi);
-		cout << "Indexing BAM using command \"" << indexCmd << "\" ... ";
+		cout << "Indexing BAM ... ";
 		cout.flush();
-		int exitCode = system(indexCmd.c_str());
-		if (exitCode != 0 || !exists(output->getBamIndexFilePath(useCsi))) {
+		try {
+			BamHelper::indexBam(sortedBam, useCsi);
+		}
+		catch (BamException& e) {
+			BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
+									  "Failed to successfully index: ") + sortedBam.string()));
+		}
+		if (!exists(output->getBamIndexFilePath(useCsi))) {
 			BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 									  "Failed to successfully index: ") + sortedBam.string()));
 		}
@@ -259,6 +313,91 @@ bool portcullis::Prepare::bamIndex(const bool copied) {
 	return bfs::exists(indexedFile) || bfs::symbolic_link_exists(indexedFile);
 }
 
+bool portcullis::Prepare::splicedSpill(const vector<path>& bamFiles) {
+	const path spillFile = output->getSplicedSpillFilePath();
+	if (bfs::exists(spillFile)) {
+		cout << "Prepped spliced alignments detected: " << spillFile << endl;
+	}
+	else {
+		auto_cpu_timer timer(1, " - Spliced Alignments - Wall time taken: %ws\n\n");
+		cout << "Keeping spliced alignments from " << bamFiles.size() << " BAM file" << (bamFiles.size() > 1 ? "s" : "") << " ... ";
+		cout.flush();
+		SplicedSpill spill(spillFile);
+		spill.create(bamFiles, ioThreads, DEFAULT_SPILL_BUCKETS);
+		cout << "done." << endl
+			 << "Kept " << spill.getNbSplicedAlignments() << " spliced alignments out of " << spill.getNbAlignments()
+			 << ", in " << spill.getNbBuckets() << " temporary files." << endl
+			 << "Spliced alignment index created at: " << spillFile << endl;
+	}
+	return bfs::exists(spillFile);
+}
+
+bool portcullis::Prepare::evidenceWrite() {
+	const path evidenceFile = output->getJunctionEvidenceFilePath();
+	if (bfs::exists(evidenceFile)) {
+		cout << "Prepped junction evidence detected: " << evidenceFile << endl;
+	}
+	else {
+		auto_cpu_timer timer(1, " - Junction Evidence - Wall time taken: %ws\n\n");
+		cout << "Writing junction evidence ... ";
+		cout.flush();
+		EvidenceFileWriter writer(evidenceFile);
+		const path sortedBam = output->getSortedBamFilePath();
+		if (bfs::exists(sortedBam) || bfs::symbolic_link_exists(sortedBam)) {
+			BamReader reader(sortedBam, ioThreads);
+			reader.open();
+			writer.open(reader.getHeader());
+			vector<SpillRefStats> stats(reader.getHeader()->n_targets);
+			bam1_t* b = nullptr;
+			while ((b = reader.nextRaw()) != nullptr) {
+				// Alignments without a target sequence play no part in junction finding
+				if (b->core.tid < 0) {
+					continue;
+				}
+				const bool spliced = BamAlignment::isSplicedRead(b);
+				stats[b->core.tid].add(b, spliced);
+				if (spliced) {
+					writer.add(b);
+				}
+			}
+			reader.close();
+			writer.close(stats);
+		}
+		else {
+			// Only the spliced alignments were kept, along with the stats for all
+			// alignments, so sort each bucket in turn
+			SplicedSpill spill(output->getSplicedSpillFilePath());
+			spill.load();
+			if (spill.getNbBuckets() == 0) {
+				BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
+										  "No target sequences in spliced alignments at: ") + spill.getIndexFile().string()));
+			}
+			BamReader headerReader(spill.getBucketFile(0));
+			headerReader.open();
+			writer.open(headerReader.getHeader());
+			vector<SpillRefStats> stats;
+			for (int32_t t = 0; t < headerReader.getHeader()->n_targets; t++) {
+				stats.push_back(spill.getRefStats(t));
+			}
+			headerReader.close();
+			SortBuffer buffer;
+			bam1_t b;
+			memset(&b, 0, sizeof(bam1_t));
+			for (size_t i = 0; i < spill.getNbBuckets(); i++) {
+				spill.readBucket(i, buffer);
+				for (const auto& e : buffer.entries) {
+					buffer.get(e, &b);
+					writer.add(&b);
+				}
+			}
+			writer.close(stats);
+		}
+		cout << "done." << endl
+			 << "Kept " << writer.getNbRecords() << " spliced alignments as junction evidence at: " << evidenceFile << endl;
+	}
+	return bfs::exists(evidenceFile);
+}
+
 void portcullis::Prepare::prepare(vector<path> bamFiles, const path& originalGenomeFile) {
 	if (verbose) {
 		cout << "Configured portcullis prep to use the following settings: " << endl
@@ -266,7 +405,11 @@ void portcullis::Prepare::prepare(vector<path> bamFiles, const path& originalGen
 			 << " - Force prep (cleans output directory): " << boolalpha << force << endl
 			 << " - Use symbolic links instead of copy where possible: " << boolalpha << useLinks << endl
 			 << " - Indexing type: " << (useCsi ? "CSI" : "BAI") << endl
-			 << " - Threads (for sorting BAM): " << threads << endl << endl;
+			 << " - Threads (for sorting BAM): " << threads << endl
+			 << " - Additional I/O threads: " << ioThreads << endl
+			 << " - Memory for sorting BAM: " << sortMemory << " bytes" << endl
+			 << " - Only keep spliced alignments: " << boolalpha << splicedOnly << endl
+			 << " - Write junction evidence: " << boolalpha << junctionEvidence << endl << endl;
 	}
 	if (force) {
 		cout << "Cleaning output dir: " << output->getPrepDir() << " ... ";
@@ -291,11 +434,27 @@ void portcullis::Prepare::prepare(vector<path> bamFiles, const path& originalGen
 		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 								  "User requested ") + (useCsi ? "CSI" : "BAI") + " indexing mode, however, genome file contains sequences too long to properly index using this method.  To continue, restart using the --use_csi option."));
 	}
+	// Create a packed copy of the genome for fast random access
+	genomePack();
 	const bool doMerge = bamFiles.size() > 1;
 	if (bamFiles.empty()) {
 		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 								  "No BAM files to process")));
 	}
+	// Junction finding without the extra metrics only needs the spliced alignments,
+	// so don't sort the whole BAM, unless that's been done already
+	const bool sorted = bfs::exists(output->getSortedBamFilePath()) || bfs::symbolic_link_exists(output->getSortedBamFilePath());
+	if (splicedOnly && !sorted) {
+		if (!splicedSpill(bamFiles)) {
+			BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
+									  "Could not keep spliced alignments at: ") + output->getSplicedSpillFilePath().string()));
+		}
+		if (junctionEvidence && !evidenceWrite()) {
+			BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
+									  "Could not write junction evidence to: ") + output->getJunctionEvidenceFilePath().string()));
+		}
+		return;
+	}
 	path mergedBamFile = doMerge ? output->getUnsortedBamFilePath() : bamFiles[0];
 	bool indexCopied = false;
 	// Merge the bams to output a sorted bam file if required, otherwise just
@@ -315,7 +474,7 @@ void portcullis::Prepare::prepare(vector<path> bamFiles, const path& originalGen
 		// Copy / Symlink the index file to the output dir if it exists... otherwise we'll create it later
 		indexCopied = copy(bamFiles[0].string() + (useCsi ? CSI_EXTENSION : BAI_EXTENSION), output->getBamIndexFilePath(useCsi), "BAM index", false);
 		// Sort the data (if required, will auto-detect if necessary)
-		if (!bamSort(output->getUnsortedBamFilePath(), output->getSortedBamFilePath())) {
+		if (!bamSort(output->getUnsortedBamFilePath(), output->getSortedBamFilePath(), true)) {
 			BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 									  "Could not sort: ") + output->getUnsortedBamFilePath().string()));
 		}
@@ -329,6 +488,10 @@ void portcullis::Prepare::prepare(vector<path> bamFiles, const path& originalGen
 		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 								  "Failed to index: ") + output->getSortedBamFilePath().string()));
 	}
+	if (junctionEvidence && !evidenceWrite()) {
+		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
+								  "Could not write junction evidence to: ") + output->getJunctionEvidenceFilePath().string()));
+	}
 }
 
 vector<path> portcullis::Prepare::globFiles(vector<path> input) {
@@ -380,6 +543,10 @@ int portcullis::Prepare::main(int argc, char *argv[]) {
 	bool copy;
 	bool useCsi;
 	uint16_t threads;
+	uint16_t ioThreads;
+	string sortMemory;
+	bool splicedOnly;
+	bool junctionEvidence;
 	bool verbose;
 	bool help;
 	struct winsize w;
@@ -397,6 +564,14 @@ int portcullis::Prepare::main(int argc, char *argv[]) {
 	 "Whether to use CSI indexing rather than BAI indexing.  CSI has the advantage that it supports very long target sequences (probably not an issue unless you are working on huge genomes).  BAI has the advantage that it is more widely supported (useful for viewing in genome browsers).")
 	("threads,t", po::value<uint16_t>(&threads)->default_value(DEFAULT_PREP_THREADS),
 	 (string("The number of threads to used to sort the BAM file (if required).  Default: ") + lexical_cast<string>(DEFAULT_PREP_THREADS)).c_str())
+	("io_threads", po::value<uint16_t>(&ioThreads)->default_value(0),
+	 "The number of additional threads to use for compressing each BAM file written.  Reading only ever uses one extra thread per BAM file, which reads ahead when this is greater than 0.")
+	("sort_memory,m", po::value<string>(&sortMemory)->default_value(DEFAULT_PREP_SORT_MEMORY),
+	 "Maximum memory to use for holding alignments when sorting the BAM file.  Larger inputs are sorted in several parts, which are saved to temporary files in the output directory and then merged.  Accepts K, M and G suffixes.")
+	("spliced_only", po::bool_switch(&splicedOnly)->default_value(false),
+	 "Rather than sorting and indexing the whole BAM file, read it once and keep only the spliced alignments, split by target sequence into small temporary files, along with counts of the unspliced alignments.  This is much faster for unsorted input, and is all that \"portcullis junc\" needs, unless the extra metrics or separated BAMs are requested.")
+	("junction_evidence", po::bool_switch(&junctionEvidence)->default_value(false),
+	 "Also write a compact, memory mappable, copy of the spliced alignments and the alignment stats, which \"portcullis junc\" then reads instead of the BAM file when finding junctions.  This makes rerunning junction finding, for example with different options, much faster.")
 	("verbose,v", po::bool_switch(&verbose)->default_value(false),
 	 "Print extra information")
 	("help", po::bool_switch(&help)->default_value(false), "Produce help message")
@@ -455,6 +630,10 @@ int portcullis::Prepare::main(int argc, char *argv[]) {
 	prep.setUseLinks(!copy);
 	prep.setUseCsi(useCsi);
 	prep.setThreads(threads);
+	prep.setIoThreads(ioThreads);
+	prep.setSortMemory(BamSorter::parseMemory(sortMemory));
+	prep.setSplicedOnly(splicedOnly);
+	prep.setJunctionEvidence(junctionEvidence);
 	prep.setVerbose(verbose);
 	// Prep the input to produce a usable indexed and sorted bam plus, indexed
 	// genome and queryable coverage information
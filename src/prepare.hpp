@@ -44,6 +44,11 @@ using bfs::path;
 namespace po = boost::program_options;
 
 #include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/bam_merger.hpp>
+#include <portcullis/bam/bam_sorter.hpp>
+#include <portcullis/bam/genome_mapper.hpp>
+#include <portcullis/bam/evidence_file.hpp>
+#include <portcullis/bam/spliced_spill.hpp>
 using portcullis::bam::Strandedness;
 
 #include <portcullis/portcullis_fs.hpp>
@@ -58,6 +63,7 @@ struct PrepareException: virtual boost::exception, virtual std::exception { };
 
 const string DEFAULT_PREP_OUTPUT_DIR = "portcullis_prep";
 const uint16_t DEFAULT_PREP_THREADS = 1;
+const string DEFAULT_PREP_SORT_MEMORY = "2G";
 
 const string PORTCULLIS = "portcullis";
 
@@ -131,6 +137,22 @@ public:
 		return path(getBcfFilePath().string() + BCF_INDEX_EXTENSION);
 	}
 
+	/**
+	 * Index of the spliced alignments kept when the full BAM is not sorted.  The
+	 * bucket files are named after it.
+	 */
+	path getSplicedSpillFilePath() const {
+		return path(prepDir.string() + "/" + PORTCULLIS + ".spliced.alignments.spill");
+	}
+
+	/**
+	 * Compact copy of the spliced alignments, with the alignment stats, that
+	 * junction finding can read without decoding a BAM file
+	 */
+	path getJunctionEvidenceFilePath() const {
+		return path(prepDir.string() + "/" + PORTCULLIS + ".junction.evidence");
+	}
+
 	path getGenomeFilePath() const {
 		return path(prepDir.string() + "/" + PORTCULLIS + ".genome" + FASTA_EXTENSION);
 	}
@@ -139,8 +161,18 @@ public:
 		return path(getGenomeFilePath().string() + FASTA_INDEX_EXTENSION);
 	}
 
+	path getPackedGenomeFilePath() const {
+		return path(getGenomeFilePath().string() + portcullis::bam::PACKED_GENOME_EXTENSION);
+	}
+
 	bool valid(bool useCsi) const;
 
+	/**
+	 * Checks whether the spliced alignments, rather than a sorted BAM, have been
+	 * prepared, along with the genome
+	 */
+	bool validSpliced() const;
+
 	void clean();
 };
 
@@ -153,7 +185,11 @@ private:
 	bool force;
 	bool useLinks;
 	uint16_t threads;
+	uint16_t ioThreads;
+	uint64_t sortMemory;
 	bool useCsi;
+	bool splicedOnly;
+	bool junctionEvidence;
 	bool verbose;
 
 
@@ -185,6 +221,29 @@ public:
 		this->threads = threads;
 	}
 
+	uint16_t getIoThreads() const {
+		return ioThreads;
+	}
+
+	/**
+	 * Additional threads to use for compressing each BAM file.  Any value above
+	 * 0 also reads each BAM file ahead on one helper thread.
+	 */
+	void setIoThreads(uint16_t ioThreads) {
+		this->ioThreads = ioThreads;
+	}
+
+	uint64_t getSortMemory() const {
+		return sortMemory;
+	}
+
+	/**
+	 * Maximum number of bytes of alignments to hold in memory when sorting
+	 */
+	void setSortMemory(uint64_t sortMemory) {
+		this->sortMemory = sortMemory;
+	}
+
 	bool isUseCsi() const {
 		return useCsi;
 	}
@@ -193,6 +252,31 @@ public:
 		this->useCsi = useCsi;
 	}
 
+	bool isSplicedOnly() const {
+		return splicedOnly;
+	}
+
+	/**
+	 * Only keep the spliced alignments, bucketed by target sequence, rather than
+	 * sorting and indexing the whole BAM.  Enough for junction finding without
+	 * the extra metrics.
+	 */
+	void setSplicedOnly(bool splicedOnly) {
+		this->splicedOnly = splicedOnly;
+	}
+
+	bool isJunctionEvidence() const {
+		return junctionEvidence;
+	}
+
+	/**
+	 * Also write the junction evidence file, so that junction finding can be
+	 * rerun quickly
+	 */
+	void setJunctionEvidence(bool junctionEvidence) {
+		this->junctionEvidence = junctionEvidence;
+	}
+
 	bool isUseLinks() const {
 		return useLinks;
 	}
@@ -220,6 +304,11 @@ protected:
 
 	bool genomeIndex();
 
+	/**
+	 * Creates a packed, memory mappable, copy of the genome if it doesn't already exist
+	 */
+	void genomePack();
+
 
 	/**
 	 * Merge together a set of BAM files, use the output prefix to construct a
@@ -233,12 +322,28 @@ protected:
 	 * Sorts the unsorted bam file if required or forced
 	 * @param input Path to input BAM to sort
 	 * @param output Sorted BAM file
+	 * @param index Whether to index the sorted BAM file while writing it
 	 * @return
 	 */
-	bool bamSort(const path& input, const path& output);
+	bool bamSort(const path& input, const path& output, const bool index);
 
 	bool bamIndex(const bool copied);
 
+	/**
+	 * Keeps the spliced alignments from the BAM files, which needn't be sorted,
+	 * in a single pass, if not done already
+	 * @param bamFiles The BAM files to read
+	 * @return
+	 */
+	bool splicedSpill(const vector<path>& bamFiles);
+
+	/**
+	 * Writes the junction evidence file from the sorted BAM, or the spliced
+	 * alignments if only they were kept, if not done already
+	 * @return
+	 */
+	bool evidenceWrite();
+
 	/**
 	 * Checks whether the specified indexing method can support the genome sequence lengths
 	 * @param genomeFile
@@ -33,9 +33,15 @@ using bfs::path;
 
 #include <portcullis/bam/bam_master.hpp>
 #include <portcullis/bam/bam_alignment.hpp>
+#include <portcullis/bam/bam_merger.hpp>
 #include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bam_sorter.hpp>
+#include <portcullis/bam/bam_writer.hpp>
 #include <portcullis/bam/depth_parser.hpp>
 #include <portcullis/bam/genome_mapper.hpp>
+#include <portcullis/bam/evidence_file.hpp>
+#include <portcullis/bam/spliced_spill.hpp>
+#include <portcullis/bam/window_coverage.hpp>
 using namespace portcullis::bam;
 
 /**        
@@ -132,6 +138,548 @@ TEST(bam, depth_test_1) {
     EXPECT_LE(count2, count1);
 }
 
+TEST(bam, window_coverage) {
+    
+    // Depths in each window should match the pileup, which holds the depth of each
+    // 0-based position at the following index
+    DepthParser dp(RESOURCESDIR "/sorted.bam", 0, false);
+    BamReader reader(RESOURCESDIR "/sorted.bam");
+    reader.open();
+    vector<uint32_t> batch;
+    uint64_t total = 0;
+    while(dp.loadNextBatch(batch)) {
+        const int32_t refId = dp.getCurrentRefIndex();
+        const int32_t length = (int32_t)batch.size();
+        WindowCoverage coverage;
+        for (int32_t i = 0; i < length; i += 997) {
+            coverage.addWindow(i, i + 50);
+            coverage.addWindow(i + 25, i + 100);
+        }
+        coverage.prepare();
+        EXPECT_TRUE(reader.seekToSequence(refId));
+        bam1_t* b = nullptr;
+        while((b = reader.nextRaw()) != nullptr && b->core.tid == refId) {
+            if ((b->core.flag & BAM_FUNMAP) == 0 && !BamAlignment::isSplicedRead(b)) {
+                coverage.addAlignment(b);
+            }
+        }
+        coverage.finalise();
+        for (int32_t i = 0; i < length; i += 997) {
+            uint64_t sum = 0;
+            for (int32_t p = i; p < i + 100 && p + 1 < length; p++) {
+                EXPECT_EQ(batch[p + 1], coverage.getDepth(p));
+                sum += batch[p + 1];
+            }
+            if (i + 101 <= length) {
+                EXPECT_EQ(sum, coverage.sumDepths(i, i + 99));
+            }
+            total += sum;
+        }
+        // Nothing is held outside the windows
+        EXPECT_EQ((uint32_t)0, coverage.getDepth(length + 1000));
+    }
+    EXPECT_GT(total, (uint64_t)0);
+    reader.close();
+}
+
+TEST(bam, writer_index) {
+    
+    // An index built while writing should match one built afterwards from the
+    // file, and the file itself should match what htslib would write
+    bfs::create_directories("temp");
+    for (int csi = 0; csi <= 1; csi++) {
+        const uint16_t ioThreads = csi ? 2 : 0;
+        path bamFile = csi ? "temp/writer_index.csi.bam" : "temp/writer_index.bai.bam";
+        path indexFile = bamFile.string() + (csi ? ".csi" : ".bai");
+        path htsFile = "temp/writer_index.hts.bam";
+        BamReader reader(RESOURCESDIR "/sorted.bam");
+        reader.open();
+        BamWriter writer(bamFile, ioThreads, 6);
+        writer.setIndex(csi == 1);
+        writer.open(reader.getHeader());
+        BGZF* hts = bgzf_open(htsFile.c_str(), "w6");
+        bam_hdr_write(hts, reader.getHeader());
+        bam1_t* b = nullptr;
+        uint64_t count = 0;
+        while((b = reader.nextRaw()) != nullptr) {
+            // Repeat each alignment to span several blocks
+            for (int i = 0; i < 500; i++) {
+                writer.write(b);
+                bam_write1(hts, b);
+                count++;
+            }
+        }
+        writer.close();
+        bgzf_close(hts);
+        reader.close();
+        EXPECT_GT(count, (uint64_t)0);
+        EXPECT_TRUE(bfs::exists(indexFile));
+        
+        std::ifstream ours(bamFile.c_str(), std::ios::binary);
+        std::ifstream theirs(htsFile.c_str(), std::ios::binary);
+        string oursBam((std::istreambuf_iterator<char>(ours)), std::istreambuf_iterator<char>());
+        string theirsBam((std::istreambuf_iterator<char>(theirs)), std::istreambuf_iterator<char>());
+        EXPECT_GT(oursBam.size(), (size_t)BGZF_MAX_BLOCK_SIZE);
+        EXPECT_EQ(theirsBam, oursBam);
+        
+        std::ifstream in1(indexFile.c_str(), std::ios::binary);
+        string onTheFly((std::istreambuf_iterator<char>(in1)), std::istreambuf_iterator<char>());
+        in1.close();
+        EXPECT_EQ(0, sam_index_build(bamFile.c_str(), csi ? 14 : 0));
+        std::ifstream in2(indexFile.c_str(), std::ios::binary);
+        string afterwards((std::istreambuf_iterator<char>(in2)), std::istreambuf_iterator<char>());
+        EXPECT_GT(onTheFly.size(), (size_t)0);
+        EXPECT_EQ(afterwards, onTheFly);
+    }
+}
+
+TEST(bam, sorter) {
+    
+    EXPECT_EQ((uint64_t)2 << 30, BamSorter::parseMemory("2G"));
+    EXPECT_EQ((uint64_t)768 << 20, BamSorter::parseMemory("768m"));
+    EXPECT_EQ((uint64_t)5000, BamSorter::parseMemory("5000"));
+    
+    // Sorting in memory and via several temporary files should give the same result
+    bfs::create_directories("temp");
+    BamSorter inMemory(RESOURCESDIR "/unsorted.bam", "temp/sorter.mem.bam", 2, DEFAULT_SORT_MEMORY);
+    inMemory.setIndex(false);
+    inMemory.sort();
+    EXPECT_EQ((size_t)0, inMemory.getNbRuns());
+    EXPECT_TRUE(bfs::exists("temp/sorter.mem.bam.bai"));
+    
+    BamSorter spilt(RESOURCESDIR "/unsorted.bam", "temp/sorter.spilt.bam", 2, 3000);
+    spilt.sort();
+    EXPECT_GT(spilt.getNbRuns(), (size_t)1);
+    EXPECT_EQ(inMemory.getNbAlignments(), spilt.getNbAlignments());
+    EXPECT_FALSE(bfs::exists("temp/sorter.spilt.bam.tmp.0.bam"));
+    
+    std::ifstream in1("temp/sorter.mem.bam", std::ios::binary);
+    std::ifstream in2("temp/sorter.spilt.bam", std::ios::binary);
+    string mem((std::istreambuf_iterator<char>(in1)), std::istreambuf_iterator<char>());
+    string onDisk((std::istreambuf_iterator<char>(in2)), std::istreambuf_iterator<char>());
+    EXPECT_EQ(mem, onDisk);
+    
+    EXPECT_TRUE(BamHelper::isCoordSortedBam("temp/sorter.mem.bam"));
+    BamReader reader("temp/sorter.mem.bam");
+    reader.open();
+    uint64_t count = 0;
+    uint64_t lastKey = 0;
+    bam1_t* b = nullptr;
+    while((b = reader.nextRaw()) != nullptr) {
+        const uint64_t key = BamSorter::sortKey(b->core);
+        EXPECT_LE(lastKey, key);
+        lastKey = key;
+        count++;
+    }
+    reader.close();
+    EXPECT_EQ(inMemory.getNbAlignments(), count);
+    EXPECT_GT(count, (uint64_t)0);
+    
+    // A buffer only grows as far as its limit, however it's split between the
+    // records and the sort entries
+    for (uint64_t maxBytes : {(uint64_t)1, (uint64_t)1000, (uint64_t)2000, (uint64_t)100000}) {
+        SortBuffer buffer;
+        BamReader limited(RESOURCESDIR "/unsorted.bam");
+        limited.open();
+        size_t added = 0;
+        while((b = limited.nextRaw()) != nullptr && buffer.add(b, maxBytes)) {
+            added++;
+            if (added > 1) {
+                EXPECT_LE(buffer.bytes(), maxBytes) << added;
+            }
+        }
+        limited.close();
+        EXPECT_GT(added, (size_t)0);
+        EXPECT_EQ(added, buffer.entries.size());
+        if (maxBytes > 2000) {
+            EXPECT_EQ(count, added);
+        }
+        else if (maxBytes > 1) {
+            EXPECT_LT(added, count);
+            EXPECT_GT(buffer.bytes() * 2, maxBytes);
+        }
+    }
+}
+
+TEST(bam, merger) {
+    
+    // Target sequences missing from the first input are added at the end
+    auto parse = [](const string& text) {
+        bam_hdr_t* h = sam_hdr_parse(text.size(), text.c_str());
+        h->l_text = text.size();
+        h->text = strdup(text.c_str());
+        return h;
+    };
+    vector<bam_hdr_t*> headers;
+    headers.push_back(parse("@SQ\tSN:chr1\tLN:1000\n@SQ\tSN:chr2\tLN:2000\n"));
+    headers.push_back(parse("@SQ\tSN:chr2\tLN:2000\n@SQ\tSN:chr3\tLN:3000\n"));
+    vector<vector<int32_t>> tidMaps;
+    bam_hdr_t* merged = BamMerger::mergeHeaders(headers, tidMaps);
+    EXPECT_EQ(3, merged->n_targets);
+    EXPECT_EQ(string("chr3"), string(merged->target_name[2]));
+    EXPECT_EQ(1, tidMaps[1][0]);
+    EXPECT_EQ(2, tidMaps[1][1]);
+    EXPECT_NE(string::npos, string(merged->text).find("SO:coordinate"));
+    bam_hdr_destroy(merged);
+    
+    // Target sequences shared by the inputs must be in the same order
+    headers.push_back(parse("@SQ\tSN:chr3\tLN:3000\n@SQ\tSN:chr1\tLN:1000\n"));
+    EXPECT_THROW(BamMerger::mergeHeaders(headers, tidMaps), BamException);
+    for (auto h : headers) {
+        bam_hdr_destroy(h);
+    }
+    
+    // These claim to be sorted but aren't, which should be caught
+    vector<path> unsorted;
+    unsorted.push_back(RESOURCESDIR "/bam1.bam");
+    unsorted.push_back(RESOURCESDIR "/bam2.bam");
+    bfs::create_directories("temp");
+    BamMerger bad(unsorted, "temp/merger.bad.bam", 1);
+    EXPECT_THROW(bad.merge(), BamException);
+    
+    vector<path> inputs;
+    inputs.push_back(RESOURCESDIR "/sorted.bam");
+    for (size_t i = 0; i < unsorted.size(); i++) {
+        inputs.push_back(path("temp/merger.in" + std::to_string(i) + ".bam"));
+        BamSorter(unsorted[i], inputs.back(), 1, DEFAULT_SORT_MEMORY).sort();
+    }
+    BamMerger merger(inputs, "temp/merger.bam", 2);
+    merger.setIndex(false);
+    merger.merge();
+    EXPECT_TRUE(bfs::exists("temp/merger.bam.bai"));
+    
+    uint64_t count = 0;
+    for (const auto& input : inputs) {
+        BamReader reader(input);
+        reader.open();
+        while(reader.nextRaw() != nullptr) {
+            count++;
+        }
+        reader.close();
+    }
+    EXPECT_EQ(count, merger.getNbAlignments());
+    
+    BamReader reader("temp/merger.bam");
+    reader.open();
+    uint64_t lastKey = 0;
+    uint64_t mergedCount = 0;
+    bam1_t* b = nullptr;
+    while((b = reader.nextRaw()) != nullptr) {
+        const uint64_t key = BamSorter::sortKey(b->core);
+        EXPECT_LE(lastKey, key);
+        lastKey = key;
+        mergedCount++;
+    }
+    reader.close();
+    EXPECT_EQ(count, mergedCount);
+}
+
+TEST(bam, spliced_spill) {
+    
+    bfs::create_directories("temp");
+    vector<path> inputs;
+    inputs.push_back(RESOURCESDIR "/clipped3.bam");
+    SplicedSpill spill("temp/spill.idx");
+    spill.create(inputs, 1, 4);
+    EXPECT_TRUE(bfs::exists("temp/spill.idx"));
+    EXPECT_GT(spill.getNbSplicedAlignments(), (uint64_t)0);
+    
+    // Sorting the buckets in turn should give the spliced alignments in the same
+    // order as sorting the whole file
+    BamSorter(RESOURCESDIR "/clipped3.bam", "temp/spill.sorted.bam", 1, DEFAULT_SORT_MEMORY).sort();
+    vector<string> expected;
+    vector<uint64_t> unspliced;
+    BamReader reader("temp/spill.sorted.bam");
+    reader.open();
+    bam1_t* b = nullptr;
+    while((b = reader.nextRaw()) != nullptr) {
+        if (b->core.tid < 0) {
+            continue;
+        }
+        unspliced.resize(std::max(unspliced.size(), (size_t)b->core.tid + 1));
+        if (BamAlignment::isSplicedRead(b)) {
+            expected.push_back(string(bam_get_qname(b)) + ":" + std::to_string(BamSorter::sortKey(b->core)));
+        }
+        else {
+            unspliced[b->core.tid]++;
+        }
+    }
+    reader.close();
+    
+    SplicedSpill loaded("temp/spill.idx");
+    loaded.load();
+    EXPECT_EQ(spill.getNbBuckets(), loaded.getNbBuckets());
+    EXPECT_EQ(spill.getNbAlignments(), loaded.getNbAlignments());
+    vector<string> actual;
+    for (size_t i = 0; i < loaded.getNbBuckets(); i++) {
+        SortBuffer buffer;
+        loaded.readBucket(i, buffer);
+        EXPECT_EQ(loaded.getBucket(i).nbAlignments, buffer.entries.size());
+        bam1_t r;
+        for (const auto& e : buffer.entries) {
+            buffer.get(e, &r);
+            EXPECT_GE(r.core.tid, loaded.getBucket(i).refId);
+            EXPECT_LE(r.core.tid, loaded.getBucket(i).lastRefId);
+            actual.push_back(string(bam_get_qname(&r)) + ":" + std::to_string(BamSorter::sortKey(r.core)));
+        }
+    }
+    EXPECT_EQ(expected, actual);
+    for (size_t t = 0; t < unspliced.size(); t++) {
+        EXPECT_EQ(unspliced[t], loaded.getRefStats(t).unsplicedCount);
+    }
+    
+    loaded.remove();
+    EXPECT_FALSE(bfs::exists("temp/spill.idx"));
+    EXPECT_FALSE(bfs::exists(loaded.getBucketFile(0)));
+}
+
+TEST(bam, junction_evidence) {
+    
+    bfs::create_directories("temp");
+    BamSorter(RESOURCESDIR "/clipped3.bam", "temp/evidence.sorted.bam", 1, DEFAULT_SORT_MEMORY).sort();
+    
+    // Write the spliced alignments, keeping copies to compare against
+    vector<bam1_t*> expected;
+    vector<SpillRefStats> stats;
+    EvidenceFileWriter writer("temp/test.evidence");
+    BamReader reader("temp/evidence.sorted.bam");
+    reader.open();
+    writer.open(reader.getHeader());
+    stats.resize(reader.getHeader()->n_targets);
+    bam1_t* b = nullptr;
+    while((b = reader.nextRaw()) != nullptr) {
+        if (b->core.tid < 0) {
+            continue;
+        }
+        const bool spliced = BamAlignment::isSplicedRead(b);
+        stats[b->core.tid].add(b, spliced);
+        if (spliced) {
+            writer.add(b);
+            expected.push_back(bam_dup1(b));
+        }
+    }
+    writer.close(stats);
+    EXPECT_EQ(expected.size(), writer.getNbRecords());
+    EXPECT_GT(expected.size(), (size_t)0);
+    EXPECT_FALSE(bfs::exists("temp/test.evidence.tmp.positions"));
+    
+    EvidenceFile evidence("temp/test.evidence");
+    EXPECT_EQ(expected.size(), evidence.getNbRecords());
+    EXPECT_EQ(reader.getHeader()->n_targets, evidence.getNbRefs());
+    EXPECT_EQ(string(reader.getHeader()->target_name[0]), evidence.getRefName(0));
+    bam1_t* r = bam_init1();
+    for (size_t i = 0; i < expected.size(); i++) {
+        const bam1_t* e = expected[i];
+        evidence.getRecord(i, r);
+        EXPECT_EQ(string(bam_get_qname(e)), string(bam_get_qname(r)));
+        EXPECT_EQ(e->core.tid, r->core.tid);
+        EXPECT_EQ(e->core.pos, r->core.pos);
+        EXPECT_EQ(e->core.flag, r->core.flag);
+        EXPECT_EQ(e->core.n_cigar, r->core.n_cigar);
+        EXPECT_EQ(0, memcmp(bam_get_cigar(e), bam_get_cigar(r), e->core.n_cigar * 4));
+        EXPECT_EQ(0, memcmp(bam_get_seq(e), bam_get_seq(r), (e->core.l_qseq + 1) / 2));
+        uint8_t* md = bam_aux_get(e, "MD");
+        EXPECT_EQ(md == nullptr, bam_aux_get(r, "MD") == nullptr);
+        if (md != nullptr) {
+            EXPECT_EQ(string(bam_aux2Z(md)), string(bam_aux2Z(bam_aux_get(r, "MD"))));
+        }
+        EXPECT_EQ(e->core.pos, evidence.getPositions()[i]);
+        EXPECT_EQ(e->core.flag, evidence.getFlags()[i]);
+        EXPECT_EQ(e->core.qual, evidence.getMapQualities()[i]);
+        BamAlignment al;
+        al.setRaw(const_cast<bam1_t*>(e));
+        EXPECT_EQ(std::hash<string>()(al.deriveName()), evidence.getNameHashes()[i]);
+    }
+    bam_destroy1(r);
+    
+    uint64_t nbRecords = 0;
+    for (int32_t t = 0; t < evidence.getNbRefs(); t++) {
+        const EvidenceFileRef& ref = evidence.getRef(t);
+        EXPECT_EQ(stats[t].splicedCount, ref.nbRecords);
+        EXPECT_EQ(stats[t].unsplicedCount, ref.stats.unsplicedCount);
+        EXPECT_EQ(nbRecords, ref.firstRecord);
+        EXPECT_EQ(ref.firstRecord, evidence.findFirst(t, 0));
+        EXPECT_EQ(ref.firstRecord + ref.nbRecords, evidence.findFirst(t, ref.length));
+        nbRecords += ref.nbRecords;
+    }
+    
+    // Alignments must be added in coordinate order
+    EvidenceFileWriter unsorted("temp/unsorted.evidence");
+    unsorted.open(reader.getHeader());
+    unsorted.add(expected.back());
+    EXPECT_THROW(unsorted.add(expected.front()), BamException);
+    reader.close();
+    for (auto e : expected) {
+        bam_destroy1(e);
+    }
+}
+
+TEST(bam, junction_evidence_corrupt) {
+    
+    bfs::create_directories("temp");
+    BamSorter(RESOURCESDIR "/clipped3.bam", "temp/evidence_corrupt.sorted.bam", 1, DEFAULT_SORT_MEMORY).sort();
+    const path good("temp/good.evidence");
+    EvidenceFileWriter writer(good);
+    BamReader reader("temp/evidence_corrupt.sorted.bam");
+    reader.open();
+    writer.open(reader.getHeader());
+    vector<SpillRefStats> stats(reader.getHeader()->n_targets);
+    bam1_t* b = nullptr;
+    while((b = reader.nextRaw()) != nullptr) {
+        if (b->core.tid >= 0 && BamAlignment::isSplicedRead(b)) {
+            stats[b->core.tid].add(b, true);
+            writer.add(b);
+        }
+    }
+    writer.close(stats);
+    reader.close();
+    
+    EvidenceFileHeader h;
+    EvidenceFileRef ref;
+    {
+        std::ifstream in(good.c_str(), std::ios::binary);
+        in.read((char*)&h, sizeof(EvidenceFileHeader));
+        in.seekg(h.refsOffset);
+        in.read((char*)&ref, sizeof(EvidenceFileRef));
+    }
+    ASSERT_GT(h.nbRecords, (uint64_t)1);
+    
+    // Copies the good file, truncated to the given size, then overwrites part of it
+    const path corrupt("temp/corrupt.evidence");
+    auto corruptCopy = [&](const uint64_t size, const uint64_t offset, const void* value, const size_t bytes) {
+        bfs::copy_file(good, corrupt, bfs::copy_option::overwrite_if_exists);
+        bfs::resize_file(corrupt, size);
+        std::fstream out(corrupt.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        out.seekp(offset);
+        out.write((const char*)value, bytes);
+    };
+    auto corruptHeader = [&](const size_t field, const uint64_t value) {
+        corruptCopy(h.fileSize, field, &value, sizeof(value));
+    };
+    
+    // Truncated, with and without the file size fixed up to match
+    corruptCopy(h.fileSize - 8, 0, &h, sizeof(h));
+    EXPECT_THROW(EvidenceFile e(corrupt), BamException);
+    for (uint64_t size : {h.recordOffsetsOffset + 8, h.positionsOffset + 4, h.flagsOffset + 2,
+                          h.mapQualitiesOffset + 1, h.nameHashesOffset + 8}) {
+        corruptCopy(size, offsetof(EvidenceFileHeader, fileSize), &size, sizeof(size));
+        EXPECT_THROW(EvidenceFile e(corrupt), BamException) << size;
+    }
+    
+    // Columns and sections that start too near the end
+    for (size_t field : {offsetof(EvidenceFileHeader, recordOffsetsOffset), offsetof(EvidenceFileHeader, positionsOffset),
+                         offsetof(EvidenceFileHeader, flagsOffset), offsetof(EvidenceFileHeader, mapQualitiesOffset),
+                         offsetof(EvidenceFileHeader, nameHashesOffset), offsetof(EvidenceFileHeader, refsOffset)}) {
+        corruptHeader(field, h.fileSize - 1);
+        EXPECT_THROW(EvidenceFile e(corrupt), BamException) << field;
+    }
+    corruptHeader(offsetof(EvidenceFileHeader, nbRecords), h.fileSize);
+    EXPECT_THROW(EvidenceFile e(corrupt), BamException);
+    corruptHeader(offsetof(EvidenceFileHeader, namesOffset), h.fileSize + 1);
+    EXPECT_THROW(EvidenceFile e(corrupt), BamException);
+    
+    // A record that starts outside the records
+    const uint64_t outside = h.recordOffsetsOffset - 1;
+    corruptCopy(h.fileSize, h.recordOffsetsOffset + 8, &outside, sizeof(outside));
+    EXPECT_THROW(EvidenceFile e(corrupt), BamException);
+    
+    // A record whose data runs past the end of the records
+    const int32_t length = h.recordOffsetsOffset;
+    corruptCopy(h.fileSize, h.recordsOffset + sizeof(bam1_core_t), &length, sizeof(length));
+    {
+        EvidenceFile e(corrupt);
+        bam1_t* r = bam_init1();
+        EXPECT_THROW(e.getRecord(0, r), BamException);
+        e.getRecord(1, r);
+        bam_destroy1(r);
+    }
+    
+    // Target sequences with too many records, or names outside the file
+    EvidenceFileRef badRef = ref;
+    badRef.nbRecords = h.nbRecords + 1 - ref.firstRecord;
+    corruptCopy(h.fileSize, h.refsOffset, &badRef, sizeof(badRef));
+    EXPECT_THROW(EvidenceFile e(corrupt), BamException);
+    badRef = ref;
+    badRef.nameLength = h.fileSize - h.namesOffset - ref.nameOffset + 1;
+    corruptCopy(h.fileSize, h.refsOffset, &badRef, sizeof(badRef));
+    EXPECT_THROW(EvidenceFile e(corrupt), BamException);
+    
+    // The untouched file is fine
+    EXPECT_NO_THROW(EvidenceFile e(good));
+    bfs::remove(corrupt);
+}
+
+TEST(bam, read_ahead) {
+    
+    // Reading ahead on a helper thread should give exactly the same alignments
+    BamReader reader1(RESOURCESDIR "/clipped3.bam");
+    BamReader reader2(RESOURCESDIR "/clipped3.bam", 1);
+    reader1.open();
+    reader2.open();
+    
+    uint32_t count = 0;
+    while(reader1.next()) {
+        EXPECT_TRUE(reader2.next());
+        EXPECT_EQ(reader1.current().deriveName(), reader2.current().deriveName());
+        count++;
+    }
+    EXPECT_FALSE(reader2.next());
+    EXPECT_GT(count, 0);
+    
+    // Make sure we can switch regions part way through reading
+    reader1.setRegion(0, 0, reader1.getHeader()->target_len[0]);
+    reader2.setRegion(0, 0, reader2.getHeader()->target_len[0]);
+    EXPECT_TRUE(reader2.next());
+    reader2.setRegion(0, 0, reader2.getHeader()->target_len[0]);
+    while(reader1.next()) {
+        EXPECT_TRUE(reader2.next());
+        EXPECT_EQ(reader1.current().deriveName(), reader2.current().deriveName());
+    }
+    EXPECT_FALSE(reader2.next());
+    
+    reader1.close();
+    reader2.close();
+    
+    // Same for depths
+    DepthParser dp1(RESOURCESDIR "/sorted.bam", 0, true);
+    DepthParser dp2(RESOURCESDIR "/sorted.bam", 0, true, 1);
+    vector<uint32_t> batch1;
+    vector<uint32_t> batch2;
+    while(dp1.loadNextBatch(batch1)) {
+        EXPECT_TRUE(dp2.loadNextBatch(batch2));
+        EXPECT_EQ(batch1, batch2);
+    }
+    EXPECT_FALSE(dp2.loadNextBatch(batch2));
+}
+
+TEST(bam, lazy_decoding) {
+    
+    // Checks on the raw record should agree with the decoded cigar
+    BamReader reader(RESOURCESDIR "/clipped3.bam");
+    reader.open();
+    uint32_t spliced = 0;
+    while(reader.next()) {
+        const BamAlignment& al = reader.current();
+        const bool rawSpliced = BamAlignment::isSplicedRead(al.getRaw());
+        const uint32_t rawJunctions = al.getNbJunctionsInRead();
+        const size_t rawNbOps = al.getNbCigarOps();
+        uint32_t junctions = 0;
+        int32_t alignedLength = 0;
+        for (const auto& op : al.getCigar()) {
+            if (op.type == BAM_CIGAR_REFSKIP_CHAR) junctions++;
+            if (CigarOp::opConsumesReference(op.type)) alignedLength += op.length;
+        }
+        EXPECT_EQ(rawSpliced, junctions > 0);
+        EXPECT_EQ(rawSpliced, al.isSplicedRead());
+        EXPECT_EQ(rawJunctions, junctions);
+        EXPECT_EQ(rawNbOps, al.getNbCigarOps());
+        EXPECT_EQ(al.getEnd(), al.getPosition() + alignedLength - 1);
+        if (rawSpliced) spliced++;
+    }
+    reader.close();
+    EXPECT_GT(spliced, 0);
+}
+
 TEST(bam, genome_mapper_ecoli) {
     
     // Create a new faidx
@@ -178,6 +726,122 @@ TEST(bam, genome_mapper_ecoli) {
     bfs::remove(faidxFile);
 }
 
+TEST(bam, genome_mapper_cache) {
+
+    // Create a small genome containing soft masked regions, Ns and IUPAC codes
+    bfs::create_directories("temp");
+    path genome("temp/cache.fa");
+    std::ofstream fa(genome.c_str());
+    fa << ">seq1" << endl << "ACGTacgtNN" << endl << "NNnnACGTRY" << endl << "ttGGAAccW" << endl;
+    fa << ">seq2" << endl << "GATTACA" << endl;
+    fa << ">seq3" << endl << "nnnnNNNNacgtACGTkmKM" << endl;
+    fa.close();
+
+    GenomeMapper uncached(genome);
+    uncached.buildFastaIndex();
+    uncached.loadFastaIndex();
+
+    // Use the smallest cache possible so that sequences get swapped in and out
+    GenomeMapper cached(genome);
+    cached.loadFastaIndex();
+    cached.enableCache(0);
+
+    for (string name : {"seq1", "seq2", "seq3", "seq1"}) {
+        for (int start = -2; start < 32; start++) {
+            for (int end = start - 2; end < 32; end++) {
+                EXPECT_EQ(cached.fetchBases(name.c_str(), start, end), uncached.fetchBases(name.c_str(), start, end));
+            }
+        }
+    }
+    EXPECT_EQ(cached.fetchBases("seq1", 0, 28), "ACGTacgtNNNNnnACGTRYttGGAAccW");
+
+    PackedSeqPtr seq = cached.getSeq("seq1");
+    EXPECT_EQ(seq->length(), 29);
+    EXPECT_EQ(seq->getCode(6), 2);
+    EXPECT_TRUE(seq->isN(9));
+    EXPECT_TRUE(seq->isN(18));
+    EXPECT_FALSE(seq->isN(17));
+
+    // Check a real genome too
+    path in(RESOURCESDIR "/spombe.III.fa");
+    path spombe("temp/spombe.III.fa");
+    bfs::copy_file(in, spombe, bfs::copy_option::overwrite_if_exists);
+    GenomeMapper spombeUncached(spombe);
+    spombeUncached.buildFastaIndex();
+    spombeUncached.loadFastaIndex();
+    GenomeMapper spombeCached(spombe);
+    spombeCached.loadFastaIndex();
+    spombeCached.enableCache(DEFAULT_GENOME_CACHE_SIZE);
+
+    string chr = "III";
+    for (int start = 0; start < 200000; start += 997) {
+        EXPECT_EQ(spombeCached.fetchBases(chr.c_str(), start, start + 250), spombeUncached.fetchBases(chr.c_str(), start, start + 250));
+    }
+    EXPECT_EQ(spombeCached.fetchBases("unknown", 0, 10), "");
+}
+
+TEST(bam, genome_mapper_packed) {
+
+    bfs::create_directories("temp");
+    path genome("temp/packed.fa");
+    std::ofstream fa(genome.c_str());
+    fa << ">seq1" << endl << "ACGTacgtNN" << endl << "NNnnACGTRY" << endl << "ttGGAAccW" << endl;
+    fa << ">empty" << endl;
+    fa << ">seq2 with description" << endl << "GATTACA" << endl;
+    fa.close();
+
+    GenomeMapper uncached(genome);
+    uncached.buildFastaIndex();
+    uncached.loadFastaIndex();
+    EXPECT_FALSE(uncached.isPacked());
+    uncached.buildPackedGenome();
+    EXPECT_TRUE(bfs::exists(uncached.getPackedGenomeFile()));
+
+    GenomeMapper packed(genome);
+    packed.loadFastaIndex();
+    EXPECT_TRUE(packed.isPacked());
+
+    // Note that faidx returns garbage for empty sequences
+    EXPECT_EQ(packed.fetchBases("empty", 0, 10), "");
+
+    for (string name : {"seq1", "seq2", "seq1", "unknown"}) {
+        for (int start = -2; start < 32; start++) {
+            for (int end = start - 2; end < 32; end++) {
+                EXPECT_EQ(packed.fetchBases(name.c_str(), start, end), uncached.fetchBases(name.c_str(), start, end));
+            }
+        }
+    }
+
+    // Mappers for the same file share a single mapping
+    GenomeMapper packed2(genome);
+    packed2.loadFastaIndex();
+    EXPECT_EQ(packed.getSeq("seq2").get(), packed2.getSeq("seq2").get());
+    EXPECT_EQ(packed2.getSeq("seq1")->length(), 29);
+    EXPECT_TRUE(packed2.getSeq("unknown") == nullptr);
+
+    // Entries pointing outside the file are rejected when opening
+    const path corrupt("temp/packed.corrupt.fa.packed");
+    auto corruptFirstEntry = [&](const size_t field, const void* value, const size_t bytes) {
+        bfs::copy_file(uncached.getPackedGenomeFile(), corrupt, bfs::copy_option::overwrite_if_exists);
+        std::fstream out(corrupt.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        out.seekp(sizeof(PackedGenomeHeader) + field);
+        out.write((const char*)value, bytes);
+    };
+    const uint64_t nearEnd = bfs::file_size(uncached.getPackedGenomeFile()) - 2;
+    for (size_t field : {offsetof(PackedSeqEntry, basesOffset), offsetof(PackedSeqEntry, nRunsOffset),
+                         offsetof(PackedSeqEntry, lowerRunsOffset), offsetof(PackedSeqEntry, nameOffset)}) {
+        corruptFirstEntry(field, &nearEnd, sizeof(nearEnd));
+        EXPECT_THROW(PackedGenome p(corrupt), BamException) << field;
+    }
+    const uint32_t nbRuns = 0xffffffff;
+    corruptFirstEntry(offsetof(PackedSeqEntry, nbLowerRuns), &nbRuns, sizeof(nbRuns));
+    EXPECT_THROW(PackedGenome p(corrupt), BamException);
+    bfs::remove(corrupt);
+
+    bfs::remove(uncached.getPackedGenomeFile());
+    bfs::remove(uncached.getFastaIndexFile());
+}
+
 TEST(bam, padding) {
     
     vector<CigarOp> cigar = CigarOp::createFullCigarFromString("2S14M2I1M1737N8M14S");
@@ -22,6 +22,8 @@ using portcullis::bam::RefSeq;
 
 #include <portcullis/intron.hpp>
 using portcullis::Intron;
+using portcullis::IntronComparator;
+using portcullis::IntronKey;
 
 const RefSeq rd2(2, "seq_2", 100);
 const RefSeq rd5(5, "seq_5", 100);
@@ -63,3 +65,21 @@ TEST(intron, size) {
     
     EXPECT_EQ(intron.size(), 11);    
 }
+
+TEST(intron, key) {
+    
+    // Keys must order introns exactly as the comparator does, negative
+    // coordinates included
+    vector<Intron> introns;
+    introns.push_back(Intron(rd5, 10, 20));
+    introns.push_back(Intron(rd2, 20, 30));
+    introns.push_back(Intron(rd5, 10, 15));
+    introns.push_back(Intron(rd5, -1, 15));
+    introns.push_back(Intron(rd2, 300000, 400000));
+    for (const auto& a : introns) {
+        for (const auto& b : introns) {
+            EXPECT_EQ(IntronComparator()(a, b), a.key() < b.key());
+            EXPECT_EQ(a == b, a.key() == b.key());
+        }
+    }
+}
@@ -0,0 +1,376 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+namespace bfs = boost::filesystem;
+using boost::filesystem::path;
+using boost::lexical_cast;
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_alignment.hpp>
+#include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bam_writer.hpp>
+#include <portcullis/junction.hpp>
+#include <portcullis/junction_system.hpp>
+using portcullis::bam::BamAlignment;
+using portcullis::bam::BamReader;
+using portcullis::bam::BamWriter;
+using portcullis::JunctionPtr;
+using portcullis::JunctionSystem;
+
+#include <prepare.hpp>
+#include <junction_builder.hpp>
+using portcullis::Prepare;
+using portcullis::PreparedFiles;
+using portcullis::JunctionBuilder;
+
+namespace {
+
+/**
+ * A target sequence in a synthetic data set, with the number of evenly spaced
+ * reads to put on it
+ */
+struct TestRef {
+    string name;
+    int32_t length;
+    int32_t nbReads;
+};
+
+/**
+ * Writes a random genome with the given target sequences
+ * @return The sequences
+ */
+vector<string> writeGenome(const path& genomeFile, const vector<TestRef>& refs) {
+    std::minstd_rand rng(42);
+    const char bases[] = "ACGT";
+    vector<string> seqs;
+    std::ofstream fa(genomeFile.c_str());
+    for (const auto& r : refs) {
+        string seq(r.length, 'N');
+        for (auto& c : seq) {
+            c = bases[rng() % 4];
+        }
+        fa << ">" << r.name << "\n";
+        for (int32_t i = 0; i < r.length; i += 60) {
+            fa << seq.substr(i, 60) << "\n";
+        }
+        seqs.push_back(seq);
+    }
+    return seqs;
+}
+
+/**
+ * Writes a random genome, and a coordinate sorted BAM of 100bp reads that match
+ * it exactly.  Reads are evenly spaced along each target sequence and every fourth
+ * one is spliced, with an intron of between 100 and 1000bp.  Three more spliced
+ * reads are added for each of the given intron starts on the first target sequence.
+ * @return The number of spliced reads
+ */
+int32_t writeTestData(const path& genomeFile, const path& bamFile, const vector<TestRef>& refs, const vector<int32_t>& intronStarts) {
+    const vector<string> seqs = writeGenome(genomeFile, refs);
+    // Target sequence, position and SAM line of each read
+    vector<std::tuple<size_t, int32_t, string>> reads;
+    int32_t nbSpliced = 0;
+    auto addRead = [&](const size_t refIndex, const int32_t pos, const int32_t intronLength) {
+        const string& seq = seqs[refIndex];
+        const string cigar = intronLength > 0 ? "50M" + lexical_cast<string>(intronLength) + "N50M" : "100M";
+        const string query = intronLength > 0 ? seq.substr(pos, 50) + seq.substr(pos + 50 + intronLength, 50) : seq.substr(pos, 100);
+        std::ostringstream line;
+        line << "r" << reads.size() << "\t0\t" << refs[refIndex].name << "\t" << pos + 1 << "\t60\t"
+             << cigar << "\t*\t0\t0\t" << query << "\t*\n";
+        reads.push_back(std::make_tuple(refIndex, pos, line.str()));
+        nbSpliced += intronLength > 0 ? 1 : 0;
+    };
+    for (size_t r = 0; r < refs.size(); r++) {
+        const int32_t spacing = refs[r].nbReads > 0 ? (refs[r].length - 1200) / refs[r].nbReads : 0;
+        for (int32_t i = 0; i < refs[r].nbReads; i++) {
+            addRead(r, i * spacing, i % 4 == 0 ? 100 + (i * 37) % 900 : 0);
+        }
+    }
+    for (const auto s : intronStarts) {
+        for (int32_t i = 0; i < 3; i++) {
+            addRead(0, s - 50, 200);
+        }
+    }
+    std::stable_sort(reads.begin(), reads.end(), [](const std::tuple<size_t, int32_t, string>& a, const std::tuple<size_t, int32_t, string>& b) {
+        return std::get<0>(a) < std::get<0>(b) || (std::get<0>(a) == std::get<0>(b) && std::get<1>(a) < std::get<1>(b));
+    });
+    const string samPath = bamFile.string() + ".sam";
+    std::ofstream sam(samPath.c_str());
+    sam << "@HD\tVN:1.4\tSO:coordinate\n";
+    for (const auto& r : refs) {
+        sam << "@SQ\tSN:" << r.name << "\tLN:" << r.length << "\n";
+    }
+    for (const auto& r : reads) {
+        sam << std::get<2>(r);
+    }
+    sam.close();
+    // Convert to BAM
+    samFile* in = sam_open(samPath.c_str(), "r");
+    bam_hdr_t* header = sam_hdr_read(in);
+    samFile* out = sam_open(bamFile.c_str(), "wb");
+    sam_hdr_write(out, header);
+    bam1_t* b = bam_init1();
+    while (sam_read1(in, header, b) >= 0) {
+        sam_write1(out, header, b);
+    }
+    bam_destroy1(b);
+    sam_close(out);
+    bam_hdr_destroy(header);
+    sam_close(in);
+    bfs::remove(samPath);
+    return nbSpliced;
+}
+
+/**
+ * Prepares the BAM and genome in a fresh directory
+ */
+void prepareTestData(const path& prepDir, const path& genomeFile, const path& bamFile) {
+    bfs::remove_all(prepDir);
+    Prepare prep(prepDir);
+    prep.prepare(vector<path>{bfs::absolute(bamFile)}, bfs::absolute(genomeFile));
+}
+
+/**
+ * Finds junctions in the prepared data with the given settings
+ * @return The number of regions processed
+ */
+size_t buildJunctions(const path& prepDir, const path& output, const uint16_t threads, const uint64_t chunkSize,
+                      const uint64_t batchSize = portcullis::DEFAULT_JUNC_BATCH_SIZE, const bool separate = false) {
+    JunctionBuilder jb(prepDir, output);
+    jb.setThreads(threads);
+    jb.setChunkSize(chunkSize);
+    jb.setBatchSize(batchSize);
+    jb.setExtra(false);
+    jb.setSeparate(separate);
+    jb.setStrandSpecific(portcullis::bam::Strandedness::UNKNOWN);
+    jb.setOrientation(portcullis::bam::Orientation::UNKNOWN);
+    jb.setOutputExonGFF(false);
+    jb.setOutputIntronGFF(false);
+    jb.process();
+    return jb.getNbRegions();
+}
+
+string readFile(const path& file) {
+    std::ifstream in(file.c_str(), std::ios::binary);
+    return string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+/**
+ * Copies clipped3.bam, adding an unmapped copy of every 50th read, without its
+ * cigar, at the same position, and the same unmapped reads again without any
+ * position at the end
+ */
+void writeWithUnmapped(const path& bamFile) {
+    samFile* in = sam_open(RESOURCESDIR "/clipped3.bam", "r");
+    bam_hdr_t* header = sam_hdr_read(in);
+    samFile* out = sam_open(bamFile.c_str(), "wb");
+    sam_hdr_write(out, header);
+    vector<bam1_t*> unplaced;
+    bam1_t* b = bam_init1();
+    for (size_t i = 0; sam_read1(in, header, b) >= 0; i++) {
+        sam_write1(out, header, b);
+        if (i % 50 == 0) {
+            // The cigar sits between the name and the sequence
+            bam1_t* u = bam_dup1(b);
+            const int cigarBytes = u->core.n_cigar * 4;
+            uint8_t* cigar = u->data + u->core.l_qname;
+            memmove(cigar, cigar + cigarBytes, u->l_data - u->core.l_qname - cigarBytes);
+            u->l_data -= cigarBytes;
+            u->core.n_cigar = 0;
+            u->core.flag |= BAM_FUNMAP;
+            u->core.bin = hts_reg2bin(u->core.pos, u->core.pos + 1, 14, 5);
+            sam_write1(out, header, u);
+            u->core.tid = u->core.mtid = -1;
+            u->core.pos = u->core.mpos = -1;
+            u->core.bin = hts_reg2bin(-1, 0, 14, 5);
+            unplaced.push_back(u);
+        }
+    }
+    for (auto u : unplaced) {
+        sam_write1(out, header, u);
+        bam_destroy1(u);
+    }
+    bam_destroy1(b);
+    sam_close(out);
+    bam_hdr_destroy(header);
+    sam_close(in);
+}
+
+/**
+ * Separates a BAM serially, in file order, then indexes the spliced and unspliced
+ * BAMs afterwards, which is how the separated BAMs used to be written
+ */
+void separateSerially(const path& bamFile, const string& prefix) {
+    BamReader reader(bamFile);
+    reader.open();
+    BamWriter spliced(prefix + ".spliced.bam", 0, portcullis::DEFAULT_JUNC_BAM_COMPRESSION);
+    BamWriter unspliced(prefix + ".unspliced.bam", 0, portcullis::DEFAULT_JUNC_BAM_COMPRESSION);
+    BamWriter unmapped(prefix + ".unmapped.bam", 0, portcullis::DEFAULT_JUNC_BAM_COMPRESSION);
+    spliced.open(reader.getHeader());
+    unspliced.open(reader.getHeader());
+    unmapped.open(reader.getHeader());
+    while (reader.next()) {
+        const BamAlignment& al = reader.current();
+        BamWriter& writer = al.isSplicedRead() ? spliced : al.isMapped() ? unspliced : unmapped;
+        writer.write(al.getRaw());
+    }
+    spliced.close();
+    unspliced.close();
+    unmapped.close();
+    reader.close();
+    sam_index_build((prefix + ".spliced.bam").c_str(), 0);
+    sam_index_build((prefix + ".unspliced.bam").c_str(), 0);
+}
+
+/**
+ * Reads each record of a BAM file as its raw bytes
+ */
+vector<string> readRecords(const path& bamFile) {
+    vector<string> records;
+    samFile* in = sam_open(bamFile.c_str(), "r");
+    if (in == nullptr) {
+        return records;
+    }
+    bam_hdr_t* header = sam_hdr_read(in);
+    bam1_t* b = bam_init1();
+    while (sam_read1(in, header, b) >= 0) {
+        records.push_back(string((const char*)&b->core, sizeof(bam1_core_t)) + string((const char*)b->data, b->l_data));
+    }
+    bam_destroy1(b);
+    bam_hdr_destroy(header);
+    sam_close(in);
+    return records;
+}
+
+}
+
+TEST(junction_builder, chunked_regions) {
+    // One chromosome with enough reads to split, which with a chunk size of 2000
+    // gives 6 regions of 40000bp.  Junctions are placed with their intron starting
+    // exactly on, and either side of, a region boundary.
+    bfs::create_directories("temp/jb");
+    const path genome = "temp/jb/chunked.fa";
+    const path bam = "temp/jb/chunked.bam";
+    const int32_t nbSpliced = writeTestData(genome, bam, {{"chrL", 240000, 11900}}, {39999, 40000, 80000, 80001, 200000});
+    prepareTestData("temp/jb/chunked_prep", genome, bam);
+
+    EXPECT_EQ(1, buildJunctions("temp/jb/chunked_prep", "temp/jb/whole/portcullis", 1, 0));
+    EXPECT_EQ(6, buildJunctions("temp/jb/chunked_prep", "temp/jb/chunked/portcullis", 4, 2000));
+
+    // The junctions found, and all their metrics, should be the same either way
+    const string whole = readFile("temp/jb/whole/portcullis.junctions.tab");
+    EXPECT_FALSE(whole.empty());
+    EXPECT_EQ(whole, readFile("temp/jb/chunked/portcullis.junctions.tab"));
+
+    // Every spliced read is counted exactly once, including those whose intron
+    // starts on a boundary
+    JunctionSystem js("temp/jb/chunked/portcullis.junctions.tab");
+    uint32_t total = 0;
+    uint32_t onBoundary = 0;
+    for (const auto& j : js.getJunctions()) {
+        total += j->getNbSplicedAlignments();
+        if (j->getIntron()->start == 80000 && j->getIntron()->end == 80199) {
+            onBoundary = j->getNbSplicedAlignments();
+        }
+    }
+    EXPECT_EQ((uint32_t)nbSpliced, total);
+    EXPECT_EQ(3, onBoundary);
+}
+
+TEST(junction_builder, batched_sequences) {
+    // Small contigs, some without any reads, including the first and last
+    bfs::create_directories("temp/jb");
+    const path genome = "temp/jb/batched.fa";
+    const path bam = "temp/jb/batched.bam";
+    writeTestData(genome, bam, {{"ctg1", 5000, 0}, {"ctg2", 5000, 200}, {"ctg3", 5000, 0},
+                                {"ctg4", 5000, 300}, {"ctg5", 5000, 100}, {"ctg6", 5000, 0}}, {});
+    prepareTestData("temp/jb/batched_prep", genome, bam);
+
+    // Seeking to a contig without reads fails, otherwise the reader is left at
+    // its first read
+    BamReader reader(PreparedFiles("temp/jb/batched_prep").getSortedBamFilePath());
+    reader.open();
+    const vector<bool> hasReads = {false, true, false, true, true, false};
+    for (int32_t refId = 0; refId < (int32_t)hasReads.size(); refId++) {
+        EXPECT_EQ(hasReads[refId], reader.seekToSequence(refId)) << refId;
+        if (hasReads[refId]) {
+            EXPECT_TRUE(reader.next());
+            EXPECT_EQ(refId, reader.current().getReferenceId());
+            EXPECT_EQ(0, reader.current().getPosition());
+        }
+    }
+    reader.close();
+
+    // All contigs in one batch, in three batches, two of which start or end with
+    // an empty contig, and each contig separately
+    EXPECT_EQ(1, buildJunctions("temp/jb/batched_prep", "temp/jb/one_batch/portcullis", 1, 0));
+    EXPECT_EQ(3, buildJunctions("temp/jb/batched_prep", "temp/jb/three_batches/portcullis", 1, 0, 300));
+    EXPECT_EQ(6, buildJunctions("temp/jb/batched_prep", "temp/jb/unbatched/portcullis", 1, 0, 0));
+
+    const string unbatched = readFile("temp/jb/unbatched/portcullis.junctions.tab");
+    EXPECT_FALSE(unbatched.empty());
+    EXPECT_EQ(unbatched, readFile("temp/jb/one_batch/portcullis.junctions.tab"));
+    EXPECT_EQ(unbatched, readFile("temp/jb/three_batches/portcullis.junctions.tab"));
+}
+
+TEST(junction_builder, separated_bams) {
+    // A real BAM, with unmapped reads both placed and without a position added
+    bfs::create_directories("temp/jb");
+    const path genome = "temp/jb/separate.fa";
+    const path bam = "temp/jb/separate.bam";
+    writeGenome(genome, {{"Chr4", 18585056, 0}});
+    writeWithUnmapped(bam);
+    prepareTestData("temp/jb/separate_prep", genome, bam);
+    separateSerially(bam, "temp/jb/serial");
+
+    // Separating in parallel should give the same alignments in the same order
+    // and the same indexes, however many threads are used
+    for (uint16_t threads : {1, 4}) {
+        const string output = "temp/jb/separate_" + lexical_cast<string>(threads) + "/portcullis";
+        buildJunctions("temp/jb/separate_prep", output, threads, portcullis::DEFAULT_JUNC_CHUNK_SIZE,
+                       portcullis::DEFAULT_JUNC_BATCH_SIZE, true);
+        for (const string type : {"spliced", "unspliced", "unmapped"}) {
+            const vector<string> expected = readRecords("temp/jb/serial." + type + ".bam");
+            const vector<string> actual = readRecords(output + "." + type + ".bam");
+            EXPECT_FALSE(expected.empty()) << type;
+            EXPECT_EQ(expected.size(), actual.size()) << threads << " " << type;
+            EXPECT_TRUE(expected == actual) << threads << " " << type;
+        }
+        for (const string type : {"spliced", "unspliced"}) {
+            const string index = readFile("temp/jb/serial." + type + ".bam.bai");
+            EXPECT_FALSE(index.empty()) << type;
+            EXPECT_EQ(index, readFile(output + "." + type + ".bam.bai")) << threads << " " << type;
+        }
+    }
+}
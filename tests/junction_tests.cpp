@@ -17,18 +17,50 @@
 
 #include <gtest/gtest.h>
 
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <sstream>
+#include <tuple>
 using std::cout;
 using std::endl;
 
+#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+namespace bfs = boost::filesystem;
 
+#include <htslib/kstring.h>
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_reader.hpp>
 #include <portcullis/intron.hpp>
 #include <portcullis/junction.hpp>
+#include <portcullis/junction_file.hpp>
+#include <portcullis/junction_index.hpp>
+#include <portcullis/junction_map.hpp>
+#include <portcullis/junction_system.hpp>
+#include <portcullis/junction_table.hpp>
+#include <portcullis/junction_writer.hpp>
+using portcullis::bam::BamReader;
+using portcullis::bam::RefSeqPtrList;
+using portcullis::AlignmentInfo;
+using portcullis::AlignmentSummary;
+using portcullis::AnchorMismatches;
+using portcullis::AnchorRef;
 using portcullis::CanonicalSS;
 using portcullis::Intron;
 using portcullis::Junction;
 using portcullis::JunctionException;
+using portcullis::JunctionFile;
+using portcullis::IndexedJunctionReader;
+using portcullis::IndexedJunctionWriter;
+using portcullis::JunctionMap;
+using portcullis::KeyedIndex;
+using portcullis::JunctionSystem;
+using portcullis::JunctionTable;
+using portcullis::JunctionWriter;
+using portcullis::SeqUtils;
 
 bool is_critical( JunctionException const& ex ) { return true; }
 
@@ -106,6 +138,139 @@ TEST(junction, entropy) {
     EXPECT_GT(e1, e2);
 }
 
+/**
+ * Creates a BAM record from a SAM formatted line
+ */
+BamAlignment samToAlignment(bam_hdr_t* header, const string& line) {
+    kstring_t str = {0, 0, NULL};
+    kputs(line.c_str(), &str);
+    bam1_t* b = bam_init1();
+    sam_parse1(&str, header, b);
+    free(str.s);
+    BamAlignment al(b, true, Strandedness::UNKNOWN, Orientation::UNKNOWN);
+    bam_destroy1(b);
+    return al;
+}
+
+/**
+ * Metrics are accumulated as alignments are added to the junction, so check they
+ * come out the same as if they were calculated from the complete set of alignments
+ */
+TEST(junction, streaming_metrics) {
+
+    string hdrText = "@SQ\tSN:seq_5\tLN:100\n";
+    bam_hdr_t* header = sam_hdr_parse(hdrText.size(), hdrText.c_str());
+
+    shared_ptr<Intron> l(new Intron(rd5, 20, 30));
+    Junction j(l, 5, 45);
+
+    // Starts are deliberately not in order for the last alignment
+    vector<string> sam{
+        "r1\t99\tseq_5\t6\t60\t15M11N10M\t=\t40\t45\tACGTACGTACGTACGTACGTACGTA\t*",
+        "r2\t99\tseq_5\t6\t60\t15M11N10M\t=\t40\t45\tACGTACGTACGTACGTACGTACGTA\t*",
+        "r3\t163\tseq_5\t8\t10\t13M11N12M\t=\t40\t45\tACGTACGTACGTACGTACGTACGTA\t*",
+        "r4\t83\tseq_5\t11\t60\t10M11N15M\t=\t41\t-45\tACGTACGTACGTACGTACGTACGTA\t*",
+        "r5\t147\tseq_5\t7\t60\t14M11N11M\t=\t2\t-45\tACGTACGTACGTACGTACGTACGTA\t*"
+    };
+    vector<int32_t> starts;
+    for (const auto& line : sam) {
+        BamAlignment al = samToAlignment(header, line);
+        j.addJunctionAlignment(al);
+        starts.push_back(al.getStart());
+    }
+    bam_hdr_destroy(header);
+
+    j.calcMetrics(Orientation::FR);
+
+    EXPECT_EQ(j.getNbSplicedAlignments(), 5);
+    EXPECT_EQ(j.getNbDistinctAlignments(), 4);
+    EXPECT_EQ(j.getNbUniquelyMappedAlignments(), 4);
+    EXPECT_EQ(j.getNbBamProperlyPairedAlignments(), 5);
+    EXPECT_EQ(j.getNbPortcullisProperlyPairedAlignments(), 4);
+    EXPECT_EQ(j.getNbReliableAlignments(), 3);
+    EXPECT_EQ(j.getNbR1PosAlignments(), 2);
+    EXPECT_EQ(j.getNbR1NegAlignments(), 1);
+    EXPECT_EQ(j.getNbR2PosAlignments(), 1);
+    EXPECT_EQ(j.getNbR2NegAlignments(), 1);
+
+    double streamed = j.getEntropy();
+    std::sort(starts.begin(), starts.end());
+    EXPECT_DOUBLE_EQ(streamed, j.calcEntropy(starts));
+}
+
+/**
+ * Match statistics from the MD tag should be the same as those from comparing
+ * against the genome, either as a string or packed
+ */
+TEST(junction, md_match_stats) {
+
+    string hdrText = "@SQ\tSN:seq_5\tLN:60\n";
+    bam_hdr_t* header = sam_hdr_parse(hdrText.size(), hdrText.c_str());
+
+    string genome = "ACGTTGCAAGCTTAGCCGATGTAAGTCCGTAGGCTAACGTTAGCATCGGATCCAAGTTCG";
+    Intron intron(rd5, 20, 30);
+
+    // One mismatch, insertion and deletion in the left anchor, one mismatch and
+    // deletion in the right anchor
+    string read = "r1\t0\tseq_5\t6\t60\t5M1I4M1D5M11N6M1D4M\t*\t0\t0\tGCAAGTCTTACCAATGACTAAGTTA\t*";
+    AlignmentSummary withMD(samToAlignment(header, read + "\tMD:Z:9^G2G3G4^C4"));
+    AlignmentSummary withoutMD(samToAlignment(header, read));
+    bam_hdr_destroy(header);
+
+    string leftAnc = genome.substr(5, 15);
+    string rightAnc = genome.substr(31, 11);
+    PackedSeq packed(genome.c_str(), genome.size());
+
+    AnchorRef leftRef(5, leftAnc, nullptr);
+    AnchorMismatches mismatches;
+    EXPECT_TRUE(withMD.calcAnchorMismatches(5, 19, leftRef, true, mismatches));
+    EXPECT_FALSE(withoutMD.calcAnchorMismatches(5, 19, leftRef, true, mismatches));
+    EXPECT_TRUE(withoutMD.calcAnchorMismatches(5, 19, leftRef, false, mismatches));
+
+    // Walking the cigar should give the same result as comparing the padded
+    // query and genome sequences
+    int32_t qStart = 0;
+    int32_t qEnd = 0;
+    string paddedQuery = BamAlignment::getPaddedQuerySeq(withoutMD.cigar, withoutMD.position, withoutMD.alignedLength,
+            withoutMD.getQuerySeq(), 5, 19, qStart, qEnd, false);
+    string paddedGenome = BamAlignment::getPaddedGenomeSeq(withoutMD.cigar, withoutMD.position, withoutMD.alignedLength,
+            leftAnc, 5, 19, qStart, qEnd, false);
+    EXPECT_EQ(mismatches.length, paddedQuery.size());
+    EXPECT_EQ(mismatches.nbMismatches, SeqUtils::hammingDistance(paddedQuery, paddedGenome));
+
+    AlignmentInfo md;
+    md.calcMatchStats(withMD, intron, 5, 41, leftAnc, rightAnc);
+    AlignmentInfo gen;
+    gen.calcMatchStats(withoutMD, intron, 5, 41, leftAnc, rightAnc);
+    AlignmentInfo pac;
+    pac.calcMatchStats(withoutMD, intron, 5, 41, leftAnc, rightAnc, &packed);
+
+    EXPECT_EQ(md.nbMismatches, 5);
+    EXPECT_EQ(md.upstreamMatches, 2);
+    EXPECT_EQ(md.downstreamMatches, 1);
+    EXPECT_EQ(md.mmes, 9);
+
+    EXPECT_EQ(md.totalUpstreamMatches, gen.totalUpstreamMatches);
+    EXPECT_EQ(md.totalDownstreamMatches, gen.totalDownstreamMatches);
+    EXPECT_EQ(md.totalUpstreamMismatches, gen.totalUpstreamMismatches);
+    EXPECT_EQ(md.totalDownstreamMismatches, gen.totalDownstreamMismatches);
+    EXPECT_EQ(md.upstreamMatches, gen.upstreamMatches);
+    EXPECT_EQ(md.downstreamMatches, gen.downstreamMatches);
+    EXPECT_EQ(md.minMatch, gen.minMatch);
+    EXPECT_EQ(md.maxMatch, gen.maxMatch);
+    EXPECT_EQ(md.nbMismatches, gen.nbMismatches);
+    EXPECT_EQ(md.mmes, gen.mmes);
+    EXPECT_EQ(md.upstreamMismatchPositions, gen.upstreamMismatchPositions);
+    EXPECT_EQ(md.downstreamMismatchPositions, gen.downstreamMismatchPositions);
+
+    EXPECT_EQ(pac.nbMismatches, gen.nbMismatches);
+    EXPECT_EQ(pac.upstreamMatches, gen.upstreamMatches);
+    EXPECT_EQ(pac.downstreamMatches, gen.downstreamMatches);
+    EXPECT_EQ(pac.mmes, gen.mmes);
+    EXPECT_EQ(pac.upstreamMismatchPositions, gen.upstreamMismatchPositions);
+    EXPECT_EQ(pac.downstreamMismatchPositions, gen.downstreamMismatchPositions);
+}
+
 /**
  * This IS what you'd expect to see in a real junction
  */
@@ -146,3 +311,634 @@ TEST(junction, coverage2) {
     
     EXPECT_LT(cvg2, 0);
 }
+
+TEST(junction, system_ref_index) {
+    
+    JunctionSystem js;
+    js.addJunction(make_shared<Junction>(make_shared<Intron>(rd2, 20, 30), 10, 40));
+    js.addJunction(make_shared<Junction>(make_shared<Intron>(rd5, 50, 60), 40, 70));
+    js.addJunction(make_shared<Junction>(make_shared<Intron>(rd5, 20, 30), 10, 40));
+    
+    // Still in target order, so the index can be used straight away
+    EXPECT_TRUE(js.isGroupedByRef());
+    EXPECT_EQ(std::make_pair((size_t)0, (size_t)1), js.getRefRange(2));
+    EXPECT_EQ(std::make_pair((size_t)1, (size_t)3), js.getRefRange(5));
+    EXPECT_EQ(js.getRefRange(3).first, js.getRefRange(3).second);
+    EXPECT_EQ(js.getRefRange(7).first, js.getRefRange(7).second);
+    
+    // Out of order until sorted, but lookups by target still work
+    js.addJunction(make_shared<Junction>(make_shared<Intron>(rd2, 5, 15), 1, 20));
+    EXPECT_FALSE(js.isGroupedByRef());
+    JunctionList subset;
+    js.findJunctions(2, subset);
+    EXPECT_EQ((size_t)2, subset.size());
+    
+    js.sort();
+    EXPECT_TRUE(js.isGroupedByRef());
+    EXPECT_EQ(std::make_pair((size_t)0, (size_t)2), js.getRefRange(2));
+    EXPECT_EQ(std::make_pair((size_t)2, (size_t)4), js.getRefRange(5));
+    js.findJunctions(5, subset);
+    EXPECT_EQ((size_t)2, subset.size());
+    EXPECT_EQ(20, subset[0]->getIntron()->start);
+    EXPECT_EQ(50, subset[1]->getIntron()->start);
+    
+    // Appending keeps the index
+    JunctionSystem all;
+    all.append(js);
+    EXPECT_TRUE(all.isGroupedByRef());
+    EXPECT_EQ(std::make_pair((size_t)2, (size_t)4), all.getRefRange(5));
+}
+
+TEST(junction, map) {
+    
+    JunctionMap map;
+    EXPECT_EQ(nullptr, map.find(IntronKey::of(2, 20, 30)));
+    
+    // Enough junctions to grow the table a few times
+    for (int32_t i = 0; i < 1000; i++) {
+        JunctionPtr j = make_shared<Junction>(make_shared<Intron>(rd2, i, i + 10), i - 5, i + 20);
+        map.set(j->getIntron()->key(), j);
+    }
+    EXPECT_EQ((size_t)1000, map.size());
+    for (int32_t i = 0; i < 1000; i++) {
+        const JunctionPtr& j = map.find(IntronKey::of(2, i, i + 10));
+        ASSERT_NE(nullptr, j);
+        EXPECT_EQ(i, j->getIntron()->start);
+    }
+    EXPECT_EQ(nullptr, map.find(IntronKey::of(5, 0, 10)));
+    EXPECT_EQ(nullptr, map.find(IntronKey::of(2, 0, 11)));
+    
+    // Setting an existing location replaces the junction
+    JunctionPtr j = make_shared<Junction>(make_shared<Intron>(rd2, 0, 10), 0, 20);
+    map.set(j->getIntron()->key(), j);
+    EXPECT_EQ((size_t)1000, map.size());
+    EXPECT_EQ(j, map.find(IntronKey::of(2, 0, 10)));
+    
+    map.clear();
+    EXPECT_TRUE(map.empty());
+    EXPECT_EQ(nullptr, map.find(IntronKey::of(2, 0, 10)));
+}
+
+TEST(junction, radix_sort) {
+    
+    // Should match sorting with the comparator, keeping equal keys in order
+    vector<KeyedIndex> keys;
+    vector<std::pair<IntronKey, size_t>> expected;
+    uint32_t x = 12345;
+    for (size_t i = 0; i < 5000; i++) {
+        x = x * 1103515245 + 12345;
+        const IntronKey key = IntronKey::of((x >> 4) % 3, (x >> 8) % 70000, (x >> 12) % 300);
+        keys.push_back({key, i});
+        expected.push_back(std::make_pair(key, i));
+    }
+    portcullis::radixSort(keys);
+    std::sort(expected.begin(), expected.end());
+    ASSERT_EQ(expected.size(), keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        EXPECT_EQ(expected[i].first, keys[i].key);
+        EXPECT_EQ(expected[i].second, keys[i].index);
+    }
+}
+
+TEST(junction, table) {
+    
+    EXPECT_EQ(portcullis::JAD_LENGTH, Junction::JAD_NAMES.size());
+    
+    // A few junctions with a spread of metric values
+    JunctionSystem js;
+    for (int32_t i = 0; i < 50; i++) {
+        JunctionPtr j = make_shared<Junction>(make_shared<Intron>(i % 3 == 0 ? rd2 : rd5, 20 + i, 30 + i * 7), 10 + i, 40 + i * 7);
+        j->setId(i);
+        j->setDa1(i % 2 == 0 ? "GT" : "AT");
+        j->setDa2(i % 5 == 0 ? "A" : "AG");
+        j->setScore(i / 7.0);
+        j->setSuspicious(i % 4 == 0);
+        j->setNbSplicedAlignments(i + 3);
+        j->setNbMultiplySplicedAlignments(i % 3);
+        j->setNbReliableAlignments(i + 1);
+        j->setEntropy(i * 0.123456789);
+        j->setMeanReadLength(75 + i);
+        j->setMaxMMES(i % 11);
+        j->setNbUpstreamJunctions(i);
+        j->setCoverage(-i / 3.0);
+        j->setJunctionAnchorDepth(i % 20, i * 2);
+        js.addJunction(j);
+    }
+    
+    // Table rows are output exactly as the junctions are
+    JunctionTable table;
+    js.toTable(table);
+    ASSERT_EQ(js.getJunctions().size(), table.size());
+    EXPECT_EQ((size_t)2, table.refs.size());
+    for (size_t i = 0; i < table.size(); i++) {
+        std::ostringstream expected, actual, copy;
+        expected << *js.getJunctionAt(i);
+        table.writeRow(actual, i);
+        copy << *table.getJunction(i);
+        EXPECT_EQ(expected.str(), actual.str());
+        EXPECT_EQ(expected.str(), copy.str());
+        EXPECT_EQ(js.getJunctionAt(i)->calcJunctionAnchorDepthLogDeviation(i % 20), table.calcJunctionAnchorDepthLogDeviation(i, i % 20));
+    }
+    
+    // Loading the table output gives the same as parsing each line
+    bfs::create_directories("temp");
+    {
+        std::ofstream out("temp/table.junctions.tab");
+        out << table << endl;
+    }
+    JunctionTable loaded("temp/table.junctions.tab");
+    ASSERT_EQ(table.size(), loaded.size());
+    std::ifstream in("temp/table.junctions.tab");
+    string line;
+    std::getline(in, line);
+    for (size_t i = 0; i < loaded.size(); i++) {
+        std::getline(in, line);
+        std::ostringstream expected, actual;
+        expected << *Junction::parse(line);
+        loaded.writeRow(actual, i);
+        EXPECT_EQ(expected.str(), actual.str());
+    }
+    
+    // As does loading a junction system
+    JunctionSystem fromFile("temp/table.junctions.tab");
+    EXPECT_EQ(js.size(), fromFile.size());
+    std::ostringstream expected, actual;
+    expected << js;
+    actual << fromFile;
+    EXPECT_EQ(expected.str(), actual.str());
+    
+    // Bad rows aren't added
+    {
+        std::ofstream out("temp/table.junctions.tab", std::ios_base::app);
+        out << line.substr(0, line.rfind('\t')) << "\tx" << endl;
+    }
+    JunctionTable bad;
+    EXPECT_THROW(bad.load("temp/table.junctions.tab"), boost::bad_lexical_cast);
+    EXPECT_EQ(loaded.size(), bad.size());
+    EXPECT_EQ(loaded.size(), bad.junctionAnchorDepth.size());
+    bfs::remove("temp/table.junctions.tab");
+}
+
+TEST(junction, binary_file) {
+    
+    JunctionSystem js;
+    for (int32_t i = 0; i < 30; i++) {
+        JunctionPtr j = make_shared<Junction>(make_shared<Intron>(i % 4 == 0 ? rd5 : rd2, 100 + i * 3, 200 + i * 5), 50 + i, 250 + i * 5);
+        j->setId(i);
+        j->setDa1("GT");
+        j->setDa2(i % 3 == 0 ? "C" : "AG");
+        j->setScore(i / 3.0);
+        j->setNbSplicedAlignments(i + 1);
+        j->setEntropy(i * 0.987654321);
+        j->setMeanReadLength(100 + i);
+        j->setJunctionAnchorDepth(i % 20, i + 5);
+        js.addJunction(j);
+    }
+    JunctionTable table;
+    js.toTable(table);
+    
+    bfs::create_directories("temp");
+    path file("temp/table.junctions.bin");
+    JunctionFile::write(table, file);
+    EXPECT_TRUE(JunctionFile::isJunctionFile(file));
+    
+    // Reading everything back gives exactly the same junctions
+    JunctionFile jf(file);
+    EXPECT_EQ(table.size(), jf.getNbRows());
+    EXPECT_EQ((uint32_t)2, jf.getNbRefs());
+    JunctionTable loaded;
+    jf.read(loaded);
+    ASSERT_EQ(table.size(), loaded.size());
+    for (size_t i = 0; i < table.size(); i++) {
+        std::ostringstream expected, actual;
+        table.writeRow(expected, i);
+        loaded.writeRow(actual, i);
+        EXPECT_EQ(expected.str(), actual.str());
+    }
+    
+    // Columns can be accessed directly
+    const int32_t* start = jf.getColumn<int32_t>("start");
+    for (size_t i = 0; i < table.size(); i++) {
+        EXPECT_EQ(table.start[i], start[i]);
+    }
+    EXPECT_THROW(jf.getColumn<double>("start"), JunctionException);
+    EXPECT_THROW(jf.getColumn<int32_t>("nosuchcolumn"), JunctionException);
+    
+    // Only the requested columns are read, target sequences are matched by index
+    JunctionTable partial;
+    partial.addRef(rd5.index, rd5.name.c_str(), rd5.name.size(), rd5.length);
+    jf.read(partial, {"start", "end", "leftAncStart", "rightAncEnd"});
+    ASSERT_EQ(table.size(), partial.size());
+    for (size_t i = 0; i < table.size(); i++) {
+        EXPECT_EQ(table.getRef(i).index, partial.getRef(i).index);
+        EXPECT_EQ(table.getRef(i).name, partial.getRef(i).name);
+        EXPECT_EQ(table.start[i], partial.start[i]);
+        EXPECT_EQ(table.end[i], partial.end[i]);
+        EXPECT_EQ(table.leftAncStart[i], partial.leftAncStart[i]);
+        EXPECT_EQ(0.0, partial.score[i]);
+        EXPECT_EQ((uint32_t)0, partial.nbAlRaw[i]);
+        EXPECT_EQ(string(""), partial.da1[i].toString());
+    }
+    
+    // Junction systems can load binary files too
+    JunctionSystem fromFile(file);
+    std::ostringstream expected, actual;
+    expected << js;
+    actual << fromFile;
+    EXPECT_EQ(expected.str(), actual.str());
+    
+    // But a tab file isn't a binary file
+    {
+        std::ofstream out("temp/table.junctions.tab");
+        out << table << endl;
+    }
+    EXPECT_FALSE(JunctionFile::isJunctionFile("temp/table.junctions.tab"));
+    EXPECT_THROW(JunctionFile("temp/table.junctions.tab"), JunctionException);
+    bfs::remove("temp/table.junctions.tab");
+    
+    // Corrupt files are rejected when read, leaving the table as it was
+    path corrupt("temp/corrupt.junctions.bin");
+    auto corruptFile = [&](const uint64_t offset, const void* value, const size_t bytes) {
+        bfs::copy_file(file, corrupt, bfs::copy_option::overwrite_if_exists);
+        std::fstream out(corrupt.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        out.seekp(offset);
+        out.write((const char*)value, bytes);
+    };
+    portcullis::JunctionFileHeader header;
+    {
+        std::ifstream in(file.c_str(), std::ios::binary);
+        in.read((char*)&header, sizeof(header));
+    }
+    // A target sequence name beyond the end of the file
+    const uint32_t nameOffset = 1 << 20;
+    corruptFile(header.refsOffset + offsetof(portcullis::JunctionFileRef, nameOffset), &nameOffset, sizeof(nameOffset));
+    {
+        JunctionTable bad;
+        EXPECT_THROW(JunctionFile(corrupt).read(bad), JunctionException);
+        EXPECT_EQ((size_t)0, bad.size());
+    }
+    // No ref column
+    vector<portcullis::JunctionFileColumn> columns(header.nbColumns);
+    {
+        std::ifstream in(file.c_str(), std::ios::binary);
+        in.seekg(header.columnsOffset);
+        in.read((char*)columns.data(), columns.size() * sizeof(portcullis::JunctionFileColumn));
+    }
+    for (size_t i = 0; i < columns.size(); i++) {
+        if (string(columns[i].name) == "ref") {
+            corruptFile(header.columnsOffset + i * sizeof(portcullis::JunctionFileColumn), "xef", 3);
+        }
+    }
+    {
+        JunctionTable bad;
+        EXPECT_THROW(JunctionFile(corrupt).read(bad, {"start", "end"}), JunctionException);
+        EXPECT_EQ((size_t)0, bad.size());
+    }
+    bfs::remove(corrupt);
+    bfs::remove(file);
+}
+
+TEST(junction, table_parallel_load) {
+    
+    JunctionSystem js;
+    for (int32_t i = 0; i < 40; i++) {
+        JunctionPtr j = make_shared<Junction>(make_shared<Intron>(i % 3 == 0 ? rd2 : rd5, 20 + i, 30 + i * 7), 10 + i, 40 + i * 7);
+        j->setId(i);
+        j->setDa1("GT");
+        j->setDa2("AG");
+        j->setScore(i / 7.0);
+        j->setNbSplicedAlignments(i + 3);
+        j->setEntropy(i * 0.123456789);
+        j->setMeanReadLength(75 + i);
+        j->setJunctionAnchorDepth(i % 20, i * 2);
+        js.addJunction(j);
+    }
+    JunctionTable table;
+    js.toTable(table);
+    
+    // Numbers written in unusual ways must give the same results as lexical_cast
+    const vector<string> scores = {"1e-05", "-0", "+3.5", "007.250", ".5", "5.", "1.5E+02", "nan", "-inf",
+                                   "123456789012345678901234", "0.1e-30", "2.2250738585072014e-308", "9007199254740993"};
+    const vector<string> counts = {"0", "00042", "+7", "-1", "4294967295"};
+    vector<string> lines;
+    for (size_t i = 0; i < table.size(); i++) {
+        std::ostringstream row;
+        table.writeRow(row, i);
+        vector<string> fields;
+        boost::split(fields, row.str(), boost::is_any_of("\t"));
+        fields[15] = scores[i % scores.size()];
+        fields[18] = counts[i % counts.size()];
+        fields[45] = i % 2 == 0 ? "65535" : "1";
+        lines.push_back(boost::join(fields, "\t"));
+    }
+    bfs::create_directories("temp");
+    {
+        std::ofstream out("temp/parallel.junctions.tab");
+        out << Junction::junctionOutputHeader() << endl;
+        for (size_t i = 0; i < lines.size(); i++) {
+            // Blank lines, stray whitespace and repeated headers are ignored
+            out << (i % 9 == 0 ? "  " : "") << lines[i] << (i % 5 == 0 ? " \r" : "") << endl;
+            if (i % 13 == 0) out << endl << Junction::junctionOutputHeader() << endl;
+        }
+        out << lines[0];  // No final newline
+    }
+    lines.push_back(lines[0]);
+    for (uint16_t threads : {1, 2, 3, 8, 64}) {
+        JunctionTable loaded;
+        loaded.load("temp/parallel.junctions.tab", threads);
+        ASSERT_EQ(lines.size(), loaded.size());
+        for (size_t i = 0; i < loaded.size(); i++) {
+            std::ostringstream expected, actual;
+            expected << *Junction::parse(lines[i]);
+            loaded.writeRow(actual, i);
+            EXPECT_EQ(expected.str(), actual.str());
+        }
+    }
+    
+    // Only the requested columns are read
+    JunctionTable partial;
+    partial.load("temp/parallel.junctions.tab", {"start", "end", "junctionAnchorDepth"}, 4);
+    ASSERT_EQ(lines.size(), partial.size());
+    for (size_t i = 0; i < table.size(); i++) {
+        EXPECT_EQ(table.getRef(i).index, partial.getRef(i).index);
+        EXPECT_EQ(table.start[i], partial.start[i]);
+        EXPECT_EQ(table.end[i], partial.end[i]);
+        EXPECT_EQ(table.junctionAnchorDepth[i], partial.junctionAnchorDepth[i]);
+        EXPECT_EQ(0, partial.leftAncStart[i]);
+        EXPECT_EQ((uint32_t)0, partial.id[i]);
+        EXPECT_EQ(0.0, partial.score[i]);
+        EXPECT_EQ((uint32_t)1, partial.nbSamples[i]);
+        EXPECT_EQ(Strand::UNKNOWN, partial.readStrand[i]);
+    }
+    
+    // Rows before a bad line are kept whichever chunk it is in
+    {
+        std::ofstream out("temp/parallel.junctions.tab");
+        for (size_t i = 0; i < lines.size(); i++) {
+            out << (i == 30 ? lines[i].substr(0, lines[i].rfind('\t')) + "\t-" : lines[i]) << endl;
+        }
+    }
+    for (uint16_t threads : {1, 4}) {
+        JunctionTable bad;
+        EXPECT_THROW(bad.load("temp/parallel.junctions.tab", threads), boost::bad_lexical_cast);
+        EXPECT_EQ((size_t)30, bad.size());
+        EXPECT_EQ((size_t)30, bad.nbSamples.size());
+    }
+    bfs::remove("temp/parallel.junctions.tab");
+}
+
+static string readFile(const string& file) {
+    std::ifstream in(file);
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    return ss.str();
+}
+
+TEST(junction, writer) {
+    
+    // Junctions on several target sequences, with awkward values to format
+    const vector<double> doubles = {0.0, -0.0, 1.0, 123456.0, 1234567.0, 0.1, 1.0 / 3.0, -2.5e-7, 1e300,
+                                    std::numeric_limits<double>::quiet_NaN(), -std::numeric_limits<double>::infinity(),
+                                    99999.95, 0.00012345678};
+    JunctionSystem js;
+    for (int32_t i = 0; i < 60; i++) {
+        const RefSeq& ref = i < 20 ? rd2 : i < 45 ? rd5 : rd2;
+        JunctionPtr j = make_shared<Junction>(make_shared<Intron>(ref, 20 + i, 30 + i * 7), 10 + i, 40 + i * 7);
+        j->setId(i * 1000);
+        j->setDa1(i % 2 == 0 ? "GT" : "");
+        j->setDa2("AG");
+        j->setScore(doubles[i % doubles.size()]);
+        j->setSuspicious(i % 3 == 0);
+        j->setUniqueJunction(i % 2 == 0);
+        j->setNbSplicedAlignments(i % 4 == 0 ? 0 : i);
+        j->setNbReliableAlignments(i / 2);
+        j->setEntropy(doubles[(i + 3) % doubles.size()]);
+        j->setCoverage(doubles[(i + 7) % doubles.size()]);
+        j->setMeanReadLength(i * 1.5);
+        j->setNbUpstreamJunctions(i);
+        j->setHammingDistance5p(i % 7);
+        j->setJunctionAnchorDepth(i % 20, i * 3);
+        js.addJunction(j);
+    }
+    // Set strands and splice site types via a table
+    JunctionTable table;
+    js.toTable(table);
+    for (size_t i = 0; i < table.size(); i++) {
+        table.consensusStrand[i] = i % 3 == 0 ? Strand::POSITIVE : i % 3 == 1 ? Strand::NEGATIVE : Strand::UNKNOWN;
+        table.canonicalSpliceSites[i] = i % 2 == 0 ? CanonicalSS::CANONICAL : CanonicalSS::SEMI_CANONICAL;
+    }
+    JunctionSystem junctions(table);
+    
+    // Expected output, as written by the stream methods
+    bfs::create_directories("temp/writer");
+    {
+        std::ofstream out("temp/writer/expected.junctions.tab");
+        out << junctions << endl;
+    }
+    {
+        std::ofstream out("temp/writer/expected.junctions.exon.gff3");
+        junctions.writeExonGFF(out, "src");
+    }
+    {
+        std::ofstream out("temp/writer/expected.junctions.intron.gff3");
+        junctions.writeIntronGFF(out, "src");
+    }
+    for (bool bedscore : {false, true}) {
+        string bed = string("temp/writer/expected") + (bedscore ? ".score" : "") + ".junctions.bed";
+        junctions.outputBED(bed, CanonicalSS::ALL, "src", bedscore);
+    }
+    
+    // Exactly the same bytes whatever the number of threads
+    for (uint16_t threads : {1, 2, 8}) {
+        for (bool bedscore : {false, true}) {
+            junctions.saveAll("temp/writer/actual", "src", bedscore, true, true, false, threads);
+            EXPECT_EQ(readFile("temp/writer/expected.junctions.tab"), readFile("temp/writer/actual.junctions.tab"));
+            EXPECT_EQ(readFile("temp/writer/expected.junctions.exon.gff3"), readFile("temp/writer/actual.junctions.exon.gff3"));
+            EXPECT_EQ(readFile("temp/writer/expected.junctions.intron.gff3"), readFile("temp/writer/actual.junctions.intron.gff3"));
+            EXPECT_EQ(readFile(string("temp/writer/expected") + (bedscore ? ".score" : "") + ".junctions.bed"),
+                      readFile("temp/writer/actual.junctions.bed"));
+        }
+    }
+    
+    // Only the requested files are written
+    JunctionWriter writer(junctions.getJunctions());
+    writer.setBEDFile("temp/writer/only.junctions.bed");
+    writer.setSource("src");
+    writer.write();
+    EXPECT_EQ(readFile("temp/writer/expected.junctions.bed"), readFile("temp/writer/only.junctions.bed"));
+    EXPECT_FALSE(bfs::exists("temp/writer/only.junctions.tab"));
+    bfs::remove_all("temp/writer");
+}
+
+static string readBGZF(const string& file) {
+    string data;
+    BGZF* fp = bgzf_open(file.c_str(), "r");
+    char buf[4096];
+    ssize_t n;
+    while ((n = bgzf_read(fp, buf, sizeof(buf))) > 0) {
+        data.append(buf, n);
+    }
+    bgzf_close(fp);
+    return data;
+}
+
+/**
+ * Finds lines in a text junction file whose introns overlap the 0-based half open
+ * interval by scanning the whole file
+ */
+static vector<string> scanJunctions(const string& file, size_t refCol, size_t startCol, size_t endCol, bool inclusiveEnd,
+                                    const string& ref, int32_t beg, int32_t end) {
+    vector<string> found;
+    std::ifstream in(file);
+    string line;
+    std::getline(in, line); // header
+    while (std::getline(in, line)) {
+        if (line.empty()) {
+            continue;
+        }
+        vector<string> parts;
+        boost::split(parts, line, boost::is_any_of("\t"));
+        const int32_t s = boost::lexical_cast<int32_t>(parts[startCol]);
+        const int32_t e = boost::lexical_cast<int32_t>(parts[endCol]) + (inclusiveEnd ? 1 : 0);
+        if (parts[refCol] == ref && s < end && e > beg) {
+            found.push_back(line);
+        }
+    }
+    return found;
+}
+
+TEST(junction, indexed_files) {
+    
+    // Introns of varying length, some spanning several index bins
+    const RefSeq chrA(0, "chrA", 2000000);
+    const RefSeq chrB(1, "chrB", 2000000);
+    JunctionSystem js;
+    for (int32_t i = 0; i < 2000; i++) {
+        const RefSeq& ref = i < 1200 ? chrA : chrB;
+        const int32_t start = 100 + (i % 1200) * 500;
+        const int32_t end = start + 50 + (i * 7919) % 40000;
+        JunctionPtr j = make_shared<Junction>(make_shared<Intron>(ref, start, end), start - 10, end + 10);
+        j->setId(i);
+        j->setNbSplicedAlignments(i % 5 + 1);
+        js.addJunction(j);
+    }
+    bfs::create_directories("temp/index");
+    js.saveAll("temp/index/out", "src", false, false, false, false, true, 2);
+    
+    // Same content, apart from the blank line at the end of the table
+    string tab = readFile("temp/index/out.junctions.tab");
+    ASSERT_EQ('\n', tab.back());
+    tab.pop_back();
+    EXPECT_EQ(tab, readBGZF("temp/index/out.junctions.tab.gz"));
+    EXPECT_EQ(readFile("temp/index/out.junctions.bed"), readBGZF("temp/index/out.junctions.bed.gz"));
+    EXPECT_TRUE(bfs::exists("temp/index/out.junctions.tab.gz.tbi"));
+    EXPECT_TRUE(IndexedJunctionReader::isIndexed("temp/index/out.junctions.bed.gz"));
+    EXPECT_FALSE(IndexedJunctionReader::isIndexed("temp/index/out.junctions.bed"));
+    
+    IndexedJunctionReader tabReader("temp/index/out.junctions.tab.gz");
+    IndexedJunctionReader bedReader("temp/index/out.junctions.bed.gz");
+    EXPECT_EQ(portcullis::IndexedJunctionFormat::TAB, tabReader.getFormat());
+    EXPECT_EQ(portcullis::IndexedJunctionFormat::BED, bedReader.getFormat());
+    ASSERT_EQ(1, tabReader.getHeader().size());
+    EXPECT_EQ(Junction::junctionOutputHeader(), tabReader.getHeader()[0]);
+    EXPECT_EQ(vector<string>({"chrA", "chrB"}), bedReader.getRefs());
+    
+    // Regions are 1-based and inclusive, and the last intron position counts
+    const int32_t lastA = 100 + 50 + (1199 * 7919) % 40000 + 1199 * 500;
+    const vector<std::tuple<string, string, int32_t, int32_t>> regions = {
+        std::make_tuple("chrA:1-100", "chrA", 0, 100),
+        std::make_tuple("chrA:101-101", "chrA", 100, 101),
+        std::make_tuple("chrA:" + std::to_string(lastA + 1), "chrA", lastA, INT32_MAX),
+        std::make_tuple("chrA:" + std::to_string(lastA + 2), "chrA", lastA + 1, INT32_MAX),
+        std::make_tuple("chrA:20000-40000", "chrA", 19999, 40000),
+        std::make_tuple("chrA:123456-123456", "chrA", 123455, 123456),
+        std::make_tuple("chrA:250,000-700,000", "chrA", 249999, 700000),
+        std::make_tuple("chrB", "chrB", 0, INT32_MAX),
+        std::make_tuple("chrB:55555-56000", "chrB", 55554, 56000)
+    };
+    for (const auto& r : regions) {
+        vector<string> lines;
+        const vector<string> expectedTab = scanJunctions("temp/index/out.junctions.tab", 2, 4, 5, true, std::get<1>(r), std::get<2>(r), std::get<3>(r));
+        EXPECT_EQ(expectedTab.size(), tabReader.query(std::get<0>(r), lines));
+        EXPECT_EQ(expectedTab, lines) << std::get<0>(r);
+        lines.clear();
+        const vector<string> expectedBED = scanJunctions("temp/index/out.junctions.bed", 0, 6, 7, false, std::get<1>(r), std::get<2>(r), std::get<3>(r));
+        bedReader.query(std::get<0>(r), lines);
+        EXPECT_EQ(expectedBED, lines) << std::get<0>(r);
+    }
+    
+    // No junctions on unknown target sequences, but bad regions are errors
+    vector<string> lines;
+    EXPECT_EQ(0, tabReader.query("chrC:1-1000", lines));
+    EXPECT_THROW(tabReader.query("chrA:500-100", lines), JunctionException);
+    
+    // Junctions must be written in order
+    {
+        IndexedJunctionWriter writer("temp/index/unsorted.bed.gz", portcullis::IndexedJunctionFormat::BED);
+        writer.writeLine("a\n", 2, "chrA", 100, 200);
+        EXPECT_THROW(writer.writeLine("b\n", 2, "chrA", 50, 200), JunctionException);
+    }
+    {
+        IndexedJunctionWriter writer("temp/index/unsorted.bed.gz", portcullis::IndexedJunctionFormat::BED);
+        writer.writeLine("a\n", 2, "chrA", 100, 200);
+        writer.writeLine("b\n", 2, "chrB", 100, 200);
+        EXPECT_THROW(writer.writeLine("c\n", 2, "chrA", 300, 400), JunctionException);
+    }
+    bfs::remove_all("temp/index");
+}
+
+namespace {
+
+/**
+ * Adds the junctions from all the spliced alignments in a BAM file
+ * @return The length of the longest alignment
+ */
+int32_t addSplicedJunctions(const string& bamFile, JunctionSystem& js) {
+    BamReader reader(bamFile);
+    reader.open();
+    int32_t maxQueryLength = 0;
+    while (reader.next()) {
+        maxQueryLength = std::max(maxQueryLength, reader.current().getLength());
+        if (reader.current().isSplicedRead()) {
+            js.addJunctions(reader.current());
+        }
+    }
+    reader.close();
+    return maxQueryLength;
+}
+
+}
+
+TEST(junction, flanking_alignments) {
+    const string bam = RESOURCESDIR "/clipped3.bam";
+    BamReader reader(bam);
+    reader.open();
+    shared_ptr<RefSeqPtrList> refs = reader.createRefList();
+    // The single pass over each target sequence should give the same counts as
+    // querying the region around each junction.  Check this first with the real
+    // target sequence, then with it cut short just after the last junction, so
+    // that the regions around the last few junctions are clipped.
+    int32_t lastEnd = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            refs->at(0)->length = lastEnd + 20;
+        }
+        JunctionSystem js(refs);
+        const int32_t maxQueryLength = addSplicedJunctions(bam, js);
+        js.setMaxQueryLength(maxQueryLength);
+        js.findFlankingAlignments(bam, 2);
+        EXPECT_GT(js.size(), 0);
+        uint32_t nbFlanking = 0;
+        for (const auto& j : js.getJunctions()) {
+            const uint32_t upstream = j->getNbUpstreamFlankingAlignments();
+            const uint32_t downstream = j->getNbDownstreamFlankingAlignments();
+            j->processJunctionVicinity(reader, refs->at(0)->length, maxQueryLength);
+            EXPECT_EQ(j->getNbUpstreamFlankingAlignments(), upstream) << pass << " " << j->getIntron()->start;
+            EXPECT_EQ(j->getNbDownstreamFlankingAlignments(), downstream) << pass << " " << j->getIntron()->start;
+            nbFlanking += upstream + downstream;
+            lastEnd = std::max(lastEnd, j->getRightAncEnd());
+        }
+        EXPECT_GT(nbFlanking, 0);
+    }
+    reader.close();
+}